@@ -22,6 +22,92 @@ EFI_FILE *LoadFile(EFI_FILE *Directory, CHAR16 *Path, EFI_HANDLE ImageHandle, EF
     return LoadedFile;
 }
 
+static UINT32 ClassifyMemory(UINT32 EfiType) {
+    switch (EfiType) {
+        case EfiConventionalMemory:
+            return MEMORY_TYPE_USABLE;
+        case EfiBootServicesCode:
+        case EfiBootServicesData:
+        case EfiLoaderCode:
+            return MEMORY_TYPE_BOOT_RECLAIMABLE;
+        case EfiLoaderData:
+            return MEMORY_TYPE_LOADER;
+        case EfiACPIReclaimMemory:
+            return MEMORY_TYPE_ACPI_RECLAIMABLE;
+        case EfiACPIMemoryNVS:
+            return MEMORY_TYPE_ACPI_NVS;
+        default:
+            return MEMORY_TYPE_RESERVED;
+    }
+}
+
+// Condense the UEFI memory map into BootInfo: sort by address, merge adjacent
+// entries of the same type, and remember the largest conventional region.
+// Must not call boot services, since it runs between GetMemoryMap and ExitBootServices.
+static void BuildMemoryMap(BootInfo *bootInfo, EFI_MEMORY_DESCRIPTOR *MemoryMap, UINTN MemoryMapSize, UINTN DescriptorSize) {
+    MemoryMapEntry *entries = bootInfo->MemoryMap;
+    UINTN count = 0;
+
+    for (UINTN i = 0; i < MemoryMapSize / DescriptorSize; i++) {
+        EFI_MEMORY_DESCRIPTOR *desc = (EFI_MEMORY_DESCRIPTOR*)((char*)MemoryMap + (i * DescriptorSize));
+        MemoryMapEntry e;
+        e.Base = desc->PhysicalStart;
+        e.Size = desc->NumberOfPages * 4096;
+        e.Type = ClassifyMemory(desc->Type);
+        e.Reserved = 0;
+
+        // Insertion sort; firmware maps are usually sorted already
+        UINTN j = count;
+        while (j > 0 && entries[j - 1].Base > e.Base) {
+            entries[j] = entries[j - 1];
+            j--;
+        }
+        entries[j] = e;
+        count++;
+    }
+
+    UINTN merged = 0;
+    for (UINTN i = 0; i < count; i++) {
+        if (merged > 0 && entries[merged - 1].Type == entries[i].Type &&
+            entries[merged - 1].Base + entries[merged - 1].Size == entries[i].Base) {
+            entries[merged - 1].Size += entries[i].Size;
+        } else {
+            entries[merged++] = entries[i];
+        }
+    }
+    bootInfo->MemoryMapEntries = merged;
+
+    // Find the largest conventional memory region
+    bootInfo->LargestFreeRegion.Base = 0;
+    bootInfo->LargestFreeRegion.Size = 0;
+    for (UINTN i = 0; i < merged; i++) {
+        if (entries[i].Type == MEMORY_TYPE_USABLE && entries[i].Size > bootInfo->LargestFreeRegion.Size) {
+            bootInfo->LargestFreeRegion.Base = entries[i].Base;
+            bootInfo->LargestFreeRegion.Size = entries[i].Size;
+        }
+    }
+}
+
+// The ACPI root pointer from the firmware's configuration table, preferring
+// the ACPI 2.0 one (with the XSDT) over the 1.0 one. 0 if there is neither.
+static UINT64 FindRSDP(EFI_SYSTEM_TABLE *SystemTable) {
+    EFI_GUID Acpi20Guid = ACPI_20_TABLE_GUID;
+    EFI_GUID Acpi10Guid = ACPI_TABLE_GUID;
+    UINT64 Rsdp = 0;
+    for (UINTN i = 0; i < SystemTable->NumberOfTableEntries; i++) {
+        EFI_CONFIGURATION_TABLE *Table = &SystemTable->ConfigurationTable[i];
+        const UINT8 *Guid = (const UINT8*)&Table->VendorGuid;
+        int Is20 = 1, Is10 = 1;
+        for (UINTN b = 0; b < sizeof(EFI_GUID); b++) {
+            if (Guid[b] != ((const UINT8*)&Acpi20Guid)[b]) Is20 = 0;
+            if (Guid[b] != ((const UINT8*)&Acpi10Guid)[b]) Is10 = 0;
+        }
+        if (Is20) return (UINT64)Table->VendorTable;
+        if (Is10) Rsdp = (UINT64)Table->VendorTable;
+    }
+    return Rsdp;
+}
+
 EFI_STATUS efi_main(EFI_HANDLE ImageHandle, EFI_SYSTEM_TABLE *SystemTable) {
     InitializeLib(ImageHandle, SystemTable);
     Print(L"Tiny64 Bootloader Initializing...\n");
@@ -57,8 +143,10 @@ EFI_STATUS efi_main(EFI_HANDLE ImageHandle, EFI_SYSTEM_TABLE *SystemTable) {
     for (int i = 0; i < Header->e_phnum; i++) {
         Elf64_Phdr *Phdr = &Phdrs[i];
         if (Phdr->p_type == PT_LOAD) {
+            // The kernel is linked in the higher half; segments go to their
+            // load (physical) address and the entry code enables paging
             int pages = (Phdr->p_memsz + 0x1000 - 1) / 0x1000;
-            EFI_PHYSICAL_ADDRESS SegmentAddr = Phdr->p_vaddr;
+            EFI_PHYSICAL_ADDRESS SegmentAddr = Phdr->p_paddr;
             SystemTable->BootServices->AllocatePages(AllocateAddress, EfiLoaderData, pages, &SegmentAddr);
             
             // Zero out memory first (BSS)
@@ -78,44 +166,53 @@ EFI_STATUS efi_main(EFI_HANDLE ImageHandle, EFI_SYSTEM_TABLE *SystemTable) {
         return Status;
     }
 
-    BootInfo bootInfo;
-    bootInfo.framebuffer = (uint32_t*)Gop->Mode->FrameBufferBase;
-    bootInfo.width = Gop->Mode->Info->HorizontalResolution;
-    bootInfo.height = Gop->Mode->Info->VerticalResolution;
-    bootInfo.pitch = Gop->Mode->Info->PixelsPerScanLine;
+    // BootInfo and the memory map live in loader data, which the kernel keeps
+    // after it reclaims boot services memory.
+    BootInfo *bootInfo;
+    SystemTable->BootServices->AllocatePool(EfiLoaderData, sizeof(BootInfo), (void**)&bootInfo);
+    bootInfo->framebuffer = (uint32_t*)Gop->Mode->FrameBufferBase;
+    bootInfo->width = Gop->Mode->Info->HorizontalResolution;
+    bootInfo->height = Gop->Mode->Info->VerticalResolution;
+    bootInfo->pitch = Gop->Mode->Info->PixelsPerScanLine;
+    bootInfo->RSDP = FindRSDP(SystemTable);
 
-    // Get Memory Map to find a free region for PMM
+    Print(L"FrameBuffer: 0x%lx (%dx%d)\n", bootInfo->framebuffer, bootInfo->width, bootInfo->height);
+
+    // Get Memory Map. Both buffers are sized with some slack up front, since
+    // allocating after the final GetMemoryMap would invalidate MapKey.
     UINTN MemoryMapSize = 0;
     EFI_MEMORY_DESCRIPTOR *MemoryMap = NULL;
     UINTN MapKey, DescriptorSize;
     UINT32 DescriptorVersion;
 
     SystemTable->BootServices->GetMemoryMap(&MemoryMapSize, MemoryMap, &MapKey, &DescriptorSize, &DescriptorVersion);
-    MemoryMapSize += 2 * DescriptorSize;
-    SystemTable->BootServices->AllocatePool(EfiLoaderData, MemoryMapSize, (void**)&MemoryMap);
-    SystemTable->BootServices->GetMemoryMap(&MemoryMapSize, MemoryMap, &MapKey, &DescriptorSize, &DescriptorVersion);
-
-    // Find the largest conventional memory region
-    bootInfo.LargestFreeRegion.Base = 0;
-    bootInfo.LargestFreeRegion.Size = 0;
+    MemoryMapSize += 8 * DescriptorSize;
+    UINTN MemoryMapCapacity = MemoryMapSize;
+    SystemTable->BootServices->AllocatePool(EfiLoaderData, MemoryMapCapacity, (void**)&MemoryMap);
+    SystemTable->BootServices->AllocatePool(EfiLoaderData, (MemoryMapCapacity / DescriptorSize) * sizeof(MemoryMapEntry), (void**)&bootInfo->MemoryMap);
+
+    for (int attempt = 0; attempt < 4; attempt++) {
+        MemoryMapSize = MemoryMapCapacity;
+        Status = SystemTable->BootServices->GetMemoryMap(&MemoryMapSize, MemoryMap, &MapKey, &DescriptorSize, &DescriptorVersion);
+        if (EFI_ERROR(Status)) {
+            continue;
+        }
+        BuildMemoryMap(bootInfo, MemoryMap, MemoryMapSize, DescriptorSize);
 
-    for (UINTN i = 0; i < MemoryMapSize / DescriptorSize; i++) {
-        EFI_MEMORY_DESCRIPTOR *desc = (EFI_MEMORY_DESCRIPTOR*)((char*)MemoryMap + (i * DescriptorSize));
-        if (desc->Type == EfiConventionalMemory) {
-            if (desc->NumberOfPages * 4096 > bootInfo.LargestFreeRegion.Size) {
-                bootInfo.LargestFreeRegion.Base = desc->PhysicalStart;
-                bootInfo.LargestFreeRegion.Size = desc->NumberOfPages * 4096;
-            }
+        // No boot services calls (not even Print) between GetMemoryMap and here
+        Status = SystemTable->BootServices->ExitBootServices(ImageHandle, MapKey);
+        if (!EFI_ERROR(Status)) {
+            break;
         }
     }
-
-    Print(L"FrameBuffer: 0x%lx (%dx%d)\n", bootInfo.framebuffer, bootInfo.width, bootInfo.height);
-
-    SystemTable->BootServices->ExitBootServices(ImageHandle, MapKey);
+    if (EFI_ERROR(Status)) {
+        Print(L"Error: ExitBootServices failed\n");
+        return Status;
+    }
 
     // Jump to Kernel
     void (*KernelEntry)(BootInfo*) = (void (*)(BootInfo*))Header->e_entry;
-    KernelEntry(&bootInfo);
+    KernelEntry(bootInfo);
 
     return EFI_SUCCESS;
 }
\ No newline at end of file
@@ -0,0 +1,42 @@
+#ifndef ACPI_H
+#define ACPI_H
+
+#include <stdint.h>
+
+#define ACPI_MAX_CPUS      64
+#define ACPI_MAX_IOAPICS   8
+#define ACPI_MAX_OVERRIDES 16
+
+typedef struct {
+    uint32_t id;
+    uint64_t address;
+    uint32_t gsi_base;          // first global system interrupt it serves
+} AcpiIOAPIC;
+
+// An ISA IRQ wired to another GSI, or with other polarity or trigger mode
+typedef struct {
+    uint8_t irq;
+    uint32_t gsi;
+    uint16_t flags;             // MPS INTI flags
+} AcpiOverride;
+
+// What the kernel needs from the MADT
+typedef struct {
+    uint64_t lapic_address;
+    int pic_present;            // legacy 8259s to mask before using IOAPICs
+    uint32_t cpu_count;
+    uint32_t apic_ids[ACPI_MAX_CPUS];   // enabled CPUs, the BSP among them
+    uint32_t ioapic_count;
+    AcpiIOAPIC ioapics[ACPI_MAX_IOAPICS];
+    uint32_t override_count;
+    AcpiOverride overrides[ACPI_MAX_OVERRIDES];
+} AcpiMADT;
+
+// Finds the MADT from the RSDP the bootloader passed (physical, 0 for
+// none) and parses it. Needs VMalloc_Init for tables outside the direct
+// map. Returns 0 if there is no usable MADT.
+int ACPI_Init(uint64_t rsdp_phys);
+// NULL unless ACPI_Init found a MADT
+const AcpiMADT* ACPI_GetMADT();
+
+#endif
@@ -0,0 +1,53 @@
+#ifndef APIC_H
+#define APIC_H
+
+#include <stdint.h>
+
+#define MSR_APIC_BASE    0x1B
+#define MSR_TSC_DEADLINE 0x6E0
+
+// Local APIC registers, as offsets into its MMIO page
+#define LAPIC_ID          0x020
+#define LAPIC_EOI         0x0B0
+#define LAPIC_SVR         0x0F0
+#define LAPIC_ICR_LOW     0x300
+#define LAPIC_ICR_HIGH    0x310
+#define LAPIC_LVT_TIMER   0x320
+#define LAPIC_TIMER_INIT  0x380
+#define LAPIC_TIMER_COUNT 0x390
+#define LAPIC_TIMER_DIV   0x3E0
+
+#define LAPIC_SVR_ENABLE         (1u << 8)
+#define LAPIC_LVT_MASKED         (1u << 16)
+#define LAPIC_TIMER_ONESHOT      (0u << 17)
+#define LAPIC_TIMER_TSC_DEADLINE (2u << 17)
+#define LAPIC_TIMER_DIV_16       0x3
+
+// Interrupt command register: delivery mode, status and level in the low
+// word; the destination APIC ID goes in the top byte of the high word
+#define LAPIC_ICR_FIXED          (0u << 8)
+#define LAPIC_ICR_INIT           (5u << 8)
+#define LAPIC_ICR_STARTUP        (6u << 8)
+#define LAPIC_ICR_PENDING        (1u << 12)
+#define LAPIC_ICR_ASSERT         (1u << 14)
+#define LAPIC_ICR_SELF           (1u << 18)
+#define LAPIC_ICR_ALL_BUT_SELF   (3u << 18)
+
+// Enables the local APIC, in x2APIC mode when the CPU has it and else
+// through its mapped MMIO page, with SPURIOUS_VECTOR for spurious
+// interrupts. Needs VMalloc_Init. Returns 0 if the CPU has none.
+int LAPIC_Init();
+// Enables an application processor's LAPIC in the BSP's mode
+void LAPIC_InitCPU();
+int LAPIC_Present();
+// APIC IDs are 32 bits in x2APIC mode, else 8
+int LAPIC_IsX2APIC();
+uint32_t LAPIC_GetID();
+uint32_t LAPIC_Read(uint32_t reg);
+void LAPIC_Write(uint32_t reg, uint32_t value);
+void LAPIC_EndOfInterrupt();
+// Waits for the previous IPI to be accepted, then sends icr to apic_id
+// (ignored with a destination shorthand)
+void LAPIC_SendIPI(uint32_t apic_id, uint32_t icr);
+
+#endif
@@ -0,0 +1,70 @@
+#ifndef ASYNC_H
+#define ASYNC_H
+
+#include <stdint.h>
+#include "timer.h"
+
+// Stackless coroutines for driver state machines. A coroutine is a function
+// that runs until it has to wait, records where it stopped and returns; it
+// is called again from that point once something wakes it. Nothing lives
+// on a stack between calls, so state that spans a wait goes in the
+// coroutine's own structure, next to its AsyncTask.
+//
+// Every coroutine runs on one worker task, one step at a time, so
+// coroutines never run concurrently with each other and need no locks
+// among themselves. Waiting costs a queue entry, not a task and a stack,
+// so dozens of devices can be brought up side by side.
+typedef enum {
+    ASYNC_PENDING,              // waiting; something will wake it
+    ASYNC_DONE,
+} AsyncStatus;
+
+typedef struct AsyncTask {
+    AsyncStatus (*fn)(struct AsyncTask* t);
+    void* data;
+    uint32_t resume;            // where fn picks up: 0 at the start
+    volatile int queued;
+    volatile int done;
+    struct AsyncTask* next;     // run queue
+    Timer timer;                // for Async_WakeAfter
+} AsyncTask;
+
+// Starts the worker task. Needs Task_Init.
+void Async_Init();
+// Queues t to run fn from the start. t must stay allocated until done, and
+// after that for as long as a callback of the timer Async_WakeAfter armed
+// may still be running on another CPU: done comes after the timer is
+// cancelled, but the cancel does not wait for a callback in progress.
+void Async_Spawn(AsyncTask* t, AsyncStatus (*fn)(AsyncTask* t), void* data);
+// Queues t to run its next step, unless it is queued already. May be called
+// from interrupt handlers and from other coroutines.
+void Async_Wake(AsyncTask* t);
+// Wakes t once ns from now, whether or not anything else does first
+void Async_WakeAfter(AsyncTask* t, uint64_t ns);
+void Async_PrintStats();
+
+// Inside a coroutine, with t its AsyncTask. Locals are not kept across the
+// waits, and the waits cannot go inside a switch of the coroutine's own.
+#define ASYNC_BEGIN(t)      switch ((t)->resume) { case 0:
+#define ASYNC_END(t)        } return ASYNC_DONE
+
+// Returns to the worker; the next step starts here once t is woken
+#define ASYNC_YIELD(t)                                      \
+    do {                                                    \
+        (t)->resume = __LINE__;                             \
+        return ASYNC_PENDING;                               \
+        case __LINE__:;                                     \
+    } while (0)
+
+// Whatever makes cond true must wake t. A wake for anything else just
+// checks cond again.
+#define ASYNC_AWAIT(t, cond)                                \
+    while (!(cond)) ASYNC_YIELD(t)
+
+#define ASYNC_SLEEP(t, ns)                                  \
+    do {                                                    \
+        Async_WakeAfter((t), (ns));                         \
+        ASYNC_YIELD(t);                                     \
+    } while (0)
+
+#endif
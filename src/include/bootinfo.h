@@ -8,12 +8,34 @@ typedef struct {
     uint64_t Size;
 } MemoryRegion;
 
+// Memory map entry types, condensed from the UEFI memory types by the bootloader
+#define MEMORY_TYPE_RESERVED          0
+#define MEMORY_TYPE_USABLE            1  // EfiConventionalMemory
+#define MEMORY_TYPE_BOOT_RECLAIMABLE  2  // Boot services code/data and loader code, free once the kernel owns the machine
+#define MEMORY_TYPE_LOADER            3  // Kernel image and data handed over by the bootloader
+#define MEMORY_TYPE_ACPI_RECLAIMABLE  4
+#define MEMORY_TYPE_ACPI_NVS          5
+
+typedef struct {
+    uint64_t Base;
+    uint64_t Size;
+    uint32_t Type;
+    uint32_t Reserved;
+} MemoryMapEntry;
+
+// Handed to the kernel with physical pointers; kernel_main rebases them onto
+// the direct map on entry.
 typedef struct {
     uint32_t *framebuffer;
     uint32_t width;
     uint32_t height;
     uint32_t pitch;
     MemoryRegion LargestFreeRegion;
+    // Sorted by base address, adjacent entries of the same type merged
+    MemoryMapEntry *MemoryMap;
+    uint64_t MemoryMapEntries;
+    // Physical address of the ACPI RSDP, or 0 if the firmware has none
+    uint64_t RSDP;
 } BootInfo;
 
 #endif
\ No newline at end of file
@@ -0,0 +1,32 @@
+#ifndef CLOCK_H
+#define CLOCK_H
+
+#include <stdint.h>
+
+// Monotonic time from the TSC. Its rate comes from CPUID leaf 0x15 when the
+// CPU reports it, else from timing the PIT at boot. Reading the clock is a
+// rdtsc and a multiply, cheap enough for instrumentation anywhere.
+void Clock_Init();
+// Nanoseconds since Clock_Init
+uint64_t clock_monotonic_ns();
+uint64_t clock_tsc_hz();
+uint64_t clock_cycles_to_ns(uint64_t cycles);
+// The TSC value at which clock_monotonic_ns() reaches ns
+uint64_t clock_ns_to_tsc(uint64_t ns);
+
+// Busy waits, for the short delays hardware specs ask for. Longer waits
+// should sleep instead.
+void ndelay(uint64_t ns);
+void udelay(uint64_t us);
+void mdelay(uint64_t ms);
+
+// Timeouts as absolute deadlines, so a loop can poll without counting
+static inline uint64_t clock_deadline(uint64_t timeout_ns) {
+    return clock_monotonic_ns() + timeout_ns;
+}
+
+static inline int clock_expired(uint64_t deadline) {
+    return clock_monotonic_ns() >= deadline;
+}
+
+#endif
@@ -0,0 +1,26 @@
+#ifndef DMA_H
+#define DMA_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define DMA_ADDR_32BIT 0xFFFFFFFFULL
+#define DMA_ADDR_64BIT 0xFFFFFFFFFFFFFFFFULL
+
+// A physically contiguous, zeroed buffer a device can access. There is no
+// IOMMU, so the bus address is the physical address.
+typedef struct {
+    void* cpu;        // NULL if the allocation failed
+    uint64_t bus;
+    size_t size;      // bytes actually reserved
+} dma_buffer_t;
+
+// align and boundary must be powers of two (boundary 0 = none). The buffer
+// never crosses a boundary-aligned address and lies entirely at or below
+// max_phys. Objects up to 2 KiB are packed into shared pages.
+dma_buffer_t dma_alloc(size_t size, size_t align, uint64_t boundary, uint64_t max_phys);
+void dma_free(dma_buffer_t buf);
+
+void dma_get_stats(uint64_t* pool_pages, uint64_t* block_pages, uint64_t* bytes_in_use);
+
+#endif
@@ -0,0 +1,50 @@
+#ifndef FPU_H
+#define FPU_H
+
+#include <stdint.h>
+
+struct Task;
+
+// x87/SSE/AVX register state, switched lazily. The kernel is built to use
+// general registers only, so vector registers hold a task's state, or the
+// data of a kernel_fpu section, and nothing else. A switch away from a
+// task that used them saves its state and sets CR0.TS; the task's next
+// SIMD instruction traps (#NM) and gets its state back, unless this CPU's
+// registers still hold it. Tasks that never use SIMD never pay for any of
+// this beyond a CR0 read per switch.
+#define FPU_NO_CPU 0xFFFFFFFFu
+
+// Enables XSAVE, or FXSAVE without it, and sizes the state areas from
+// CPUID leaf 0xD. Needs SMP_InitBSP and the #NM gate.
+void FPU_Init();
+// The same setup on an application processor
+void FPU_InitCPU();
+int FPU_Ready();
+uint32_t FPU_StateSize();
+
+// Called by the scheduler with interrupts off, before switching stacks
+void FPU_Switch(struct Task* prev, struct Task* next);
+void FPU_FreeState(struct Task* task);
+// #NM: hands the vector registers to the current task
+void FPU_Trap();
+
+// SIMD in kernel code that may run in any task or in an interrupt handler.
+// The current owner's state is saved first. Interrupts are off in between,
+// so sections should be short; long jobs go in chunks.
+uint64_t kernel_fpu_begin();
+void kernel_fpu_end(uint64_t flags);
+
+// SSE2 copy with non-temporal stores, for write-combining memory and data
+// not read again soon. dst must be 16-byte aligned. Forward only, so an
+// overlapping copy works when dst is below src. Only in a kernel_fpu
+// section.
+void simd_copy_nt(void* dst, const void* src, uint64_t bytes);
+
+void FPU_PrintStats();
+
+#ifdef TINY64_BENCH
+// Needs the scheduler running, on one CPU
+void FPU_Benchmark();
+#endif
+
+#endif
@@ -17,14 +17,47 @@ struct GDTEntry {
     uint8_t Base2;
 } __attribute__((packed));
 
+// 64-bit system descriptors take two slots
+struct TSSEntry {
+    uint16_t Limit0;
+    uint16_t Base0;
+    uint8_t Base1;
+    uint8_t Access;
+    uint8_t Limit1_Flags;
+    uint8_t Base2;
+    uint32_t Base3;
+    uint32_t Reserved;
+} __attribute__((packed));
+
+struct TSS {
+    uint32_t Reserved0;
+    uint64_t RSP[3];
+    uint64_t Reserved1;
+    uint64_t IST[7];      // IST[0] is IST1
+    uint64_t Reserved2;
+    uint16_t Reserved3;
+    uint16_t IOMapBase;
+} __attribute__((packed));
+
 struct GDT {
     struct GDTEntry Null;
     struct GDTEntry KernelCode;
     struct GDTEntry KernelData;
     struct GDTEntry UserCode;
     struct GDTEntry UserData;
+    struct TSSEntry TSS;
 } __attribute__((packed)) __attribute__((aligned(0x1000)));
 
+#define GDT_KERNEL_CODE 0x08
+#define GDT_KERNEL_DATA 0x10
+#define GDT_TSS         0x28
+
+// Interrupt stack for the page fault handler, so faults on a stack page that
+// is not backed yet have somewhere to push their frame
+#define IST_PAGE_FAULT 1
+
 void LoadGDT(struct GDTDescriptor* gdtDescriptor);
+// Loads cpu's own GDT and TSS on the calling CPU
+void SetupGDT(uint32_t cpu);
 
 #endif
@@ -4,8 +4,30 @@
 #include <stdint.h>
 #include <stddef.h>
 
-void Heap_Init(void* addr, size_t size);
+// Virtual window reserved for the general heap. It is demand-zero: a page
+// is backed the first time it is touched.
+#define HEAP_BASE       0xFFFFC00000000000ULL
+#define HEAP_ARENA_SIZE (1ULL << 40)
+
+// Requests of at least this size bypass the heap and get their own
+// demand-zero vmalloc range, with a guard page behind it
+#define HEAP_LARGE_MIN  (64 * 1024)
+
+// Needs the PMM, the VMM, the slab allocator and vmalloc
+void Heap_Init();
+// Up to SLAB_KMALLOC_MAX bytes come from the slab size classes, larger
+// requests from the TLSF heap, which allocates and frees in O(1)
 void* kmalloc(size_t size);
 void kfree(void* ptr);
+// align must be a power of two
+void* kmalloc_aligned(size_t size, size_t align);
+// Same semantics as realloc(); resizes heap blocks in place when it can
+void* krealloc(void* ptr, size_t size);
+
+void Heap_PrintStats();
+
+#ifdef TINY64_BENCH
+void Heap_Benchmark();
+#endif
 
 #endif
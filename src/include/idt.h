@@ -20,5 +20,7 @@ struct IDTR {
 
 void SetIDTGate(uint8_t vector, void* handler, uint8_t type_attr);
 void SetupIDT();
+// Loads the table SetupIDT built on the calling CPU
+void LoadIDT();
 
 #endif
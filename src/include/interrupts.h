@@ -26,7 +26,43 @@ struct InterruptFrame {
     uint64_t ss;
 } __attribute__((packed));
 
+// What an exception stub hands to C: the saved registers, the error code
+// (the stub supplies a zero for vectors without one) and the CPU's frame
+struct ExceptionFrame {
+    uint64_t r15;
+    uint64_t r14;
+    uint64_t r13;
+    uint64_t r12;
+    uint64_t r11;
+    uint64_t r10;
+    uint64_t r9;
+    uint64_t r8;
+    uint64_t rbp;
+    uint64_t rdi;
+    uint64_t rsi;
+    uint64_t rdx;
+    uint64_t rcx;
+    uint64_t rbx;
+    uint64_t rax;
+    uint64_t error_code;
+    uint64_t rip;
+    uint64_t cs;
+    uint64_t rflags;
+    uint64_t rsp;
+    uint64_t ss;
+} __attribute__((packed));
+
+// The local APIC timer, or IRQ0 after PIC_Remap when there is no LAPIC
+#define TIMER_VECTOR    32
+// Inter-processor interrupts: a more urgent task was queued on the
+// target CPU, or it has a TLB shootdown to answer
+#define RESCHED_VECTOR  0xFD
+#define TLB_VECTOR      0xFE
+#define SPURIOUS_VECTOR 0xFF
+
 void PIC_EndMaster();
-void PIT_Init(uint32_t frequency);
+void PIC_Mask(uint8_t irq);
+void PIC_Unmask(uint8_t irq);
+void PIC_Disable();
 
 #endif
@@ -0,0 +1,26 @@
+#ifndef IOAPIC_H
+#define IOAPIC_H
+
+#include <stdint.h>
+
+// Redirection entry flags for IOAPIC_Route. ISA lines are edge-triggered
+// and active high unless the MADT says otherwise; PCI lines are level-
+// triggered and active low.
+#define IOAPIC_ACTIVE_LOW (1u << 13)
+#define IOAPIC_LEVEL      (1u << 15)
+
+// Maps every IOAPIC the MADT lists and masks all their inputs. Needs
+// ACPI_Init and VMalloc_Init. Returns how many there are.
+uint32_t IOAPIC_Init();
+int IOAPIC_Present();
+// The GSI an ISA IRQ is wired to, and its flags, after the MADT's
+// interrupt source overrides
+uint32_t IOAPIC_ISAToGSI(uint8_t irq, uint32_t* flags);
+// Sends gsi to vector on the CPU with apic_id, and unmasks it. Without
+// interrupt remapping the destination is 8 bits, even in x2APIC mode.
+// Returns 0 if no IOAPIC serves gsi or apic_id does not fit.
+int IOAPIC_Route(uint32_t gsi, uint8_t vector, uint32_t apic_id, uint32_t flags);
+void IOAPIC_Mask(uint32_t gsi);
+void IOAPIC_Unmask(uint32_t gsi);
+
+#endif
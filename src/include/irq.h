@@ -0,0 +1,42 @@
+#ifndef IRQ_H
+#define IRQ_H
+
+#include <stdint.h>
+
+// Device interrupts through the local APIC and the IOAPICs, with the 8259s
+// masked. Vectors IRQ_VECTOR_BASE up to IRQ_VECTOR_END each have a stub,
+// generated in interrupt_stubs.s, that calls the handler given to
+// request_irq, sends the EOI and lets a woken task preempt. Below the range
+// are the exceptions, TIMER_VECTOR and the 8259s' old range; above it the
+// IPIs and the spurious vector.
+#define IRQ_VECTOR_BASE 0x30
+#define IRQ_VECTOR_END  0xF0
+#define IRQ_STUB_SIZE   16          // bytes between generated stubs
+
+// Runs with interrupts off, before the EOI
+typedef void (*irq_handler_t)(void* ctx);
+
+// Sets up the stubs, masks the 8259s and the IOAPICs' inputs. Needs
+// Timer_Init, for the local APIC, and ACPI_Init.
+void IRQ_Init();
+// A free vector from the range, or 0 if none is left
+uint8_t IRQ_AllocVector();
+void IRQ_FreeVector(uint8_t vector);
+// Returns 0 if vector is outside the range or already has a handler
+int request_irq(uint8_t vector, irq_handler_t handler, void* ctx);
+// Does not wait for the handler if it is running on another CPU
+void free_irq(uint8_t vector);
+
+// Sends an ISA IRQ, through the MADT's overrides, or a GSI to vector on
+// the given CPU. Returns 0 if no IOAPIC serves it.
+int IRQ_RouteISA(uint8_t irq, uint8_t vector, uint32_t cpu);
+int IRQ_RouteGSI(uint32_t gsi, uint8_t vector, uint32_t cpu, uint32_t flags);
+
+void IRQ_PrintStats();
+
+#ifdef TINY64_BENCH
+// Needs interrupts enabled
+void IRQ_Benchmark();
+#endif
+
+#endif
@@ -30,6 +30,26 @@ typedef struct {
 uint32_t pci_config_read_dword(uint8_t bus, uint8_t slot, uint8_t func, uint8_t offset);
 void pci_config_write_dword(uint8_t bus, uint8_t slot, uint8_t func, uint8_t offset, uint32_t value);
 
+// Capability IDs (PCI Local Bus 3.0, appendix H)
+#define PCI_CAP_MSI  0x05
+#define PCI_CAP_MSIX 0x11
+
+// Offset of the capability with the given ID in the device's list, or 0
+uint8_t pci_find_capability(uint8_t bus, uint8_t slot, uint8_t func, uint8_t id);
+
+// Points MSI-X table entries 0 to count-1 at vectors[i] on the CPU with
+// apic_ids[i], fixed delivery and edge-triggered, then turns MSI-X on and
+// INTx off. Returns how many entries were set, which the table size can
+// cap, or 0 if the device has no MSI-X or an ID does not fit the 8-bit
+// message destination.
+uint32_t pci_enable_msix(uint8_t bus, uint8_t slot, uint8_t func,
+                         const uint8_t *vectors, const uint32_t *apic_ids,
+                         uint32_t count);
+// A single MSI message, for devices without MSI-X. Returns 0 if there is
+// no MSI capability.
+int pci_enable_msi(uint8_t bus, uint8_t slot, uint8_t func, uint8_t vector,
+                   uint32_t apic_id);
+
 void pci_enumerate();
 
 #endif
@@ -4,9 +4,53 @@
 #include <stdint.h>
 #include "bootinfo.h"
 
-// We'll need the UEFI memory map eventually, but for now, let's define a simple bitmap-based PMM
-void PMM_Init(uint64_t mem_size, void* bitmap_addr);
+// Largest buddy block is 2^PMM_MAX_ORDER pages (4 MiB)
+#define PMM_MAX_ORDER 10
+#define PMM_MAX_ZONES 32
+// Zones never straddle 4 GiB, so 32-bit DMA memory is a set of whole zones
+#define PMM_DMA32_PFN 0x100000ULL
+
+// Builds one zone per contiguous RAM span in the boot memory map and frees
+// all conventional memory. Boot services memory stays reserved until
+// PMM_ReclaimBootMemory, which must run once the kernel no longer uses the
+// firmware's stack or page tables.
+void PMM_Init(BootInfo* bootInfo);
+void PMM_ReclaimBootMemory(BootInfo* bootInfo);
+
+// Page pointers taken and returned below are direct-map addresses
+// (phys_to_virt), usable as-is; virt_to_phys gives the frame.
+
+// Buddy allocator: 2^order contiguous, naturally aligned pages
+void* PMM_AllocatePages(uint32_t order);
+void PMM_FreePages(void* addr, uint32_t order);
+// Same, with the whole block at or below max_phys (for devices with limited addressing)
+void* PMM_AllocatePagesBelow(uint32_t order, uint64_t max_phys);
+
+// Single-page wrappers
 void* PMM_AllocatePage();
 void PMM_FreePage(void* addr);
 
+// Hand an arbitrary page range to the allocator (boot-time)
+void PMM_FreeRange(void* addr, uint64_t count);
+
+// Per-page owner tag for allocators built on top of the PMM (the slab
+// allocator records the slab each page belongs to). Cleared on free.
+void PMM_SetPageOwner(void* addr, uint64_t count, void* owner);
+void* PMM_GetPageOwner(void* addr);
+
+// Mapping counts for frames shared between address spaces. A frame starts
+// at zero; PMM_PageUnref frees it when the count drops back to zero and
+// returns what is left.
+void PMM_PageRef(void* addr);
+uint32_t PMM_PageUnref(void* addr);
+uint32_t PMM_PageRefCount(void* addr);
+
+uint64_t PMM_GetFreePages();
+uint32_t PMM_GetZoneCount();
+void PMM_GetZone(uint32_t index, uint64_t* base, uint64_t* size);
+
+#ifdef TINY64_BENCH
+void PMM_Benchmark();
+#endif
+
 #endif
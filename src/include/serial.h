@@ -0,0 +1,14 @@
+#ifndef SERIAL_H
+#define SERIAL_H
+
+#include <stdint.h>
+
+// Straight to COM1, polled: usable from the first instruction and from any
+// context, interrupt handlers and spinning CPUs included. serial_print in
+// core/main.c echoes to the framebuffer console as well.
+void debug_print(const char* str);
+void debug_dec(uint64_t v);
+// All 16 digits, no prefix
+void debug_hex(uint64_t v);
+
+#endif
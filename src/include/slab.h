@@ -0,0 +1,34 @@
+#ifndef SLAB_H
+#define SLAB_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define CACHE_LINE_SIZE 64
+
+// kmalloc sizes up to this are served from the power-of-two size caches
+#define SLAB_KMALLOC_MAX 4096
+
+typedef struct SlabCache SlabCache;
+
+// Sets up the internal caches and the kmalloc-16 .. kmalloc-4096 size
+// classes. Needs the PMM.
+void Slab_Init();
+
+// Objects are size bytes, aligned to align (0 = pointer size). Pass
+// CACHE_LINE_SIZE for structures that should not share cache lines.
+SlabCache* Slab_CreateCache(const char* name, size_t size, size_t align);
+
+// O(1): objects come off a per-slab free list, slabs off per-cache lists
+void* Slab_Alloc(SlabCache* cache);
+void Slab_Free(SlabCache* cache, void* obj);
+
+// Size class for a kmalloc request, or NULL if size > SLAB_KMALLOC_MAX
+SlabCache* Slab_SizeCache(size_t size);
+// Cache an object was allocated from, or NULL if ptr is not a slab object
+SlabCache* Slab_CacheOf(void* ptr);
+size_t Slab_ObjectSize(SlabCache* cache);
+
+void Slab_PrintStats();
+
+#endif
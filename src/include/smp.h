@@ -0,0 +1,60 @@
+#ifndef SMP_H
+#define SMP_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define MAX_CPUS    16
+#define MSR_GS_BASE 0xC0000101
+
+struct AddressSpace;
+struct Task;
+
+// Each CPU's own data, found through GS_BASE. self comes first so
+// this_cpu() is a single load from %gs:0.
+typedef struct PerCPU {
+    struct PerCPU* self;
+    uint32_t id;                        // 0 for the BSP, then in bring-up order
+    uint32_t apic_id;
+    struct AddressSpace* space;         // loaded in CR3
+    volatile uint32_t tlb_pending;      // a shootdown is waiting on this CPU
+    volatile uint32_t online;
+    struct Task* fpu_owner;             // whose state the vector registers hold
+} PerCPU;
+
+static inline PerCPU* this_cpu() {
+    PerCPU* cpu;
+    __asm__ volatile ("mov %%gs:0, %0" : "=r"(cpu));
+    return cpu;
+}
+
+// Only stable while the caller cannot migrate: interrupts off, or a task
+// pinned to the CPU
+static inline uint32_t cpu_id() {
+    uint32_t id;
+    __asm__ volatile ("movl %%gs:%c1, %0" : "=r"(id) : "i"(offsetof(PerCPU, id)));
+    return id;
+}
+
+// The BSP's per-CPU area. Runs before anything uses this_cpu().
+void SMP_InitBSP();
+// Starts every other CPU the MADT lists with INIT-SIPI-SIPI and waits for
+// each to come online and enter its idle task. Needs ACPI_Init, Timer_Init
+// and Task_Init.
+void SMP_Init();
+uint32_t SMP_CPUCount();
+PerCPU* SMP_GetCPU(uint32_t id);
+// A fixed interrupt to another online CPU
+void SMP_SendIPI(uint32_t cpu, uint8_t vector);
+// Invalidates addrs, or everything when count > TLB_BATCH_MAX, on every
+// other online CPU, and waits until they all have
+void SMP_ShootdownTLB(const uint64_t* addrs, uint32_t count);
+// TLB_VECTOR: answers a pending shootdown
+void SMP_TLBInterrupt();
+
+#ifdef TINY64_BENCH
+// Needs interrupts enabled and the other CPUs online
+void SMP_Benchmark();
+#endif
+
+#endif
@@ -0,0 +1,51 @@
+#ifndef SPINLOCK_H
+#define SPINLOCK_H
+
+#include <stdint.h>
+#include "cpu.h"
+
+// Busy-wait locks for data shared between CPUs. Anything an interrupt
+// handler also takes must be locked with interrupts off, through the
+// _irqsave pair.
+typedef struct {
+    volatile uint32_t locked;
+} Spinlock;
+
+#define SPINLOCK_INIT {0}
+
+// A CPU spinning with interrupts off still answers TLB shootdowns through
+// this, so a CPU that holds the lock and is flushing cannot wait on it
+void SMP_Relax();
+
+static inline void spin_init(Spinlock* l) {
+    l->locked = 0;
+}
+
+static inline int spin_trylock(Spinlock* l) {
+    return !__atomic_exchange_n(&l->locked, 1, __ATOMIC_ACQUIRE);
+}
+
+// Spins on a plain read, so waiters do not keep pulling the line away
+// from the holder
+static inline void spin_lock(Spinlock* l) {
+    while (!spin_trylock(l)) {
+        while (l->locked) SMP_Relax();
+    }
+}
+
+static inline void spin_unlock(Spinlock* l) {
+    __atomic_store_n(&l->locked, 0, __ATOMIC_RELEASE);
+}
+
+static inline uint64_t spin_lock_irqsave(Spinlock* l) {
+    uint64_t flags = irq_save();
+    spin_lock(l);
+    return flags;
+}
+
+static inline void spin_unlock_irqrestore(Spinlock* l, uint64_t flags) {
+    spin_unlock(l);
+    irq_restore(flags);
+}
+
+#endif
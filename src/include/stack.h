@@ -0,0 +1,22 @@
+#ifndef STACK_H
+#define STACK_H
+
+#include <stdint.h>
+
+// Kernel stacks. Each is a slot in a pre-mapped pool with an unmapped
+// guard page below it, so an overflow faults instead of corrupting the
+// stack underneath, and allocating one is a pop from a free list.
+#define STACK_SIZE (16 * 1024)
+
+// Needs vmalloc. Returns the lowest address of the stack; it grows down
+// from base + STACK_SIZE.
+void* Stack_Alloc();
+void Stack_Free(void* base);
+// Deepest use of the stack so far, in bytes. Free stacks are kept filled
+// with a pattern, and this finds where the pattern ends.
+uint64_t Stack_HighWater(void* base);
+// Whether addr is in one of the pool's guard pages
+int Stack_IsGuard(uint64_t addr);
+void Stack_PrintStats();
+
+#endif
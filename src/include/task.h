@@ -2,13 +2,91 @@
 #define TASK_H
 
 #include <stdint.h>
+#include "timer.h"
 
-typedef struct {
-    uint64_t rsp;
+typedef enum {
+    TASK_READY,
+    TASK_RUNNING,
+    TASK_BLOCKED,               // until Task_Wake
+    TASK_SLEEPING,              // until its sleep timer fires
+    TASK_DEAD,
+} TaskState;
+
+// Priority levels, 0 the most urgent. Each level has its own FIFO and
+// timeslice; a ready task always runs before any task of a later level.
+#define TASK_PRIORITIES          32
+#define TASK_PRIORITY_INPUT      4      // device event handling
+#define TASK_PRIORITY_DEFAULT    16
+#define TASK_PRIORITY_BACKGROUND 24
+#define TASK_PRIORITY_IDLE       (TASK_PRIORITIES - 1)
+#define TASK_BOOST_MAX           4
+#define TASK_SLICE_NS            10000000ULL    // level 0; later levels get more
+
+typedef struct Task {
+    uint64_t rsp;               // saved while switched out
+    uint32_t id;
+    TaskState state;
+    uint32_t priority;          // base level, set by Task_SetPriority
+    uint32_t level;             // current level: priority, less any boost
+    uint64_t slice;             // ns left in its timeslice
+    Timer sleep_timer;
+    uint64_t woken_tsc;         // when woken, until it runs; else 0
+    const char* name;
+    void* stack_base;           // lowest stack address; NULL for the boot task
+    uint64_t stack_size;
+    uint64_t switches;          // times it was switched in
+    uint64_t runtime;           // ns it has run for
+    uint64_t blocks;            // times it blocked or slept
+    void* fpu_state;            // XSAVE area, from its first SIMD use
+    uint32_t fpu_cpu;           // whose registers last held that state
+    uint32_t cpu;               // run queue it is on, or last ran from
+    volatile int on_cpu;        // running, or not yet switched away from
+    struct Task* next;          // run queue or zombie list
+    struct Task* wait_next;     // wait queue
+    struct WaitQueue* wait_queue;   // the one it is queued on, if any
+    struct Task* all_prev;      // every live task
+    struct Task* all_next;
 } Task;
 
+// The code calling Task_Init becomes the first task, on CPU 0. Needs
+// Timer_Init and SMP_InitBSP.
 void Task_Init();
-void Task_Create(void (*entry)(), void* stack);
+// An application processor's bring-up code, on stack_base from the stack
+// pool, becomes that CPU's idle task. Does not return.
+void Task_StartCPU(void* stack_base);
+// Takes a stack from the pool and queues the task on the least loaded
+// CPU. Returning from entry ends the task. NULL if there is no memory for
+// the task or its stack.
+Task* Task_Create(void (*entry)(), const char* name);
+void Task_Exit();
+Task* Task_Current();
+// Ignores a NULL task, so it can take Task_Create's result directly
+void Task_SetPriority(Task* task, uint32_t priority);
+// Gives the CPU to the next task of the same level, if there is one
 void Task_Yield();
+// Blocking is in two steps, so a wakeup from another CPU between them is
+// not lost: Task_PrepareBlock marks the current task blocked, and Task_Block
+// then switches away unless Task_Wake came first. Interrupts stay off
+// between the two. A task that blocks before its timeslice runs out is
+// boosted up to TASK_BOOST_MAX levels; one that uses whole slices drifts
+// back down.
+void Task_PrepareBlock();
+void Task_Block();
+void Task_Wake(Task* task);
+// Sleeps for at least ns nanoseconds; 0 yields
+void Task_Sleep(uint64_t ns);
+// End of an interrupt handler, after the EOI: switches if the handler made
+// a more urgent task ready or ended the current timeslice
+void Task_Preempt();
+// Per-task stack high-water marks and run statistics, and each CPU's idle
+// time and wakeup latency since the last call
+void Task_PrintStats();
+
+#ifdef TINY64_BENCH
+// Needs to run before any task but the idle task is created
+void Task_Benchmark();
+// Needs the timer interrupt set up
+void Task_SwitchBenchmark();
+#endif
 
 #endif
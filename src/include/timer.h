@@ -0,0 +1,38 @@
+#ifndef TIMER_H
+#define TIMER_H
+
+#include <stdint.h>
+
+// One-shot timers on clock_monotonic_ns(). The hardware is only ever set for
+// the nearest expiry, so with nothing pending no timer interrupt comes at
+// all, and a timer fires as close to its deadline as the hardware allows.
+// Each CPU keeps its own list; a timer fires on the CPU that last armed it.
+typedef struct Timer {
+    uint64_t expires;               // clock_monotonic_ns() time
+    void (*fn)(struct Timer* t);    // runs in the timer interrupt
+    void* data;
+    struct Timer* next;
+    volatile int armed;
+    uint32_t cpu;                   // whose list it is on while armed
+} Timer;
+
+// Uses the TSC-deadline timer if the CPU has one, else the local APIC
+// timer, else the PIT. Needs Clock_Init, PIC_Remap and VMalloc_Init.
+void Timer_Init();
+// The same timer on an application processor, with its own list
+void Timer_InitCPU();
+// Arms t on this CPU, or moves it here if it is armed already. fn and data
+// must be set.
+void Timer_Arm(Timer* t, uint64_t expires);
+// Does not wait for a callback already running on another CPU
+void Timer_Cancel(Timer* t);
+// TIMER_VECTOR: sends the EOI and runs the callbacks that are due
+void Timer_Interrupt();
+void Timer_PrintStats();
+
+#ifdef TINY64_BENCH
+// Needs interrupts enabled
+void Timer_Benchmark();
+#endif
+
+#endif
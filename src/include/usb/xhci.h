@@ -80,7 +80,20 @@ typedef struct {
 
 // USB Status Register Bits
 #define USB_STS_HCH   (1 << 0) // HCHalted
+#define USB_STS_EINT  (1 << 3) // Event Interrupt (RW1C)
 
-void xhci_init(uint64_t mmio_base);
+// Boot-protocol report from a HID interrupt IN endpoint
+typedef struct {
+  uint32_t slot_id;
+  uint8_t data[8];
+  uint64_t time_ns; // clock_monotonic_ns when its event was drained
+} xhci_hid_report_t;
+
+// The PCI function is for its MSI-X or MSI capability
+void xhci_init(uint8_t bus, uint8_t slot, uint8_t func, uint64_t mmio_base);
+// Blocks until a HID report arrives. Reports that find the queue full are
+// dropped and counted.
+void xhci_hid_read(xhci_hid_report_t *out);
+void xhci_print_stats();
 
 #endif
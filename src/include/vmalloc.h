@@ -0,0 +1,48 @@
+#ifndef VMALLOC_H
+#define VMALLOC_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+// Kernel virtual window handed out in ranges: vmalloc memory, large
+// kmalloc blocks, stacks and device mappings. Every range is followed by
+// an unmapped guard page, and the window starts with one, so an overrun in
+// either direction faults instead of reaching a neighbour.
+#define VMALLOC_BASE  0xFFFFD00000000000ULL
+#define VMALLOC_SIZE  (1ULL << 44)      // 16 TiB, up to PML4 slot 448
+#define VMALLOC_GUARD 4096
+
+// Needs the slab allocator
+void VMalloc_Init();
+
+// Memory backed by fresh pages, mapped writable
+void* vmalloc(size_t size);
+// The same, but demand-zero: pages are backed the first time they are touched
+void* vmalloc_lazy(size_t size);
+// Unmaps the range, returns the frames vmalloc backed it with, and gives
+// the addresses back. Also undoes ioremap.
+void vfree(void* addr);
+// Usable size of the range starting at addr, or 0 if there is none
+size_t vmalloc_size(void* addr);
+
+// Maps a physical range (a device BAR) with the given PAGE_CACHE_* type
+// and returns the virtual address of phys. Ranges of 2 MiB and more are
+// 2 MiB aligned so they can use huge pages.
+void* ioremap(uint64_t phys, size_t size, uint64_t cache);
+void iounmap(void* addr);
+
+// Address range only, aligned to align (a power of two); the caller maps
+// what it needs and releases it with vfree
+void* VMalloc_Reserve(size_t size, size_t align);
+
+// Called for not-present faults in the window. Returns the mapping flags
+// if addr lies in a demand-zero range (not its guard page), else 0.
+uint64_t VMalloc_FaultFlags(uint64_t addr);
+
+void VMalloc_PrintStats();
+
+#ifdef TINY64_BENCH
+void VMalloc_Benchmark();
+#endif
+
+#endif
@@ -6,19 +6,147 @@
 
 #define PAGE_SIZE 4096
 
+// Higher-half layout. The low half (PML4 slots 0-255) is left free for
+// per-address-space user mappings; the kernel lives above it.
+#define DIRECT_MAP_BASE 0xFFFF800000000000ULL  // all RAM at phys + DIRECT_MAP_BASE
+#define DIRECT_MAP_SIZE (1ULL << 46)           // 64 TiB, up to the heap window
+#define KERNEL_VMA      0xFFFFFFFF80000000ULL  // kernel image at phys + KERNEL_VMA
+#define USER_TOP        0x0000800000000000ULL  // end of the per-address-space half
+
+// Any RAM frame is reachable through the direct map, so converting is one add
+static inline void* phys_to_virt(uint64_t phys) {
+    return (void*)(phys + DIRECT_MAP_BASE);
+}
+
+// Valid for direct-map and kernel image addresses; anything else (heap,
+// MMIO windows) needs VMM_GetPhysical
+static inline uint64_t virt_to_phys(void* virt) {
+    uint64_t v = (uint64_t)virt;
+    return v >= KERNEL_VMA ? v - KERNEL_VMA : v - DIRECT_MAP_BASE;
+}
+
 typedef uint64_t page_table_entry;
 
 typedef struct {
     page_table_entry entries[512];
 } page_table;
 
+// Up to this many addresses are flushed one invlpg at a time; past it a
+// batch falls back to flushing the whole TLB
+#define TLB_BATCH_MAX 32
+
+// Translations that changed and frames that were unmapped, collected so the
+// TLB work is done once per operation rather than once per page. Frames are
+// returned to the PMM only after the flush, so no stale entry can reach a
+// page that has been handed out again. Start zeroed (tlb_batch b = {0}).
+typedef struct {
+    uint64_t addrs[TLB_BATCH_MAX];
+    uint32_t count;                   // > TLB_BATCH_MAX: flush everything
+    uint32_t frame_count;
+    uint64_t frames[TLB_BATCH_MAX];   // physical address | buddy order
+} tlb_batch;
+
+// A PML4 whose kernel half is shared with every other space and whose user
+// half (below USER_TOP) is private. Each space gets its own PCID when the
+// CPU has them, so switching keeps both halves' TLB entries.
+typedef struct AddressSpace {
+    page_table* pml4;
+    uint16_t pcid;              // 0: none free, every switch flushes
+    struct AddressSpace* next;
+} AddressSpace;
+
 void VMM_Init();
 void VMM_MapPage(void* virtual_addr, void* physical_addr, uint64_t flags);
+// Maps a contiguous range with the largest pages alignment allows: 1 GiB
+// (if the CPU has them), then 2 MiB, and 4 KiB only at unaligned edges
+void VMM_MapRange(void* virtual_addr, void* physical_addr, uint64_t length, uint64_t flags);
+// Clears the mapping and flushes it from the TLB. Returns the physical page
+// that was mapped (the caller decides whether to free it), or NULL.
+void* VMM_UnmapPage(void* virtual_addr);
+
+// Batched operations on [virtual_addr, virtual_addr + length). Huge pages
+// the range covers only in part are split first; holes are skipped. Nothing
+// is flushed until VMM_FlushBatch.
+//
+// Unmap optionally queues the frames behind the range (4 KiB or 2 MiB
+// pages from the PMM) to be freed by the flush.
+void VMM_Unmap(void* virtual_addr, uint64_t length, int free_frames, tlb_batch* batch);
+// Replaces the permission and cache flags of existing mappings
+void VMM_Protect(void* virtual_addr, uint64_t length, uint64_t flags, tlb_batch* batch);
+// VMM_MapRange over mappings that may already exist
+void VMM_Remap(void* virtual_addr, void* physical_addr, uint64_t length, uint64_t flags, tlb_batch* batch);
+// Flushes on every CPU, then frees the queued frames
+void VMM_FlushBatch(tlb_batch* batch);
+// This CPU only, for shootdown requests: addrs, or everything when
+// count > TLB_BATCH_MAX
+void VMM_FlushTLB(const uint64_t* addrs, uint32_t count);
+
+void* VMM_GetPhysical(void* virtual_addr);
+
+// Anonymous memory backed on demand: a not-present fault inside a reserved
+// range maps a zeroed page with the range's flags, so reserving costs
+// nothing until the memory is touched. Needs the slab allocator.
+int VMM_Reserve(void* virtual_addr, uint64_t length, uint64_t flags);
+// Called by the #PF handler; returns 0 if the fault is not ours to fix
+int VMM_HandleFault(uint64_t addr, uint64_t error_code);
+// Pages filled in by VMM_HandleFault so far
+uint64_t VMM_GetDemandPages();
+// Loads the kernel page tables. With PCID, kernel translations are global and
+// each address space keeps its own TLB tag, so CR3 loads do not flush.
 void VMM_Activate();
+// Puts an application processor on the kernel page tables, with the PAT
+// set as on the BSP
+void VMM_InitCPU();
 page_table* VMM_GetKernelPML4();
+// Pages allocated for page tables so far
+uint64_t VMM_GetTablePages();
+
+// Address spaces need the slab allocator. Frames mapped into a user half
+// are reference counted through the PMM and freed with the last mapping.
+AddressSpace* AddressSpace_Create();
+// Copies only the page tables: writable pages turn read-only and
+// copy-on-write in both spaces, and the first write fault on either side
+// gets a private copy. Read-only pages (program text) stay shared. NULL if
+// page tables run out.
+AddressSpace* AddressSpace_Clone(AddressSpace* src);
+void AddressSpace_Destroy(AddressSpace* as);
+void AddressSpace_Switch(AddressSpace* as);
+AddressSpace* AddressSpace_Current();
+// The space of kernel_pml4 itself, loaded by VMM_Activate
+AddressSpace* AddressSpace_Kernel();
+// Maps a 4 KiB frame into the user half, taking a reference on it. Mapping
+// the same frames read-only into several spaces shares them, e.g. a program
+// image loaded once. Returns 0 for kernel-half addresses.
+int AddressSpace_MapPage(AddressSpace* as, void* virtual_addr, void* physical_addr, uint64_t flags);
+void AddressSpace_UnmapPage(AddressSpace* as, void* virtual_addr);
+// Pages copied by write faults so far
+uint64_t AddressSpace_GetCowCopies();
+
+#ifdef TINY64_BENCH
+void VMM_Benchmark(void (*map_layout)());
+// Needs the kernel page tables active
+void VMM_MapBenchmark();
+// Needs the slab allocator
+void AddressSpace_Benchmark();
+#endif
 
 #define PAGE_PRESENT (1ULL << 0)
 #define PAGE_WRITE   (1ULL << 1)
 #define PAGE_USER    (1ULL << 2)
+#define PAGE_PWT     (1ULL << 3)
+#define PAGE_PCD     (1ULL << 4)
+#define PAGE_HUGE    (1ULL << 7)   // PS: 2 MiB / 1 GiB page in a PD / PDPT entry
+#define PAGE_GLOBAL  (1ULL << 8)   // set by the VMM on every kernel-half leaf
+#define PAGE_COW     (1ULL << 9)   // software bit: read-only until a write fault copies it
+
+// Cache types for mapping flags. VMM_Init programs the PAT so PWT/PCD pick
+// one of four types and the PAT bit is never needed. Without PAT support
+// WC degrades to WT, which is still safe for a framebuffer.
+#define PAGE_CACHE_WB 0                       // RAM
+#define PAGE_CACHE_WC PAGE_PWT                // framebuffers: stores combine into bursts
+#define PAGE_CACHE_WT PAGE_PCD
+#define PAGE_CACHE_UC (PAGE_PCD | PAGE_PWT)   // device registers
+
+#define PAGE_ADDR_MASK 0x000FFFFFFFFFF000ULL
 
 #endif
@@ -0,0 +1,63 @@
+#ifndef WAIT_H
+#define WAIT_H
+
+#include <stdint.h>
+#include "task.h"
+#include "spinlock.h"
+
+// Tasks blocked until someone wakes them, in FIFO order. A waiter checks
+// its condition and calls WaitQueue_Wait with the queue's lock held, so a
+// wakeup that lands between the check and the block, from any CPU, is not
+// lost.
+typedef struct WaitQueue {
+    Spinlock lock;
+    Task* head;
+    Task* tail;
+} WaitQueue;
+
+void WaitQueue_Init(WaitQueue* q);
+// Blocks the current task until it is woken. q->lock must be held with
+// interrupts off, and still is on return; the caller rechecks its
+// condition.
+void WaitQueue_Wait(WaitQueue* q);
+// The wake calls may be made from interrupt handlers. They return how
+// many tasks were woken.
+uint32_t WaitQueue_WakeOne(WaitQueue* q);
+uint32_t WaitQueue_WakeAll(WaitQueue* q);
+
+// Stays signalled, letting every waiter through, until Event_Reset
+typedef struct {
+    volatile int signalled;
+    WaitQueue waiters;
+} Event;
+
+void Event_Init(Event* e);
+void Event_Wait(Event* e);
+void Event_Signal(Event* e);
+void Event_Reset(Event* e);
+
+typedef struct {
+    volatile uint32_t count;
+    WaitQueue waiters;
+} Semaphore;
+
+void Semaphore_Init(Semaphore* s, uint32_t count);
+void Semaphore_Down(Semaphore* s);
+// Takes a unit only if one is free; returns whether it did
+int Semaphore_TryDown(Semaphore* s);
+void Semaphore_Up(Semaphore* s);
+
+// Work finishing once, or once per Completion_Complete
+typedef struct {
+    volatile uint32_t done;
+    WaitQueue waiters;
+} Completion;
+
+void Completion_Init(Completion* c);
+void Completion_Wait(Completion* c);
+// Lets one waiter through, now or later
+void Completion_Complete(Completion* c);
+// Lets every waiter through, now and later
+void Completion_CompleteAll(Completion* c);
+
+#endif
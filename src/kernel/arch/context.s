@@ -25,3 +25,16 @@ context_switch:
     pop %rbp
     
     ret
+
+.global task_start
+.extern Task_Exit
+.extern finish_switch
+
+// Where a new task's first context_switch returns: r12 holds its entry
+// point. The switch is finished here, as schedule() would have, and since
+// it may be switched to from the timer interrupt, interrupts go back on.
+task_start:
+    call finish_switch
+    sti
+    call *%r12
+    call Task_Exit
@@ -0,0 +1,70 @@
+.extern kernel_main
+.global _start
+
+.section .bss
+.align 16
+boot_stack:
+    .skip 65536
+boot_stack_top:
+
+// Boot page tables, in low memory next to the entry code. Zeroed by the
+// loader like any other bss.
+.section .boot.bss, "aw", @nobits
+.align 4096
+boot_pml4:
+    .skip 4096
+boot_pdpt_high:
+    .skip 4096
+boot_pd_high:
+    .skip 4096
+
+// Linked at its physical address: runs identity-mapped on the firmware's
+// page tables, with the BootInfo pointer (physical) in RDI.
+.section .boot.text, "ax"
+_start:
+    // The firmware identity-maps all of memory. Borrow its lower-half PML4
+    // entries twice: as-is, so this code stays mapped across the CR3 switch,
+    // and at PML4 slot 256 as the direct map until VMM_Activate.
+    mov %cr3, %rax
+    and $~0xFFF, %rax
+    lea boot_pml4(%rip), %rbx
+    xor %ecx, %ecx
+1:
+    mov (%rax,%rcx,8), %rdx
+    mov %rdx, (%rbx,%rcx,8)
+    mov %rdx, 256*8(%rbx,%rcx,8)
+    inc %ecx
+    cmp $128, %ecx
+    jb 1b
+
+    // Kernel image window: -2 GiB .. -1 GiB onto physical 0 .. 1 GiB
+    lea boot_pd_high(%rip), %rsi
+    mov $0x83, %eax                 /* present, write, 2 MiB */
+    xor %ecx, %ecx
+2:
+    mov %rax, (%rsi,%rcx,8)
+    add $0x200000, %rax
+    inc %ecx
+    cmp $512, %ecx
+    jb 2b
+    lea boot_pdpt_high(%rip), %rdx
+    lea 3(%rsi), %rax
+    mov %rax, 510*8(%rdx)
+    lea 3(%rdx), %rax
+    mov %rax, 511*8(%rbx)
+
+    mov %rbx, %cr3
+    movabs $start_high, %rax
+    jmp *%rax
+
+.section .text
+// Now running at the link address. Switch to a kernel-owned stack so boot
+// services memory can be reclaimed once the kernel has its own page tables.
+start_high:
+    movabs $boot_stack_top, %rsp
+    xor %rbp, %rbp
+    call kernel_main
+1:
+    cli
+    hlt
+    jmp 1b
@@ -1,8 +1,11 @@
-.extern irq0_handler
-.global irq0_stub
+.extern timer_handler
+.extern resched_handler
+.extern tlb_handler
 
-irq0_stub:
-    /* Save all registers */
+// Saves every register around a C interrupt handler
+.macro irq_stub name, handler
+.global \name
+\name:
     push %rax
     push %rbx
     push %rcx
@@ -19,11 +22,122 @@ irq0_stub:
     push %r14
     push %r15
 
-    mov %rsp, %rdi /* Pass stack pointer as argument */
-    call irq0_handler
+    /* A task switch happens inside the handler, on this stack; the task
+       preempted here comes back through the same pops and iretq */
+    call \handler
 
-    /* If irq0_handler returns a new RSP, switch to it */
-    mov %rax, %rsp
+    pop %r15
+    pop %r14
+    pop %r13
+    pop %r12
+    pop %r11
+    pop %r10
+    pop %r9
+    pop %r8
+    pop %rbp
+    pop %rdi
+    pop %rsi
+    pop %rdx
+    pop %rcx
+    pop %rbx
+    pop %rax
+    iretq
+.endm
+
+irq_stub timer_stub, timer_handler
+irq_stub resched_stub, resched_handler
+irq_stub tlb_stub, tlb_handler
+irq_stub nm_stub, nm_handler
+
+.extern irq_dispatch
+.global irq_stubs
+
+// One entry per vector request_irq hands out, IRQ_VECTOR_BASE up to
+// IRQ_VECTOR_END in irq.h, IRQ_STUB_SIZE bytes apart: push the vector and
+// join irq_common
+.align 16
+irq_stubs:
+.set vector, 0x30
+.rept 0xF0 - 0x30
+    .align 16
+    push $vector
+    jmp irq_common
+    .set vector, vector + 1
+.endr
+
+irq_common:
+    push %rax
+    push %rbx
+    push %rcx
+    push %rdx
+    push %rsi
+    push %rdi
+    push %rbp
+    push %r8
+    push %r9
+    push %r10
+    push %r11
+    push %r12
+    push %r13
+    push %r14
+    push %r15
+
+    mov 120(%rsp), %rdi /* the vector, above the 15 registers */
+    mov %rsp, %rbx
+    and $-16, %rsp /* the pushed vector left the stack 8 bytes off */
+    call irq_dispatch
+    mov %rbx, %rsp
+
+    pop %r15
+    pop %r14
+    pop %r13
+    pop %r12
+    pop %r11
+    pop %r10
+    pop %r9
+    pop %r8
+    pop %rbp
+    pop %rdi
+    pop %rsi
+    pop %rdx
+    pop %rcx
+    pop %rbx
+    pop %rax
+    add $8, %rsp
+    iretq
+
+.global spurious_stub
+
+// The local APIC's spurious vector: no EOI, nothing to do
+spurious_stub:
+    iretq
+
+.extern page_fault_handler
+.global page_fault_stub
+
+// #PF, on IST_PAGE_FAULT. The CPU has pushed an error code.
+page_fault_stub:
+    push %rax
+    push %rbx
+    push %rcx
+    push %rdx
+    push %rsi
+    push %rdi
+    push %rbp
+    push %r8
+    push %r9
+    push %r10
+    push %r11
+    push %r12
+    push %r13
+    push %r14
+    push %r15
+
+    mov %rsp, %rdi /* struct ExceptionFrame* */
+    mov %rsp, %rbx
+    and $-16, %rsp /* the error code left the stack 8 bytes off */
+    call page_fault_handler
+    mov %rbx, %rsp
 
     pop %r15
     pop %r14
@@ -40,5 +154,6 @@ irq0_stub:
     pop %rcx
     pop %rbx
     pop %rax
-    
-    iretq
\ No newline at end of file
+    add $8, %rsp /* error code */
+    iretq
+
@@ -0,0 +1,26 @@
+.global simd_copy_nt
+
+// void simd_copy_nt(void* dst, const void* src, uint64_t bytes)
+simd_copy_nt:
+    mov %rdx, %rcx
+    shr $6, %rcx                    /* 64-byte blocks */
+    jz 2f
+1:
+    movdqu (%rsi), %xmm0
+    movdqu 16(%rsi), %xmm1
+    movdqu 32(%rsi), %xmm2
+    movdqu 48(%rsi), %xmm3
+    movntdq %xmm0, (%rdi)
+    movntdq %xmm1, 16(%rdi)
+    movntdq %xmm2, 32(%rdi)
+    movntdq %xmm3, 48(%rdi)
+    add $64, %rsi
+    add $64, %rdi
+    dec %rcx
+    jnz 1b
+2:
+    mov %rdx, %rcx
+    and $63, %rcx                   /* the tail */
+    rep movsb
+    sfence                          /* the streaming stores are visible before anything after */
+    ret
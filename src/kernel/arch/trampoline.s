@@ -0,0 +1,95 @@
+.global ap_trampoline
+.global ap_trampoline_params
+.global ap_trampoline_end
+
+// Application processor startup. SMP_Init copies this to a page below
+// 1 MiB and points a SIPI at it, so an AP starts here in real mode with
+// CS = page >> 4 and IP = 0. Everything is addressed relative to the page:
+// DS-relative in 16-bit code, RIP-relative in 64-bit code.
+.section .rodata
+.code16
+ap_trampoline:
+    cli
+    cld
+    mov %cs, %ax
+    mov %ax, %ds
+
+    lgdtl tr_gdtr - ap_trampoline
+
+    // Straight from real mode to long mode: PAE, the page tables and
+    // EFER.LME first, then PE and PG in one CR0 write
+    mov $0x20, %eax                 /* CR4.PAE */
+    mov %eax, %cr4
+    movl tr_cr3 - ap_trampoline, %eax
+    mov %eax, %cr3
+    mov $0xC0000080, %ecx           /* EFER */
+    movl tr_efer - ap_trampoline, %eax
+    movl tr_efer + 4 - ap_trampoline, %edx
+    wrmsr
+    mov %cr0, %eax
+    or $0x80000001, %eax            /* PG | PE */
+    mov %eax, %cr0
+
+    // Into the 64-bit code segment, at its address in the copied page
+    ljmpl *(tr_entry64 - ap_trampoline)
+
+.code64
+tr_long:
+    mov $0x10, %eax
+    mov %eax, %ds
+    mov %eax, %es
+    mov %eax, %ss
+    mov %eax, %fs
+    mov %eax, %gs
+
+    // The BSP's control registers: SSE on, write protection, global pages
+    // and PCIDs. PCIDE may be set here, with CR3[11:0] still zero.
+    mov tr_cr4(%rip), %rax
+    mov %rax, %cr4
+    mov tr_cr0(%rip), %rax
+    mov %rax, %cr0
+
+    // Still on the trampoline page tables, which map the kernel half too
+    mov tr_stack(%rip), %rsp
+    mov tr_cpu(%rip), %rdi
+    mov tr_main(%rip), %rax
+    xor %ebp, %ebp
+    call *%rax
+1:
+    cli
+    hlt
+    jmp 1b
+
+.align 16
+tr_gdt:
+    .quad 0
+    .quad 0x00AF9A000000FFFF        /* 0x08: 64-bit code */
+    .quad 0x00CF92000000FFFF        /* 0x10: data */
+
+// Filled in by SMP_Init for each AP. The two addresses start out as
+// offsets into the trampoline; SMP_Init adds the page's address.
+.align 8
+ap_trampoline_params:
+tr_gdtr:
+    .word tr_gdtr - tr_gdt - 1
+    .long tr_gdt - ap_trampoline
+    .word 0
+tr_entry64:
+    .long tr_long - ap_trampoline
+    .word 0x08
+    .word 0
+tr_cr3:
+    .quad 0                         /* below 4 GiB */
+tr_efer:
+    .quad 0
+tr_cr0:
+    .quad 0
+tr_cr4:
+    .quad 0
+tr_stack:
+    .quad 0
+tr_main:
+    .quad 0
+tr_cpu:
+    .quad 0
+ap_trampoline_end:
@@ -4,31 +4,36 @@
 #include "../include/pmm.h"
 #include "../include/vmm.h"
 #include "../include/heap.h"
+#include "../include/vmalloc.h"
+#include "../include/slab.h"
 #include "../include/task.h"
+#include "../include/timer.h"
+#include "../include/clock.h"
+#include "../include/cpu.h"
+#include "../include/acpi.h"
+#include "../include/smp.h"
+#include "../include/fpu.h"
+#include "../include/async.h"
+#include "../include/irq.h"
+#include "../include/serial.h"
 #include "pci.h"
+#include "usb/xhci.h"
 #include <stddef.h>
 
 // Defined in other files
 void ConsoleInit(BootInfo *bootInfo);
 void PrintString(const char *str, uint32_t color);
-void SetupGDT();
 void SetupIDT();
-void PMM_FreePages(void* addr, uint64_t count);
-void xhci_poll_events();
-
-// Serial Port output
-static inline void outb(uint16_t port, uint8_t val) {
-    __asm__ volatile ("outb %0, %1" : : "a"(val), "Nd"(port));
-}
+void print_hex(uint64_t val);
+#ifdef TINY64_BENCH
+void ConsoleBenchmark();
+#endif
 
 static int g_ConsoleReady = 0;
 
 void serial_print(const char *str) {
     // Always print to COM1
-    const char *p = str;
-    while (*p) {
-        outb(0x3F8, *p++);
-    }
+    debug_print(str);
 
     // Also print to framebuffer console once initialized
     if (g_ConsoleReady) {
@@ -45,7 +50,7 @@ void taskA() {
     while(1) {
         PrintString(" [A] ", 0x00FFFF);
         serial_print("A");
-        for(volatile int i=0; i<5000000; i++);
+        Task_Sleep(500000000ULL); // 500 ms
     }
 }
 
@@ -53,12 +58,85 @@ void taskB() {
     while(1) {
         PrintString(" [B] ", 0xFFFF00);
         serial_print("B");
-        for(volatile int i=0; i<5000000; i++);
+        Task_Sleep(500000000ULL); // 500 ms
+    }
+}
+
+// Linker script symbols bracketing the higher-half kernel image
+extern char _kernel_start[], _kernel_end[];
+
+// The loader's hand-off and the framebuffer's physical address, which
+// map_boot_layout reads. They live in file scope because it takes no
+// arguments: VMM_Benchmark calls it back to build the same layout again.
+static BootInfo* g_BootInfo;
+static uint64_t g_FramebufferPhys;
+
+static void print_dec(uint64_t v) {
+    char buf[21];
+    int i = 20;
+    buf[i] = 0;
+    if (v == 0) buf[--i] = '0';
+    while (v > 0) { buf[--i] = (v % 10) + '0'; v /= 10; }
+    serial_print(&buf[i]);
+}
+
+// Blocked until the xHCI interrupt handlers queue a report, so a keypress
+// is printed as soon as it arrives, with no polling in between
+static void hidTask() {
+    while (1) {
+        xhci_hid_report_t r;
+        xhci_hid_read(&r);
+        uint32_t a = r.data[0] | (r.data[1] << 8) | (r.data[2] << 16) | ((uint32_t)r.data[3] << 24);
+        uint32_t b = r.data[4] | (r.data[5] << 8) | (r.data[6] << 16) | ((uint32_t)r.data[7] << 24);
+        serial_print("[HID] slot=");
+        print_dec(r.slot_id);
+        serial_print(" report=");
+        print_hex(a);
+        serial_print(" ");
+        print_hex(b);
+        serial_print("\n");
+    }
+}
+
+static void map_direct(uint64_t base, uint64_t end) {
+    if (end > base) VMM_MapRange(phys_to_virt(base), (void*)base, end - base, PAGE_WRITE);
+}
+
+static void map_boot_layout() {
+    // Direct map of everything in the memory map that is not reserved: RAM,
+    // loader data and ACPI tables. Adjacent entries are mapped as one span
+    // so type changes do not break up the huge pages.
+    uint64_t span_base = 0, span_end = 0;
+    for (uint64_t i = 0; i < g_BootInfo->MemoryMapEntries; i++) {
+        MemoryMapEntry* e = &g_BootInfo->MemoryMap[i];
+        if (e->Type == MEMORY_TYPE_RESERVED) continue;
+        if (e->Base != span_end) {
+            map_direct(span_base, span_end);
+            span_base = e->Base;
+        }
+        span_end = e->Base + e->Size;
     }
+    map_direct(span_base, span_end);
+
+    // The framebuffer goes at its direct-map slot as well, write-combining
+    uint64_t fb_size = (uint64_t)g_BootInfo->height * g_BootInfo->pitch * 4;
+    VMM_MapRange(phys_to_virt(g_FramebufferPhys), (void*)g_FramebufferPhys, fb_size,
+                 PAGE_WRITE | PAGE_CACHE_WC);
+
+    // Kernel image, including the boot stack in .bss
+    VMM_MapRange(_kernel_start, (void*)virt_to_phys(_kernel_start), _kernel_end - _kernel_start, PAGE_WRITE);
 }
 
 void kernel_main(BootInfo *bootInfo) {
     uint64_t val;
+    // The loader passes physical pointers; the boot page tables direct-map
+    // them until the VMM takes over
+    bootInfo = (BootInfo*)phys_to_virt((uint64_t)bootInfo);
+    bootInfo->MemoryMap = (MemoryMapEntry*)phys_to_virt((uint64_t)bootInfo->MemoryMap);
+    g_FramebufferPhys = (uint64_t)bootInfo->framebuffer;
+    bootInfo->framebuffer = (uint32_t*)phys_to_virt(g_FramebufferPhys);
+    g_BootInfo = bootInfo;
+
     serial_print("[KERNEL] Entered kernel_main\n");
     serial_print("[KERNEL] BUILD: xhci-portscan-v2\n");
     // ... Console, PMM, VMM init ...
@@ -74,27 +152,20 @@ void kernel_main(BootInfo *bootInfo) {
 
     PrintString("Tiny64 Kernel Loaded!\n", 0xFFFFFF);
     serial_print("[KERNEL] Setting up GDT...\n");
-    SetupGDT();
+    SetupGDT(0);
+    // GS points at CPU 0's per-CPU area from here on
+    SMP_InitBSP();
     serial_print("[KERNEL] Setting up IDT...\n");
     SetupIDT();
+    // Lazy SIMD state: TS set, so each task's first use traps
+    FPU_Init();
+    // Timestamps for everything after this, the benchmarks included
+    Clock_Init();
 
     // PMM
     serial_print("[KERNEL] Initializing PMM...\n");
-    void* bitmap_addr = (void*)bootInfo->LargestFreeRegion.Base;
-    uint64_t mem_size = bootInfo->LargestFreeRegion.Size;
-    
-    serial_print("[KERNEL] PMM Region Base: ");
-    val = (uint64_t)bitmap_addr;
-    for (int i = 15; i >= 0; i--) {
-        char c = (val >> (i * 4)) & 0xF;
-        if (c < 10) c += '0'; else c += 'A' - 10;
-        char s[2] = {c, 0};
-        serial_print(s);
-    }
-    serial_print("\n");
-
-    serial_print("[KERNEL] PMM Region Size: ");
-    val = mem_size;
+    serial_print("[KERNEL] Memory map entries: ");
+    val = bootInfo->MemoryMapEntries;
     for (int i = 15; i >= 0; i--) {
         char c = (val >> (i * 4)) & 0xF;
         if (c < 10) c += '0'; else c += 'A' - 10;
@@ -103,71 +174,40 @@ void kernel_main(BootInfo *bootInfo) {
     }
     serial_print("\n");
 
-    PMM_Init(mem_size, bitmap_addr);
-
-    uint64_t bitmap_pages = ((mem_size / 4096 / 8) + 4095) / 4096;
-    if (bitmap_pages == 0) bitmap_pages = 1;
-    serial_print("[KERNEL] Reserving ");
-    {
-        char s[32];
-        int len = 0;
-        uint64_t tmp = bitmap_pages;
-        if (tmp == 0) s[len++] = '0';
-        else {
-            char buf[32];
-            int i = 0;
-            while (tmp > 0) { buf[i++] = (tmp % 10) + '0'; tmp /= 10; }
-            while (i > 0) s[len++] = buf[--i];
-        }
-        s[len] = 0;
-        serial_print(s);
-    }
-    serial_print(" pages for bitmap.\n");
-
-    PMM_FreePages((void*)(bootInfo->LargestFreeRegion.Base + (bitmap_pages * 4096)), (mem_size / 4096) - bitmap_pages);
+    PMM_Init(bootInfo);
+#ifdef TINY64_BENCH
+    PMM_Benchmark();
+#endif
     PrintString("PMM Initialized.\n", 0x00FF00);
 
     // VMM
     serial_print("[KERNEL] Initializing VMM...\n");
     VMM_Init();
-    // Identity map first 128MB
-    serial_print("[KERNEL] Mapping first 128MB...\n");
-    for (uint64_t i = 0; i < 0x8000000; i += 4096) VMM_MapPage((void*)i, (void*)i, PAGE_WRITE);
-    
-    // Identity map the PMM region itself so we can access it
-    serial_print("[KERNEL] Mapping PMM Region...\n");
-    for (uint64_t i = 0; i < 0x1000000; i += 4096) { // Map at least 16MB of the free region
-        uint64_t addr = bootInfo->LargestFreeRegion.Base + i;
-        VMM_MapPage((void*)addr, (void*)addr, PAGE_WRITE);
-    }
-
-    uint64_t fb_base = (uint64_t)bootInfo->framebuffer;
-    uint64_t fb_size = (uint64_t)bootInfo->height * bootInfo->pitch * 4;
-    serial_print("[KERNEL] Mapping Framebuffer...\n");
-    for (uint64_t i = 0; i < fb_size; i += 4096) VMM_MapPage((void*)(fb_base + i), (void*)(fb_base + i), PAGE_WRITE);
-
-    uint64_t rip = 0;
-    __asm__ volatile ("lea (%%rip), %0" : "=r"(rip));
-    uint64_t stack_addr_pre = (uint64_t)&val;
-
-    uint64_t rip_start = (rip > 0x800000) ? (rip - 0x800000) : 0;
-    rip_start &= ~0xFFFULL;
-    uint64_t rip_end = (rip + 0x800000) & ~0xFFFULL;
-    for (uint64_t a = rip_start; a <= rip_end; a += 4096) {
-        VMM_MapPage((void*)a, (void*)a, PAGE_WRITE);
-    }
 
-    uint64_t sp_start = (stack_addr_pre > 0x200000) ? (stack_addr_pre - 0x200000) : 0;
-    sp_start &= ~0xFFFULL;
-    uint64_t sp_end = (stack_addr_pre + 0x200000) & ~0xFFFULL;
-    for (uint64_t a = sp_start; a <= sp_end; a += 4096) {
-        VMM_MapPage((void*)a, (void*)a, PAGE_WRITE);
-    }
+#ifdef TINY64_BENCH
+    VMM_Benchmark(map_boot_layout);
+#endif
+    uint64_t map_start = rdtsc();
+    map_boot_layout();
+    uint64_t map_cycles = rdtsc() - map_start;
+    serial_print("[KERNEL] Kernel map: ");
+    print_dec(VMM_GetTablePages());
+    serial_print(" page-table pages, ");
+    print_dec(map_cycles);
+    serial_print(" cycles\n");
     
     serial_print("[KERNEL] Activating VMM...\n");
     VMM_Activate();
+#ifdef TINY64_BENCH
+    VMM_MapBenchmark();
+    ConsoleBenchmark();
+#endif
     PrintString("VMM Initialized.\n", 0x00FF00);
 
+    // Firmware page tables and stack are no longer in use, and nothing is
+    // mapped in the low half any more
+    PMM_ReclaimBootMemory(bootInfo);
+
     // Stack Check
     uint64_t stack_addr = (uint64_t)&val; // val is on the stack
     serial_print("[KERNEL] Stack Address: ");
@@ -181,56 +221,78 @@ void kernel_main(BootInfo *bootInfo) {
 
     // Heap
     serial_print("[KERNEL] Initializing Heap...\n");
-    void* heap_start = PMM_AllocatePage();
-    
-    serial_print("[KERNEL] Heap Start: ");
-    uint64_t hval = (uint64_t)heap_start;
-    for (int i = 15; i >= 0; i--) {
-        char c = (hval >> (i * 4)) & 0xF;
-        if (c < 10) c += '0'; else c += 'A' - 10;
-        char s[2] = {c, 0};
-        serial_print(s);
-    }
-    serial_print("\n");
-
-    if (heap_start == NULL) {
-        serial_print("[KERNEL] FATAL: PMM_AllocatePage returned NULL\n");
-        while(1);
-    }
-
-    // Map the heap page explicitly if needed (though it should be in identity map or PMM region)
-    // Check if it's mapped?
-    // For now, just try to map it to be safe
-    VMM_MapPage(heap_start, heap_start, PAGE_WRITE);
-
-    Heap_Init(heap_start, 4096);
+    Slab_Init();
+    VMalloc_Init();
+    Heap_Init();
+#ifdef TINY64_BENCH
+    Heap_Benchmark();
+    AddressSpace_Benchmark();
+    VMalloc_Benchmark();
+#endif
+    Heap_PrintStats();
+    VMalloc_PrintStats();
     serial_print("[KERNEL] Heap Initialized Successfully.\n");
     PrintString("Heap Initialized.\n", 0x00FF00);
 
-    // PCI Enumeration
-    serial_print("[KERNEL] Starting PCI Enumeration...\n");
-    PrintString("Scanning PCI Bus...\n", 0xFFFFFF);
-    pci_enumerate();
+    // Firmware tables: the CPUs and interrupt controllers
+    ACPI_Init(bootInfo->RSDP);
 
-    // Multitasking Setup
-    Task_Init();
-    void* stackA = kmalloc(4096);
-    void* stackB = kmalloc(4096);
-    Task_Create(taskA, (char*)stackA + 4096);
-    Task_Create(taskB, (char*)stackB + 4096);
-    
-    // Setup Timer
+    // Timers and multitasking, ahead of the drivers so they can sleep
+    // while they wait on hardware
     PIC_Remap();
-    PIT_Init(100); // 100 Hz
+    Timer_Init();
+    // Device interrupts through the IOAPICs, the 8259s masked
+    IRQ_Init();
+    Task_Init();
+#ifdef TINY64_BENCH
+    Task_Benchmark();
+#endif
+    // Input handling runs ahead of the background tasks, which only get
+    // what it leaves over
+    Task_SetPriority(Task_Current(), TASK_PRIORITY_INPUT);
+    Task_SetPriority(Task_Create(taskA, "taskA"), TASK_PRIORITY_BACKGROUND);
+    Task_SetPriority(Task_Create(taskB, "taskB"), TASK_PRIORITY_BACKGROUND);
+    // Driver state machines run as coroutines on one worker task
+    Async_Init();
+    serial_print("[KERNEL] Demand-filled pages so far: ");
+    print_dec(VMM_GetDemandPages());
+    serial_print("\n");
+#ifdef TINY64_BENCH
+    Task_SwitchBenchmark();
+#endif
 
     PrintString("Starting Preemptive Multitasking...\n", 0xFFFFFF);
     serial_print("[KERNEL] Starting Preemptive Multitaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaasking...\n");
 
     __asm__ volatile ("sti"); // Enable Interrupts
+#ifdef TINY64_BENCH
+    Timer_Benchmark();
+    FPU_Benchmark();
+    IRQ_Benchmark();
+#endif
+
+    // The other CPUs, each straight into its idle task
+    SMP_Init();
+#ifdef TINY64_BENCH
+    SMP_Benchmark();
+#endif
+
+    // PCI Enumeration
+    serial_print("[KERNEL] Starting PCI Enumeration...\n");
+    PrintString("Scanning PCI Bus...\n", 0xFFFFFF);
+    pci_enumerate();
+    Task_SetPriority(Task_Create(hidTask, "hid"), TASK_PRIORITY_INPUT);
 
     while (1) {
-        xhci_poll_events();
-        for(volatile int i=0; i<200000; i++);
+        // Stack high-water marks, for tuning STACK_SIZE, idle time and
+        // wakeup latency
+        Task_Sleep(10000000000ULL); // 10 s
+        Task_PrintStats();
+        Timer_PrintStats();
+        FPU_PrintStats();
+        Async_PrintStats();
+        IRQ_PrintStats();
+        xhci_print_stats();
     }
 }
 
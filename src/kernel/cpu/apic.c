@@ -0,0 +1,101 @@
+#include "../include/apic.h"
+#include "../include/interrupts.h"
+#include "../include/vmalloc.h"
+#include "../include/vmm.h"
+#include "../include/cpu.h"
+#include <stddef.h>
+
+#define APIC_BASE_X2APIC (1ULL << 10)
+#define APIC_BASE_ENABLE (1ULL << 11)
+// x2APIC registers are MSRs, one per 16-byte xAPIC register
+#define MSR_X2APIC       0x800
+
+static volatile uint32_t* lapic;
+static int x2apic;
+static int present;
+
+// Globally enabled, then switched to x2APIC mode, which can only be entered
+// from enabled xAPIC mode and never left without a reset
+static void enable() {
+    uint64_t base = rdmsr(MSR_APIC_BASE);
+    if (!(base & APIC_BASE_ENABLE)) {
+        base |= APIC_BASE_ENABLE;
+        wrmsr(MSR_APIC_BASE, base);
+    }
+    if (x2apic && !(base & APIC_BASE_X2APIC)) wrmsr(MSR_APIC_BASE, base | APIC_BASE_X2APIC);
+}
+
+int LAPIC_Init() {
+    uint32_t a, b, c, d;
+    cpuid(1, 0, &a, &b, &c, &d);
+    if (!(d & (1u << 9))) return 0;
+
+    // x2APIC when the CPU has it, or the firmware already turned it on;
+    // else the MMIO page, at whatever address the firmware left it
+    uint64_t base = rdmsr(MSR_APIC_BASE);
+    x2apic = (c & (1u << 21)) || (base & APIC_BASE_X2APIC);
+    if (!x2apic) {
+        lapic = (volatile uint32_t*)ioremap(base & 0x000FFFFFFFFFF000ULL, 4096, PAGE_CACHE_UC);
+        if (!lapic) return 0;
+    }
+    enable();
+    present = 1;
+
+    LAPIC_Write(LAPIC_SVR, LAPIC_SVR_ENABLE | SPURIOUS_VECTOR);
+    return 1;
+}
+
+// Every CPU's LAPIC decodes the same address, so the BSP's mapping serves;
+// each CPU switches to x2APIC mode on its own
+void LAPIC_InitCPU() {
+    enable();
+    LAPIC_Write(LAPIC_SVR, LAPIC_SVR_ENABLE | SPURIOUS_VECTOR);
+}
+
+int LAPIC_Present() {
+    return present;
+}
+
+int LAPIC_IsX2APIC() {
+    return x2apic;
+}
+
+uint32_t LAPIC_GetID() {
+    if (x2apic) return LAPIC_Read(LAPIC_ID);
+    return LAPIC_Read(LAPIC_ID) >> 24;
+}
+
+uint32_t LAPIC_Read(uint32_t reg) {
+    if (x2apic) return (uint32_t)rdmsr(MSR_X2APIC + reg / 16);
+    return lapic[reg / 4];
+}
+
+void LAPIC_Write(uint32_t reg, uint32_t value) {
+    if (x2apic) wrmsr(MSR_X2APIC + reg / 16, value);
+    else lapic[reg / 4] = value;
+}
+
+// One MSR write in x2APIC mode, against an uncached store that has to
+// reach the APIC's page
+void LAPIC_EndOfInterrupt() {
+    if (x2apic) wrmsr(MSR_X2APIC + LAPIC_EOI / 16, 0);
+    else lapic[LAPIC_EOI / 4] = 0;
+}
+
+void LAPIC_SendIPI(uint32_t apic_id, uint32_t icr) {
+    if (x2apic) {
+        // One 64-bit ICR with the full destination ID, and no delivery
+        // status to wait on. The WRMSR is not serializing, so stores the
+        // target is meant to see are fenced ahead of it.
+        __asm__ volatile ("mfence" : : : "memory");
+        wrmsr(MSR_X2APIC + LAPIC_ICR_LOW / 16, ((uint64_t)apic_id << 32) | icr);
+        return;
+    }
+    // Both halves in one go, so an interrupt handler sending its own IPI
+    // cannot land in between
+    uint64_t flags = irq_save();
+    while (LAPIC_Read(LAPIC_ICR_LOW) & LAPIC_ICR_PENDING) __asm__ volatile ("pause");
+    LAPIC_Write(LAPIC_ICR_HIGH, apic_id << 24);
+    LAPIC_Write(LAPIC_ICR_LOW, icr);
+    irq_restore(flags);
+}
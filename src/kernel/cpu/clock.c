@@ -0,0 +1,99 @@
+#include "../include/clock.h"
+#include "../include/cpu.h"
+#include "../include/serial.h"
+
+#define NS_PER_SEC 1000000000ULL
+
+static uint64_t tsc_base;
+static uint64_t tsc_hz;
+static uint64_t ns_mult;            // ns = cycles * ns_mult >> 32
+static uint64_t tsc_mult;           // cycles = ns * tsc_mult >> 24
+
+static inline uint64_t mul_shift(uint64_t a, uint64_t mult, int shift) {
+    return (uint64_t)(((unsigned __int128)a * mult) >> shift);
+}
+
+// TSC rate from the crystal clock: ecx Hz times ebx/eax. 0 if the CPU
+// does not enumerate it, as most hypervisors do not.
+static uint64_t cpuid_tsc_hz() {
+    uint32_t a, b, c, d;
+    cpuid(0, 0, &a, &b, &c, &d);
+    if (a < 0x15) return 0;
+    cpuid(0x15, 0, &a, &b, &c, &d);
+    if (!a || !b || !c) return 0;
+    return (uint64_t)c * b / a;
+}
+
+// TSC ticks per second against a 10 ms one-shot on PIT channel 2, best of
+// three so an SMI landing in one run does not skew it
+static uint64_t pit_tsc_hz() {
+    const uint16_t count = 11932;   // 1193182 Hz / 100
+    uint64_t best = ~0ULL;
+    for (int run = 0; run < 3; run++) {
+        outb(0x61, (inb(0x61) & ~0x02) | 0x01);  // gate on, speaker off
+        outb(0x43, 0xB0);                        // channel 2, lo/hi, mode 0
+        outb(0x42, count & 0xFF);
+        outb(0x42, count >> 8);
+        uint64_t start = rdtsc();
+        while (!(inb(0x61) & 0x20));
+        uint64_t cycles = rdtsc() - start;
+        if (cycles < best) best = cycles;
+    }
+    return best * 100;
+}
+
+void Clock_Init() {
+    uint32_t a, b, c, d;
+    cpuid(0x80000000, 0, &a, &b, &c, &d);
+    int invariant = 0;
+    if (a >= 0x80000007) {
+        cpuid(0x80000007, 0, &a, &b, &c, &d);
+        invariant = (d >> 8) & 1;
+    }
+
+    const char* from = "CPUID";
+    tsc_hz = cpuid_tsc_hz();
+    if (!tsc_hz) {
+        from = "PIT";
+        tsc_hz = pit_tsc_hz();
+    }
+    ns_mult = (NS_PER_SEC << 32) / tsc_hz;
+    tsc_mult = (tsc_hz << 24) / NS_PER_SEC;
+    tsc_base = rdtsc();
+
+    debug_print("[CLOCK] TSC ");
+    debug_dec(tsc_hz / 1000);
+    debug_print(" kHz from ");
+    debug_print(from);
+    // Without an invariant TSC, time drifts when the core changes speed
+    debug_print(invariant ? ", invariant\n" : ", not invariant\n");
+}
+
+uint64_t clock_monotonic_ns() {
+    return mul_shift(rdtsc() - tsc_base, ns_mult, 32);
+}
+
+uint64_t clock_tsc_hz() {
+    return tsc_hz;
+}
+
+uint64_t clock_cycles_to_ns(uint64_t cycles) {
+    return mul_shift(cycles, ns_mult, 32);
+}
+
+uint64_t clock_ns_to_tsc(uint64_t ns) {
+    return tsc_base + mul_shift(ns, tsc_mult, 24);
+}
+
+void ndelay(uint64_t ns) {
+    uint64_t end = rdtsc() + mul_shift(ns, tsc_mult, 24);
+    while (rdtsc() < end) __asm__ volatile ("pause");
+}
+
+void udelay(uint64_t us) {
+    ndelay(us * 1000);
+}
+
+void mdelay(uint64_t ms) {
+    ndelay(ms * 1000000);
+}
@@ -0,0 +1,297 @@
+#include "../include/fpu.h"
+#include "../include/task.h"
+#include "../include/smp.h"
+#include "../include/slab.h"
+#include "../include/spinlock.h"
+#include "../include/cpu.h"
+#include "../include/serial.h"
+#include <stddef.h>
+
+#define CR0_MP          (1ULL << 1)
+#define CR0_EM          (1ULL << 2)
+#define CR0_TS          (1ULL << 3)
+#define CR0_NE          (1ULL << 5)
+#define CR4_OSFXSR      (1ULL << 9)
+#define CR4_OSXMMEXCPT  (1ULL << 10)
+#define CR4_OSXSAVE     (1ULL << 18)
+
+// XCR0 components
+#define XFEATURE_X87        (1ULL << 0)
+#define XFEATURE_SSE        (1ULL << 1)
+#define XFEATURE_AVX        (1ULL << 2)
+#define XFEATURE_AVX512     (7ULL << 5)     // opmask, upper ZMM0-15, ZMM16-31
+#define XFEATURE_WANTED     (XFEATURE_X87 | XFEATURE_SSE | XFEATURE_AVX | XFEATURE_AVX512)
+
+#define FPU_STATE_MAX   4096
+#define FXSAVE_SIZE     512
+#define MXCSR_DEFAULT   0x1F80              // every exception masked
+
+typedef enum {
+    FPU_FXSAVE,
+    FPU_XSAVE,
+    FPU_XSAVEOPT,
+} FpuMode;
+
+static const char* mode_names[] = {"FXSAVE", "XSAVE", "XSAVEOPT"};
+
+static FpuMode mode;
+static uint64_t xcr0;
+static uint32_t state_size;
+static int ready;
+// What a task starts with: the registers right after FNINIT. XRSTOR needs
+// the header zeroed, which the copy carries along.
+__attribute__((aligned(64)))
+static uint8_t init_state[FPU_STATE_MAX];
+static SlabCache* state_cache;
+static Spinlock state_lock;         // creating state_cache
+
+static uint64_t traps;
+static uint64_t restores;           // traps that had to load the state
+static uint64_t saves;
+static uint64_t sections;
+
+static inline void clts() {
+    __asm__ volatile ("clts" : : : "memory");
+}
+
+static inline void stts() {
+    write_cr0(read_cr0() | CR0_TS);
+}
+
+static inline void xsetbv(uint32_t reg, uint64_t value) {
+    __asm__ volatile ("xsetbv" : : "c"(reg), "a"((uint32_t)value), "d"((uint32_t)(value >> 32)));
+}
+
+static void save(void* area) {
+    uint32_t lo = (uint32_t)xcr0, hi = (uint32_t)(xcr0 >> 32);
+    switch (mode) {
+    case FPU_XSAVEOPT: __asm__ volatile ("xsaveopt64 (%0)" : : "r"(area), "a"(lo), "d"(hi) : "memory"); break;
+    case FPU_XSAVE: __asm__ volatile ("xsave64 (%0)" : : "r"(area), "a"(lo), "d"(hi) : "memory"); break;
+    case FPU_FXSAVE: __asm__ volatile ("fxsave64 (%0)" : : "r"(area) : "memory"); break;
+    }
+}
+
+static void restore(const void* area) {
+    uint32_t lo = (uint32_t)xcr0, hi = (uint32_t)(xcr0 >> 32);
+    if (mode == FPU_FXSAVE) __asm__ volatile ("fxrstor64 (%0)" : : "r"(area) : "memory");
+    else __asm__ volatile ("xrstor64 (%0)" : : "r"(area), "a"(lo), "d"(hi) : "memory");
+}
+
+// Control registers and XCR0 the same on every CPU, the registers in their
+// initial state, and TS set so the first use traps
+static void setup_cpu() {
+    write_cr0((read_cr0() | CR0_MP | CR0_NE) & ~(CR0_EM | CR0_TS));
+    uint64_t cr4 = read_cr4() | CR4_OSFXSR | CR4_OSXMMEXCPT;
+    if (mode != FPU_FXSAVE) cr4 |= CR4_OSXSAVE;
+    write_cr4(cr4);
+    if (mode != FPU_FXSAVE) xsetbv(0, xcr0);
+
+    uint32_t mxcsr = MXCSR_DEFAULT;
+    __asm__ volatile ("fninit; ldmxcsr %0" : : "m"(mxcsr));
+}
+
+void FPU_Init() {
+    uint32_t a, b, c, d;
+    cpuid(1, 0, &a, &b, &c, &d);
+    mode = FPU_FXSAVE;
+    state_size = FXSAVE_SIZE;
+    if (c & (1u << 26)) {
+        cpuid(0xD, 0, &a, &b, &c, &d);
+        xcr0 = (((uint64_t)d << 32) | a) & XFEATURE_WANTED;
+        // AVX-512 only as a whole, and only if its state fits
+        if ((xcr0 & XFEATURE_AVX512) != XFEATURE_AVX512) xcr0 &= ~XFEATURE_AVX512;
+        mode = FPU_XSAVE;
+        setup_cpu();
+        cpuid(0xD, 0, &a, &b, &c, &d);
+        if (b > FPU_STATE_MAX) {
+            xcr0 &= ~XFEATURE_AVX512;
+            setup_cpu();
+            cpuid(0xD, 0, &a, &b, &c, &d);
+        }
+        state_size = b;     // for the components now in XCR0
+        cpuid(0xD, 1, &a, &b, &c, &d);
+        if (a & 1) mode = FPU_XSAVEOPT;
+    }
+    setup_cpu();
+
+    for (uint32_t i = 0; i < FPU_STATE_MAX; i++) init_state[i] = 0;
+    save(init_state);
+    this_cpu()->fpu_owner = NULL;
+    stts();
+    ready = 1;
+
+    debug_print("[FPU] ");
+    debug_print(mode_names[mode]);
+    if (mode != FPU_FXSAVE) {
+        debug_print(", XCR0 ");
+        debug_hex(xcr0);
+    }
+    debug_print(", ");
+    debug_dec(state_size);
+    debug_print("-byte state areas\n");
+}
+
+void FPU_InitCPU() {
+    setup_cpu();
+    this_cpu()->fpu_owner = NULL;
+    stts();
+}
+
+int FPU_Ready() {
+    return ready;
+}
+
+uint32_t FPU_StateSize() {
+    return state_size;
+}
+
+// Areas are only made for tasks that use SIMD, on their first #NM
+static void* alloc_state() {
+    if (!state_cache) {
+        uint64_t flags = spin_lock_irqsave(&state_lock);
+        if (!state_cache) state_cache = Slab_CreateCache("fpu_state", state_size, 64);
+        spin_unlock_irqrestore(&state_lock, flags);
+    }
+    uint8_t* area = state_cache ? (uint8_t*)Slab_Alloc(state_cache) : NULL;
+    if (area) {
+        for (uint32_t i = 0; i < state_size; i++) area[i] = init_state[i];
+    }
+    return area;
+}
+
+void FPU_Switch(Task* prev, Task* next) {
+    (void)next;
+    // TS is only clear once the owner, prev, has touched the registers
+    if (read_cr0() & CR0_TS) return;
+    PerCPU* cpu = this_cpu();
+    if (cpu->fpu_owner == prev) {
+        save(prev->fpu_state);
+        __atomic_add_fetch(&saves, 1, __ATOMIC_RELAXED);
+    }
+    stts();
+}
+
+void FPU_FreeState(Task* task) {
+    if (task->fpu_state) Slab_Free(state_cache, task->fpu_state);
+    task->fpu_state = NULL;
+}
+
+// The registers are loaded only if they hold someone else's state: the
+// task may have been the last to use them here, with nothing since
+void FPU_Trap() {
+    clts();
+    PerCPU* cpu = this_cpu();
+    Task* t = Task_Current();
+    __atomic_add_fetch(&traps, 1, __ATOMIC_RELAXED);
+    if (!t->fpu_state) {
+        t->fpu_state = alloc_state();
+        if (!t->fpu_state) {
+            debug_print("[FPU] No memory for a state area\n");
+            __asm__ volatile ("cli; hlt");
+        }
+        t->fpu_cpu = FPU_NO_CPU;
+    }
+    if (cpu->fpu_owner != t || t->fpu_cpu != cpu->id) {
+        restore(t->fpu_state);
+        __atomic_add_fetch(&restores, 1, __ATOMIC_RELAXED);
+    }
+    cpu->fpu_owner = t;
+    t->fpu_cpu = cpu->id;
+}
+
+uint64_t kernel_fpu_begin() {
+    uint64_t flags = irq_save();
+    PerCPU* cpu = this_cpu();
+    if (!(read_cr0() & CR0_TS) && cpu->fpu_owner) {
+        save(cpu->fpu_owner->fpu_state);
+        __atomic_add_fetch(&saves, 1, __ATOMIC_RELAXED);
+    }
+    // Whatever the registers held is about to go
+    cpu->fpu_owner = NULL;
+    clts();
+    __atomic_add_fetch(&sections, 1, __ATOMIC_RELAXED);
+    return flags;
+}
+
+// The task's next SIMD instruction traps and reloads its state
+void kernel_fpu_end(uint64_t flags) {
+    stts();
+    irq_restore(flags);
+}
+
+void FPU_PrintStats() {
+    debug_print("[FPU] ");
+    debug_dec(traps);
+    debug_print(" traps, ");
+    debug_dec(restores);
+    debug_print(" restores, ");
+    debug_dec(saves);
+    debug_print(" saves, ");
+    debug_dec(sections);
+    debug_print(" kernel sections\n");
+}
+
+#ifdef TINY64_BENCH
+#include "../include/wait.h"
+
+#define BENCH_ROUNDS 10000
+
+static Completion bench_done;
+static uint64_t bench_cycles;
+
+// Two of these take turns. Each touches the registers once per round and
+// yields, so every round is a save on the way out and a trap and restore
+// on the way back in.
+static void bench_simd_task() {
+    uint64_t cycles = 0;
+    for (int i = 0; i < BENCH_ROUNDS; i++) {
+        uint64_t start = rdtsc();
+        __asm__ volatile ("pxor %%xmm0, %%xmm0" : : : "memory");
+        cycles += rdtsc() - start;
+        Task_Yield();
+    }
+    __atomic_add_fetch(&bench_cycles, cycles, __ATOMIC_RELAXED);
+    Completion_Complete(&bench_done);
+}
+
+// The cost of a lazy restore as seen by the task, the raw save and
+// restore, and an empty kernel_fpu section
+void FPU_Benchmark() {
+    __attribute__((aligned(64))) static uint8_t area[FPU_STATE_MAX];
+    for (uint32_t i = 0; i < state_size; i++) area[i] = init_state[i];
+
+    uint64_t flags = kernel_fpu_begin();
+    uint64_t start = rdtsc();
+    for (int i = 0; i < BENCH_ROUNDS; i++) save(area);
+    uint64_t save_cycles = (rdtsc() - start) / BENCH_ROUNDS;
+    start = rdtsc();
+    for (int i = 0; i < BENCH_ROUNDS; i++) restore(area);
+    uint64_t restore_cycles = (rdtsc() - start) / BENCH_ROUNDS;
+    kernel_fpu_end(flags);
+
+    start = rdtsc();
+    for (int i = 0; i < BENCH_ROUNDS; i++) kernel_fpu_end(kernel_fpu_begin());
+    uint64_t section_cycles = (rdtsc() - start) / BENCH_ROUNDS;
+
+    // Run before the other CPUs start, so both tasks share this one
+    Completion_Init(&bench_done);
+    bench_cycles = 0;
+    int created = 0;
+    for (int i = 0; i < 2; i++) {
+        if (Task_Create(bench_simd_task, "bench_simd")) created++;
+    }
+    for (int i = 0; i < created; i++) Completion_Wait(&bench_done);
+
+    debug_print("[BENCH] FPU: ");
+    debug_print(mode_names[mode]);
+    debug_print(" save ");
+    debug_dec(save_cycles);
+    debug_print(", restore ");
+    debug_dec(restore_cycles);
+    debug_print(", kernel_fpu section ");
+    debug_dec(section_cycles);
+    debug_print(", first SIMD use after a switch ");
+    debug_dec(created ? bench_cycles / (created * BENCH_ROUNDS) : 0);
+    debug_print(" cycles\n");
+}
+#endif
@@ -1,17 +1,60 @@
 #include "gdt.h"
+#include "smp.h"
 
+// Copied for each CPU, which gets its own TSS in the last slot
 struct GDT DefaultGDT = {
     {0, 0, 0, 0, 0, 0},             // Null
     {0, 0, 0, 0x9a, 0xa0, 0},       // Kernel Code (64-bit)
     {0, 0, 0, 0x92, 0xa0, 0},       // Kernel Data (64-bit)
     {0, 0, 0, 0xfa, 0xa0, 0},       // User Code (64-bit)
     {0, 0, 0, 0xf2, 0xa0, 0},       // User Data (64-bit)
+    {0, 0, 0, 0, 0, 0, 0, 0},       // TSS, filled in by SetupGDT
 };
 
-void SetupGDT() {
+static struct GDT gdts[MAX_CPUS];
+static struct TSS tss[MAX_CPUS];
+// A fault on one CPU must not land on another's interrupt stack
+__attribute__((aligned(16)))
+static uint8_t page_fault_stacks[MAX_CPUS][16384];
+
+void SetupGDT(uint32_t cpu) {
+    struct GDT* gdt = &gdts[cpu];
+    struct TSS* t = &tss[cpu];
+    *gdt = DefaultGDT;
+
+    uint64_t base = (uint64_t)t;
+    uint32_t limit = sizeof(*t) - 1;
+    t->IST[IST_PAGE_FAULT - 1] = (uint64_t)(page_fault_stacks[cpu] + sizeof(page_fault_stacks[cpu]));
+    t->IOMapBase = sizeof(*t);
+    gdt->TSS.Limit0 = (uint16_t)limit;
+    gdt->TSS.Base0 = (uint16_t)base;
+    gdt->TSS.Base1 = (uint8_t)(base >> 16);
+    gdt->TSS.Access = 0x89; // Present, 64-bit TSS (available)
+    gdt->TSS.Limit1_Flags = (uint8_t)((limit >> 16) & 0x0F);
+    gdt->TSS.Base2 = (uint8_t)(base >> 24);
+    gdt->TSS.Base3 = (uint32_t)(base >> 32);
+    gdt->TSS.Reserved = 0;
+
     struct GDTDescriptor gdtDescriptor;
     gdtDescriptor.Size = sizeof(struct GDT) - 1;
-    gdtDescriptor.Offset = (uint64_t)&DefaultGDT;
+    gdtDescriptor.Offset = (uint64_t)gdt;
 
     __asm__ volatile ("lgdt %0" : : "m"(gdtDescriptor));
+
+    // The firmware's (or the AP trampoline's) selectors index its own GDT;
+    // switch CS (via a far return) and the data segments to ours so iretq
+    // frames stay valid. GS is left alone: its base is the per-CPU area.
+    __asm__ volatile (
+        "pushq %0\n"
+        "lea 1f(%%rip), %%rax\n"
+        "pushq %%rax\n"
+        "lretq\n"
+        "1:\n"
+        "mov %1, %%ax\n"
+        "mov %%ax, %%ds\n"
+        "mov %%ax, %%es\n"
+        "mov %%ax, %%ss\n"
+        : : "i"(GDT_KERNEL_CODE), "i"(GDT_KERNEL_DATA) : "rax", "memory");
+
+    __asm__ volatile ("ltr %0" : : "r"((uint16_t)GDT_TSS));
 }
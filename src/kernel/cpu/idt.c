@@ -1,13 +1,26 @@
 #include "../include/idt.h"
 #include "../include/interrupts.h"
+#include "../include/gdt.h"
+#include "../include/vmm.h"
+#include "../include/stack.h"
+#include "../include/timer.h"
+#include "../include/task.h"
+#include "../include/apic.h"
+#include "../include/smp.h"
+#include "../include/fpu.h"
+#include "../include/serial.h"
 #include <stdint.h>
 
 __attribute__((aligned(0x10)))
 static struct IDTEntry idt[256];
 static struct IDTR idtr;
 
-extern void irq0_stub();
-extern uint64_t Task_Schedule(uint64_t current_rsp);
+extern void timer_stub();
+extern void resched_stub();
+extern void tlb_stub();
+extern void nm_stub();
+extern void spurious_stub();
+extern void page_fault_stub();
 
 void SetIDTGate(uint8_t vector, void* handler, uint8_t type_attr) {
     uint64_t offset = (uint64_t)handler;
@@ -20,16 +33,49 @@ void SetIDTGate(uint8_t vector, void* handler, uint8_t type_attr) {
     idt[vector].Reserved = 0;
 }
 
-uint64_t irq0_handler(uint64_t rsp) {
-    uint64_t next_rsp = Task_Schedule(rsp);
-    PIC_EndMaster();
-    return next_rsp;
+// The EOI goes first: Task_Preempt may switch to a task that does not come
+// back through here for a while
+void timer_handler() {
+    Timer_Interrupt();
+    Task_Preempt();
+}
+
+// Another CPU queued a task here that should run before the current one
+void resched_handler() {
+    LAPIC_EndOfInterrupt();
+    Task_Preempt();
+}
+
+void tlb_handler() {
+    SMP_TLBInterrupt();
+    LAPIC_EndOfInterrupt();
+}
+
+// #NM: a task's first SIMD instruction since it was switched in
+void nm_handler() {
+    FPU_Trap();
 }
 
 void exception_handler() {
     __asm__ volatile ("cli; hlt");
 }
 
+void page_fault_handler(struct ExceptionFrame* frame) {
+    uint64_t addr;
+    __asm__ volatile ("mov %%cr2, %0" : "=r"(addr));
+    if (VMM_HandleFault(addr, frame->error_code)) return;
+
+    if (Stack_IsGuard(addr)) debug_print("[KERNEL] Kernel stack overflow\n");
+    debug_print("[KERNEL] Page fault at ");
+    debug_hex(addr);
+    debug_print(" rip=");
+    debug_hex(frame->rip);
+    debug_print(" error=");
+    debug_hex(frame->error_code);
+    debug_print("\n");
+    while (1) __asm__ volatile ("cli; hlt");
+}
+
 void SetupIDT() {
     idtr.Limit = sizeof(idt) - 1;
     idtr.Offset = (uint64_t)&idt;
@@ -38,8 +84,19 @@ void SetupIDT() {
         SetIDTGate(i, exception_handler, 0x8E);
     }
 
-    SetIDTGate(32, irq0_stub, 0x8E); // IRQ0 - Timer
+    SetIDTGate(14, page_fault_stub, 0x8E);
+    idt[14].IST = IST_PAGE_FAULT;
+    SetIDTGate(7, nm_stub, 0x8E);
+    SetIDTGate(TIMER_VECTOR, timer_stub, 0x8E);
+    SetIDTGate(RESCHED_VECTOR, resched_stub, 0x8E);
+    SetIDTGate(TLB_VECTOR, tlb_stub, 0x8E);
+    SetIDTGate(SPURIOUS_VECTOR, spurious_stub, 0x8E);
+
+    LoadIDT();
+}
 
+// Every CPU shares the one table
+void LoadIDT() {
     __asm__ volatile ("lidt %0" : : "m"(idtr));
 }
 
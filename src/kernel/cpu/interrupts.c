@@ -1,10 +1,7 @@
 #include "../include/interrupts.h"
+#include "../include/cpu.h"
 #include <stdint.h>
 
-static inline void outb(uint16_t port, uint8_t val) {
-    __asm__ volatile ("outb %0, %1" : : "a"(val), "Nd"(port));
-}
-
 void PIC_EndMaster() {
     outb(0x20, 0x20);
 }
@@ -30,9 +27,20 @@ void PIC_Remap() {
     outb(0xA1, a2);
 }
 
-void PIT_Init(uint32_t frequency) {
-    uint32_t divisor = 1193182 / frequency;
-    outb(0x43, 0x36);
-    outb(0x40, (uint8_t)(divisor & 0xFF));
-    outb(0x40, (uint8_t)((divisor >> 8) & 0xFF));
+void PIC_Mask(uint8_t irq) {
+    uint16_t port = irq < 8 ? 0x21 : 0xA1;
+    outb(port, inb(port) | (1 << (irq & 7)));
+}
+
+void PIC_Unmask(uint8_t irq) {
+    uint16_t port = irq < 8 ? 0x21 : 0xA1;
+    outb(port, inb(port) & ~(1 << (irq & 7)));
+}
+
+// Every line masked, once the local APIC and IOAPICs take over. They stay
+// remapped, so a spurious IRQ7 or IRQ15 lands on 39 or 47, not on an
+// exception vector.
+void PIC_Disable() {
+    outb(0x21, 0xFF);
+    outb(0xA1, 0xFF);
 }
@@ -0,0 +1,124 @@
+#include "../include/ioapic.h"
+#include "../include/acpi.h"
+#include "../include/vmalloc.h"
+#include "../include/vmm.h"
+#include "../include/spinlock.h"
+#include "../include/serial.h"
+#include <stddef.h>
+
+// Registers are reached through an index and a data window
+#define IOAPIC_REGSEL   0x00
+#define IOAPIC_WINDOW   0x10
+#define IOAPIC_VER      0x01
+#define IOAPIC_REDTBL   0x10            // two 32-bit registers per entry
+
+#define IOAPIC_MASKED   (1u << 16)
+#define IOAPIC_FLAGS    (IOAPIC_ACTIVE_LOW | IOAPIC_LEVEL)
+
+// MPS INTI flags in MADT overrides: polarity in bits 1:0, trigger in 3:2
+#define INTI_POLARITY_LOW   3u
+#define INTI_TRIGGER_LEVEL  (3u << 2)
+
+typedef struct {
+    volatile uint32_t* mmio;
+    uint32_t gsi_base;
+    uint32_t entries;
+    Spinlock lock;                      // the index register
+} IOApic;
+
+static IOApic ioapics[ACPI_MAX_IOAPICS];
+static uint32_t ioapic_count;
+
+// With io->lock held
+static uint32_t io_read(IOApic* io, uint32_t reg) {
+    io->mmio[IOAPIC_REGSEL / 4] = reg;
+    return io->mmio[IOAPIC_WINDOW / 4];
+}
+
+static void io_write(IOApic* io, uint32_t reg, uint32_t value) {
+    io->mmio[IOAPIC_REGSEL / 4] = reg;
+    io->mmio[IOAPIC_WINDOW / 4] = value;
+}
+
+static IOApic* find(uint32_t gsi) {
+    for (uint32_t i = 0; i < ioapic_count; i++) {
+        IOApic* io = &ioapics[i];
+        if (gsi >= io->gsi_base && gsi < io->gsi_base + io->entries) return io;
+    }
+    return NULL;
+}
+
+uint32_t IOAPIC_Init() {
+    const AcpiMADT* madt = ACPI_GetMADT();
+    if (!madt) return 0;
+    for (uint32_t i = 0; i < madt->ioapic_count; i++) {
+        IOApic* io = &ioapics[ioapic_count];
+        io->mmio = (volatile uint32_t*)ioremap(madt->ioapics[i].address, 4096, PAGE_CACHE_UC);
+        if (!io->mmio) continue;
+        io->gsi_base = madt->ioapics[i].gsi_base;
+        spin_init(&io->lock);
+        // Maximum Redirection Entry, bits 23:16, is the last index
+        io->entries = ((io_read(io, IOAPIC_VER) >> 16) & 0xFF) + 1;
+        for (uint32_t e = 0; e < io->entries; e++) {
+            io_write(io, IOAPIC_REDTBL + e * 2, IOAPIC_MASKED);
+            io_write(io, IOAPIC_REDTBL + e * 2 + 1, 0);
+        }
+        ioapic_count++;
+
+        debug_print("[IOAPIC] GSIs ");
+        debug_dec(io->gsi_base);
+        debug_print("-");
+        debug_dec(io->gsi_base + io->entries - 1);
+        debug_print("\n");
+    }
+    return ioapic_count;
+}
+
+int IOAPIC_Present() {
+    return ioapic_count != 0;
+}
+
+uint32_t IOAPIC_ISAToGSI(uint8_t irq, uint32_t* flags) {
+    *flags = 0;
+    const AcpiMADT* madt = ACPI_GetMADT();
+    if (!madt) return irq;
+    for (uint32_t i = 0; i < madt->override_count; i++) {
+        const AcpiOverride* o = &madt->overrides[i];
+        if (o->irq != irq) continue;
+        if ((o->flags & 3u) == INTI_POLARITY_LOW) *flags |= IOAPIC_ACTIVE_LOW;
+        if ((o->flags & (3u << 2)) == INTI_TRIGGER_LEVEL) *flags |= IOAPIC_LEVEL;
+        return o->gsi;
+    }
+    return irq;
+}
+
+int IOAPIC_Route(uint32_t gsi, uint8_t vector, uint32_t apic_id, uint32_t flags) {
+    IOApic* io = find(gsi);
+    if (!io || apic_id > 0xFF) return 0;
+    uint32_t e = gsi - io->gsi_base;
+    uint64_t irq_flags = spin_lock_irqsave(&io->lock);
+    // Masked while the destination changes, so no half-written entry fires
+    io_write(io, IOAPIC_REDTBL + e * 2, IOAPIC_MASKED);
+    io_write(io, IOAPIC_REDTBL + e * 2 + 1, apic_id << 24);
+    io_write(io, IOAPIC_REDTBL + e * 2, vector | (flags & IOAPIC_FLAGS));
+    spin_unlock_irqrestore(&io->lock, irq_flags);
+    return 1;
+}
+
+static void set_mask(uint32_t gsi, int masked) {
+    IOApic* io = find(gsi);
+    if (!io) return;
+    uint32_t reg = IOAPIC_REDTBL + (gsi - io->gsi_base) * 2;
+    uint64_t flags = spin_lock_irqsave(&io->lock);
+    uint32_t low = io_read(io, reg);
+    io_write(io, reg, masked ? (low | IOAPIC_MASKED) : (low & ~IOAPIC_MASKED));
+    spin_unlock_irqrestore(&io->lock, flags);
+}
+
+void IOAPIC_Mask(uint32_t gsi) {
+    set_mask(gsi, 1);
+}
+
+void IOAPIC_Unmask(uint32_t gsi) {
+    set_mask(gsi, 0);
+}
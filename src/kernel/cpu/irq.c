@@ -0,0 +1,205 @@
+#include "../include/irq.h"
+#include "../include/idt.h"
+#include "../include/apic.h"
+#include "../include/ioapic.h"
+#include "../include/acpi.h"
+#include "../include/interrupts.h"
+#include "../include/smp.h"
+#include "../include/task.h"
+#include "../include/spinlock.h"
+#include "../include/serial.h"
+#include <stddef.h>
+
+// Where the 8259s' IRQ7 and IRQ15 land after PIC_Remap. Masked lines can
+// still raise these as spurious interrupts.
+#define PIC_SPURIOUS_MASTER 0x27
+#define PIC_SPURIOUS_SLAVE  0x2F
+
+typedef struct {
+    irq_handler_t fn;
+    void* ctx;
+    uint64_t count;
+} IrqAction;
+
+extern char irq_stubs[];
+extern void spurious_stub();
+
+static IrqAction actions[256];
+// Vectors handed out by IRQ_AllocVector, a bit each
+static uint64_t allocated[4];
+static Spinlock irq_lock;
+static uint64_t unhandled;
+
+static void debug_hex8(uint8_t v) {
+    const char* digits = "0123456789ABCDEF";
+    char s[5] = {'0', 'x', digits[v >> 4], digits[v & 0xF], 0};
+    debug_print(s);
+}
+
+static inline int in_range(uint32_t vector) {
+    return vector >= IRQ_VECTOR_BASE && vector < IRQ_VECTOR_END;
+}
+
+// From irq_common with the vector its stub pushed. The EOI waits for the
+// handler, so a level-triggered line the device still holds is not taken
+// again; Task_Preempt comes last, as in timer_handler.
+void irq_dispatch(uint64_t vector) {
+    IrqAction* a = &actions[vector & 0xFF];
+    irq_handler_t fn = __atomic_load_n(&a->fn, __ATOMIC_ACQUIRE);
+    if (fn) {
+        fn(a->ctx);
+        __atomic_add_fetch(&a->count, 1, __ATOMIC_RELAXED);
+    } else {
+        __atomic_add_fetch(&unhandled, 1, __ATOMIC_RELAXED);
+    }
+    LAPIC_EndOfInterrupt();
+    Task_Preempt();
+}
+
+void IRQ_Init() {
+    for (uint32_t v = IRQ_VECTOR_BASE; v < IRQ_VECTOR_END; v++) {
+        SetIDTGate(v, irq_stubs + (v - IRQ_VECTOR_BASE) * IRQ_STUB_SIZE, 0x8E);
+    }
+    if (!LAPIC_Present()) {
+        debug_print("[IRQ] No local APIC, the 8259 stays in charge\n");
+        return;
+    }
+
+    // Without a MADT there is no telling, so the 8259s are assumed
+    const AcpiMADT* madt = ACPI_GetMADT();
+    if (!madt || madt->pic_present) {
+        PIC_Disable();
+        SetIDTGate(PIC_SPURIOUS_MASTER, spurious_stub, 0x8E);
+        SetIDTGate(PIC_SPURIOUS_SLAVE, spurious_stub, 0x8E);
+    }
+    uint32_t ioapics = IOAPIC_Init();
+
+    debug_print("[IRQ] ");
+    debug_print(LAPIC_IsX2APIC() ? "x2APIC" : "xAPIC");
+    debug_print(", ");
+    debug_dec(ioapics);
+    debug_print(" IOAPICs, vectors ");
+    debug_hex8(IRQ_VECTOR_BASE);
+    debug_print("-");
+    debug_hex8(IRQ_VECTOR_END - 1);
+    debug_print("\n");
+}
+
+uint8_t IRQ_AllocVector() {
+    uint8_t vector = 0;
+    uint64_t flags = spin_lock_irqsave(&irq_lock);
+    for (uint32_t v = IRQ_VECTOR_BASE; v < IRQ_VECTOR_END; v++) {
+        if (allocated[v / 64] & (1ULL << (v % 64))) continue;
+        allocated[v / 64] |= 1ULL << (v % 64);
+        vector = (uint8_t)v;
+        break;
+    }
+    spin_unlock_irqrestore(&irq_lock, flags);
+    return vector;
+}
+
+void IRQ_FreeVector(uint8_t vector) {
+    uint64_t flags = spin_lock_irqsave(&irq_lock);
+    allocated[vector / 64] &= ~(1ULL << (vector % 64));
+    spin_unlock_irqrestore(&irq_lock, flags);
+}
+
+int request_irq(uint8_t vector, irq_handler_t handler, void* ctx) {
+    if (!in_range(vector) || !handler) return 0;
+    int ok = 0;
+    uint64_t flags = spin_lock_irqsave(&irq_lock);
+    IrqAction* a = &actions[vector];
+    if (!a->fn) {
+        a->ctx = ctx;
+        a->count = 0;
+        // ctx first: a stub that sees the handler sees its context
+        __atomic_store_n(&a->fn, handler, __ATOMIC_RELEASE);
+        ok = 1;
+    }
+    spin_unlock_irqrestore(&irq_lock, flags);
+    return ok;
+}
+
+void free_irq(uint8_t vector) {
+    if (!in_range(vector)) return;
+    __atomic_store_n(&actions[vector].fn, NULL, __ATOMIC_RELEASE);
+}
+
+int IRQ_RouteISA(uint8_t irq, uint8_t vector, uint32_t cpu) {
+    uint32_t flags;
+    uint32_t gsi = IOAPIC_ISAToGSI(irq, &flags);
+    return IRQ_RouteGSI(gsi, vector, cpu, flags);
+}
+
+int IRQ_RouteGSI(uint32_t gsi, uint8_t vector, uint32_t cpu, uint32_t flags) {
+    if (!in_range(vector) || cpu >= MAX_CPUS) return 0;
+    return IOAPIC_Route(gsi, vector, SMP_GetCPU(cpu)->apic_id, flags);
+}
+
+void IRQ_PrintStats() {
+    int any = 0;
+    for (uint32_t v = IRQ_VECTOR_BASE; v < IRQ_VECTOR_END; v++) {
+        if (!actions[v].fn) continue;
+        debug_print(any ? ", " : "[IRQ] ");
+        debug_hex8((uint8_t)v);
+        debug_print(": ");
+        debug_dec(actions[v].count);
+        any = 1;
+    }
+    if (!any && !unhandled) return;
+    if (!any) debug_print("[IRQ] ");
+    else debug_print(", ");
+    debug_dec(unhandled);
+    debug_print(" unhandled\n");
+}
+
+#ifdef TINY64_BENCH
+#include "../include/cpu.h"
+
+#define BENCH_ROUNDS 1000
+
+static volatile uint64_t bench_seen;
+
+static void bench_handler(void* ctx) {
+    (void)ctx;
+    bench_seen++;
+}
+
+// EOI cost on either controller, with nothing in service so neither acts
+// on it, and a self-IPI's trip through a generated stub and back
+void IRQ_Benchmark() {
+    if (!LAPIC_Present()) return;
+    uint64_t flags = irq_save();
+    uint64_t start = rdtsc();
+    for (int i = 0; i < BENCH_ROUNDS; i++) LAPIC_EndOfInterrupt();
+    uint64_t lapic_eoi = (rdtsc() - start) / BENCH_ROUNDS;
+    start = rdtsc();
+    for (int i = 0; i < BENCH_ROUNDS; i++) PIC_EndMaster();
+    uint64_t pic_eoi = (rdtsc() - start) / BENCH_ROUNDS;
+    irq_restore(flags);
+
+    uint64_t round_trip = 0;
+    uint8_t vector = IRQ_AllocVector();
+    if (vector && request_irq(vector, bench_handler, NULL)) {
+        bench_seen = 0;
+        start = rdtsc();
+        for (uint64_t i = 1; i <= BENCH_ROUNDS; i++) {
+            LAPIC_SendIPI(0, LAPIC_ICR_SELF | LAPIC_ICR_FIXED | vector);
+            while (bench_seen < i) __asm__ volatile ("pause");
+        }
+        round_trip = (rdtsc() - start) / BENCH_ROUNDS;
+        free_irq(vector);
+    }
+    if (vector) IRQ_FreeVector(vector);
+
+    debug_print("[BENCH] IRQ: ");
+    debug_print(LAPIC_IsX2APIC() ? "x2APIC" : "xAPIC");
+    debug_print(" EOI ");
+    debug_dec(lapic_eoi);
+    debug_print(" cycles, 8259 EOI ");
+    debug_dec(pic_eoi);
+    debug_print(" cycles, self-IPI to handler ");
+    debug_dec(round_trip);
+    debug_print(" cycles\n");
+}
+#endif
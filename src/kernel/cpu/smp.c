@@ -0,0 +1,274 @@
+#include "../include/smp.h"
+#include "../include/acpi.h"
+#include "../include/apic.h"
+#include "../include/gdt.h"
+#include "../include/idt.h"
+#include "../include/interrupts.h"
+#include "../include/pmm.h"
+#include "../include/vmm.h"
+#include "../include/stack.h"
+#include "../include/timer.h"
+#include "../include/task.h"
+#include "../include/clock.h"
+#include "../include/cpu.h"
+#include "../include/spinlock.h"
+#include "../include/fpu.h"
+#include "../include/serial.h"
+#include <stddef.h>
+
+#define MSR_EFER            0xC0000080
+#define EFER_LMA            (1ULL << 10)
+#define TRAMPOLINE_MAX      0x100000        // SIPI vectors address the first MiB
+#define AP_START_TIMEOUT_NS 100000000ULL
+
+// Matches ap_trampoline_params in trampoline.s
+typedef struct {
+    uint16_t gdt_limit;
+    uint32_t gdt_base;              // offset in the trampoline until fixed up
+    uint16_t pad0;
+    uint32_t entry64;               // likewise
+    uint16_t code_sel;
+    uint16_t pad1;
+    uint64_t cr3;
+    uint64_t efer;
+    uint64_t cr0;
+    uint64_t cr4;
+    uint64_t stack;
+    uint64_t main;
+    uint64_t cpu;
+} __attribute__((packed)) TrampolineParams;
+
+extern char ap_trampoline[], ap_trampoline_params[], ap_trampoline_end[];
+
+static PerCPU cpus[MAX_CPUS];
+static void* ap_stacks[MAX_CPUS];
+static volatile uint32_t online_count;
+
+// One shootdown at a time; the addresses stay on the sender's stack until
+// every CPU has answered
+static Spinlock shootdown_lock;
+static const uint64_t* shootdown_addrs;
+static uint32_t shootdown_count;
+
+void SMP_InitBSP() {
+    uint32_t a, b, c, d;
+    cpuid(1, 0, &a, &b, &c, &d);
+    PerCPU* cpu = &cpus[0];
+    cpu->self = cpu;
+    cpu->id = 0;
+    cpu->apic_id = b >> 24;
+    cpu->online = 1;
+    online_count = 1;
+    wrmsr(MSR_GS_BASE, (uint64_t)cpu);
+}
+
+uint32_t SMP_CPUCount() {
+    return online_count;
+}
+
+PerCPU* SMP_GetCPU(uint32_t id) {
+    return &cpus[id];
+}
+
+void SMP_SendIPI(uint32_t cpu, uint8_t vector) {
+    LAPIC_SendIPI(cpus[cpu].apic_id, LAPIC_ICR_FIXED | vector);
+}
+
+void SMP_TLBInterrupt() {
+    PerCPU* cpu = this_cpu();
+    if (!cpu->tlb_pending) return;
+    VMM_FlushTLB(shootdown_addrs, shootdown_count);
+    __atomic_store_n(&cpu->tlb_pending, 0, __ATOMIC_RELEASE);
+}
+
+void SMP_Relax() {
+    __asm__ volatile ("pause" : : : "memory");
+    if (online_count > 1) SMP_TLBInterrupt();
+}
+
+// Interrupts stay off throughout. A CPU that cannot take the IPI because
+// it is spinning on a lock answers from SMP_Relax instead.
+void SMP_ShootdownTLB(const uint64_t* addrs, uint32_t count) {
+    if (online_count < 2) return;
+    uint64_t flags = spin_lock_irqsave(&shootdown_lock);
+    uint32_t self = cpu_id();
+    shootdown_addrs = addrs;
+    shootdown_count = count;
+    for (uint32_t i = 0; i < MAX_CPUS; i++) {
+        if (i != self && cpus[i].online) __atomic_store_n(&cpus[i].tlb_pending, 1, __ATOMIC_RELEASE);
+    }
+    LAPIC_SendIPI(0, LAPIC_ICR_ALL_BUT_SELF | LAPIC_ICR_FIXED | TLB_VECTOR);
+    for (uint32_t i = 0; i < MAX_CPUS; i++) {
+        while (__atomic_load_n(&cpus[i].tlb_pending, __ATOMIC_ACQUIRE)) __asm__ volatile ("pause");
+    }
+    spin_unlock_irqrestore(&shootdown_lock, flags);
+}
+
+// Where the trampoline lands, on the AP's own stack, still on the
+// trampoline page tables
+static void ap_main(uint32_t id) {
+    PerCPU* cpu = &cpus[id];
+    wrmsr(MSR_GS_BASE, (uint64_t)cpu);
+    VMM_InitCPU();
+    FPU_InitCPU();
+    SetupGDT(id);
+    LoadIDT();
+    LAPIC_InitCPU();
+    Timer_InitCPU();
+    __atomic_add_fetch(&online_count, 1, __ATOMIC_RELEASE);
+    cpu->online = 1;
+    Task_StartCPU(ap_stacks[id]);
+}
+
+static page_table* table_below_4g() {
+    page_table* t = (page_table*)PMM_AllocatePagesBelow(0, 1ULL << 32);
+    if (t) {
+        for (int i = 0; i < 512; i++) t->entries[i] = 0;
+    }
+    return t;
+}
+
+// Sends INIT, then two SIPIs, and waits for the AP to come online
+static int start_ap(PerCPU* cpu, uint64_t page_phys) {
+    LAPIC_SendIPI(cpu->apic_id, LAPIC_ICR_INIT | LAPIC_ICR_ASSERT);
+    mdelay(10);
+    for (int i = 0; i < 2 && !cpu->online; i++) {
+        LAPIC_SendIPI(cpu->apic_id, LAPIC_ICR_STARTUP | (uint32_t)(page_phys >> 12));
+        udelay(200);
+    }
+    uint64_t deadline = clock_deadline(AP_START_TIMEOUT_NS);
+    while (!cpu->online && !clock_expired(deadline)) __asm__ volatile ("pause");
+    return cpu->online;
+}
+
+void SMP_Init() {
+    const AcpiMADT* madt = ACPI_GetMADT();
+    if (!madt || !LAPIC_Present()) {
+        debug_print("[SMP] No MADT or local APIC, staying on one CPU\n");
+        return;
+    }
+
+    // The trampoline page, and page tables below 4 GiB for its 32-bit CR3
+    // load: the kernel half as it is, plus the first 2 MiB identity-mapped
+    // so the trampoline keeps running when paging comes on
+    uint8_t* page = (uint8_t*)PMM_AllocatePagesBelow(0, TRAMPOLINE_MAX);
+    page_table* pml4 = table_below_4g();
+    page_table* pdpt = table_below_4g();
+    page_table* pd = table_below_4g();
+    if (!page || !pml4 || !pdpt || !pd) {
+        debug_print("[SMP] No memory for the trampoline\n");
+        if (page) PMM_FreePage(page);
+        if (pml4) PMM_FreePage(pml4);
+        if (pdpt) PMM_FreePage(pdpt);
+        if (pd) PMM_FreePage(pd);
+        return;
+    }
+    page_table* kernel_pml4 = VMM_GetKernelPML4();
+    for (int i = 256; i < 512; i++) pml4->entries[i] = kernel_pml4->entries[i];
+    pd->entries[0] = PAGE_PRESENT | PAGE_WRITE | PAGE_HUGE;
+    pdpt->entries[0] = virt_to_phys(pd) | PAGE_PRESENT | PAGE_WRITE;
+    pml4->entries[0] = virt_to_phys(pdpt) | PAGE_PRESENT | PAGE_WRITE;
+
+    // CPUID's 8-bit ID may be short of the x2APIC one the MADT lists
+    cpus[0].apic_id = LAPIC_GetID();
+    uint64_t page_phys = virt_to_phys(page);
+    uint64_t size = ap_trampoline_end - ap_trampoline;
+    TrampolineParams* params = (TrampolineParams*)(page + (ap_trampoline_params - ap_trampoline));
+
+    uint32_t next = 1;
+    for (uint32_t i = 0; i < madt->cpu_count && next < MAX_CPUS; i++) {
+        uint32_t apic_id = madt->apic_ids[i];
+        if (apic_id == cpus[0].apic_id) continue;
+        // xAPIC destinations are 8 bits
+        if (apic_id > 0xFF && !LAPIC_IsX2APIC()) continue;
+        void* stack = Stack_Alloc();
+        if (!stack) break;
+
+        PerCPU* cpu = &cpus[next];
+        cpu->self = cpu;
+        cpu->id = next;
+        cpu->apic_id = apic_id;
+        ap_stacks[next] = stack;
+
+        // A fresh copy each time: the last AP is done with it once online
+        for (uint64_t b = 0; b < size; b++) page[b] = ap_trampoline[b];
+        params->gdt_base += (uint32_t)page_phys;
+        params->entry64 += (uint32_t)page_phys;
+        params->cr3 = virt_to_phys(pml4);
+        params->efer = rdmsr(MSR_EFER) & ~EFER_LMA;
+        params->cr0 = read_cr0();
+        params->cr4 = read_cr4();
+        params->stack = (uint64_t)stack + STACK_SIZE;
+        params->main = (uint64_t)ap_main;
+        params->cpu = next;
+
+        if (!start_ap(cpu, page_phys)) {
+            // It may still come up late and use the trampoline, so the
+            // pages stay and no other AP is started
+            debug_print("[SMP] CPU with APIC ID ");
+            debug_dec(apic_id);
+            debug_print(" did not start\n");
+            return;
+        }
+        next++;
+    }
+
+    PMM_FreePage(page);
+    PMM_FreePage(pml4);
+    PMM_FreePage(pdpt);
+    PMM_FreePage(pd);
+    debug_print("[SMP] ");
+    debug_dec(online_count);
+    debug_print(" CPUs online\n");
+}
+
+#ifdef TINY64_BENCH
+#include "../include/wait.h"
+
+#define BENCH_ITERATIONS 100000000ULL
+
+static Completion bench_done;
+static volatile uint64_t bench_sink;
+
+// Pure computation, no memory traffic to share
+static void bench_compute() {
+    uint64_t x = 1;
+    for (uint64_t i = 0; i < BENCH_ITERATIONS; i++) x = x * 6364136223846793005ULL + 1442695040888963407ULL;
+    __atomic_add_fetch(&bench_sink, x, __ATOMIC_RELAXED);
+    Completion_Complete(&bench_done);
+}
+
+static uint64_t bench_run(uint32_t tasks) {
+    Completion_Init(&bench_done);
+    uint64_t start = clock_monotonic_ns();
+    uint32_t created = 0;
+    for (uint32_t i = 0; i < tasks; i++) {
+        if (Task_Create(bench_compute, "compute")) created++;
+    }
+    for (uint32_t i = 0; i < created; i++) Completion_Wait(&bench_done);
+    return clock_monotonic_ns() - start;
+}
+
+// One compute task, then one per CPU: with the work spread, N tasks take
+// as long as one and throughput scales N times
+void SMP_Benchmark() {
+    uint32_t n = SMP_CPUCount();
+    uint64_t one = bench_run(1);
+    uint64_t all = bench_run(n);
+    debug_print("[BENCH] SMP: 1 compute task ");
+    debug_dec(one / 1000000);
+    debug_print(" ms, ");
+    debug_dec(n);
+    debug_print(" tasks on ");
+    debug_dec(n);
+    debug_print(" CPUs ");
+    debug_dec(all / 1000000);
+    debug_print(" ms, throughput x");
+    uint64_t ratio = all ? n * one * 100 / all : 0;
+    debug_dec(ratio / 100);
+    debug_print(".");
+    debug_dec(ratio % 100 / 10);
+    debug_dec(ratio % 10);
+    debug_print("\n");
+}
+#endif
@@ -0,0 +1,258 @@
+#include "../include/timer.h"
+#include "../include/clock.h"
+#include "../include/apic.h"
+#include "../include/interrupts.h"
+#include "../include/cpu.h"
+#include "../include/smp.h"
+#include "../include/slab.h"
+#include "../include/spinlock.h"
+#include "../include/serial.h"
+#include <stddef.h>
+
+#define NS_PER_SEC     1000000000ULL
+#define PIT_HZ         1193182
+#define PIT_MAX_NS     50000000ULL      // under the 16-bit counter's 55 ms
+#define LAPIC_MAX_NS   NS_PER_SEC       // keeps the count in 32 bits
+
+typedef enum {
+    TIMER_PIT,
+    TIMER_LAPIC,
+    TIMER_TSC_DEADLINE,
+} TimerSource;
+
+static const char* source_names[] = {"PIT", "LAPIC one-shot", "TSC-deadline"};
+
+// A CPU's armed timers. Only that CPU programs its hardware from them;
+// others only take timers off.
+typedef struct {
+    Spinlock lock;
+    Timer* timers;                  // armed, sorted by expires
+    uint64_t interrupts;
+    uint64_t empty_interrupts;      // nothing was due yet
+} __attribute__((aligned(CACHE_LINE_SIZE))) TimerBase;
+
+static TimerSource source;
+static TimerBase bases[MAX_CPUS];
+static uint64_t lapic_hz;           // the same on every CPU
+
+// LAPIC timer ticks per second, after the divider, against 10 ms of TSC
+static uint64_t calibrate_lapic() {
+    LAPIC_Write(LAPIC_LVT_TIMER, LAPIC_LVT_MASKED | TIMER_VECTOR);
+    LAPIC_Write(LAPIC_TIMER_INIT, 0xFFFFFFFF);
+    mdelay(10);
+    uint32_t left = LAPIC_Read(LAPIC_TIMER_COUNT);
+    LAPIC_Write(LAPIC_TIMER_INIT, 0);
+    return (uint64_t)(0xFFFFFFFF - left) * 100;
+}
+
+static void disarm() {
+    switch (source) {
+    case TIMER_TSC_DEADLINE: wrmsr(MSR_TSC_DEADLINE, 0); break;
+    case TIMER_LAPIC: LAPIC_Write(LAPIC_TIMER_INIT, 0); break;
+    case TIMER_PIT: outb(0x43, 0x30); break;    // waits for a count
+    }
+}
+
+// Sets this CPU's hardware for the earliest timer, with b locked. The
+// LAPIC and PIT counters cannot reach every deadline; they fire early and
+// the interrupt re-arms.
+static void program(TimerBase* b) {
+    if (!b->timers) {
+        disarm();
+        return;
+    }
+    uint64_t expires = b->timers->expires;
+    if (source == TIMER_TSC_DEADLINE) {
+        // A deadline already past fires at once
+        wrmsr(MSR_TSC_DEADLINE, clock_ns_to_tsc(expires));
+        return;
+    }
+
+    uint64_t now = clock_monotonic_ns();
+    uint64_t delta = expires > now ? expires - now : 0;
+    if (source == TIMER_LAPIC) {
+        if (delta > LAPIC_MAX_NS) delta = LAPIC_MAX_NS;
+        uint64_t count = delta * lapic_hz / NS_PER_SEC;
+        LAPIC_Write(LAPIC_TIMER_INIT, count ? (uint32_t)count : 1);
+    } else {
+        if (delta > PIT_MAX_NS) delta = PIT_MAX_NS;
+        uint64_t count = delta * PIT_HZ / NS_PER_SEC;
+        if (!count) count = 1;
+        outb(0x43, 0x30);                       // channel 0, lo/hi, mode 0
+        outb(0x40, count & 0xFF);
+        outb(0x40, count >> 8);
+    }
+}
+
+void Timer_Init() {
+    uint32_t a, b, c, d;
+    cpuid(1, 0, &a, &b, &c, &d);
+    if (LAPIC_Init()) {
+        PIC_Mask(0);
+        if (c & (1u << 24)) {
+            source = TIMER_TSC_DEADLINE;
+            LAPIC_Write(LAPIC_LVT_TIMER, LAPIC_TIMER_TSC_DEADLINE | TIMER_VECTOR);
+            // The LVT write has to land before the first deadline is set
+            __asm__ volatile ("mfence" : : : "memory");
+        } else {
+            source = TIMER_LAPIC;
+            LAPIC_Write(LAPIC_TIMER_DIV, LAPIC_TIMER_DIV_16);
+            lapic_hz = calibrate_lapic();
+            LAPIC_Write(LAPIC_LVT_TIMER, LAPIC_TIMER_ONESHOT | TIMER_VECTOR);
+        }
+    } else {
+        source = TIMER_PIT;
+        PIC_Unmask(0);
+    }
+    disarm();
+
+    debug_print("[TIMER] ");
+    debug_print(source_names[source]);
+    if (source == TIMER_LAPIC) {
+        debug_print(", LAPIC timer ");
+        debug_dec(lapic_hz / 1000);
+        debug_print(" kHz");
+    }
+    debug_print("\n");
+}
+
+void Timer_InitCPU() {
+    if (source == TIMER_TSC_DEADLINE) {
+        LAPIC_Write(LAPIC_LVT_TIMER, LAPIC_TIMER_TSC_DEADLINE | TIMER_VECTOR);
+        __asm__ volatile ("mfence" : : : "memory");
+    } else if (source == TIMER_LAPIC) {
+        LAPIC_Write(LAPIC_TIMER_DIV, LAPIC_TIMER_DIV_16);
+        LAPIC_Write(LAPIC_LVT_TIMER, LAPIC_TIMER_ONESHOT | TIMER_VECTOR);
+    }
+    disarm();
+}
+
+static void unlink(TimerBase* b, Timer* t) {
+    Timer** link = &b->timers;
+    while (*link != t) link = &(*link)->next;
+    *link = t->next;
+    t->armed = 0;
+}
+
+// Takes t off whichever list it is on. armed and cpu only change under
+// the lock of the list t is on, so they are checked again once it is held.
+// Called with interrupts off.
+static void detach(Timer* t) {
+    while (t->armed) {
+        uint32_t cpu = t->cpu;
+        TimerBase* b = &bases[cpu];
+        spin_lock(&b->lock);
+        if (t->armed && t->cpu == cpu) {
+            int first = b->timers == t;
+            unlink(b, t);
+            // Another CPU's hardware just fires early and finds nothing due
+            if (first && cpu == cpu_id()) program(b);
+            spin_unlock(&b->lock);
+            return;
+        }
+        spin_unlock(&b->lock);
+    }
+}
+
+void Timer_Arm(Timer* t, uint64_t expires) {
+    uint64_t flags = irq_save();
+    detach(t);
+    TimerBase* b = &bases[cpu_id()];
+    spin_lock(&b->lock);
+    t->expires = expires;
+    Timer** link = &b->timers;
+    while (*link && (*link)->expires <= expires) link = &(*link)->next;
+    t->next = *link;
+    *link = t;
+    t->cpu = cpu_id();
+    t->armed = 1;
+    if (b->timers == t) program(b);
+    spin_unlock(&b->lock);
+    irq_restore(flags);
+}
+
+void Timer_Cancel(Timer* t) {
+    uint64_t flags = irq_save();
+    detach(t);
+    irq_restore(flags);
+}
+
+// Callbacks run with the list unlocked, so they can arm timers themselves
+void Timer_Interrupt() {
+    if (source == TIMER_PIT) PIC_EndMaster();
+    else LAPIC_EndOfInterrupt();
+    TimerBase* b = &bases[cpu_id()];
+    spin_lock(&b->lock);
+    b->interrupts++;
+
+    uint64_t now = clock_monotonic_ns();
+    if (!b->timers || b->timers->expires > now) b->empty_interrupts++;
+    while (b->timers && b->timers->expires <= now) {
+        Timer* t = b->timers;
+        b->timers = t->next;
+        t->armed = 0;
+        spin_unlock(&b->lock);
+        t->fn(t);
+        spin_lock(&b->lock);
+    }
+    program(b);
+    spin_unlock(&b->lock);
+}
+
+void Timer_PrintStats() {
+    uint64_t interrupts = 0, empty_interrupts = 0;
+    for (uint32_t i = 0; i < MAX_CPUS; i++) {
+        interrupts += bases[i].interrupts;
+        empty_interrupts += bases[i].empty_interrupts;
+    }
+    debug_print("[TIMER] ");
+    debug_print(source_names[source]);
+    debug_print(": ");
+    debug_dec(interrupts);
+    debug_print(" interrupts, ");
+    debug_dec(empty_interrupts);
+    debug_print(" with nothing due\n");
+}
+
+#ifdef TINY64_BENCH
+#define BENCH_FIRES 100
+
+static volatile int bench_fired;
+static volatile uint64_t bench_late;
+
+static void bench_fire(Timer* t) {
+    bench_late = clock_monotonic_ns() - t->expires;
+    bench_fired = 1;
+}
+
+// How late timers fire past their deadline, from 10 us to 1 ms out, with
+// the CPU halted in between
+void Timer_Benchmark() {
+    static const uint64_t delays[3] = {10000, 100000, 1000000};
+    Timer t;
+    t.fn = bench_fire;
+    t.data = NULL;
+    t.armed = 0;
+
+    for (int d = 0; d < 3; d++) {
+        uint64_t total = 0, worst = 0;
+        for (int i = 0; i < BENCH_FIRES; i++) {
+            bench_fired = 0;
+            __asm__ volatile ("cli");
+            Timer_Arm(&t, clock_monotonic_ns() + delays[d]);
+            // sti; hlt cannot miss an interrupt between the two
+            while (!bench_fired) __asm__ volatile ("sti; hlt; cli");
+            __asm__ volatile ("sti");
+            total += bench_late;
+            if (bench_late > worst) worst = bench_late;
+        }
+        debug_print("[BENCH] Timer: ");
+        debug_dec(delays[d] / 1000);
+        debug_print(" us timer late by avg ");
+        debug_dec(total / BENCH_FIRES);
+        debug_print(" ns, worst ");
+        debug_dec(worst);
+        debug_print(" ns\n");
+    }
+}
+#endif
@@ -0,0 +1,181 @@
+#include "../include/acpi.h"
+#include "../include/vmalloc.h"
+#include "../include/vmm.h"
+#include "../include/serial.h"
+#include <stddef.h>
+
+// MADT entry types
+#define MADT_LAPIC          0
+#define MADT_IOAPIC         1
+#define MADT_OVERRIDE       2
+#define MADT_LAPIC_ADDRESS  5
+#define MADT_X2APIC         9
+
+#define MADT_CPU_ENABLED    (1u << 0)
+#define MADT_PCAT_COMPAT    (1u << 0)
+
+typedef struct {
+    char signature[8];
+    uint8_t checksum;
+    char oem_id[6];
+    uint8_t revision;           // 0 for ACPI 1.0, which has no XSDT
+    uint32_t rsdt_address;
+    uint32_t length;
+    uint64_t xsdt_address;
+    uint8_t extended_checksum;
+    uint8_t reserved[3];
+} __attribute__((packed)) Rsdp;
+
+typedef struct {
+    char signature[4];
+    uint32_t length;            // header included
+    uint8_t revision;
+    uint8_t checksum;
+    char oem_id[6];
+    char oem_table_id[8];
+    uint32_t oem_revision;
+    uint32_t creator_id;
+    uint32_t creator_revision;
+} __attribute__((packed)) SdtHeader;
+
+typedef struct {
+    SdtHeader header;
+    uint32_t lapic_address;
+    uint32_t flags;
+} __attribute__((packed)) Madt;
+
+static AcpiMADT madt;
+static int have_madt;
+
+static int checksum_ok(const void* p, uint32_t length) {
+    const uint8_t* b = (const uint8_t*)p;
+    uint8_t sum = 0;
+    for (uint32_t i = 0; i < length; i++) sum += b[i];
+    return sum == 0;
+}
+
+static int signature_is(const char* sig, const char* want, int n) {
+    for (int i = 0; i < n; i++) {
+        if (sig[i] != want[i]) return 0;
+    }
+    return 1;
+}
+
+// Firmware tables may sit in memory the direct map leaves out, so each is
+// mapped on its own: the header first, for the length, then the whole table
+static SdtHeader* map_table(uint64_t phys) {
+    SdtHeader* h = (SdtHeader*)ioremap(phys, sizeof(SdtHeader), PAGE_CACHE_WB);
+    if (!h) return NULL;
+    uint32_t length = h->length;
+    iounmap(h);
+    if (length < sizeof(SdtHeader)) return NULL;
+
+    h = (SdtHeader*)ioremap(phys, length, PAGE_CACHE_WB);
+    if (h && !checksum_ok(h, length)) {
+        iounmap(h);
+        return NULL;
+    }
+    return h;
+}
+
+static void add_cpu(uint32_t apic_id, uint32_t flags) {
+    if (!(flags & MADT_CPU_ENABLED) || madt.cpu_count == ACPI_MAX_CPUS) return;
+    // Firmware lists a CPU in both forms when its ID fits in 8 bits
+    for (uint32_t i = 0; i < madt.cpu_count; i++) {
+        if (madt.apic_ids[i] == apic_id) return;
+    }
+    madt.apic_ids[madt.cpu_count++] = apic_id;
+}
+
+static void parse_madt(Madt* m) {
+    madt.lapic_address = m->lapic_address;
+    madt.pic_present = (m->flags & MADT_PCAT_COMPAT) != 0;
+
+    uint8_t* p = (uint8_t*)(m + 1);
+    uint8_t* end = (uint8_t*)m + m->header.length;
+    while (p + 2 <= end && p[1] >= 2 && p + p[1] <= end) {
+        switch (p[0]) {
+        case MADT_LAPIC:
+            add_cpu(p[3], *(uint32_t*)(p + 4));
+            break;
+        case MADT_X2APIC:
+            add_cpu(*(uint32_t*)(p + 4), *(uint32_t*)(p + 8));
+            break;
+        case MADT_IOAPIC:
+            if (madt.ioapic_count < ACPI_MAX_IOAPICS) {
+                AcpiIOAPIC* io = &madt.ioapics[madt.ioapic_count++];
+                io->id = p[2];
+                io->address = *(uint32_t*)(p + 4);
+                io->gsi_base = *(uint32_t*)(p + 8);
+            }
+            break;
+        case MADT_OVERRIDE:
+            if (madt.override_count < ACPI_MAX_OVERRIDES) {
+                AcpiOverride* o = &madt.overrides[madt.override_count++];
+                o->irq = p[3];
+                o->gsi = *(uint32_t*)(p + 4);
+                o->flags = *(uint16_t*)(p + 8);
+            }
+            break;
+        case MADT_LAPIC_ADDRESS:
+            madt.lapic_address = *(uint64_t*)(p + 4);
+            break;
+        }
+        p += p[1];
+    }
+}
+
+int ACPI_Init(uint64_t rsdp_phys) {
+    if (!rsdp_phys) {
+        debug_print("[ACPI] No RSDP\n");
+        return 0;
+    }
+    Rsdp* rsdp = (Rsdp*)ioremap(rsdp_phys, sizeof(Rsdp), PAGE_CACHE_WB);
+    if (!rsdp) return 0;
+    if (!signature_is(rsdp->signature, "RSD PTR ", 8) || !checksum_ok(rsdp, 20)) {
+        debug_print("[ACPI] Bad RSDP\n");
+        iounmap(rsdp);
+        return 0;
+    }
+    // The XSDT has 64-bit entries; ACPI 1.0 only has the RSDT
+    int wide = rsdp->revision >= 2 && rsdp->xsdt_address;
+    uint64_t root_phys = wide ? rsdp->xsdt_address : rsdp->rsdt_address;
+    iounmap(rsdp);
+
+    SdtHeader* root = map_table(root_phys);
+    if (!root) {
+        debug_print("[ACPI] Bad root table\n");
+        return 0;
+    }
+    uint32_t entry_size = wide ? 8 : 4;
+    uint32_t entries = (root->length - sizeof(SdtHeader)) / entry_size;
+    uint8_t* list = (uint8_t*)(root + 1);
+    for (uint32_t i = 0; i < entries && !have_madt; i++) {
+        uint64_t phys = wide ? *(uint64_t*)(list + i * 8) : *(uint32_t*)(list + i * 4);
+        SdtHeader* h = map_table(phys);
+        if (!h) continue;
+        if (signature_is(h->signature, "APIC", 4) && h->length >= sizeof(Madt)) {
+            parse_madt((Madt*)h);
+            have_madt = 1;
+        }
+        iounmap(h);
+    }
+    iounmap(root);
+
+    if (!have_madt) {
+        debug_print("[ACPI] No MADT\n");
+        return 0;
+    }
+    debug_print("[ACPI] MADT: ");
+    debug_dec(madt.cpu_count);
+    debug_print(" CPUs, ");
+    debug_dec(madt.ioapic_count);
+    debug_print(" IOAPICs, ");
+    debug_dec(madt.override_count);
+    debug_print(" IRQ overrides\n");
+    return 1;
+}
+
+const AcpiMADT* ACPI_GetMADT() {
+    return have_madt ? &madt : NULL;
+}
@@ -1,5 +1,7 @@
 #include "pci.h"
 #include "usb/xhci.h"
+#include "vmalloc.h"
+#include "vmm.h"
 
 // I/O ports for PCI
 static inline void outl(uint16_t port, uint32_t val) {
@@ -38,6 +40,98 @@ void pci_config_write_dword(uint8_t bus, uint8_t slot, uint8_t func, uint8_t off
     outl(PCI_CONFIG_DATA, value);
 }
 
+// Status register bit 4: the capability list pointer at 0x34 is valid
+#define PCI_STATUS_CAP_LIST (1u << 20)
+#define PCI_CMD_INTX_DISABLE (1u << 10)
+
+// Message address for the local APIC with the given ID (Intel SDM 10.11)
+#define MSI_ADDRESS_BASE 0xFEE00000u
+
+#define MSIX_ENABLE        (1u << 31) // Message Control bit 15, in the cap's dword
+#define MSIX_FUNCTION_MASK (1u << 30)
+#define MSI_ENABLE         (1u << 16)
+#define MSI_64BIT          (1u << 23)
+#define MSI_MME_MASK       (7u << 20) // Multiple Message Enable
+
+uint8_t pci_find_capability(uint8_t bus, uint8_t slot, uint8_t func, uint8_t id) {
+    if (!(pci_config_read_dword(bus, slot, func, 0x04) & PCI_STATUS_CAP_LIST)) return 0;
+    uint8_t ptr = pci_config_read_dword(bus, slot, func, 0x34) & 0xFC;
+    // Bounded, so a looping list cannot hang the boot
+    for (int i = 0; ptr && i < 48; i++) {
+        uint32_t header = pci_config_read_dword(bus, slot, func, ptr);
+        if ((header & 0xFF) == id) return ptr;
+        ptr = (header >> 8) & 0xFC;
+    }
+    return 0;
+}
+
+static uint64_t pci_bar_address(uint8_t bus, uint8_t slot, uint8_t func, uint8_t bir) {
+    uint8_t offset = 0x10 + bir * 4;
+    uint32_t bar = pci_config_read_dword(bus, slot, func, offset);
+    uint64_t address = bar & 0xFFFFFFF0;
+    if ((bar & 0x6) == 0x4) {
+        address |= (uint64_t)pci_config_read_dword(bus, slot, func, offset + 4) << 32;
+    }
+    return address;
+}
+
+static void pci_disable_intx(uint8_t bus, uint8_t slot, uint8_t func) {
+    uint32_t command = pci_config_read_dword(bus, slot, func, 0x04);
+    // Status bits are RW1C; write them back as zero
+    pci_config_write_dword(bus, slot, func, 0x04, (command & 0xFFFF) | PCI_CMD_INTX_DISABLE);
+}
+
+uint32_t pci_enable_msix(uint8_t bus, uint8_t slot, uint8_t func,
+                         const uint8_t *vectors, const uint32_t *apic_ids,
+                         uint32_t count) {
+    uint8_t cap = pci_find_capability(bus, slot, func, PCI_CAP_MSIX);
+    if (!cap) return 0;
+    uint32_t control = pci_config_read_dword(bus, slot, func, cap);
+    uint32_t table_size = ((control >> 16) & 0x7FF) + 1;
+    if (count > table_size) count = table_size;
+    for (uint32_t i = 0; i < count; i++) {
+        if (apic_ids[i] > 0xFF) return 0;
+    }
+
+    uint32_t table = pci_config_read_dword(bus, slot, func, cap + 4);
+    uint64_t phys = pci_bar_address(bus, slot, func, table & 7) + (table & ~7u);
+    volatile uint32_t *entries = (volatile uint32_t *)ioremap(phys, count * 16, PAGE_CACHE_UC);
+    if (!entries) return 0;
+
+    // Enabled with the whole function masked, so no entry fires while it
+    // is half written
+    pci_config_write_dword(bus, slot, func, cap, control | MSIX_ENABLE | MSIX_FUNCTION_MASK);
+    for (uint32_t i = 0; i < count; i++) {
+        volatile uint32_t *e = entries + i * 4;
+        e[0] = MSI_ADDRESS_BASE | (apic_ids[i] << 12);
+        e[1] = 0;
+        e[2] = vectors[i];
+        e[3] = 0; // Vector Control: unmasked
+    }
+    pci_disable_intx(bus, slot, func);
+    pci_config_write_dword(bus, slot, func, cap, (control | MSIX_ENABLE) & ~MSIX_FUNCTION_MASK);
+    iounmap((void *)entries);
+    return count;
+}
+
+int pci_enable_msi(uint8_t bus, uint8_t slot, uint8_t func, uint8_t vector,
+                   uint32_t apic_id) {
+    uint8_t cap = pci_find_capability(bus, slot, func, PCI_CAP_MSI);
+    if (!cap || apic_id > 0xFF) return 0;
+    uint32_t control = pci_config_read_dword(bus, slot, func, cap);
+    pci_config_write_dword(bus, slot, func, cap + 4, MSI_ADDRESS_BASE | (apic_id << 12));
+    if (control & MSI_64BIT) {
+        pci_config_write_dword(bus, slot, func, cap + 8, 0);
+        pci_config_write_dword(bus, slot, func, cap + 12, vector);
+    } else {
+        pci_config_write_dword(bus, slot, func, cap + 8, vector);
+    }
+    pci_disable_intx(bus, slot, func);
+    // One message: Multiple Message Enable left at zero
+    pci_config_write_dword(bus, slot, func, cap, (control & ~MSI_MME_MASK) | MSI_ENABLE);
+    return 1;
+}
+
 // Forward declaration
 void serial_print(const char *str);
 
@@ -114,7 +208,7 @@ void pci_enumerate() {
                     uint32_t command = pci_config_read_dword(bus, slot, func, 0x04);
                     pci_config_write_dword(bus, slot, func, 0x04, command | 0x06);
 
-                    xhci_init(mmio_base);
+                    xhci_init(bus, slot, func, mmio_base);
                 }
 
                 // If not multi-function, don't check other functions
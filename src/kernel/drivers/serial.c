@@ -0,0 +1,28 @@
+#include "../include/serial.h"
+#include "../include/cpu.h"
+
+#define COM1 0x3F8
+
+void debug_print(const char* str) {
+    while (*str) outb(COM1, *str++);
+}
+
+void debug_dec(uint64_t v) {
+    char buf[21];
+    int i = 20;
+    buf[i] = 0;
+    if (v == 0) buf[--i] = '0';
+    while (v > 0) { buf[--i] = (v % 10) + '0'; v /= 10; }
+    debug_print(&buf[i]);
+}
+
+void debug_hex(uint64_t v) {
+    char buf[17];
+    for (int i = 15; i >= 0; i--) {
+        char c = v & 0xF;
+        buf[i] = c < 10 ? c + '0' : c + 'A' - 10;
+        v >>= 4;
+    }
+    buf[16] = 0;
+    debug_print(buf);
+}
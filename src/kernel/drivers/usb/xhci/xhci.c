@@ -1,18 +1,58 @@
 #include "usb/xhci.h"
+#include "async.h"
+#include "dma.h"
 #include "heap.h"
 #include "pmm.h"
+#include "slab.h"
+#include "clock.h"
+#include "task.h"
+#include "vmalloc.h"
 #include "vmm.h"
+#include "wait.h"
+#include "apic.h"
+#include "irq.h"
+#include "pci.h"
+#include "smp.h"
+#include "spinlock.h"
 #include <stddef.h>
 
 /**
- * Tiny64 xHCI Driver (bring-up + command ring + event ring polling)
+ * Tiny64 xHCI Driver (bring-up + command ring + interrupter event rings)
  * Spec refs:
  * - xHCI 1.1: 4.2 (init), 4.8/4.9 (rings), 6.4 (TRBs), 7 (commands/events)
+ *
+ * Each connected port is brought up by its own coroutine (async.h), so a
+ * slow reset or a device that is slow to answer only holds up its own port.
+ *
+ * Events arrive by MSI-X, or MSI, on several interrupters (4.17): command
+ * completions and port changes on interrupter 0, each device's transfers on
+ * one of the others, picked by slot. Each interrupter's handler drains its
+ * own event ring and hands each completion to the command or transfer
+ * waiting on it. Without either capability a pump coroutine polls instead.
  */
 
 #define XHCI_MMIO_MAP_SIZE 0x100000
 #define XHCI_CMD_RING_TRBS 256
 #define XHCI_EVT_RING_TRBS 256
+#define XHCI_SPIN_POLLS 10000
+#define XHCI_POLL_NS 1000000ULL
+// Event ring polling, while ports are coming up, for a controller with
+// neither MSI-X nor MSI; XHCI_POLL_NS after that
+#define XHCI_PUMP_NS 100000ULL
+// Interrupter 0 and up to three for transfers
+#define XHCI_MAX_INTRS 4
+// IMOD interval: at most one interrupt per 40 us per interrupter. A burst
+// of events is drained in one go, while an event after a quiet spell still
+// interrupts at once, the counter having long run down (4.17.2).
+#define XHCI_IMOD_NS 40000u
+// ERDP is written once per drain, and every this many events within one,
+// so a long drain does not leave the controller thinking the ring is full
+#define XHCI_ERDP_BATCH (XHCI_EVT_RING_TRBS / 4)
+#define XHCI_HID_QUEUE 64
+
+// IMAN: Interrupt Pending (RW1C) and Interrupt Enable
+#define XHCI_IMAN_IP (1u << 0)
+#define XHCI_IMAN_IE (1u << 1)
 
 // ERST entry is 16 bytes (xHCI 6.5)
 typedef struct {
@@ -27,17 +67,46 @@ static xhci_runtime_regs_t *runtime_regs;
 static uint32_t *doorbell_regs;
 
 static xhci_trb_t *command_ring;
+static uint64_t command_ring_bus;
 static uint32_t command_ring_index = 0;
 static uint8_t command_ring_cycle = 1;
 
-static xhci_trb_t *event_ring;
-static uint32_t event_ring_index = 0;
-static uint8_t event_ring_cycle = 1;
-static xhci_erst_entry_t *erst;
+// An interrupter and its single-segment event ring
+typedef struct {
+  uint32_t index;
+  volatile xhci_interrupter_regs_t *regs;
+  xhci_trb_t *ring;
+  uint64_t ring_bus;
+  uint32_t dequeue;
+  uint8_t cycle;
+  uint8_t vector;
+  uint64_t irqs;
+  uint64_t events;
+  uint32_t max_batch;
+} xhci_intr_t;
+
+static xhci_intr_t g_intrs[XHCI_MAX_INTRS];
+static uint32_t g_intr_count;
+static int g_use_irqs;
+
+// Command and transfer registrations, against the interrupt handlers
+static Spinlock g_op_lock;
 
 // DCBAA - Device Context Base Address Array
 static uint64_t *dcbaa;
 
+// Highest address the controller can reach: 4 GiB unless HCCPARAMS1.AC64.
+static uint64_t g_dma_max = DMA_ADDR_32BIT;
+
+/**
+ * All controller-visible memory goes through here. Rings and buffers must not
+ * cross a 64 KiB boundary and contexts must not cross a page (xHCI 6.1, 6.4).
+ */
+static dma_buffer_t xhci_dma_alloc(size_t size, size_t align,
+                                   uint64_t boundary) {
+  return dma_alloc(size, align, boundary, g_dma_max);
+}
+
 // Forward declarations for printing
 void PrintString(const char *str, uint32_t color);
 void serial_print(const char *str);
@@ -54,6 +123,34 @@ static void print_hex64(uint64_t val) {
   }
 }
 
+/**
+ * Bounded waits on the controller. Most conditions hold within a few
+ * microseconds, so a wait spins first and then sleeps between polls until
+ * its timeout, leaving the CPU to other tasks.
+ */
+typedef struct {
+  uint32_t polls;
+  uint64_t deadline;
+} xhci_wait_t;
+
+static void xhci_wait_start(xhci_wait_t *w, uint32_t timeout_ms) {
+  w->polls = 0;
+  w->deadline = clock_deadline((uint64_t)timeout_ms * 1000000ULL);
+}
+
+// Call before each poll; returns 0 once the timeout has passed
+static int xhci_wait_more(xhci_wait_t *w) {
+  if (w->polls < XHCI_SPIN_POLLS) {
+    w->polls++;
+    __asm__ volatile("pause");
+    return 1;
+  }
+  if (clock_expired(w->deadline))
+    return 0;
+  Task_Sleep(XHCI_POLL_NS);
+  return 1;
+}
+
 static inline uint32_t trb_type(uint32_t control) {
   return (control >> 10) & 0x3F;
 }
@@ -73,38 +170,109 @@ static void xhci_ring_doorbell_cmd(void) {
   doorbell_regs[0] = 0;
 }
 
-static void xhci_event_ring_update_erdp(void) {
+static void xhci_intr_update_erdp(xhci_intr_t *ir, int clear_busy) {
   // ERDP points to the next TRB to be dequeued.
   // Set EHB (bit 3) to clear Event Handler Busy.
-  uint64_t next = (uint64_t)(uintptr_t)&event_ring[event_ring_index];
-  runtime_regs->interrupters[0].erdp = next | (1ULL << 3);
+  uint64_t next = ir->ring_bus + ir->dequeue * sizeof(xhci_trb_t);
+  ir->regs->erdp = next | (clear_busy ? (1ULL << 3) : 0);
 }
 
-static int xhci_poll_event(xhci_trb_t *out) {
-  xhci_trb_t trb = event_ring[event_ring_index];
+static int xhci_poll_event(xhci_intr_t *ir, xhci_trb_t *out) {
+  xhci_trb_t trb = ir->ring[ir->dequeue];
 
   // Producer sets cycle bit; consumer tracks expected cycle.
-  if ((trb.control & 1u) != (uint32_t)event_ring_cycle) {
+  if ((trb.control & 1u) != (uint32_t)ir->cycle) {
     return 0;
   }
 
   *out = trb;
 
   // Advance consumer
-  event_ring_index++;
-  if (event_ring_index >= XHCI_EVT_RING_TRBS) {
-    event_ring_index = 0;
-    event_ring_cycle ^= 1;
+  ir->dequeue++;
+  if (ir->dequeue >= XHCI_EVT_RING_TRBS) {
+    ir->dequeue = 0;
+    ir->cycle ^= 1;
   }
-
-  xhci_event_ring_update_erdp();
   return 1;
 }
 
+static void xhci_handle_event(const xhci_trb_t *evt);
+
+// Hands every pending event on, then moves ERDP once for the batch
+static uint32_t xhci_intr_drain(xhci_intr_t *ir) {
+  uint32_t n = 0;
+  xhci_trb_t evt;
+  uint64_t flags = spin_lock_irqsave(&g_op_lock);
+  while (xhci_poll_event(ir, &evt)) {
+    xhci_handle_event(&evt);
+    if (++n % XHCI_ERDP_BATCH == 0)
+      xhci_intr_update_erdp(ir, 0);
+  }
+  spin_unlock_irqrestore(&g_op_lock, flags);
+  if (n)
+    xhci_intr_update_erdp(ir, 1);
+  ir->events += n;
+  if (n > ir->max_batch)
+    ir->max_batch = n;
+  return n;
+}
+
+// The interrupter a slot's transfer events go to
+static uint32_t xhci_slot_interrupter(uint32_t slot_id) {
+  if (g_intr_count < 2)
+    return 0;
+  return 1 + (slot_id - 1) % (g_intr_count - 1);
+}
+
+// Interrupter Target, bits 31:22 of a transfer TRB's status and of the
+// Slot Context's third dword
+static inline uint32_t trb_intr_target(uint32_t slot_id) {
+  return xhci_slot_interrupter(slot_id) << 22;
+}
+
+/**
+ * A command or transfer in flight, finished by its completion event. The
+ * event handler clears the registration it came through, so a late event
+ * for a request that timed out finds nothing.
+ */
+typedef struct xhci_op {
+  AsyncTask *waiter;
+  struct xhci_op **reg; // where the event handler looks for it
+  volatile int done;
+  uint32_t cc;
+  uint32_t slot_id;
+} xhci_op_t;
+
+// By command ring index: Command Completion Events carry the TRB's address
+static xhci_op_t *cmd_ops[XHCI_CMD_RING_TRBS];
+
+static void xhci_op_start(xhci_op_t *op, AsyncTask *waiter, xhci_op_t **reg) {
+  op->waiter = waiter;
+  op->reg = reg;
+  op->done = 0;
+  op->cc = 0;
+  op->slot_id = 0;
+  uint64_t flags = spin_lock_irqsave(&g_op_lock);
+  *reg = op;
+  spin_unlock_irqrestore(&g_op_lock, flags);
+}
+
+static void xhci_op_finish(xhci_op_t *op, uint32_t cc, uint32_t slot_id) {
+  *op->reg = NULL;
+  op->cc = cc;
+  op->slot_id = slot_id;
+  op->done = 1;
+  Async_Wake(op->waiter);
+}
+
+// Returns 1, after logging, if op is still outstanding
+static int xhci_op_timed_out(xhci_op_t *op, const char *what);
+
 struct xhci_device_state {
   uint32_t slot_id;
   uint32_t ep0_mps;
   xhci_trb_t *ep0_ring;
+  uint64_t ep0_ring_bus;
   uint32_t ep0_index;
   uint8_t ep0_cycle;
 
@@ -119,132 +287,156 @@ struct xhci_device_state {
   uint8_t intr_interval;
 
   xhci_trb_t *intr_ring;
+  uint64_t intr_ring_bus;
   uint32_t intr_index;
   uint8_t intr_cycle;
 
   uint8_t *intr_buf;
+  uint64_t intr_buf_bus;
+
+  xhci_op_t *ep0_op; // control transfer in flight
 };
 typedef struct xhci_device_state xhci_device_state_t;
 
+// A root hub port being brought up by its own coroutine. Everything that
+// lives across a wait is kept here.
+typedef struct {
+  AsyncTask task;
+  uint32_t port_id;
+  volatile uint32_t *portsc;
+  uint32_t ps;
+  uint32_t ready;
+  uint32_t speed;
+  uint64_t deadline;
+  xhci_op_t op;
+  uint32_t slot_id;
+  uint8_t *dev_ctx;
+  xhci_trb_t *ep0_ring;
+  uint64_t ep0_ring_bus;
+  uint32_t ep0_mps;
+  dma_buffer_t input; // input context of the command in flight
+  dma_buffer_t buf;   // descriptors
+  uint16_t total_len;
+  uint8_t configured;
+  xhci_device_state_t *dev;
+} xhci_port_t;
+
 static void xhci_ring_doorbell_ep0(uint32_t slot_id);
 static void xhci_ep0_ring_push(xhci_device_state_t *dev, const xhci_trb_t *trb);
-static int xhci_wait_for_transfer_event(uint32_t slot_id, uint32_t *out_cc);
 static void xhci_print_u32_dec(uint32_t v);
 static void xhci_print_hex32(uint32_t v);
 
-static xhci_trb_t *xhci_alloc_tr_ring(void);
+static xhci_trb_t *xhci_alloc_tr_ring(uint64_t *out_bus);
 
-static int xhci_wait_for_command_completion(uint32_t *out_slot_id,
-                                            uint32_t *out_cc);
 static void xhci_cmd_ring_push(const xhci_trb_t *trb);
 static void xhci_ring_doorbell_cmd(void);
 
-static int xhci_ep0_control_in(xhci_device_state_t *dev, uint64_t setup,
-                               void *buf, uint32_t len) {
+static int xhci_op_timed_out(xhci_op_t *op, const char *what) {
+  // Under the lock, so a completion being handled on another CPU either
+  // lands first or finds nothing
+  uint64_t flags = spin_lock_irqsave(&g_op_lock);
+  int done = op->done;
+  if (!done && *op->reg == op)
+    *op->reg = NULL;
+  spin_unlock_irqrestore(&g_op_lock, flags);
+  if (done)
+    return 0;
+  serial_print("[xHCI] ");
+  serial_print(what);
+  serial_print(": timeout\n");
+  return 1;
+}
+
+// Only the status stage interrupts, so its Transfer Event means the whole
+// transfer is done, data included.
+static void xhci_ep0_control_in(xhci_device_state_t *dev, uint64_t setup,
+                                uint64_t buf_bus, uint32_t len, xhci_op_t *op,
+                                AsyncTask *waiter) {
   xhci_trb_t setup_trb;
   setup_trb.data = setup;
-  setup_trb.status = 8;
+  setup_trb.status = 8 | trb_intr_target(dev->slot_id);
   setup_trb.control = make_trb_control(TRB_TYPE_SETUP_STAGE, dev->ep0_cycle) |
-                      (2u << 16) | (1u << 6) | (1u << 5);
+                      (2u << 16) | (1u << 6);
 
   xhci_trb_t data_trb;
-  data_trb.data = (uint64_t)(uintptr_t)buf;
-  data_trb.status = len;
+  data_trb.data = buf_bus;
+  data_trb.status = len | trb_intr_target(dev->slot_id);
   data_trb.control = make_trb_control(TRB_TYPE_DATA_STAGE, dev->ep0_cycle) |
-                     (1u << 16) | (1u << 5);
+                     (1u << 16);
 
   xhci_trb_t status_trb;
   status_trb.data = 0;
-  status_trb.status = 0;
+  status_trb.status = trb_intr_target(dev->slot_id);
   status_trb.control =
       make_trb_control(TRB_TYPE_STATUS_STAGE, dev->ep0_cycle) | (1u << 5);
 
+  xhci_op_start(op, waiter, &dev->ep0_op);
   xhci_ep0_ring_push(dev, &setup_trb);
   xhci_ep0_ring_push(dev, &data_trb);
   xhci_ep0_ring_push(dev, &status_trb);
   xhci_ring_doorbell_ep0(dev->slot_id);
-
-  uint32_t cc = 0;
-  if (!xhci_wait_for_transfer_event(dev->slot_id, &cc)) {
-    serial_print("[xHCI] EP0 control IN: timeout\n");
-    return 0;
-  }
-  if (cc != 1) {
-    serial_print("[xHCI] EP0 control IN: completion_code=");
-    xhci_print_u32_dec(cc);
-    serial_print("\n");
-    return 0;
-  }
-  return 1;
 }
 
-static int xhci_ep0_control_no_data_out(xhci_device_state_t *dev,
-                                        uint64_t setup) {
+static void xhci_ep0_control_no_data_out(xhci_device_state_t *dev,
+                                         uint64_t setup, xhci_op_t *op,
+                                         AsyncTask *waiter) {
   xhci_trb_t setup_trb;
   setup_trb.data = setup;
-  setup_trb.status = 8;
+  setup_trb.status = 8 | trb_intr_target(dev->slot_id);
   setup_trb.control = make_trb_control(TRB_TYPE_SETUP_STAGE, dev->ep0_cycle) |
-                      (0u << 16) | (1u << 6) | (1u << 5);
+                      (0u << 16) | (1u << 6);
 
   xhci_trb_t status_trb;
   status_trb.data = 0;
-  status_trb.status = 0;
+  status_trb.status = trb_intr_target(dev->slot_id);
   status_trb.control = make_trb_control(TRB_TYPE_STATUS_STAGE, dev->ep0_cycle) |
                        (1u << 16) | (1u << 5);
 
+  xhci_op_start(op, waiter, &dev->ep0_op);
   xhci_ep0_ring_push(dev, &setup_trb);
   xhci_ep0_ring_push(dev, &status_trb);
   xhci_ring_doorbell_ep0(dev->slot_id);
+}
 
-  uint32_t cc = 0;
-  if (!xhci_wait_for_transfer_event(dev->slot_id, &cc)) {
-    serial_print("[xHCI] EP0 control OUT: timeout\n");
+// Once a control transfer's wait is over: 1 if it went through
+static int xhci_ep0_check(xhci_op_t *op, const char *what) {
+  if (xhci_op_timed_out(op, what))
     return 0;
-  }
-  if (cc != 1) {
-    serial_print("[xHCI] EP0 control OUT: completion_code=");
-    xhci_print_u32_dec(cc);
+  if (op->cc != 1) {
+    serial_print("[xHCI] ");
+    serial_print(what);
+    serial_print(": completion_code=");
+    xhci_print_u32_dec(op->cc);
     serial_print("\n");
     return 0;
   }
   return 1;
 }
 
-static int xhci_ep0_get_config_and_set_config(xhci_device_state_t *dev) {
-  uint8_t *buf = (uint8_t *)PMM_AllocatePage();
-  for (uint32_t i = 0; i < 4096; i++)
-    buf[i] = 0;
-
-  uint64_t setup9 = 0;
-  setup9 |= 0x80ULL;
-  setup9 |= 0x06ULL << 8;
-  setup9 |= 0x0200ULL << 16;
-  setup9 |= 0x0000ULL << 32;
-  setup9 |= 9ULL << 48;
-
-  if (!xhci_ep0_control_in(dev, setup9, buf, 9)) {
-    serial_print("[xHCI] EP0 GET_DESCRIPTOR(Configuration 9) failed\n");
-    return 0;
-  }
+static uint64_t xhci_setup_get_config(uint16_t len) {
+  uint64_t setup = 0;
+  setup |= 0x80ULL;
+  setup |= 0x06ULL << 8;
+  setup |= 0x0200ULL << 16;
+  setup |= 0x0000ULL << 32;
+  setup |= ((uint64_t)len) << 48;
+  return setup;
+}
 
-  uint16_t total_len = (uint16_t)(buf[2] | (buf[3] << 8));
-  if (total_len == 0 || total_len > 4096)
-    total_len = 4096;
-
-  uint64_t setupFull = 0;
-  setupFull |= 0x80ULL;
-  setupFull |= 0x06ULL << 8;
-  setupFull |= 0x0200ULL << 16;
-  setupFull |= 0x0000ULL << 32;
-  setupFull |= ((uint64_t)total_len) << 48;
-
-  for (uint32_t i = 0; i < 4096; i++)
-    buf[i] = 0;
-  if (!xhci_ep0_control_in(dev, setupFull, buf, total_len)) {
-    serial_print("[xHCI] EP0 GET_DESCRIPTOR(Configuration full) failed\n");
-    return 0;
-  }
+static uint64_t xhci_setup_set_config(uint8_t cfg_value) {
+  uint64_t setcfg = 0;
+  setcfg |= 0x00ULL;
+  setcfg |= 0x09ULL << 8;
+  setcfg |= ((uint64_t)cfg_value) << 16;
+  setcfg |= 0x0000ULL << 32;
+  setcfg |= 0ULL << 48;
+  return setcfg;
+}
 
+// Walks the full configuration descriptor for a boot HID interface and its
+// interrupt IN endpoint; returns the configuration value to set
+static uint8_t xhci_parse_config(xhci_device_state_t *dev, const uint8_t *buf,
+                                 uint16_t total_len) {
   uint8_t cfg_value = buf[5];
   serial_print("[USB] Config total_len=");
   xhci_print_u32_dec(total_len);
@@ -330,49 +522,13 @@ static int xhci_ep0_get_config_and_set_config(xhci_device_state_t *dev) {
 
     off += bLength;
   }
-
   if (cfg_value == 0)
     cfg_value = 1;
-  uint64_t setcfg = 0;
-  setcfg |= 0x00ULL;
-  setcfg |= 0x09ULL << 8;
-  setcfg |= ((uint64_t)cfg_value) << 16;
-  setcfg |= 0x0000ULL << 32;
-  setcfg |= 0ULL << 48;
-
-  if (!xhci_ep0_control_no_data_out(dev, setcfg)) {
-    serial_print("[xHCI] EP0 SET_CONFIGURATION failed\n");
-    return 0;
-  }
-
-  serial_print("[USB] SET_CONFIGURATION done\n");
-  return 1;
+  return cfg_value;
 }
 
-static int xhci_cmd_configure_intr_in_ep(xhci_device_state_t *dev);
-static int xhci_hid_set_protocol_boot(xhci_device_state_t *dev);
-static int xhci_hid_set_idle(xhci_device_state_t *dev);
 static void xhci_hid_start_polling(xhci_device_state_t *dev);
 
-static int xhci_wait_for_command_completion(uint32_t *out_slot_id,
-                                            uint32_t *out_cc) {
-  // Busy-wait poll. This is fine for early bring-up.
-  for (uint32_t spins = 0; spins < 5000000; spins++) {
-    xhci_trb_t evt;
-    if (!xhci_poll_event(&evt))
-      continue;
-
-    if (trb_type(evt.control) == TRB_TYPE_COMMAND_COMPLETION) {
-      if (out_slot_id)
-        *out_slot_id = trb_slot_id(evt.control);
-      if (out_cc)
-        *out_cc = trb_cc(evt.status);
-      return 1;
-    }
-  }
-  return 0;
-}
-
 static void xhci_cmd_ring_push(const xhci_trb_t *trb) {
   // Place TRB at current index
   command_ring[command_ring_index] = *trb;
@@ -393,6 +549,14 @@ static void xhci_cmd_ring_push(const xhci_trb_t *trb) {
   }
 }
 
+// Queues a command; its Command Completion Event finishes op
+static void xhci_cmd_submit(const xhci_trb_t *trb, xhci_op_t *op,
+                            AsyncTask *waiter) {
+  xhci_op_start(op, waiter, &cmd_ops[command_ring_index]);
+  xhci_cmd_ring_push(trb);
+  xhci_ring_doorbell_cmd();
+}
+
 // Context structures (xHCI 6.2). Layout here is for CSZ=0 (32-byte contexts).
 // For QEMU's xHCI this is typically fine; we'll also compute context size from
 // HCCPARAMS1.
@@ -440,7 +604,11 @@ static void xhci_ring_doorbell_ep(uint32_t slot_id, uint32_t dci) {
   doorbell_regs[slot_id] = dci;
 }
 
-static int xhci_cmd_configure_intr_in_ep(xhci_device_state_t *dev) {
+// Queues Configure Endpoint for the HID interrupt IN endpoint; returns 0 if
+// there is none or memory ran out, with nothing queued
+static int xhci_cmd_configure_intr_in_ep(xhci_device_state_t *dev,
+                                         dma_buffer_t *out_input,
+                                         xhci_op_t *op, AsyncTask *waiter) {
   if (dev->intr_epaddr == 0 || dev->intr_mps == 0) {
     serial_print(
         "[xHCI] No interrupt IN endpoint found; skipping HID polling\n");
@@ -451,13 +619,17 @@ static int xhci_cmd_configure_intr_in_ep(xhci_device_state_t *dev) {
   const uint32_t dci = 3;
   const uint32_t ctx_index = dci + 1;
 
-  dev->intr_ring = xhci_alloc_tr_ring();
+  dev->intr_ring = xhci_alloc_tr_ring(&dev->intr_ring_bus);
+  if (!dev->intr_ring)
+    return 0;
   dev->intr_index = 0;
   dev->intr_cycle = 1;
 
-  uint8_t *input_ctx = (uint8_t *)PMM_AllocatePage();
-  for (uint32_t i = 0; i < 4096; i++)
-    input_ctx[i] = 0;
+  // Input Context: Input Control + Slot + 31 endpoint contexts
+  dma_buffer_t input_dma = xhci_dma_alloc(33 * g_ctx_size, 64, 4096);
+  if (!input_dma.cpu)
+    return 0;
+  uint8_t *input_ctx = (uint8_t *)input_dma.cpu;
 
   xhci_input_control_ctx_t *icc = (xhci_input_control_ctx_t *)input_ctx;
   // Must include Slot Context when increasing Context Entries (xHCI spec
@@ -493,7 +665,7 @@ static int xhci_cmd_configure_intr_in_ep(xhci_device_state_t *dev) {
   ep->dword1 = ((uint32_t)(dev->intr_mps & 0xFFFFu) << 16) | (0u << 8) |
                ((7u & 0x7u) << 3) | 3u;
 
-  uint64_t trdp = (uint64_t)(uintptr_t)dev->intr_ring;
+  uint64_t trdp = dev->intr_ring_bus;
   trdp &= ~0xFULL;
   trdp |= 1u;
   ep->tr_deq_lo = (uint32_t)(trdp & 0xFFFFFFFFu);
@@ -510,26 +682,30 @@ static int xhci_cmd_configure_intr_in_ep(xhci_device_state_t *dev) {
   ep->dword4 = (uint32_t)8u | ((uint32_t)(dev->intr_mps & 0xFFFFu) << 16);
 
   xhci_trb_t cmd;
-  cmd.data = (uint64_t)(uintptr_t)input_ctx;
+  cmd.data = input_dma.bus;
   cmd.status = 0;
   cmd.control =
       make_trb_control(TRB_TYPE_CONFIGURE_EP_CMD, command_ring_cycle) |
       (dev->slot_id << 24);
 
-  xhci_cmd_ring_push(&cmd);
-  xhci_ring_doorbell_cmd();
+  *out_input = input_dma;
+  xhci_cmd_submit(&cmd, op, waiter);
+  return 1;
+}
 
-  uint32_t evt_slot = 0;
-  uint32_t cc = 0;
-  if (!xhci_wait_for_command_completion(&evt_slot, &cc)) {
-    serial_print("[xHCI] ConfigureEP: timeout\n");
+static int xhci_configure_intr_in_ep_done(xhci_device_state_t *dev,
+                                          dma_buffer_t input_dma,
+                                          xhci_op_t *op) {
+  // The controller may still read the input context; leave it allocated.
+  if (xhci_op_timed_out(op, "ConfigureEP"))
     return 0;
-  }
+  dma_free(input_dma);
 
+  uint32_t cc = op->cc;
   serial_print("[xHCI] ConfigureEP: completion_code=");
   xhci_print_u32_dec(cc);
   serial_print(" slot_id=");
-  xhci_print_u32_dec(evt_slot);
+  xhci_print_u32_dec(op->slot_id);
   serial_print("\n");
 
   if (cc == 1 && dev->dev_ctx) {
@@ -549,28 +725,16 @@ static int xhci_cmd_configure_intr_in_ep(xhci_device_state_t *dev) {
   return (cc == 1);
 }
 
-static int xhci_hid_set_protocol_boot(xhci_device_state_t *dev) {
-  if (dev->hid_ifnum == 0xFF)
-    return 0;
+// HID class requests to the boot interface: SET_PROTOCOL(boot) is 0x0B,
+// SET_IDLE 0x0A
+static uint64_t xhci_setup_hid(xhci_device_state_t *dev, uint8_t request) {
   uint64_t setup = 0;
   setup |= 0x21ULL;
-  setup |= 0x0BULL << 8;
+  setup |= ((uint64_t)request) << 8;
   setup |= 0x0000ULL << 16;
   setup |= ((uint64_t)dev->hid_ifnum) << 32;
   setup |= 0ULL << 48;
-  return xhci_ep0_control_no_data_out(dev, setup);
-}
-
-static int xhci_hid_set_idle(xhci_device_state_t *dev) {
-  if (dev->hid_ifnum == 0xFF)
-    return 0;
-  uint64_t setup = 0;
-  setup |= 0x21ULL;
-  setup |= 0x0AULL << 8;
-  setup |= 0x0000ULL << 16;
-  setup |= ((uint64_t)dev->hid_ifnum) << 32;
-  setup |= 0ULL << 48;
-  return xhci_ep0_control_no_data_out(dev, setup);
+  return setup;
 }
 
 static void xhci_hid_start_polling(xhci_device_state_t *dev) {
@@ -578,15 +742,18 @@ static void xhci_hid_start_polling(xhci_device_state_t *dev) {
     return;
 
   if (!dev->intr_buf) {
-    dev->intr_buf = (uint8_t *)PMM_AllocatePage();
-    for (uint32_t i = 0; i < 4096; i++)
-      dev->intr_buf[i] = 0;
+    dma_buffer_t dma = xhci_dma_alloc(dev->intr_mps, 64, 0x10000);
+    if (!dma.cpu)
+      return;
+    dev->intr_buf = (uint8_t *)dma.cpu;
+    dev->intr_buf_bus = dma.bus;
   }
 
   const uint32_t dci = 3;
   xhci_trb_t trb;
-  trb.data = (uint64_t)(uintptr_t)dev->intr_buf;
-  trb.status = (uint32_t)(dev->intr_mps & 0xFFFFu);
+  trb.data = dev->intr_buf_bus;
+  trb.status =
+      (uint32_t)(dev->intr_mps & 0xFFFFu) | trb_intr_target(dev->slot_id);
   trb.control = make_trb_control(TRB_TYPE_NORMAL, dev->intr_cycle) | (1u << 5) |
                 (1u << 2);
   xhci_intr_ring_push(dev, &trb);
@@ -669,9 +836,10 @@ static void xhci_port_clear_w1c(volatile uint32_t *portsc, uint32_t *ps) {
   }
 }
 
-static int xhci_port_wait_ready(volatile uint32_t *portsc, uint32_t spins,
+static int xhci_port_wait_ready(volatile uint32_t *portsc, uint32_t timeout_ms,
                                 uint32_t *out_ps) {
-  for (uint32_t i = 0; i < spins; i++) {
+  xhci_wait_t w;
+  for (xhci_wait_start(&w, timeout_ms); xhci_wait_more(&w);) {
     uint32_t ps = *portsc;
     if (xhci_port_ready(ps)) {
       if (out_ps)
@@ -705,7 +873,8 @@ static void xhci_port_warm_reset(volatile uint32_t *portsc) {
   v |= PORTSC_WPR;
   *portsc = v;
 
-  for (uint32_t spins = 0; spins < 20000000; spins++) {
+  xhci_wait_t w;
+  for (xhci_wait_start(&w, 500); xhci_wait_more(&w);) {
     ps = *portsc;
     if (!(ps & PORTSC_WPR))
       break;
@@ -719,7 +888,8 @@ static void xhci_port_cold_reset(volatile uint32_t *portsc) {
   v |= PORTSC_PR;
   *portsc = v;
 
-  for (uint32_t spins = 0; spins < 20000000; spins++) {
+  xhci_wait_t w;
+  for (xhci_wait_start(&w, 500); xhci_wait_more(&w);) {
     ps = *portsc;
     if (!(ps & PORTSC_PR))
       break;
@@ -764,14 +934,14 @@ static int xhci_force_port_ready(volatile uint32_t *portsc, uint32_t port_id,
         xhci_log_portsc(port_id, "[xHCI] After cold reset", ps);
       }
 
-      if (xhci_port_wait_ready(portsc, 20000000, &ps)) {
+      if (xhci_port_wait_ready(portsc, 500, &ps)) {
         if (out_speed)
           *out_speed = xhci_port_speed(ps);
         return 1;
       }
 
       xhci_port_force_u0(portsc);
-      if (xhci_port_wait_ready(portsc, 20000000, &ps)) {
+      if (xhci_port_wait_ready(portsc, 500, &ps)) {
         if (out_speed)
           *out_speed = xhci_port_speed(ps);
         return 1;
@@ -810,7 +980,8 @@ static void xhci_bios_handoff(void) {
       ext[0] = v;
 
       // Wait for BIOS to release ownership
-      for (uint32_t spins = 0; spins < 50000000; spins++) {
+      xhci_wait_t w;
+      for (xhci_wait_start(&w, 1000); xhci_wait_more(&w);) {
         uint32_t r = ext[0];
         if ((r & (1u << 16)) == 0) {
           serial_print("[xHCI] BIOS ownership released\n");
@@ -842,22 +1013,20 @@ static void xhci_print_hex32(uint32_t v) {
   serial_print(s);
 }
 
-static int xhci_cmd_enable_slot(uint32_t *out_slot_id) {
+static void xhci_cmd_enable_slot(xhci_op_t *op, AsyncTask *waiter) {
   xhci_trb_t cmd;
   cmd.data = 0;
   cmd.status = 0;
   cmd.control = make_trb_control(TRB_TYPE_ENABLE_SLOT_CMD, command_ring_cycle);
+  xhci_cmd_submit(&cmd, op, waiter);
+}
 
-  xhci_cmd_ring_push(&cmd);
-  xhci_ring_doorbell_cmd();
-
-  uint32_t slot = 0;
-  uint32_t cc = 0;
-  if (!xhci_wait_for_command_completion(&slot, &cc)) {
-    serial_print("[xHCI] EnableSlot: timeout waiting for Command Completion\n");
+static int xhci_enable_slot_done(xhci_op_t *op, uint32_t *out_slot_id) {
+  if (xhci_op_timed_out(op, "EnableSlot"))
     return 0;
-  }
 
+  uint32_t slot = op->slot_id;
+  uint32_t cc = op->cc;
   serial_print("[xHCI] EnableSlot: completion_code=");
   xhci_print_u32_dec(cc);
   serial_print(" slot_id=");
@@ -869,21 +1038,21 @@ static int xhci_cmd_enable_slot(uint32_t *out_slot_id) {
   return (cc == 1 && slot != 0);
 }
 
-static xhci_trb_t *xhci_alloc_tr_ring(void) {
-  xhci_trb_t *ring = (xhci_trb_t *)PMM_AllocatePage();
-  for (int i = 0; i < 256; i++) {
-    ring[i].data = 0;
-    ring[i].status = 0;
-    ring[i].control = 0;
-  }
+static xhci_trb_t *xhci_alloc_tr_ring(uint64_t *out_bus) {
+  dma_buffer_t dma = xhci_dma_alloc(256 * sizeof(xhci_trb_t), 64, 0x10000);
+  if (!dma.cpu)
+    return NULL;
+  xhci_trb_t *ring = (xhci_trb_t *)dma.cpu;
+  *out_bus = dma.bus;
   // Link TRB at end
-  ring[255].data = (uint64_t)(uintptr_t)ring;
+  ring[255].data = dma.bus;
   ring[255].status = 0;
   ring[255].control = make_trb_control(TRB_TYPE_LINK, 1) | (1u << 1);
   return ring;
 }
 
-static xhci_device_state_t g_devs[256];
+static xhci_device_state_t *g_devs[256];
+static SlabCache *g_dev_cache;
 
 static void xhci_ring_doorbell_ep0(uint32_t slot_id) {
   // Doorbell target is DCI. For EP0, DCI=1.
@@ -903,37 +1072,6 @@ static void xhci_ep0_ring_push(xhci_device_state_t *dev,
   }
 }
 
-static int xhci_wait_for_transfer_event(uint32_t slot_id, uint32_t *out_cc) {
-  uint32_t seen_other = 0;
-  for (uint32_t spins = 0; spins < 50000000; spins++) {
-    xhci_trb_t evt;
-    if (!xhci_poll_event(&evt))
-      continue;
-
-    if (trb_type(evt.control) == TRB_TYPE_TRANSFER_EVENT) {
-      uint32_t cc = trb_cc(evt.status);
-      uint32_t eslot = trb_slot_id(evt.control);
-      if (eslot == slot_id) {
-        if (out_cc)
-          *out_cc = cc;
-        return 1;
-      }
-
-      // Rate-limited debug: if we're getting transfer events but not for our
-      // slot, print a few so we know the ring is alive.
-      if (seen_other < 4) {
-        serial_print("[xHCI] TransferEvent other slot=");
-        xhci_print_u32_dec(eslot);
-        serial_print(" cc=");
-        xhci_print_u32_dec(cc);
-        serial_print("\n");
-        seen_other++;
-      }
-    }
-  }
-  return 0;
-}
-
 static void xhci_print_hex16(uint16_t v) {
   static const char *hex = "0123456789ABCDEF";
   char s[5];
@@ -945,66 +1083,21 @@ static void xhci_print_hex16(uint16_t v) {
   serial_print(s);
 }
 
-static int xhci_ep0_get_device_descriptor(xhci_device_state_t *dev) {
-  // USB Device Descriptor is 18 bytes
-  uint8_t *buf = (uint8_t *)PMM_AllocatePage();
-  for (uint32_t i = 0; i < 4096; i++)
-    buf[i] = 0;
-
-  // Setup packet (USB2.0 9.3): GET_DESCRIPTOR(Device)
-  // bmRequestType=0x80 (Device-to-host, Standard, Device)
-  // bRequest=6, wValue=(1<<8)|0, wIndex=0, wLength=18
+// Setup packet (USB2.0 9.3): GET_DESCRIPTOR(Device)
+// bmRequestType=0x80 (Device-to-host, Standard, Device)
+// bRequest=6, wValue=(1<<8)|0, wIndex=0, wLength=18
+static uint64_t xhci_setup_get_device(void) {
   uint64_t setup = 0;
   setup |= 0x80ULL;         // bmRequestType
   setup |= 0x06ULL << 8;    // bRequest
   setup |= 0x0100ULL << 16; // wValue
   setup |= 0x0000ULL << 32; // wIndex
   setup |= 18ULL << 48;     // wLength
+  return setup;
+}
 
-  // Setup Stage TRB
-  xhci_trb_t setup_trb;
-  setup_trb.data = setup;
-  // Transfer length=8, interrupter target=0
-  setup_trb.status = 8;
-  // TRT=2 (IN data stage) in bits 17:16
-  // IDT=1 (bit 6) because setup packet is in the TRB parameter field
-  setup_trb.control = make_trb_control(TRB_TYPE_SETUP_STAGE, dev->ep0_cycle) |
-                      (2u << 16) | (1u << 6) | (1u << 5);
-
-  // Data Stage TRB (IN)
-  xhci_trb_t data_trb;
-  data_trb.data = (uint64_t)(uintptr_t)buf;
-  data_trb.status = 18; // transfer length
-  // DIR=1 in bit 16
-  data_trb.control = make_trb_control(TRB_TYPE_DATA_STAGE, dev->ep0_cycle) |
-                     (1u << 16) | (1u << 5);
-
-  // Status Stage TRB (OUT for IN data stage)
-  xhci_trb_t status_trb;
-  status_trb.data = 0;
-  status_trb.status = 0;
-  // DIR=0
-  status_trb.control =
-      make_trb_control(TRB_TYPE_STATUS_STAGE, dev->ep0_cycle) | (1u << 5);
-
-  xhci_ep0_ring_push(dev, &setup_trb);
-  xhci_ep0_ring_push(dev, &data_trb);
-  xhci_ep0_ring_push(dev, &status_trb);
-
-  xhci_ring_doorbell_ep0(dev->slot_id);
-
-  uint32_t cc = 0;
-  if (!xhci_wait_for_transfer_event(dev->slot_id, &cc)) {
-    serial_print("[xHCI] EP0 GET_DESCRIPTOR: timeout\n");
-    return 0;
-  }
-
-  serial_print("[xHCI] EP0 GET_DESCRIPTOR: completion_code=");
-  xhci_print_u32_dec(cc);
-  serial_print("\n");
-  if (cc != 1)
-    return 0;
-
+// USB Device Descriptor is 18 bytes
+static void xhci_parse_device_descriptor(const uint8_t *buf) {
   // Parse: idVendor at 8, idProduct at 10, bDeviceClass at 4
   uint16_t vid = (uint16_t)(buf[8] | (buf[9] << 8));
   uint16_t pid = (uint16_t)(buf[10] | (buf[11] << 8));
@@ -1023,26 +1116,33 @@ static int xhci_ep0_get_device_descriptor(xhci_device_state_t *dev) {
   serial_print(" proto=");
   xhci_print_u32_dec(proto);
   serial_print("\n");
-
-  return 1;
 }
 
-static int xhci_cmd_address_device(uint32_t slot_id, uint32_t port_id,
-                                   uint32_t speed_code) {
-  // Allocate Device Context and EP0 transfer ring
-  uint8_t *dev_ctx = (uint8_t *)PMM_AllocatePage();
-  for (uint32_t i = 0; i < 4096; i++)
-    dev_ctx[i] = 0;
+// Sets up the slot's contexts and queues Address Device; returns 0, with
+// nothing queued, if memory ran out
+static int xhci_cmd_address_device(xhci_port_t *p) {
+  uint32_t slot_id = p->slot_id;
+  uint32_t port_id = p->port_id;
+  uint32_t speed_code = p->speed;
+  // Allocate Device Context (Slot + 31 endpoints) and EP0 transfer ring
+  dma_buffer_t ctx_dma = xhci_dma_alloc(32 * g_ctx_size, 64, 4096);
+  if (!ctx_dma.cpu)
+    return 0;
+  uint8_t *dev_ctx = (uint8_t *)ctx_dma.cpu;
 
-  xhci_trb_t *ep0_ring = xhci_alloc_tr_ring();
+  uint64_t ep0_ring_bus = 0;
+  xhci_trb_t *ep0_ring = xhci_alloc_tr_ring(&ep0_ring_bus);
+  if (!ep0_ring)
+    return 0;
 
   // Write DCBAA entry for this slot
-  dcbaa[slot_id] = (uint64_t)(uintptr_t)dev_ctx;
+  dcbaa[slot_id] = ctx_dma.bus;
 
-  // Allocate Input Context (must hold Input Control + Slot + EP0)
-  uint8_t *input_ctx = (uint8_t *)PMM_AllocatePage();
-  for (uint32_t i = 0; i < 4096; i++)
-    input_ctx[i] = 0;
+  // Allocate Input Context (Input Control + Slot + 31 endpoints)
+  dma_buffer_t input_dma = xhci_dma_alloc(33 * g_ctx_size, 64, 4096);
+  if (!input_dma.cpu)
+    return 0;
+  uint8_t *input_ctx = (uint8_t *)input_dma.cpu;
 
   // Input Control Context at offset 0
   xhci_input_control_ctx_t *icc = (xhci_input_control_ctx_t *)input_ctx;
@@ -1054,7 +1154,8 @@ static int xhci_cmd_address_device(uint32_t slot_id, uint32_t port_id,
   xhci_slot_ctx_32_t *slot = (xhci_slot_ctx_32_t *)(input_ctx + g_ctx_size);
   slot->dword0 = ((speed_code & 0xFu) << 20) | ((1u & 0x1Fu) << 27);
   slot->dword1 = ((port_id & 0xFFu) << 16);
-  slot->dword2 = 0;
+  // For the slot's events that are not tied to a TRB
+  slot->dword2 = trb_intr_target(slot_id);
   slot->dword3 = 0;
 
   // EP0 Context at index 2
@@ -1070,7 +1171,7 @@ static int xhci_cmd_address_device(uint32_t slot_id, uint32_t port_id,
 
   ep0->dword1 = ((mps & 0xFFFFu) << 16) | ((4u & 0x7u) << 3);
 
-  uint64_t trdp = (uint64_t)(uintptr_t)ep0_ring;
+  uint64_t trdp = ep0_ring_bus;
   trdp &= ~0xFULL;
   trdp |= 1u; // DCS = 1
   ep0->tr_deq_lo = (uint32_t)(trdp & 0xFFFFFFFFu);
@@ -1081,41 +1182,57 @@ static int xhci_cmd_address_device(uint32_t slot_id, uint32_t port_id,
 
   // Address Device Command TRB
   xhci_trb_t cmd;
-  cmd.data = (uint64_t)(uintptr_t)input_ctx;
+  cmd.data = input_dma.bus;
   cmd.status = 0;
   cmd.control =
       make_trb_control(TRB_TYPE_ADDRESS_DEVICE_CMD, command_ring_cycle) |
       (slot_id << 24);
 
-  xhci_cmd_ring_push(&cmd);
-  xhci_ring_doorbell_cmd();
+  p->dev_ctx = dev_ctx;
+  p->ep0_ring = ep0_ring;
+  p->ep0_ring_bus = ep0_ring_bus;
+  p->ep0_mps = mps;
+  p->input = input_dma;
+  xhci_cmd_submit(&cmd, &p->op, &p->task);
+  return 1;
+}
 
-  uint32_t evt_slot = 0;
-  uint32_t cc = 0;
-  if (!xhci_wait_for_command_completion(&evt_slot, &cc)) {
-    serial_print("[xHCI] AddressDevice: timeout\n");
-    return 0;
-  }
+// The slot's device state once it has an address, else NULL
+static xhci_device_state_t *xhci_address_device_done(xhci_port_t *p) {
+  // The controller may still read the input context; leave it allocated.
+  if (xhci_op_timed_out(&p->op, "AddressDevice"))
+    return NULL;
+  dma_free(p->input);
 
+  uint32_t cc = p->op.cc;
   serial_print("[xHCI] AddressDevice: completion_code=");
   xhci_print_u32_dec(cc);
   serial_print(" slot_id=");
-  xhci_print_u32_dec(evt_slot);
+  xhci_print_u32_dec(p->op.slot_id);
   serial_print("\n");
 
   if (cc != 1)
-    return 0;
+    return NULL;
 
+  uint32_t slot_id = p->slot_id;
   // Save device state for EP0 transfers (per-slot)
-  xhci_device_state_t *dev = &g_devs[slot_id];
+  xhci_device_state_t *dev = g_devs[slot_id];
+  if (!dev) {
+    dev = (xhci_device_state_t *)Slab_Alloc(g_dev_cache);
+    if (!dev)
+      return NULL;
+    g_devs[slot_id] = dev;
+  }
   dev->slot_id = slot_id;
-  dev->ep0_mps = mps;
-  dev->ep0_ring = ep0_ring;
+  dev->ep0_mps = p->ep0_mps;
+  dev->ep0_ring = p->ep0_ring;
+  dev->ep0_ring_bus = p->ep0_ring_bus;
   dev->ep0_index = 0;
   dev->ep0_cycle = 1;
-  dev->dev_ctx = dev_ctx;
-  dev->speed_code = (uint8_t)(speed_code & 0xFFu);
+  dev->dev_ctx = p->dev_ctx;
+  dev->speed_code = (uint8_t)(p->speed & 0xFFu);
   dev->intr_ring = NULL;
+  dev->intr_buf = NULL;
   dev->intr_index = 0;
   dev->intr_cycle = 1;
   dev->hid_ifnum = 0xFF;
@@ -1123,55 +1240,366 @@ static int xhci_cmd_address_device(uint32_t slot_id, uint32_t port_id,
   dev->intr_epaddr = 0;
   dev->intr_mps = 0;
   dev->intr_interval = 0;
+  dev->ep0_op = NULL;
+  return dev;
+}
+
+// Reports on their way from the event handlers to xhci_hid_read
+static xhci_hid_report_t g_hid_queue[XHCI_HID_QUEUE];
+static uint32_t g_hid_head;
+static uint32_t g_hid_tail;
+static Spinlock g_hid_lock;
+static Semaphore g_hid_ready;
+static uint64_t g_hid_reports;
+static uint64_t g_hid_dropped;
+static uint64_t g_hid_latency_ns;
+static uint64_t g_hid_latency_max_ns;
+
+// With interrupts off
+static void xhci_hid_queue_report(uint32_t slot_id, const uint8_t *buf) {
+  spin_lock(&g_hid_lock);
+  int queued = g_hid_tail - g_hid_head < XHCI_HID_QUEUE;
+  if (queued) {
+    xhci_hid_report_t *r = &g_hid_queue[g_hid_tail % XHCI_HID_QUEUE];
+    r->slot_id = slot_id;
+    for (int i = 0; i < 8; i++)
+      r->data[i] = buf[i];
+    r->time_ns = clock_monotonic_ns();
+    g_hid_tail++;
+  } else {
+    g_hid_dropped++;
+  }
+  spin_unlock(&g_hid_lock);
+  if (queued)
+    Semaphore_Up(&g_hid_ready);
+}
+
+void xhci_hid_read(xhci_hid_report_t *out) {
+  Semaphore_Down(&g_hid_ready);
+  uint64_t flags = spin_lock_irqsave(&g_hid_lock);
+  *out = g_hid_queue[g_hid_head % XHCI_HID_QUEUE];
+  g_hid_head++;
+  uint64_t latency = clock_monotonic_ns() - out->time_ns;
+  g_hid_reports++;
+  g_hid_latency_ns += latency;
+  if (latency > g_hid_latency_max_ns)
+    g_hid_latency_max_ns = latency;
+  spin_unlock_irqrestore(&g_hid_lock, flags);
+}
+
+/**
+ * Routes one event: completions to the command or control transfer waiting
+ * on them, HID reports to xhci_hid_read. Runs with g_op_lock held, from an
+ * interrupter's handler, or from the pump when there are no interrupts.
+ */
+static void xhci_handle_event(const xhci_trb_t *evt) {
+  uint32_t type = trb_type(evt->control);
+  if (type == TRB_TYPE_COMMAND_COMPLETION) {
+    uint64_t index = (evt->data - command_ring_bus) / sizeof(xhci_trb_t);
+    if (index < XHCI_CMD_RING_TRBS && cmd_ops[index])
+      xhci_op_finish(cmd_ops[index], trb_cc(evt->status),
+                     trb_slot_id(evt->control));
+    return;
+  }
+
+  if (type != TRB_TYPE_TRANSFER_EVENT) {
+    return;
+  }
+
+  uint32_t cc = trb_cc(evt->status);
+  uint32_t slot_id = trb_slot_id(evt->control);
+  uint32_t ep_id = (evt->control >> 16) & 0x1Fu;
+
+  if (slot_id == 0 || slot_id >= 256) {
+    return;
+  }
+
+  xhci_device_state_t *dev = g_devs[slot_id];
+  if (!dev || dev->slot_id != slot_id) {
+    return;
+  }
+
+  // EP0 is DCI=1
+  if (ep_id == 1) {
+    if (dev->ep0_op)
+      xhci_op_finish(dev->ep0_op, cc, slot_id);
+    return;
+  }
+
+  // EP1 IN is DCI=3.
+  if (ep_id != 3) {
+    return;
+  }
+
+  // Boot-protocol reports are 8 bytes at most, and the endpoint's buffer
+  // is at least that
+  if (cc == 1 && dev->intr_buf && dev->intr_mps >= 8)
+    xhci_hid_queue_report(slot_id, dev->intr_buf);
+
+  // Re-arm interrupt IN for next report.
+  if (dev->intr_ring && dev->intr_mps) {
+    xhci_hid_start_polling(dev);
+  }
+}
+
+/**
+ * An interrupter's MSI-X or MSI vector. IP is cleared here as well as by the
+ * controller, which 4.17.5 leaves to the implementation, and so is EINT.
+ */
+static void xhci_irq(void *ctx) {
+  xhci_intr_t *ir = (xhci_intr_t *)ctx;
+  ir->irqs++;
+  ir->regs->iman = XHCI_IMAN_IE | XHCI_IMAN_IP;
+  op_regs->usb_sts = USB_STS_EINT;
+  xhci_intr_drain(ir);
+}
+
+static AsyncTask g_pump;
+static uint32_t g_ports_left; // only touched on the async worker
+static Completion g_ports_done;
+
+// Without MSI-X or MSI only: drains interrupter 0 every XHCI_PUMP_NS while
+// ports come up, and every XHCI_POLL_NS after
+static AsyncStatus xhci_pump(AsyncTask *t) {
+  ASYNC_BEGIN(t);
+  for (;;) {
+    xhci_intr_drain(&g_intrs[0]);
+    ASYNC_SLEEP(t, g_ports_left ? XHCI_PUMP_NS : XHCI_POLL_NS);
+  }
+  ASYNC_END(t);
+}
+
+// Polls cond every XHCI_POLL_NS until it holds or timeout_ms passes
+#define XHCI_POLL_UNTIL(p, cond, timeout_ms)                                   \
+  do {                                                                         \
+    (p)->deadline = clock_deadline((uint64_t)(timeout_ms) * 1000000ULL);      \
+    while (!(cond) && !clock_expired((p)->deadline))                          \
+      ASYNC_SLEEP(&(p)->task, XHCI_POLL_NS);                                  \
+  } while (0)
+
+// Waits for the command or transfer in p->op, or for timeout_ms to pass
+#define XHCI_AWAIT_OP(p, timeout_ms)                                           \
+  do {                                                                         \
+    (p)->deadline = clock_deadline((uint64_t)(timeout_ms) * 1000000ULL);      \
+    Async_WakeAfter(&(p)->task, (uint64_t)(timeout_ms) * 1000000ULL);         \
+    ASYNC_AWAIT(&(p)->task, (p)->op.done || clock_expired((p)->deadline));    \
+  } while (0)
+
+/**
+ * One port, from reset to HID polling: the sequence the boot used to run
+ * port after port. A step that times out only ends this port's coroutine.
+ */
+static AsyncStatus xhci_port_main(AsyncTask *t) {
+  xhci_port_t *p = (xhci_port_t *)t->data;
+  volatile uint32_t *portsc = p->portsc;
+  ASYNC_BEGIN(t);
+
+  // If the port is already usable, do NOT reset it. On some real controllers
+  // a reset here can knock the link into Disabled/Recovery and it won't come
+  // back.
+  p->ps = *portsc;
+  if (xhci_port_ready(p->ps)) {
+    serial_print("[xHCI] Port already ready; skipping reset\n");
+    p->ready = 1;
+  } else {
+    // Ensure port power is on (some controllers require PP before reset),
+    // and clear any pending change bits before doing reset
+    xhci_port_power_on(portsc, &p->ps);
+    xhci_port_clear_w1c(portsc, &p->ps);
+
+    if (xhci_port_speed(p->ps) == 4) {
+      // SuperSpeed: prefer Warm Port Reset
+      serial_print("[xHCI] SuperSpeed port; using Warm Reset\n");
+      *portsc = (p->ps & ~PORTSC_W1C) | PORTSC_WPR;
+      XHCI_POLL_UNTIL(p, !(*portsc & PORTSC_WPR), 500);
+      p->ps = *portsc;
+      xhci_port_clear_w1c(portsc, &p->ps);
+      xhci_log_portsc(p->port_id, "[xHCI] After warm reset", p->ps);
+    } else {
+      // Non-SS: cold Port Reset
+      *portsc = (p->ps & ~PORTSC_W1C) | PORTSC_PR;
+      XHCI_POLL_UNTIL(p, !(*portsc & PORTSC_PR), 500);
+      if (*portsc & PORTSC_PR) {
+        serial_print("[xHCI] Port reset timeout PortSC=");
+        xhci_print_hex32(*portsc);
+        serial_print("\n");
+      }
+      // Clear RW1C bits that may be set after reset
+      p->ps = *portsc;
+      xhci_port_clear_w1c(portsc, &p->ps);
+      xhci_log_portsc(p->port_id, "[xHCI] After cold reset", p->ps);
+    }
+
+    // Wait for the port to actually be usable (PED=1, speed!=0, and for USB3:
+    // link in U0). On real hardware, speed may remain 0 until link training
+    // completes.
+    XHCI_POLL_UNTIL(p, xhci_port_ready(*portsc), 500);
+    p->ready = xhci_port_ready(*portsc);
+  }
+
+  p->ps = *portsc;
+  if (p->ready) {
+    serial_print("[xHCI] Port ready\n");
+  } else {
+    serial_print("[xHCI] Port NOT ready after reset(s)\n");
+    serial_print("[xHCI] Stuck state: PLS=");
+    xhci_print_u32_dec(xhci_port_pls(p->ps));
+    serial_print(" speed=");
+    xhci_print_u32_dec(xhci_port_speed(p->ps));
+    serial_print("\n");
+
+    if (xhci_port_pls(p->ps) == 3) { // U3 (Suspend)
+      serial_print("[xHCI] Port in U3; attempting Wakeup (PLS=15)...\n");
+      // Resume, with LWS (Link Write Strobe) required to write PLS
+      *portsc = (p->ps & ~PORTSC_W1C & ~PORTSC_PLS_MASK) | (15u << 5) |
+                PORTSC_LWS;
+      // Wait for Resume to complete (transition to U0)
+      XHCI_POLL_UNTIL(p, xhci_port_pls(*portsc) == 0, 500);
+      p->ps = *portsc;
+      if (xhci_port_pls(p->ps) == 0) {
+        serial_print("[xHCI] Wakeup successful (U0)\n");
+        p->ready = 1;
+      }
+    }
+  }
+  xhci_log_portsc(p->port_id, "[xHCI] Final", p->ps);
+
+  if (!p->ready) {
+    // Don't attempt EnableSlot/AddressDevice with invalid speed/PED.
+    goto out;
+  }
+  p->speed = xhci_port_speed(p->ps);
+
+  // Enable Slot + Address Device
+  xhci_cmd_enable_slot(&p->op, t);
+  XHCI_AWAIT_OP(p, 1000);
+  if (!xhci_enable_slot_done(&p->op, &p->slot_id)) {
+    serial_print("[xHCI] EnableSlot failed\n");
+    goto out;
+  }
+
+  if (xhci_cmd_address_device(p)) {
+    XHCI_AWAIT_OP(p, 1000);
+    p->dev = xhci_address_device_done(p);
+  }
+  if (!p->dev) {
+    serial_print("[xHCI] AddressDevice failed\n");
+    goto out;
+  }
+
+  // One buffer for every descriptor read
+  p->buf = xhci_dma_alloc(4096, 64, 0x10000);
+  if (!p->buf.cpu)
+    goto out;
 
   // Next milestone: read the USB Device Descriptor via EP0 control transfer
-  if (!xhci_ep0_get_device_descriptor(dev)) {
+  xhci_ep0_control_in(p->dev, xhci_setup_get_device(), p->buf.bus, 18, &p->op,
+                      t);
+  XHCI_AWAIT_OP(p, 1000);
+  if (xhci_ep0_check(&p->op, "EP0 GET_DESCRIPTOR")) {
+    xhci_parse_device_descriptor((uint8_t *)p->buf.cpu);
+  } else {
     serial_print("[xHCI] EP0 GET_DESCRIPTOR failed\n");
   }
 
-  if (!xhci_ep0_get_config_and_set_config(dev)) {
+  // The configuration's first 9 bytes for its length, then all of it
+  xhci_ep0_control_in(p->dev, xhci_setup_get_config(9), p->buf.bus, 9, &p->op,
+                      t);
+  XHCI_AWAIT_OP(p, 1000);
+  if (!xhci_ep0_check(&p->op, "EP0 control IN")) {
+    serial_print("[xHCI] EP0 GET_DESCRIPTOR(Configuration 9) failed\n");
+  } else {
+    p->total_len = (uint16_t)(((uint8_t *)p->buf.cpu)[2] |
+                              (((uint8_t *)p->buf.cpu)[3] << 8));
+    if (p->total_len == 0 || p->total_len > 4096)
+      p->total_len = 4096;
+    for (uint32_t i = 0; i < 4096; i++)
+      ((uint8_t *)p->buf.cpu)[i] = 0;
+    xhci_ep0_control_in(p->dev, xhci_setup_get_config(p->total_len),
+                        p->buf.bus, p->total_len, &p->op, t);
+    XHCI_AWAIT_OP(p, 1000);
+    if (!xhci_ep0_check(&p->op, "EP0 control IN")) {
+      serial_print("[xHCI] EP0 GET_DESCRIPTOR(Configuration full) failed\n");
+    } else {
+      xhci_ep0_control_no_data_out(
+          p->dev,
+          xhci_setup_set_config(xhci_parse_config(
+              p->dev, (uint8_t *)p->buf.cpu, p->total_len)),
+          &p->op, t);
+      XHCI_AWAIT_OP(p, 1000);
+      if (xhci_ep0_check(&p->op, "EP0 control OUT")) {
+        serial_print("[USB] SET_CONFIGURATION done\n");
+        p->configured = 1;
+      } else {
+        serial_print("[xHCI] EP0 SET_CONFIGURATION failed\n");
+      }
+    }
+  }
+  if (!p->configured) {
     serial_print("[xHCI] Config descriptor / set config failed\n");
   }
+  if (!p->op.done) {
+    // The device stopped answering on EP0
+    goto out;
+  }
 
   // Basic HID bring-up: boot protocol + idle, then enable interrupt IN EP and
   // poll reports.
-  if (dev->hid_ifnum != 0xFF) {
+  if (p->dev->hid_ifnum != 0xFF) {
     serial_print("[HID] SET_PROTOCOL(boot)\n");
-    (void)xhci_hid_set_protocol_boot(dev);
+    xhci_ep0_control_no_data_out(p->dev, xhci_setup_hid(p->dev, 0x0B), &p->op,
+                                 t);
+    XHCI_AWAIT_OP(p, 1000);
+    (void)xhci_ep0_check(&p->op, "EP0 control OUT");
     serial_print("[HID] SET_IDLE\n");
-    (void)xhci_hid_set_idle(dev);
-    if (xhci_cmd_configure_intr_in_ep(dev)) {
-      serial_print("[HID] Interrupt IN armed\n");
-      xhci_hid_start_polling(dev);
+    xhci_ep0_control_no_data_out(p->dev, xhci_setup_hid(p->dev, 0x0A), &p->op,
+                                 t);
+    XHCI_AWAIT_OP(p, 1000);
+    (void)xhci_ep0_check(&p->op, "EP0 control OUT");
+    if (xhci_cmd_configure_intr_in_ep(p->dev, &p->input, &p->op, t)) {
+      XHCI_AWAIT_OP(p, 1000);
+      if (xhci_configure_intr_in_ep_done(p->dev, p->input, &p->op)) {
+        serial_print("[HID] Interrupt IN armed\n");
+        xhci_hid_start_polling(p->dev);
+      }
     }
   }
 
-  return 1;
+  serial_print("[xHCI] PORT SCAN END\n");
+
+out:
+  // After a timeout the controller may still write the buffer; leave it
+  if (p->buf.cpu && p->op.done)
+    dma_free(p->buf);
+  if (--g_ports_left == 0)
+    Completion_Complete(&g_ports_done);
+  ASYNC_END(t);
 }
 
 /**
  * See xHCI Spec Section 4.2: Host Controller Initialization
  */
-void xhci_init(uint64_t mmio_phys) {
+void xhci_init(uint8_t bus, uint8_t slot, uint8_t func, uint64_t mmio_phys) {
   serial_print("[xHCI] Initializing Controller at ");
   print_hex64(mmio_phys);
   serial_print("\n");
 
-  // 1) Map MMIO space
+  // 1) Map MMIO space uncached in the vmalloc window
   serial_print("[xHCI] Mapping MMIO...\n");
-  for (uint64_t i = 0; i < XHCI_MMIO_MAP_SIZE; i += 4096) {
-    VMM_MapPage((void *)(mmio_phys + i), (void *)(mmio_phys + i),
-                PAGE_WRITE | PAGE_PRESENT);
+  uint8_t *mmio = (uint8_t *)ioremap(mmio_phys, XHCI_MMIO_MAP_SIZE, PAGE_CACHE_UC);
+  if (!mmio) {
+    serial_print("[xHCI] Failed to map MMIO\n");
+    return;
   }
 
-  cap_regs = (xhci_cap_regs_t *)mmio_phys;
-  op_regs = (xhci_op_regs_t *)(mmio_phys + cap_regs->cap_length);
+  cap_regs = (xhci_cap_regs_t *)mmio;
+  op_regs = (xhci_op_regs_t *)(mmio + cap_regs->cap_length);
 
   uint32_t dboff = cap_regs->dboff & ~0x3u;
   uint32_t rtsoff = cap_regs->rtsoff & ~0x1Fu;
 
-  doorbell_regs = (uint32_t *)(mmio_phys + dboff);
-  runtime_regs = (xhci_runtime_regs_t *)(mmio_phys + rtsoff);
+  doorbell_regs = (uint32_t *)(mmio + dboff);
+  runtime_regs = (xhci_runtime_regs_t *)(mmio + rtsoff);
 
   serial_print("[xHCI] cap_length: ");
   {
@@ -1188,6 +1616,11 @@ void xhci_init(uint64_t mmio_phys) {
 
   // Context size (HCCPARAMS1.CSZ): 0=32B contexts, 1=64B contexts
   g_ctx_size = (cap_regs->hcc_params1 & (1u << 2)) ? 64u : 32u;
+  g_dev_cache = Slab_CreateCache("xhci_device", sizeof(xhci_device_state_t),
+                                 CACHE_LINE_SIZE);
+
+  // 64-bit addressing capability (HCCPARAMS1.AC64)
+  g_dma_max = (cap_regs->hcc_params1 & 1u) ? DMA_ADDR_64BIT : DMA_ADDR_32BIT;
   serial_print("[xHCI] Context size: ");
   xhci_print_u32_dec(g_ctx_size);
   serial_print("\n");
@@ -1196,15 +1629,19 @@ void xhci_init(uint64_t mmio_phys) {
   serial_print("[xHCI] Resetting Controller...\n");
   op_regs->usb_cmd &= ~USB_CMD_RS;
   serial_print("[xHCI] Waiting for halt...\n");
-  while (!(op_regs->usb_sts & USB_STS_HCH))
+  xhci_wait_t w;
+  for (xhci_wait_start(&w, 1000);
+       !(op_regs->usb_sts & USB_STS_HCH) && xhci_wait_more(&w);)
     ;
 
   serial_print("[xHCI] Issuing Reset...\n");
   op_regs->usb_cmd |= USB_CMD_HCRST;
-  while (op_regs->usb_cmd & USB_CMD_HCRST)
+  for (xhci_wait_start(&w, 1000);
+       (op_regs->usb_cmd & USB_CMD_HCRST) && xhci_wait_more(&w);)
     ;
   serial_print("[xHCI] Waiting for CNR...\n");
-  while (op_regs->usb_sts & (1 << 11))
+  for (xhci_wait_start(&w, 1000);
+       (op_regs->usb_sts & (1 << 11)) && xhci_wait_more(&w);)
     ;
 
   // 3) Configure MaxSlots
@@ -1221,9 +1658,13 @@ void xhci_init(uint64_t mmio_phys) {
   serial_print("\n");
 
   // 4) DCBAA + Scratchpad Buffers (xHCI 4.2 + 6.1)
-  dcbaa = (uint64_t *)PMM_AllocatePage();
-  for (int i = 0; i < 512; i++)
-    dcbaa[i] = 0;
+  dma_buffer_t dcbaa_dma =
+      xhci_dma_alloc((max_slots + 1) * sizeof(uint64_t), 64, 4096);
+  if (!dcbaa_dma.cpu) {
+    serial_print("[xHCI] Out of DMA memory\n");
+    return;
+  }
+  dcbaa = (uint64_t *)dcbaa_dma.cpu;
 
   // Max Scratchpad Buffers = (MaxScratchpadBuffersHi << 5) |
   // MaxScratchpadBuffersLo
@@ -1254,31 +1695,33 @@ void xhci_init(uint64_t mmio_phys) {
     serial_print("\n");
 
     // Scratchpad Buffer Array is an array of 64-bit pointers, one per
-    // scratchpad buffer. Typically fits in one page.
-    uint64_t *sp_array = (uint64_t *)PMM_AllocatePage();
-    for (uint32_t i = 0; i < 512; i++)
-      sp_array[i] = 0;
-
-    for (uint32_t i = 0; i < scratchpad_count; i++) {
-      void *sp_buf = PMM_AllocatePage();
-      sp_array[i] = (uint64_t)(uintptr_t)sp_buf;
+    // scratchpad buffer. Buffers are PAGESIZE (4 KiB) and page aligned.
+    dma_buffer_t sp_dma =
+        xhci_dma_alloc(scratchpad_count * sizeof(uint64_t), 64, 4096);
+    uint64_t *sp_array = (uint64_t *)sp_dma.cpu;
+
+    for (uint32_t i = 0; sp_array && i < scratchpad_count; i++) {
+      dma_buffer_t sp_buf = xhci_dma_alloc(4096, 4096, 0);
+      sp_array[i] = sp_buf.bus;
     }
 
-    dcbaa[0] = (uint64_t)(uintptr_t)sp_array;
+    dcbaa[0] = sp_dma.bus;
   }
 
-  op_regs->dcbaap = (uint64_t)(uintptr_t)dcbaa;
+  op_regs->dcbaap = dcbaa_dma.bus;
 
   // 5) Command Ring: 256 TRBs with last TRB as Link TRB
-  command_ring = (xhci_trb_t *)PMM_AllocatePage();
-  for (int i = 0; i < XHCI_CMD_RING_TRBS; i++) {
-    command_ring[i].data = 0;
-    command_ring[i].status = 0;
-    command_ring[i].control = 0;
+  dma_buffer_t cmd_dma = xhci_dma_alloc(
+      XHCI_CMD_RING_TRBS * sizeof(xhci_trb_t), 64, 0x10000);
+  if (!cmd_dma.cpu) {
+    serial_print("[xHCI] Out of DMA memory\n");
+    return;
   }
+  command_ring = (xhci_trb_t *)cmd_dma.cpu;
+  command_ring_bus = cmd_dma.bus;
 
   // Link TRB at end points back to ring start, toggles cycle
-  command_ring[XHCI_CMD_RING_TRBS - 1].data = (uint64_t)(uintptr_t)command_ring;
+  command_ring[XHCI_CMD_RING_TRBS - 1].data = command_ring_bus;
   command_ring[XHCI_CMD_RING_TRBS - 1].status = 0;
   // cycle=1 (initial), type=LINK, TC=1 (bit1)
   command_ring[XHCI_CMD_RING_TRBS - 1].control =
@@ -1287,38 +1730,91 @@ void xhci_init(uint64_t mmio_phys) {
   command_ring_index = 0;
   command_ring_cycle = 1;
   // CRCR: ring base (aligned) + RCS
-  op_regs->crcr = ((uint64_t)(uintptr_t)command_ring) | 1u;
-
-  // 6) Event Ring + ERST (single segment)
-  event_ring = (xhci_trb_t *)PMM_AllocatePage();
-  for (int i = 0; i < XHCI_EVT_RING_TRBS; i++) {
-    event_ring[i].data = 0;
-    event_ring[i].status = 0;
-    event_ring[i].control = 0;
+  op_regs->crcr = command_ring_bus | 1u;
+
+  // 6) Interrupters: as many as MaxIntrs (HCSPARAMS1 18:8), free vectors
+  // and the MSI-X table allow, interrupter 0 on the boot CPU and the
+  // transfer ones spread over the others. One, polled, without MSI-X or
+  // MSI, since PCI INTx lines are not routed.
+  uint32_t want = (cap_regs->hcs_params1 >> 8) & 0x7FFu;
+  if (want > XHCI_MAX_INTRS)
+    want = XHCI_MAX_INTRS;
+  uint8_t vectors[XHCI_MAX_INTRS];
+  uint32_t apic_ids[XHCI_MAX_INTRS];
+  uint32_t nvec = 0;
+  while (LAPIC_Present() && nvec < want) {
+    vectors[nvec] = IRQ_AllocVector();
+    if (!vectors[nvec])
+      break;
+    apic_ids[nvec] = SMP_GetCPU(nvec % SMP_CPUCount())->apic_id;
+    nvec++;
+  }
+  uint32_t granted = 0;
+  const char *mode = "polled";
+  if (nvec) {
+    granted = pci_enable_msix(bus, slot, func, vectors, apic_ids, nvec);
+    if (granted) {
+      mode = "MSI-X";
+    } else if (pci_enable_msi(bus, slot, func, vectors[0], apic_ids[0])) {
+      granted = 1;
+      mode = "MSI";
+    }
+  }
+  for (uint32_t i = granted; i < nvec; i++)
+    IRQ_FreeVector(vectors[i]);
+  g_use_irqs = granted != 0;
+  g_intr_count = granted ? granted : 1;
+
+  // Event Ring + ERST (single segment) for each
+  for (uint32_t i = 0; i < g_intr_count; i++) {
+    dma_buffer_t evt_dma = xhci_dma_alloc(
+        XHCI_EVT_RING_TRBS * sizeof(xhci_trb_t), 64, 0x10000);
+    dma_buffer_t erst_dma = xhci_dma_alloc(sizeof(xhci_erst_entry_t), 64, 0);
+    if (!evt_dma.cpu || !erst_dma.cpu) {
+      serial_print("[xHCI] Out of DMA memory\n");
+      return;
+    }
+    xhci_intr_t *ir = &g_intrs[i];
+    ir->index = i;
+    ir->regs = &runtime_regs->interrupters[i];
+    ir->ring = (xhci_trb_t *)evt_dma.cpu;
+    ir->ring_bus = evt_dma.bus;
+    ir->dequeue = 0;
+    ir->cycle = 1;
+
+    xhci_erst_entry_t *erst = (xhci_erst_entry_t *)erst_dma.cpu;
+    erst[0].segment_base = ir->ring_bus;
+    erst[0].segment_size = XHCI_EVT_RING_TRBS;
+    erst[0].rsvd = 0;
+
+    // ERSTBA last: writing it hands the ring to the controller (4.9.4)
+    ir->regs->imod = XHCI_IMOD_NS / 250;
+    ir->regs->erstsz = 1;
+    ir->regs->erdp = ir->ring_bus;
+    ir->regs->erstba = erst_dma.bus;
+    if (g_use_irqs) {
+      ir->vector = vectors[i];
+      request_irq(ir->vector, xhci_irq, ir);
+    }
+    // Enabled even when polling; some implementations may not generate
+    // events otherwise
+    ir->regs->iman = XHCI_IMAN_IE | XHCI_IMAN_IP;
   }
 
-  erst = (xhci_erst_entry_t *)PMM_AllocatePage();
-  erst[0].segment_base = (uint64_t)(uintptr_t)event_ring;
-  erst[0].segment_size = XHCI_EVT_RING_TRBS;
-  erst[0].rsvd = 0;
-
-  event_ring_index = 0;
-  event_ring_cycle = 1;
-
-  runtime_regs->interrupters[0].erstsz = 1;
-  runtime_regs->interrupters[0].erstba = (uint64_t)(uintptr_t)erst;
-  runtime_regs->interrupters[0].erdp = (uint64_t)(uintptr_t)&event_ring[0];
-  // Enable interrupter even though we poll; some implementations may not
-  // generate events otherwise. IMAN: bit0=IP (RW1C), bit1=IE
-  runtime_regs->interrupters[0].iman = (1u << 1) | (1u << 0);
+  serial_print("[xHCI] Interrupters: ");
+  xhci_print_u32_dec(g_intr_count);
+  serial_print(", ");
+  serial_print(mode);
+  if (g_use_irqs) {
+    serial_print(", first vector ");
+    xhci_print_u32_dec(vectors[0]);
+  }
+  serial_print("\n");
 
-  // 7) Run controller (do NOT enable INTE yet; polling only)
+  // 7) Run controller
   op_regs->usb_cmd |= USB_CMD_RS | USB_CMD_INTE;
   serial_print("[xHCI] Controller Running\n");
 
-  // Prime ERDP
-  xhci_event_ring_update_erdp();
-
   // 8) Ports info
   uint32_t num_ports = (cap_regs->hcs_params1 >> 24) & 0xFF;
   serial_print("[xHCI] Number of ports: ");
@@ -1331,20 +1827,6 @@ void xhci_init(uint64_t mmio_phys) {
   }
   serial_print("\n");
 
-  // PortSC bits
-  const uint32_t PORTSC_CCS = 1u << 0; // Current Connect Status
-  const uint32_t PORTSC_PED = 1u << 1; // Port Enabled/Disabled
-  const uint32_t PORTSC_PR = 1u << 4;  // Port Reset
-  const uint32_t PORTSC_PP = 1u << 9;  // Port Power
-  const uint32_t PORTSC_SPEED_MASK = 0xFu << 10;
-  const uint32_t PORTSC_WPR = 1u << 31; // Warm Port Reset (USB3)
-
-  const uint32_t PORTSC_PLS_MASK = 0xFu << 5;
-
-  // RW1C bits (write 1 to clear).
-  const uint32_t PORTSC_W1C = (1u << 17) | (1u << 18) | (1u << 19) |
-                              (1u << 20) | (1u << 21) | (1u << 22);
-
   serial_print("[xHCI] PORT SCAN BEGIN\n");
 
   // Power on ALL ports and wait for them to stabilize.
@@ -1363,7 +1845,7 @@ void xhci_init(uint64_t mmio_phys) {
   // Always wait a bit for lines to stabilize (especially USB 2.0)
   serial_print("[xHCI] Waiting for ports to stabilize...\n");
   for (uint32_t tries = 0; tries < 20; tries++) {
-    for (volatile uint32_t d = 0; d < 2000000; d++) { }
+    Task_Sleep(10000000ULL); // 10 ms
 
     for (uint32_t i = 0; i < num_ports; i++) {
       volatile uint32_t *portsc =
@@ -1376,224 +1858,93 @@ void xhci_init(uint64_t mmio_phys) {
     }
   }
 
+  // Each connected port comes up in its own coroutine, all at once; this
+  // returns when the last is done, so boot waits for the slowest device
+  // rather than for all of them in turn
+  xhci_port_t *ports = NULL;
+  if (num_ports)
+    ports = (xhci_port_t *)kmalloc(num_ports * sizeof(xhci_port_t));
+  if (!ports) {
+    serial_print("[xHCI] Out of memory for port state\n");
+    return;
+  }
+  uint8_t *zero = (uint8_t *)ports;
+  for (uint64_t i = 0; i < num_ports * sizeof(xhci_port_t); i++)
+    zero[i] = 0;
+
+  uint64_t scan_start = clock_monotonic_ns();
+  uint32_t connected = 0;
   for (uint32_t i = 0; i < num_ports; i++) {
     volatile uint32_t *portsc =
         (uint32_t *)((uint64_t)op_regs + 0x400 + (i * 0x10));
     uint32_t ps = *portsc;
 
-    uint32_t port_id = i + 1;
     if (ps & PORTSC_CCS) {
-      xhci_log_portsc(port_id, "[xHCI] Device detected", ps);
-    } else {
-      xhci_log_portsc(port_id, "[xHCI] Port", ps);
-      continue;
-    }
-
-    // If the port is already usable, do NOT reset it. On some real controllers
-    // a reset here can knock the link into Disabled/Recovery and it won't come
-    // back.
-    uint32_t initial_speed = xhci_port_speed(ps);
-    uint32_t initial_pls = xhci_port_pls(ps);
-    uint32_t initial_ped = (ps & PORTSC_PED) ? 1u : 0u;
-    uint32_t ready = 0;
-    if (initial_ped && initial_speed != 0 && initial_pls == 0) {
-      serial_print("[xHCI] Port already ready; skipping reset\n");
-      ready = 1;
-    }
-
-    if (!ready) {
-      // Ensure port power is on (some controllers require PP before reset)
-      if (!(ps & PORTSC_PP)) {
-        *portsc = (ps | PORTSC_PP) & ~PORTSC_W1C;
-        ps = *portsc;
-      }
-
-      // Clear any pending change bits before doing reset
-      ps = *portsc;
-      if (ps & PORTSC_W1C) {
-        *portsc = ps | PORTSC_W1C;
-      }
-
-      ps = *portsc;
-      uint32_t speed_hint = xhci_port_speed(ps);
-
-      if (speed_hint == 4) {
-        // SuperSpeed: prefer Warm Port Reset
-        serial_print("[xHCI] SuperSpeed port; using Warm Reset\n");
-        uint32_t w = ps;
-        w &= ~PORTSC_W1C;
-        w |= PORTSC_WPR;
-        *portsc = w;
-
-        for (uint32_t spins = 0; spins < 20000000; spins++) {
-          ps = *portsc;
-          if (!(ps & PORTSC_WPR))
-            break;
-        }
-
-        ps = *portsc;
-        if (ps & PORTSC_W1C) {
-          *portsc = ps | PORTSC_W1C;
-          ps = *portsc;
-        }
-        xhci_log_portsc(port_id, "[xHCI] After warm reset", ps);
-      } else {
-        // Non-SS: cold Port Reset
-        uint32_t v = ps;
-        v &= ~PORTSC_W1C;
-        v |= PORTSC_PR;
-        *portsc = v;
-
-        // Wait for PR to clear
-        uint32_t ok = 0;
-        for (uint32_t spins = 0; spins < 20000000; spins++) {
-          ps = *portsc;
-          if (!(ps & PORTSC_PR)) {
-            ok = 1;
-            break;
-          }
-        }
-        if (!ok) {
-          serial_print("[xHCI] Port reset timeout PortSC=");
-          xhci_print_hex32(*portsc);
-          serial_print("\n");
-        }
-
-        // Clear RW1C bits that may be set after reset
-        ps = *portsc;
-        if (ps & PORTSC_W1C) {
-          *portsc = ps | PORTSC_W1C;
-        }
-
-        ps = *portsc;
-        xhci_log_portsc(port_id, "[xHCI] After cold reset", ps);
-      }
-
-      // Wait for the port to actually be usable (PED=1, speed!=0, and for USB3:
-      // link in U0). On real hardware, speed may remain 0 until link training
-      // completes.
-      for (uint32_t spins = 0; spins < 20000000; spins++) {
-        ps = *portsc;
-        uint32_t speed = xhci_port_speed(ps);
-        uint32_t pls = xhci_port_pls(ps);
-        if ((ps & PORTSC_CCS) && (ps & PORTSC_PED) && (speed != 0) &&
-            (pls == 0)) {
-          ready = 1;
-          break;
-        }
-      }
-    }
-
-    ps = *portsc;
-    uint32_t speed = xhci_port_speed(ps);
-    if (ready) {
-      serial_print("[xHCI] Port ready\n");
+      xhci_log_portsc(i + 1, "[xHCI] Device detected", ps);
+      ports[i].port_id = i + 1;
+      ports[i].portsc = portsc;
+      connected++;
     } else {
-      serial_print("[xHCI] Port NOT ready after reset(s)\n");
-      uint32_t pls = xhci_port_pls(ps);
-      serial_print("[xHCI] Stuck state: PLS=");
-      xhci_print_u32_dec(pls);
-      serial_print(" speed=");
-      xhci_print_u32_dec(speed);
-      serial_print("\n");
-
-      if (pls == 3) { // U3 (Suspend)
-        serial_print("[xHCI] Port in U3; attempting Wakeup (PLS=15)...\n");
-        uint32_t cmd = ps & ~PORTSC_W1C;
-        cmd &= ~PORTSC_PLS_MASK;
-        cmd |= (15u << 5); // Resume
-        cmd |= (1u << 16); // LWS (Link Write Strobe) required to write PLS
-        *portsc = cmd;
-
-        // Wait for Resume to complete (transition to U0)
-        for (uint32_t w = 0; w < 20000000; w++) {
-          ps = *portsc;
-          if (xhci_port_pls(ps) == 0) { // U0
-            serial_print("[xHCI] Wakeup successful (U0)\n");
-            ready = 1;
-            break;
-          }
-        }
-      }
-    }
-    xhci_log_portsc(port_id, "[xHCI] Final", ps);
-
-    if (!ready) {
-      // Don't attempt EnableSlot/AddressDevice with invalid speed/PED.
-      continue;
-    }
-
-    // Enable Slot + Address Device (still no descriptor transfers yet)
-    uint32_t slot_id = 0;
-    if (!xhci_cmd_enable_slot(&slot_id)) {
-      serial_print("[xHCI] EnableSlot failed\n");
-      continue;
+      xhci_log_portsc(i + 1, "[xHCI] Port", ps);
     }
+  }
 
-    if (!xhci_cmd_address_device(slot_id, port_id, speed)) {
-      serial_print("[xHCI] AddressDevice failed\n");
-      continue;
+  // Every port counted before any coroutine runs, so the first to finish
+  // cannot see zero early
+  Completion_Init(&g_ports_done);
+  g_ports_left = connected;
+  if (!g_use_irqs)
+    Async_Spawn(&g_pump, xhci_pump, NULL);
+  if (connected) {
+    for (uint32_t i = 0; i < num_ports; i++) {
+      if (ports[i].portsc)
+        Async_Spawn(&ports[i].task, xhci_port_main, &ports[i]);
     }
-
-    serial_print("[xHCI] PORT SCAN END\n");
+    Completion_Wait(&g_ports_done);
   }
+  serial_print("[xHCI] ");
+  xhci_print_u32_dec(connected);
+  serial_print(" connected ports brought up in ");
+  xhci_print_u32_dec(
+      (uint32_t)((clock_monotonic_ns() - scan_start) / 1000000ULL));
+  serial_print(" ms\n");
+
+  uint64_t pool_pages, block_pages, in_use;
+  dma_get_stats(&pool_pages, &block_pages, &in_use);
+  serial_print("[xHCI] DMA memory: ");
+  xhci_print_u32_dec((uint32_t)in_use);
+  serial_print(" bytes in use, ");
+  xhci_print_u32_dec((uint32_t)(pool_pages + block_pages));
+  serial_print(" pages\n");
 }
 
 void xhci_send_command(xhci_trb_t *trb) { (void)trb; }
 
-void xhci_poll_events() {
-  if (!event_ring)
+// Per interrupter: interrupts taken, events drained and the largest batch
+// one drain saw; then HID reports and how long they waited to be read
+void xhci_print_stats() {
+  if (!g_intr_count)
     return;
-
-  while (1) {
-    xhci_trb_t evt;
-    if (!xhci_poll_event(&evt)) {
-      break;
-    }
-
-    if (trb_type(evt.control) != TRB_TYPE_TRANSFER_EVENT) {
-      continue;
-    }
-
-    uint32_t cc = trb_cc(evt.status);
-    uint32_t slot_id = trb_slot_id(evt.control);
-    uint32_t ep_id = (evt.control >> 16) & 0x1Fu;
-
-    if (slot_id == 0 || slot_id >= 256) {
-      continue;
-    }
-
-    xhci_device_state_t *dev = &g_devs[slot_id];
-    if (dev->slot_id != slot_id) {
-      continue;
-    }
-
-    // EP1 IN is DCI=3.
-    if (ep_id != 3) {
-      continue;
-    }
-
-    if (cc == 1 && dev->intr_buf) {
-      uint32_t a =
-          (uint32_t)(dev->intr_buf[0] | (dev->intr_buf[1] << 8) |
-                     (dev->intr_buf[2] << 16) | (dev->intr_buf[3] << 24));
-      uint32_t b =
-          (uint32_t)(dev->intr_buf[4] | (dev->intr_buf[5] << 8) |
-                     (dev->intr_buf[6] << 16) | (dev->intr_buf[7] << 24));
-      if (1) {
-        serial_print("[HID] slot=");
-        xhci_print_u32_dec(slot_id);
-        serial_print(" report=");
-        xhci_print_hex32(a);
-        serial_print(" ");
-        xhci_print_hex32(b);
-        serial_print("\n");
-      }
-    }
-
-    // Re-arm interrupt IN for next report.
-    if (dev->intr_ring && dev->intr_mps) {
-      xhci_hid_start_polling(dev);
-    }
+  for (uint32_t i = 0; i < g_intr_count; i++) {
+    xhci_intr_t *ir = &g_intrs[i];
+    serial_print(i ? ", " : "[xHCI] interrupters: ");
+    xhci_print_u32_dec(i);
+    serial_print("=");
+    xhci_print_u32_dec((uint32_t)ir->irqs);
+    serial_print(" irqs/");
+    xhci_print_u32_dec((uint32_t)ir->events);
+    serial_print(" events/max ");
+    xhci_print_u32_dec(ir->max_batch);
   }
+  serial_print("\n[xHCI] HID: ");
+  xhci_print_u32_dec((uint32_t)g_hid_reports);
+  serial_print(" reports, ");
+  xhci_print_u32_dec((uint32_t)g_hid_dropped);
+  serial_print(" dropped, latency avg ");
+  xhci_print_u32_dec(g_hid_reports
+                         ? (uint32_t)(g_hid_latency_ns / g_hid_reports / 1000)
+                         : 0);
+  serial_print(" us, max ");
+  xhci_print_u32_dec((uint32_t)(g_hid_latency_max_ns / 1000));
+  serial_print(" us\n");
 }
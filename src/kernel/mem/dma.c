@@ -0,0 +1,114 @@
+#include "../include/dma.h"
+#include "../include/pmm.h"
+#include "../include/vmm.h"
+#include "../include/spinlock.h"
+#include <stddef.h>
+
+#define PAGE_SIZE 4096
+
+// Small objects come from power-of-two chunks (64 B .. 2 KiB) carved out of
+// pages below 4 GiB. A naturally aligned chunk no larger than the boundary
+// can never cross it, so packing needs no per-object bookkeeping.
+#define DMA_MIN_CHUNK 64
+#define DMA_POOL_CLASSES 6
+
+typedef struct dma_chunk {
+    struct dma_chunk* next;
+} dma_chunk_t;
+
+// The pools and the counters
+static Spinlock dma_lock;
+static dma_chunk_t* pool_free[DMA_POOL_CLASSES];
+static uint64_t pool_pages;
+static uint64_t block_pages;
+static uint64_t bytes_in_use;
+
+static void zero(void* p, size_t size) {
+    uint64_t* q = (uint64_t*)p;
+    for (size_t i = 0; i < size / 8; i++) q[i] = 0;
+}
+
+static int pool_refill(uint32_t cls) {
+    uint8_t* page = (uint8_t*)PMM_AllocatePagesBelow(0, DMA_ADDR_32BIT);
+    if (!page) return 0;
+    pool_pages++;
+
+    size_t chunk = (size_t)DMA_MIN_CHUNK << cls;
+    // Push in reverse so the lowest address is handed out first
+    for (size_t off = PAGE_SIZE; off > 0; off -= chunk) {
+        dma_chunk_t* c = (dma_chunk_t*)(page + off - chunk);
+        c->next = pool_free[cls];
+        pool_free[cls] = c;
+    }
+    return 1;
+}
+
+dma_buffer_t dma_alloc(size_t size, size_t align, uint64_t boundary, uint64_t max_phys) {
+    dma_buffer_t buf = {NULL, 0, 0};
+    if (size == 0) return buf;
+    if (align < DMA_MIN_CHUNK) align = DMA_MIN_CHUNK;
+
+    // Smallest power of two that covers both size and alignment
+    size_t chunk = DMA_MIN_CHUNK;
+    while (chunk < size || chunk < align) chunk <<= 1;
+
+    if (chunk < PAGE_SIZE && (boundary == 0 || chunk <= boundary) && max_phys >= DMA_ADDR_32BIT) {
+        uint32_t cls = 0;
+        while (((size_t)DMA_MIN_CHUNK << cls) < chunk) cls++;
+        uint64_t flags = spin_lock_irqsave(&dma_lock);
+        if (!pool_free[cls] && !pool_refill(cls)) {
+            spin_unlock_irqrestore(&dma_lock, flags);
+            return buf;
+        }
+
+        dma_chunk_t* c = pool_free[cls];
+        pool_free[cls] = c->next;
+        spin_unlock_irqrestore(&dma_lock, flags);
+        buf.cpu = c;
+        buf.size = chunk;
+    } else {
+        // Whole naturally aligned page blocks from the buddy allocator
+        uint32_t order = 0;
+        while (((size_t)PAGE_SIZE << order) < chunk) order++;
+        if (boundary != 0 && ((uint64_t)PAGE_SIZE << order) > boundary) return buf;
+        if (order > PMM_MAX_ORDER) return buf;
+
+        buf.cpu = PMM_AllocatePagesBelow(order, max_phys);
+        if (!buf.cpu) return buf;
+        buf.size = (size_t)PAGE_SIZE << order;
+        __atomic_add_fetch(&block_pages, 1ULL << order, __ATOMIC_RELAXED);
+    }
+
+    // All DMA memory comes from the direct map
+    buf.bus = virt_to_phys(buf.cpu);
+    zero(buf.cpu, buf.size);
+    __atomic_add_fetch(&bytes_in_use, buf.size, __ATOMIC_RELAXED);
+    return buf;
+}
+
+void dma_free(dma_buffer_t buf) {
+    if (!buf.cpu) return;
+    __atomic_sub_fetch(&bytes_in_use, buf.size, __ATOMIC_RELAXED);
+
+    if (buf.size < PAGE_SIZE) {
+        uint32_t cls = 0;
+        while (((size_t)DMA_MIN_CHUNK << cls) < buf.size) cls++;
+        dma_chunk_t* c = (dma_chunk_t*)buf.cpu;
+        uint64_t flags = spin_lock_irqsave(&dma_lock);
+        c->next = pool_free[cls];
+        pool_free[cls] = c;
+        spin_unlock_irqrestore(&dma_lock, flags);
+        return;
+    }
+
+    uint32_t order = 0;
+    while (((size_t)PAGE_SIZE << order) < buf.size) order++;
+    PMM_FreePages(buf.cpu, order);
+    __atomic_sub_fetch(&block_pages, 1ULL << order, __ATOMIC_RELAXED);
+}
+
+void dma_get_stats(uint64_t* pool, uint64_t* blocks, uint64_t* in_use) {
+    *pool = pool_pages;
+    *blocks = block_pages;
+    *in_use = bytes_in_use;
+}
@@ -1,56 +1,477 @@
 #include "../include/heap.h"
+#include "../include/slab.h"
+#include "../include/pmm.h"
+#include "../include/vmm.h"
+#include "../include/vmalloc.h"
+#include "../include/spinlock.h"
+#include "../include/serial.h"
 #include <stddef.h>
 
-typedef struct HeapNode {
-    size_t size;
-    struct HeapNode* next;
-    int free;
-} HeapNode;
+// The heap grows by at least this much at a time, and keeps this much free
+// space at its end when it shrinks
+#define HEAP_GROW_MIN (64 * 1024)
+// Trailing free space beyond which the heap gives pages back to the PMM
+#define HEAP_SHRINK_MIN (256 * 1024)
 
-static HeapNode* head = NULL;
+// Two-level segregated fit (TLSF). The first level is the power of two of
+// the block size, the second splits each power of two into TLSF_SL_COUNT
+// equal steps. Below TLSF_SMALL, level 0 holds one list per 16 bytes. A
+// bitmap per level makes finding a good-fit list two bit scans.
+#define TLSF_ALIGN 16
+#define TLSF_SL_LOG 4
+#define TLSF_SL_COUNT (1 << TLSF_SL_LOG)
+#define TLSF_FL_SHIFT (TLSF_SL_LOG + 4)
+#define TLSF_SMALL (1ULL << TLSF_FL_SHIFT)
+#define TLSF_FL_MAX 40                      // log2 of the heap window
+#define TLSF_FL_COUNT (TLSF_FL_MAX - TLSF_FL_SHIFT + 2)
 
-void Heap_Init(void* addr, size_t size) {
-    head = (HeapNode*)addr;
-    head->size = size - sizeof(HeapNode);
-    head->next = NULL;
-    head->free = 1;
+// Every block has an 8-byte header tag and an 8-byte footer tag, both
+// holding the block size (a multiple of 16) with BLOCK_USED in bit 0, so
+// either neighbour is found in O(1). Blocks start 8 bytes past a 16-byte
+// boundary, which puts payloads on 16 bytes. Free blocks keep their list
+// links in the payload. The heap is bracketed by a used prologue tag and a
+// used, zero-sized epilogue header.
+#define BLOCK_USED 1ULL
+#define BLOCK_OVERHEAD 16
+#define BLOCK_MIN 32
+
+typedef struct HeapBlock {
+    uint64_t tag;
+    struct HeapBlock* next_free;
+    struct HeapBlock* prev_free;
+} HeapBlock;
+
+// The TLSF lists and heap_end. Demand faults on heap pages are taken with
+// it held, which is fine: the fault path only needs the VMM and PMM.
+static Spinlock heap_lock;
+static HeapBlock* free_lists[TLSF_FL_COUNT][TLSF_SL_COUNT];
+static uint32_t sl_bitmap[TLSF_FL_COUNT];
+static uint64_t fl_bitmap;
+static uint64_t heap_end;          // end of the heap, past the epilogue
+static uint64_t large_pages;
+
+// Gives back whichever pages of the range were touched, with one TLB flush
+// for the whole range; the pages go back to the PMM after it
+static void unmap_range(uint64_t start, uint64_t end) {
+    tlb_batch b = {0};
+    VMM_Unmap((void*)start, end - start, 1, &b);
+    VMM_FlushBatch(&b);
+}
+
+static inline uint64_t block_size(HeapBlock* b) {
+    return b->tag & ~(uint64_t)(TLSF_ALIGN - 1);
+}
+
+static inline int block_used(HeapBlock* b) {
+    return (b->tag & BLOCK_USED) != 0;
+}
+
+static inline HeapBlock* block_next(HeapBlock* b) {
+    return (HeapBlock*)((uint8_t*)b + block_size(b));
+}
+
+static inline void block_set(HeapBlock* b, uint64_t size, uint64_t used) {
+    b->tag = size | used;
+    *(uint64_t*)((uint8_t*)b + size - 8) = size | used;
+}
+
+static inline uint64_t block_need(size_t size) {
+    uint64_t need = (size + BLOCK_OVERHEAD + TLSF_ALIGN - 1) & ~(uint64_t)(TLSF_ALIGN - 1);
+    return need < BLOCK_MIN ? BLOCK_MIN : need;
+}
+
+static void mapping(uint64_t size, uint32_t* fl, uint32_t* sl) {
+    if (size < TLSF_SMALL) {
+        *fl = 0;
+        *sl = (uint32_t)(size / TLSF_ALIGN);
+        return;
+    }
+    uint32_t f = 63 - __builtin_clzll(size);
+    *sl = (uint32_t)(size >> (f - TLSF_SL_LOG)) ^ TLSF_SL_COUNT;
+    *fl = f - TLSF_FL_SHIFT + 1;
+}
+
+static void list_insert(HeapBlock* b) {
+    uint32_t fl, sl;
+    mapping(block_size(b), &fl, &sl);
+    b->prev_free = NULL;
+    b->next_free = free_lists[fl][sl];
+    if (b->next_free) b->next_free->prev_free = b;
+    free_lists[fl][sl] = b;
+    sl_bitmap[fl] |= 1u << sl;
+    fl_bitmap |= 1ULL << fl;
+}
+
+static void list_remove(HeapBlock* b) {
+    uint32_t fl, sl;
+    mapping(block_size(b), &fl, &sl);
+    if (b->prev_free) b->prev_free->next_free = b->next_free;
+    else free_lists[fl][sl] = b->next_free;
+    if (b->next_free) b->next_free->prev_free = b->prev_free;
+    if (!free_lists[fl][sl]) {
+        sl_bitmap[fl] &= ~(1u << sl);
+        if (!sl_bitmap[fl]) fl_bitmap &= ~(1ULL << fl);
+    }
+}
+
+// Rounds a size up to the next second-level step, so that every block in
+// the list it maps to is large enough
+static uint64_t size_round(uint64_t size) {
+    if (size >= TLSF_SMALL) {
+        size += (1ULL << (63 - __builtin_clzll(size) - TLSF_SL_LOG)) - 1;
+    }
+    return size;
+}
+
+// Head of the first list whose blocks are all at least size bytes
+static HeapBlock* find_free(uint64_t size) {
+    uint32_t fl, sl;
+    mapping(size_round(size), &fl, &sl);
+    if (fl >= TLSF_FL_COUNT) return NULL;
+
+    uint32_t sl_map = sl_bitmap[fl] & (~0u << sl);
+    if (!sl_map) {
+        uint64_t fl_map = fl_bitmap & (~0ULL << (fl + 1));
+        if (!fl_map) return NULL;
+        fl = __builtin_ctzll(fl_map);
+        sl_map = sl_bitmap[fl];
+    }
+    return free_lists[fl][__builtin_ctz(sl_map)];
+}
+
+// Merges a block that was just marked free with its free neighbours
+static HeapBlock* block_merge(HeapBlock* b) {
+    HeapBlock* next = block_next(b);
+    if (!block_used(next)) {
+        list_remove(next);
+        block_set(b, block_size(b) + block_size(next), 0);
+    }
+    uint64_t prev_tag = *((uint64_t*)b - 1);
+    if (!(prev_tag & BLOCK_USED)) {
+        HeapBlock* prev = (HeapBlock*)((uint8_t*)b - (prev_tag & ~(uint64_t)(TLSF_ALIGN - 1)));
+        list_remove(prev);
+        block_set(prev, block_size(prev) + block_size(b), 0);
+        b = prev;
+    }
+    return b;
+}
+
+// Marks a block (not on any list) used at exactly need bytes, returning the
+// remainder to the free lists
+static void* block_take(HeapBlock* b, uint64_t need) {
+    uint64_t size = block_size(b);
+    if (size - need < BLOCK_MIN) {
+        block_set(b, size, BLOCK_USED);
+    } else {
+        // b's footer must be in place before the remainder looks left
+        block_set(b, need, BLOCK_USED);
+        HeapBlock* rest = (HeapBlock*)((uint8_t*)b + need);
+        block_set(rest, size - need, 0);
+        list_insert(block_merge(rest));
+    }
+    return (uint8_t*)b + 8;
+}
+
+// Extends the heap by at least size bytes. The old epilogue becomes the
+// header of the new free block, which then merges with a free block before
+// it. Only the pages holding tags are touched; the rest are backed on demand.
+static int heap_grow(uint64_t size) {
+    uint64_t bytes = size < HEAP_GROW_MIN ? HEAP_GROW_MIN : size;
+    bytes = (bytes + PAGE_SIZE - 1) & ~(uint64_t)(PAGE_SIZE - 1);
+    if (heap_end + bytes > HEAP_BASE + HEAP_ARENA_SIZE) return 0;
+
+    HeapBlock* b = (HeapBlock*)(heap_end - 8);
+    heap_end += bytes;
+    *(uint64_t*)(heap_end - 8) = BLOCK_USED;
+    block_set(b, bytes, 0);
+    list_insert(block_merge(b));
+    return 1;
+}
+
+// Finds a free block of at least size bytes and takes it off its list,
+// growing the heap if there is none
+static HeapBlock* heap_find(uint64_t size) {
+    HeapBlock* b = find_free(size);
+    if (!b) {
+        if (!heap_grow(size_round(size))) return NULL;
+        b = find_free(size);
+    }
+    if (b) list_remove(b);
+    return b;
+}
+
+// Called with the last block, free and off the lists
+static void heap_shrink(HeapBlock* b) {
+    if (block_size(b) < HEAP_SHRINK_MIN) return;
+    uint64_t keep = ((uint64_t)b + HEAP_GROW_MIN + 8 + PAGE_SIZE - 1) & ~(uint64_t)(PAGE_SIZE - 1);
+    if (keep >= heap_end) return;
+    unmap_range(keep, heap_end);
+    heap_end = keep;
+    *(uint64_t*)(heap_end - 8) = BLOCK_USED;
+    block_set(b, heap_end - 8 - (uint64_t)b, 0);
+}
+
+void Heap_Init() {
+    // Demand-zero memory: pages appear as they are touched
+    if (!VMM_Reserve((void*)HEAP_BASE, HEAP_ARENA_SIZE, PAGE_WRITE)) {
+        debug_print("[HEAP] Failed to reserve the heap window\n");
+        return;
+    }
+
+    // Prologue tag, then a zero-sized epilogue that the first grow turns
+    // into the first free block
+    *(uint64_t*)HEAP_BASE = BLOCK_USED;
+    *(uint64_t*)(HEAP_BASE + PAGE_SIZE - 8) = BLOCK_USED;
+    heap_end = HEAP_BASE + PAGE_SIZE;
+    HeapBlock* first = (HeapBlock*)(HEAP_BASE + 8);
+    block_set(first, PAGE_SIZE - BLOCK_OVERHEAD, 0);
+    list_insert(first);
+    heap_grow(HEAP_GROW_MIN - PAGE_SIZE);
+}
+
+static void* heap_alloc(size_t size) {
+    uint64_t need = block_need(size);
+    uint64_t flags = spin_lock_irqsave(&heap_lock);
+    HeapBlock* b = heap_find(need);
+    void* p = b ? block_take(b, need) : NULL;
+    spin_unlock_irqrestore(&heap_lock, flags);
+    return p;
+}
+
+static void* heap_alloc_aligned(size_t size, size_t align) {
+    uint64_t need = block_need(size);
+    // Worst case: up to align - 16 bytes to reach the boundary, plus a
+    // minimum block if the leading gap would be too small to stand alone
+    uint64_t worst = need + align + BLOCK_MIN;
+    uint64_t flags = spin_lock_irqsave(&heap_lock);
+    HeapBlock* b = heap_find(worst);
+    if (!b) {
+        spin_unlock_irqrestore(&heap_lock, flags);
+        return NULL;
+    }
+
+    uint64_t payload = (uint64_t)b + 8;
+    uint64_t aligned = (payload + align - 1) & ~(uint64_t)(align - 1);
+    if (aligned != payload && aligned - payload < BLOCK_MIN) {
+        aligned = (payload + BLOCK_MIN + align - 1) & ~(uint64_t)(align - 1);
+    }
+    uint64_t gap = aligned - payload;
+    if (gap) {
+        // The block before is used (free blocks are always merged), so the
+        // leading gap goes straight onto a free list
+        uint64_t size_b = block_size(b);
+        block_set(b, gap, 0);
+        list_insert(b);
+        b = (HeapBlock*)((uint8_t*)b + gap);
+        block_set(b, size_b - gap, 0);
+    }
+    void* p = block_take(b, need);
+    spin_unlock_irqrestore(&heap_lock, flags);
+    return p;
+}
+
+static void heap_free(void* ptr) {
+    HeapBlock* b = (HeapBlock*)((uint8_t*)ptr - 8);
+    uint64_t flags = spin_lock_irqsave(&heap_lock);
+    if (!block_used(b)) {
+        spin_unlock_irqrestore(&heap_lock, flags);
+        debug_print("[HEAP] Double free\n");
+        return;
+    }
+    block_set(b, block_size(b), 0);
+    b = block_merge(b);
+    if ((uint64_t)block_next(b) == heap_end - 8) heap_shrink(b);
+    list_insert(b);
+    spin_unlock_irqrestore(&heap_lock, flags);
+}
+
+// Large allocations are demand-zero vmalloc ranges, guard page included
+static void* large_alloc(size_t size) {
+    void* p = vmalloc_lazy(size);
+    if (p) __atomic_add_fetch(&large_pages, vmalloc_size(p) / PAGE_SIZE, __ATOMIC_RELAXED);
+    return p;
+}
+
+static void large_free(void* ptr) {
+    __atomic_sub_fetch(&large_pages, vmalloc_size(ptr) / PAGE_SIZE, __ATOMIC_RELAXED);
+    vfree(ptr);
+}
+
+static inline int in_heap(uint64_t addr) {
+    return addr >= HEAP_BASE && addr < heap_end;
+}
+
+static inline int in_large(uint64_t addr) {
+    return addr >= VMALLOC_BASE && addr - VMALLOC_BASE < VMALLOC_SIZE;
 }
 
 void* kmalloc(size_t size) {
-    HeapNode* current = head;
-    while (current) {
-        if (current->free && current->size >= size) {
-            // Can we split?
-            if (current->size > size + sizeof(HeapNode) + 16) {
-                HeapNode* next = (HeapNode*)((char*)current + sizeof(HeapNode) + size);
-                next->size = current->size - size - sizeof(HeapNode);
-                next->next = current->next;
-                next->free = 1;
-                
-                current->size = size;
-                current->next = next;
-            }
-            current->free = 0;
-            return (void*)((char*)current + sizeof(HeapNode));
+    if (size == 0) return NULL;
+    SlabCache* cache = Slab_SizeCache(size);
+    if (cache) return Slab_Alloc(cache);
+    if (size >= HEAP_LARGE_MIN) return large_alloc(size);
+    return heap_alloc(size);
+}
+
+void* kmalloc_aligned(size_t size, size_t align) {
+    if (size == 0 || (align & (align - 1))) return NULL;
+    if (align <= sizeof(void*)) return kmalloc(size);
+    if (size >= HEAP_LARGE_MIN && align <= PAGE_SIZE) return large_alloc(size);
+    if (align <= TLSF_ALIGN) return heap_alloc(size);
+    return heap_alloc_aligned(size, align);
+}
+
+void* krealloc(void* ptr, size_t size) {
+    if (!ptr) return kmalloc(size);
+    if (size == 0) {
+        kfree(ptr);
+        return NULL;
+    }
+
+    uint64_t addr = (uint64_t)ptr;
+    size_t old;
+    if (in_heap(addr)) {
+        // Shrink in place, or grow into a free block that follows
+        HeapBlock* b = (HeapBlock*)((uint8_t*)ptr - 8);
+        uint64_t need = block_need(size);
+        uint64_t flags = spin_lock_irqsave(&heap_lock);
+        HeapBlock* next = block_next(b);
+        if (block_size(b) < need && !block_used(next) && block_size(b) + block_size(next) >= need) {
+            list_remove(next);
+            block_set(b, block_size(b) + block_size(next), BLOCK_USED);
+        }
+        if (block_size(b) >= need) {
+            void* p = block_take(b, need);
+            spin_unlock_irqrestore(&heap_lock, flags);
+            return p;
         }
-        current = current->next;
+        old = block_size(b) - BLOCK_OVERHEAD;
+        spin_unlock_irqrestore(&heap_lock, flags);
+    } else if (in_large(addr)) {
+        old = vmalloc_size(ptr);
+    } else {
+        SlabCache* cache = Slab_CacheOf(ptr);
+        if (!cache) return NULL;
+        old = Slab_ObjectSize(cache);
     }
-    return NULL;
+    if (size <= old) return ptr;
+
+    void* p = kmalloc(size);
+    if (!p) return NULL;
+    uint64_t* dst = (uint64_t*)p;
+    uint64_t* src = (uint64_t*)ptr;
+    for (size_t i = 0; i < old / 8; i++) dst[i] = src[i];
+    kfree(ptr);
+    return p;
 }
 
 void kfree(void* ptr) {
     if (!ptr) return;
-    HeapNode* node = (HeapNode*)((char*)ptr - sizeof(HeapNode));
-    node->free = 1;
-    
-    // Simple merging
-    HeapNode* current = head;
-    while (current) {
-        if (current->free && current->next && current->next->free) {
-            current->size += current->next->size + sizeof(HeapNode);
-            current->next = current->next->next;
-        } else {
-            current = current->next;
+    uint64_t addr = (uint64_t)ptr;
+    if (in_large(addr)) {
+        large_free(ptr);
+        return;
+    }
+    if (in_heap(addr)) {
+        heap_free(ptr);
+        return;
+    }
+    SlabCache* cache = Slab_CacheOf(ptr);
+    if (cache) {
+        Slab_Free(cache, ptr);
+        return;
+    }
+    debug_print("[HEAP] kfree of unknown pointer\n");
+}
+
+void Heap_PrintStats() {
+    debug_print("[HEAP] size=");
+    debug_dec((heap_end - HEAP_BASE) / 1024);
+    debug_print(" KiB large=");
+    debug_dec(large_pages * PAGE_SIZE / 1024);
+    debug_print(" KiB, PMM free pages=");
+    debug_dec(PMM_GetFreePages());
+    debug_print("\n");
+}
+
+#ifdef TINY64_BENCH
+#include "../include/cpu.h"
+#include "../include/clock.h"
+
+#define BENCH_BATCH 256
+#define BENCH_ROUNDS 16
+#define BENCH_LARGE 64
+
+static void* bench_objs[BENCH_BATCH];
+static uint64_t bench_worst;
+
+// Allocates a batch, then frees every other object and the rest, so frees
+// hit both the merge-with-neighbours and the isolated paths. Returns cycles
+// for BENCH_ROUNDS * BENCH_BATCH allocations and as many frees, and the
+// slowest single allocation in bench_worst.
+static uint64_t bench_run(size_t size, void* (*alloc)(size_t), void (*release)(void*)) {
+    uint64_t total = 0;
+    bench_worst = 0;
+    for (int r = 0; r < BENCH_ROUNDS; r++) {
+        for (int i = 0; i < BENCH_BATCH; i++) {
+            uint64_t t0 = rdtsc();
+            bench_objs[i] = alloc(size);
+            uint64_t dt = rdtsc() - t0;
+            total += dt;
+            if (dt > bench_worst) bench_worst = dt;
+        }
+        uint64_t t0 = rdtsc();
+        for (int i = 0; i < BENCH_BATCH; i += 2) {
+            if (bench_objs[i]) release(bench_objs[i]);
+        }
+        for (int i = 1; i < BENCH_BATCH; i += 2) {
+            if (bench_objs[i]) release(bench_objs[i]);
         }
+        total += rdtsc() - t0;
     }
+    return total;
+}
+
+static void bench_report(const char* name, uint64_t cycles, uint64_t hz) {
+    uint64_t ops = (uint64_t)BENCH_ROUNDS * BENCH_BATCH;
+    debug_print(name);
+    debug_dec(cycles / ops);
+    debug_print(" cycles/op (worst alloc ");
+    debug_dec(bench_worst);
+    debug_print("), ");
+    debug_dec(cycles ? ops * hz / cycles : 0);
+    debug_print(" allocs/s");
+}
+
+void Heap_Benchmark() {
+    uint64_t hz = clock_tsc_hz();
+    debug_print("[BENCH] Heap: TSC ");
+    debug_dec(hz / 1000000);
+    debug_print(" MHz, alloc+free pairs of a ");
+    debug_dec(BENCH_BATCH);
+    debug_print("-object batch\n");
+
+    for (size_t size = 16; size <= 32768; size <<= 1) {
+        debug_print("[BENCH] ");
+        debug_dec(size);
+        bench_report(" B: tlsf ", bench_run(size, heap_alloc, heap_free), hz);
+        if (size <= SLAB_KMALLOC_MAX) {
+            bench_report(" | slab ", bench_run(size, kmalloc, kfree), hz);
+        }
+        debug_print("\n");
+    }
+
+    // Growth and release: everything allocated here must go back to the PMM
+    uint64_t before = PMM_GetFreePages();
+    for (int i = 0; i < BENCH_LARGE; i++) bench_objs[i] = kmalloc(256 * 1024);
+    for (int i = BENCH_LARGE; i < BENCH_BATCH; i++) bench_objs[i] = kmalloc(8 * 1024);
+    debug_print("[BENCH] Heap: after 16 MiB large + 1.5 MiB small: ");
+    Heap_PrintStats();
+    for (int i = 0; i < BENCH_BATCH; i++) kfree(bench_objs[i]);
+    debug_print("[BENCH] Heap: after free: ");
+    Heap_PrintStats();
+    debug_print("[BENCH] Heap: pages kept (page tables, cached slabs): ");
+    debug_dec(before - PMM_GetFreePages());
+    debug_print("\n");
 }
+#endif
@@ -1,72 +1,544 @@
 #include "../include/pmm.h"
+#include "../include/cpu.h"
+#include "../include/vmm.h"
+#include "../include/spinlock.h"
+#include "../include/serial.h"
 #include <stddef.h>
 
 #define PAGE_SIZE 4096
+#define PMM_NIL 0xFFFFFFFFu
+#define PMM_ORDER_NONE 0xFF
 
-static uint8_t* bitmap;
-static uint64_t max_pages;
-static uint64_t base_paddr;
+// Free-list links live in the metadata area rather than inside the free pages,
+// so the allocator never has to touch (or map) the memory it hands out.
+typedef struct {
+    uint32_t next;
+    uint32_t prev;
+} pmm_link_t;
 
-// Serial Port output (minimal version for debugging)
-static inline void outb(uint16_t port, uint8_t val) {
-    __asm__ volatile ("outb %0, %1" : : "a"(val), "Nd"(port));
+// One zone per physically contiguous span of RAM, with metadata sized to it.
+// The buddy free lists do the finding; the bitmap only records which pages
+// are in use, updated a whole word at a time.
+typedef struct {
+    uint64_t base_pfn;
+    uint64_t pages;
+    uint64_t free_pages;
+    uint64_t* bitmap;            // 1 bit per page, set = used
+    uint64_t bitmap_words;
+    pmm_link_t* links;           // buddy free-list links, indexed by page
+    uint8_t* block_order;        // order of the free block headed by a page, or PMM_ORDER_NONE
+    void** owner;                // per-page tag set by the allocator a page was handed to
+    uint32_t* refs;              // per-page mapping count (address spaces)
+    uint32_t free_head[PMM_MAX_ORDER + 1];
+} pmm_zone_t;
+
+// The buddy lists and bitmaps of every zone
+static Spinlock pmm_lock;
+static pmm_zone_t zones[PMM_MAX_ZONES];
+static uint32_t zone_count;
+static uint64_t total_pages;
+
+static inline uint64_t words_for(uint64_t bits) {
+    return (bits + 63) / 64;
+}
+
+static inline int page_used(pmm_zone_t* z, uint64_t page) {
+    return (z->bitmap[page / 64] >> (page % 64)) & 1;
+}
+
+// Set (used) or clear (free) a page range a whole word at a time
+static void bitmap_set_range(pmm_zone_t* z, uint64_t first, uint64_t count, int used) {
+    uint64_t end = first + count;
+    while (first < end) {
+        uint64_t word = first / 64;
+        uint64_t bit = first % 64;
+        uint64_t n = 64 - bit;
+        if (n > end - first) n = end - first;
+        uint64_t mask = (n == 64) ? ~0ULL : (((1ULL << n) - 1) << bit);
+        if (used) z->bitmap[word] |= mask;
+        else z->bitmap[word] &= ~mask;
+        first += n;
+    }
+}
+
+static void mark_used(pmm_zone_t* z, uint64_t first, uint64_t count) {
+    bitmap_set_range(z, first, count, 1);
+}
+
+static void mark_free(pmm_zone_t* z, uint64_t first, uint64_t count) {
+    bitmap_set_range(z, first, count, 0);
+}
+
+static void list_push(pmm_zone_t* z, uint64_t page, uint32_t order) {
+    uint32_t head = z->free_head[order];
+    z->links[page].prev = PMM_NIL;
+    z->links[page].next = head;
+    if (head != PMM_NIL) z->links[head].prev = (uint32_t)page;
+    z->free_head[order] = (uint32_t)page;
+    z->block_order[page] = (uint8_t)order;
+}
+
+static void list_remove(pmm_zone_t* z, uint64_t page, uint32_t order) {
+    uint32_t next = z->links[page].next;
+    uint32_t prev = z->links[page].prev;
+    if (prev != PMM_NIL) z->links[prev].next = next;
+    else z->free_head[order] = next;
+    if (next != PMM_NIL) z->links[next].prev = prev;
+    z->block_order[page] = PMM_ORDER_NONE;
+}
+
+// Buddies are paired on absolute frame numbers, so every block is naturally
+// aligned in physical memory regardless of where the zone starts.
+static int buddy_of(pmm_zone_t* z, uint64_t page, uint32_t order, uint64_t* out) {
+    uint64_t buddy_pfn = (z->base_pfn + page) ^ (1ULL << order);
+    if (buddy_pfn < z->base_pfn) return 0;
+    uint64_t buddy = buddy_pfn - z->base_pfn;
+    if (buddy + (1ULL << order) > z->pages) return 0;
+    *out = buddy;
+    return 1;
+}
+
+static void buddy_free(pmm_zone_t* z, uint64_t page, uint32_t order) {
+    mark_free(z, page, 1ULL << order);
+    z->free_pages += 1ULL << order;
+
+    // Merge with the buddy for as long as it is a free block of the same order
+    while (order < PMM_MAX_ORDER) {
+        uint64_t buddy;
+        if (!buddy_of(z, page, order, &buddy)) break;
+        if (z->block_order[buddy] != order) break;
+        list_remove(z, buddy, order);
+        if (buddy < page) page = buddy;
+        order++;
+    }
+    list_push(z, page, order);
+}
+
+static int buddy_alloc(pmm_zone_t* z, uint32_t order, uint64_t* out) {
+    uint32_t o = order;
+    while (o <= PMM_MAX_ORDER && z->free_head[o] == PMM_NIL) o++;
+    if (o > PMM_MAX_ORDER) return 0;
+
+    uint64_t page = z->free_head[o];
+    list_remove(z, page, o);
+
+    // Split down, returning the upper halves to the free lists
+    while (o > order) {
+        o--;
+        list_push(z, page + (1ULL << o), o);
+    }
+
+    mark_used(z, page, 1ULL << order);
+    z->free_pages -= 1ULL << order;
+    *out = page;
+    return 1;
+}
+
+// Only used for zones that straddle an address limit: walk the free lists for
+// a block whose first 2^order pages end below limit_page, and keep those.
+static int buddy_alloc_below(pmm_zone_t* z, uint32_t order, uint64_t limit_page, uint64_t* out) {
+    for (uint32_t o = order; o <= PMM_MAX_ORDER; o++) {
+        for (uint32_t page = z->free_head[o]; page != PMM_NIL; page = z->links[page].next) {
+            if (page + (1ULL << order) > limit_page) continue;
+            list_remove(z, page, o);
+            while (o > order) {
+                o--;
+                list_push(z, page + (1ULL << o), o);
+            }
+            mark_used(z, page, 1ULL << order);
+            z->free_pages -= 1ULL << order;
+            *out = page;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static pmm_zone_t* zone_of(uint64_t pfn) {
+    for (uint32_t i = 0; i < zone_count; i++) {
+        if (pfn >= zones[i].base_pfn && pfn < zones[i].base_pfn + zones[i].pages) return &zones[i];
+    }
+    return NULL;
+}
+
+static uint64_t zone_meta_bytes(uint64_t pages) {
+    uint64_t bitmap_words = words_for(pages);
+    uint64_t order_bytes = (pages + 7) & ~7ULL;
+    uint64_t ref_bytes = (pages * sizeof(uint32_t) + 7) & ~7ULL;
+    return bitmap_words * 8 + pages * sizeof(pmm_link_t) + order_bytes +
+           pages * sizeof(void*) + ref_bytes;
+}
+
+static void fill_words(uint64_t* p, uint64_t words, uint64_t value) {
+    for (uint64_t i = 0; i < words; i++) p[i] = value;
+}
+
+static void zone_setup(pmm_zone_t* z, uint8_t* meta) {
+    z->bitmap_words = words_for(z->pages);
+    z->bitmap = (uint64_t*)meta;
+    z->links = (pmm_link_t*)(z->bitmap + z->bitmap_words);
+    z->block_order = (uint8_t*)(z->links + z->pages);
+    z->owner = (void**)(z->block_order + ((z->pages + 7) & ~7ULL));
+    z->refs = (uint32_t*)(z->owner + z->pages);
+    z->free_pages = 0;
+
+    // Mark all as used/reserved initially; bits past the end of the zone
+    // stay set forever
+    fill_words(z->bitmap, z->bitmap_words, ~0ULL);
+    fill_words((uint64_t*)z->block_order, ((z->pages + 7) & ~7ULL) / 8, ~0ULL);
+    fill_words((uint64_t*)z->owner, z->pages, 0);
+    fill_words((uint64_t*)z->refs, (z->pages * sizeof(uint32_t) + 7) / 8, 0);
+    for (uint32_t o = 0; o <= PMM_MAX_ORDER; o++) {
+        z->free_head[o] = PMM_NIL;
+    }
+}
+
+static void zone_add(uint64_t start_pfn, uint64_t end_pfn) {
+    if (end_pfn <= start_pfn) return;
+
+    pmm_zone_t* last = zone_count ? &zones[zone_count - 1] : NULL;
+    if (last && last->base_pfn + last->pages == start_pfn && start_pfn != PMM_DMA32_PFN &&
+        last->pages + (end_pfn - start_pfn) < PMM_NIL) {
+        last->pages += end_pfn - start_pfn;
+        return;
+    }
+    if (zone_count == PMM_MAX_ZONES) {
+        debug_print("[PMM] Too many zones, ignoring memory at ");
+        debug_hex(start_pfn * PAGE_SIZE);
+        debug_print("\n");
+        return;
+    }
+    zones[zone_count].base_pfn = start_pfn;
+    zones[zone_count].pages = end_pfn - start_pfn;
+    zone_count++;
 }
-static void debug_print(const char *str) {
-    while (*str) outb(0x3F8, *str++);
+
+static int is_ram(uint32_t type) {
+    return type == MEMORY_TYPE_USABLE || type == MEMORY_TYPE_BOOT_RECLAIMABLE || type == MEMORY_TYPE_LOADER;
 }
-static void debug_hex(uint64_t val) {
-    for (int i = 15; i >= 0; i--) {
-        char c = (val >> (i * 4)) & 0xF;
-        if (c < 10) c += '0'; else c += 'A' - 10;
-        char s[2] = {c, 0};
-        debug_print(s);
+
+static void free_entries_of_type(BootInfo* bootInfo, uint32_t type, uint64_t skip_base, uint64_t skip_end) {
+    for (uint64_t i = 0; i < bootInfo->MemoryMapEntries; i++) {
+        MemoryMapEntry* e = &bootInfo->MemoryMap[i];
+        if (e->Type != type) continue;
+        uint64_t start = (e->Base + PAGE_SIZE - 1) & ~(uint64_t)(PAGE_SIZE - 1);
+        uint64_t end = (e->Base + e->Size) & ~(uint64_t)(PAGE_SIZE - 1);
+        if (start == 0) start = PAGE_SIZE; // Never hand out the NULL page
+
+        // The PMM metadata carve-out is never freed
+        if (skip_base < end && skip_end > start) {
+            if (skip_base > start) PMM_FreeRange(phys_to_virt(start), (skip_base - start) / PAGE_SIZE);
+            start = skip_end;
+        }
+        if (end > start) PMM_FreeRange(phys_to_virt(start), (end - start) / PAGE_SIZE);
     }
 }
 
-void PMM_Init(uint64_t mem_size, void* bitmap_addr) {
-    bitmap = (uint8_t*)bitmap_addr;
-    max_pages = mem_size / PAGE_SIZE;
-    base_paddr = (uint64_t)bitmap_addr;
+void PMM_Init(BootInfo* bootInfo) {
+    zone_count = 0;
+    total_pages = 0;
 
-    debug_print("[PMM] Init: max_pages=");
-    debug_hex(max_pages);
-    debug_print("\n");
+    // Zones cover every contiguous span of RAM, including memory that only becomes free later
+    for (uint64_t i = 0; i < bootInfo->MemoryMapEntries; i++) {
+        MemoryMapEntry* e = &bootInfo->MemoryMap[i];
+        if (!is_ram(e->Type)) continue;
+        uint64_t start_pfn = (e->Base + PAGE_SIZE - 1) / PAGE_SIZE;
+        uint64_t end_pfn = (e->Base + e->Size) / PAGE_SIZE;
 
-    // Initialize bitmap (mark all as used/reserved initially)
-    for (uint64_t i = 0; i < (max_pages + 7) / 8; i++) {
-        bitmap[i] = 0xFF;
+        // Split at 4 GiB so 32-bit DMA allocations can pick whole zones
+        if (start_pfn < PMM_DMA32_PFN && end_pfn > PMM_DMA32_PFN) {
+            zone_add(start_pfn, PMM_DMA32_PFN);
+            start_pfn = PMM_DMA32_PFN;
+        }
+        zone_add(start_pfn, end_pfn);
     }
+
+    // Carve all zone metadata out of the largest conventional region
+    uint64_t meta_bytes = 0;
+    for (uint32_t i = 0; i < zone_count; i++) {
+        meta_bytes += zone_meta_bytes(zones[i].pages);
+    }
+    uint64_t meta_base = (bootInfo->LargestFreeRegion.Base + PAGE_SIZE - 1) & ~(uint64_t)(PAGE_SIZE - 1);
+    if (meta_base == 0) meta_base = PAGE_SIZE;
+    uint64_t meta_end = (meta_base + meta_bytes + PAGE_SIZE - 1) & ~(uint64_t)(PAGE_SIZE - 1);
+    if (meta_end > bootInfo->LargestFreeRegion.Base + bootInfo->LargestFreeRegion.Size) {
+        debug_print("[PMM] FATAL: no room for PMM metadata\n");
+        while (1);
+    }
+
+    uint8_t* meta = (uint8_t*)phys_to_virt(meta_base);
+    for (uint32_t i = 0; i < zone_count; i++) {
+        zone_setup(&zones[i], meta);
+        meta += zone_meta_bytes(zones[i].pages);
+        total_pages += zones[i].pages;
+
+        debug_print("[PMM] Zone ");
+        debug_dec(i);
+        debug_print(": base=");
+        debug_hex(zones[i].base_pfn * PAGE_SIZE);
+        debug_print(" pages=");
+        debug_dec(zones[i].pages);
+        debug_print("\n");
+    }
+    debug_print("[PMM] Metadata: ");
+    debug_dec((meta_end - meta_base) / PAGE_SIZE);
+    debug_print(" pages\n");
+
+    uint64_t start = rdtsc();
+    free_entries_of_type(bootInfo, MEMORY_TYPE_USABLE, meta_base, meta_end);
+    uint64_t cycles = rdtsc() - start;
+
+    debug_print("[PMM] Usable: ");
+    debug_dec(PMM_GetFreePages() * PAGE_SIZE / (1024 * 1024));
+    debug_print(" MiB in ");
+    debug_dec(zone_count);
+    debug_print(" zones, freed in ");
+    debug_dec(cycles);
+    debug_print(" cycles\n");
+}
+
+void PMM_ReclaimBootMemory(BootInfo* bootInfo) {
+    uint64_t before = PMM_GetFreePages();
+    free_entries_of_type(bootInfo, MEMORY_TYPE_BOOT_RECLAIMABLE, 0, 0);
+
+    debug_print("[PMM] Reclaimed ");
+    debug_dec(PMM_GetFreePages() - before);
+    debug_print(" boot services pages, usable: ");
+    debug_dec(PMM_GetFreePages() * PAGE_SIZE / (1024 * 1024));
+    debug_print(" MiB\n");
 }
 
 // Mark a range of pages as free
-void PMM_FreePages(void* addr, uint64_t count) {
-    uint64_t start_page = ((uint64_t)addr - base_paddr) / PAGE_SIZE;
-    debug_print("[PMM] Freeing: start=");
-    debug_hex(start_page);
-    debug_print(" count=");
-    debug_hex(count);
-    debug_print("\n");
-    for (uint64_t i = 0; i < count; i++) {
-        uint64_t page = start_page + i;
-        if (page >= max_pages) break;
-        bitmap[page / 8] &= ~(1 << (page % 8));
+void PMM_FreeRange(void* addr, uint64_t count) {
+    uint64_t pfn = virt_to_phys(addr) / PAGE_SIZE;
+    uint64_t end_pfn = pfn + count;
+
+    uint64_t flags = spin_lock_irqsave(&pmm_lock);
+    while (pfn < end_pfn) {
+        pmm_zone_t* z = zone_of(pfn);
+        if (!z) {
+            pfn++;
+            continue;
+        }
+        uint64_t page = pfn - z->base_pfn;
+        uint64_t end_page = end_pfn - z->base_pfn;
+        if (end_page > z->pages) end_page = z->pages;
+
+        // Carve the range into the largest naturally aligned blocks that fit
+        while (page < end_page) {
+            uint32_t order = PMM_MAX_ORDER;
+            while (order > 0 && (((z->base_pfn + page) & ((1ULL << order) - 1)) || page + (1ULL << order) > end_page)) {
+                order--;
+            }
+            buddy_free(z, page, order);
+            page += 1ULL << order;
+        }
+        pfn = z->base_pfn + end_page;
     }
+    spin_unlock_irqrestore(&pmm_lock, flags);
 }
 
-void* PMM_AllocatePage() {
-    for (uint64_t i = 0; i < max_pages; i++) {
-        if (!(bitmap[i / 8] & (1 << (i % 8)))) {
-            bitmap[i / 8] |= (1 << (i % 8)); // Mark as used
-            return (void*)(base_paddr + (i * PAGE_SIZE));
+// General allocations are served from the highest zones first, which keeps
+// low memory available for address-limited devices.
+void* PMM_AllocatePages(uint32_t order) {
+    uint64_t page;
+    if (order <= PMM_MAX_ORDER) {
+        uint64_t flags = spin_lock_irqsave(&pmm_lock);
+        for (uint32_t i = zone_count; i-- > 0;) {
+            if (buddy_alloc(&zones[i], order, &page)) {
+                spin_unlock_irqrestore(&pmm_lock, flags);
+                return phys_to_virt((zones[i].base_pfn + page) * PAGE_SIZE);
+            }
         }
+        spin_unlock_irqrestore(&pmm_lock, flags);
     }
     debug_print("[PMM] Allocate: FAILED!\n");
     return NULL; // Out of memory
 }
 
+void* PMM_AllocatePagesBelow(uint32_t order, uint64_t max_phys) {
+    uint64_t limit_pfn = (max_phys / PAGE_SIZE) + 1; // first frame that is out of reach
+    uint64_t page;
+    if (order <= PMM_MAX_ORDER) {
+        uint64_t flags = spin_lock_irqsave(&pmm_lock);
+        for (uint32_t i = zone_count; i-- > 0;) {
+            pmm_zone_t* z = &zones[i];
+            if (z->base_pfn + (1ULL << order) > limit_pfn) continue;
+            int ok = (z->base_pfn + z->pages <= limit_pfn)
+                   ? buddy_alloc(z, order, &page)
+                   : buddy_alloc_below(z, order, limit_pfn - z->base_pfn, &page);
+            if (ok) {
+                spin_unlock_irqrestore(&pmm_lock, flags);
+                return phys_to_virt((z->base_pfn + page) * PAGE_SIZE);
+            }
+        }
+        spin_unlock_irqrestore(&pmm_lock, flags);
+    }
+    debug_print("[PMM] Allocate below ");
+    debug_hex(max_phys);
+    debug_print(": FAILED!\n");
+    return NULL;
+}
+
+void PMM_FreePages(void* addr, uint32_t order) {
+    uint64_t pfn = virt_to_phys(addr) / PAGE_SIZE;
+    pmm_zone_t* z = zone_of(pfn);
+    if (!z || order > PMM_MAX_ORDER) return;
+    uint64_t page = pfn - z->base_pfn;
+    if (page + (1ULL << order) > z->pages) return;
+    uint64_t flags = spin_lock_irqsave(&pmm_lock);
+    int used = page_used(z, page);
+    if (used) {
+        for (uint64_t i = 0; i < (1ULL << order); i++) {
+            z->owner[page + i] = NULL;
+            z->refs[page + i] = 0;
+        }
+        buddy_free(z, page, order);
+    }
+    spin_unlock_irqrestore(&pmm_lock, flags);
+    if (!used) {
+        debug_print("[PMM] Double free at ");
+        debug_hex((uint64_t)addr);
+        debug_print("\n");
+    }
+}
+
+void PMM_SetPageOwner(void* addr, uint64_t count, void* owner) {
+    uint64_t pfn = virt_to_phys(addr) / PAGE_SIZE;
+    pmm_zone_t* z = zone_of(pfn);
+    if (!z || pfn - z->base_pfn + count > z->pages) return;
+    for (uint64_t i = 0; i < count; i++) z->owner[pfn - z->base_pfn + i] = owner;
+}
+
+void* PMM_GetPageOwner(void* addr) {
+    uint64_t pfn = virt_to_phys(addr) / PAGE_SIZE;
+    pmm_zone_t* z = zone_of(pfn);
+    return z ? z->owner[pfn - z->base_pfn] : NULL;
+}
+
+void PMM_PageRef(void* addr) {
+    uint64_t pfn = virt_to_phys(addr) / PAGE_SIZE;
+    pmm_zone_t* z = zone_of(pfn);
+    if (z) __atomic_add_fetch(&z->refs[pfn - z->base_pfn], 1, __ATOMIC_RELAXED);
+}
+
+uint32_t PMM_PageUnref(void* addr) {
+    uint64_t pfn = virt_to_phys(addr) / PAGE_SIZE;
+    pmm_zone_t* z = zone_of(pfn);
+    if (!z || z->refs[pfn - z->base_pfn] == 0) return 0;
+    uint32_t left = __atomic_sub_fetch(&z->refs[pfn - z->base_pfn], 1, __ATOMIC_ACQ_REL);
+    if (left == 0) PMM_FreePages(addr, 0);
+    return left;
+}
+
+uint32_t PMM_PageRefCount(void* addr) {
+    uint64_t pfn = virt_to_phys(addr) / PAGE_SIZE;
+    pmm_zone_t* z = zone_of(pfn);
+    return z ? z->refs[pfn - z->base_pfn] : 0;
+}
+
+void* PMM_AllocatePage() {
+    return PMM_AllocatePages(0);
+}
+
 void PMM_FreePage(void* addr) {
-    uint64_t page = ((uint64_t)addr - base_paddr) / PAGE_SIZE;
-    if (page < max_pages) {
-        bitmap[page / 8] &= ~(1 << (page % 8));
+    PMM_FreePages(addr, 0);
+}
+
+uint64_t PMM_GetFreePages() {
+    uint64_t free = 0;
+    for (uint32_t i = 0; i < zone_count; i++) {
+        free += zones[i].free_pages;
     }
-}
\ No newline at end of file
+    return free;
+}
+
+uint32_t PMM_GetZoneCount() {
+    return zone_count;
+}
+
+void PMM_GetZone(uint32_t index, uint64_t* base, uint64_t* size) {
+    *base = zones[index].base_pfn * PAGE_SIZE;
+    *size = zones[index].pages * PAGE_SIZE;
+}
+
+#ifdef TINY64_BENCH
+// The original allocator: first-fit scan of a byte-addressed bitmap from page 0
+static uint64_t bench_bitmap_alloc(uint8_t* bm, uint64_t pages) {
+    for (uint64_t i = 0; i < pages; i++) {
+        if (!(bm[i / 8] & (1 << (i % 8)))) {
+            bm[i / 8] |= (1 << (i % 8));
+            return i;
+        }
+    }
+    return pages;
+}
+
+static void bench_bitmap_free(uint8_t* bm, uint64_t page) {
+    bm[page / 8] &= ~(1 << (page % 8));
+}
+
+#define BENCH_BUDDY_ITERS 4096
+#define BENCH_BITMAP_ITERS 64
+
+// Compares the buddy allocator and the old bitmap scan with 50/90/99% of
+// memory in use. The bitmap variant runs on a shadow bitmap of the same size,
+// filled from page 0 upwards the way its first-fit policy would fill it.
+void PMM_Benchmark() {
+    static const uint32_t fills[3] = {50, 90, 99};
+
+    uint64_t shadow_bytes = (total_pages + 7) / 8;
+    uint32_t shadow_order = 0;
+    while ((PAGE_SIZE << shadow_order) < shadow_bytes) shadow_order++;
+    uint8_t* shadow = (uint8_t*)PMM_AllocatePages(shadow_order);
+    if (!shadow) return;
+
+    debug_print("[PMM] Benchmark: cycles per alloc+free pair\n");
+    for (int f = 0; f < 3; f++) {
+        // Buddy: fill real memory to the target, chaining pages so they can be released
+        uint64_t target_free = total_pages * (100 - fills[f]) / 100;
+        uint64_t* chain = NULL;
+        while (PMM_GetFreePages() > target_free) {
+            uint64_t* page = (uint64_t*)PMM_AllocatePage();
+            if (!page) break;
+            *page = (uint64_t)chain;
+            chain = page;
+        }
+
+        uint64_t start = rdtsc();
+        for (int i = 0; i < BENCH_BUDDY_ITERS; i++) {
+            PMM_FreePage(PMM_AllocatePage());
+        }
+        uint64_t buddy_cycles = (rdtsc() - start) / BENCH_BUDDY_ITERS;
+
+        while (chain) {
+            uint64_t* next = (uint64_t*)*chain;
+            PMM_FreePage(chain);
+            chain = next;
+        }
+
+        // Bitmap: the lowest fill% of pages are in use
+        uint64_t used = total_pages * fills[f] / 100;
+        for (uint64_t i = 0; i < shadow_bytes; i++) shadow[i] = 0;
+        for (uint64_t i = 0; i < used / 8; i++) shadow[i] = 0xFF;
+        for (uint64_t i = (used / 8) * 8; i < used; i++) shadow[i / 8] |= (1 << (i % 8));
+
+        start = rdtsc();
+        for (int i = 0; i < BENCH_BITMAP_ITERS; i++) {
+            uint64_t page = bench_bitmap_alloc(shadow, total_pages);
+            if (page < total_pages) bench_bitmap_free(shadow, page);
+        }
+        uint64_t bitmap_cycles = (rdtsc() - start) / BENCH_BITMAP_ITERS;
+
+        debug_print("[PMM] fill=");
+        debug_dec(fills[f]);
+        debug_print("% buddy=");
+        debug_dec(buddy_cycles);
+        debug_print(" byte-bitmap=");
+        debug_dec(bitmap_cycles);
+        debug_print("\n");
+    }
+
+    PMM_FreePages(shadow, shadow_order);
+}
+#endif
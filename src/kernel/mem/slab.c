@@ -0,0 +1,238 @@
+#include "../include/slab.h"
+#include "../include/pmm.h"
+#include "../include/spinlock.h"
+#include "../include/serial.h"
+#include <stddef.h>
+
+#define PAGE_SIZE 4096
+#define SLAB_MAX_ORDER 3
+// Objects this large keep their slab descriptor off-slab, so the whole block
+// is usable and page-sized objects pack without waste
+#define SLAB_OFF_SLAB_MIN 512
+// Objects per slab we aim for before giving up and using SLAB_MAX_ORDER
+#define SLAB_MIN_OBJECTS 8
+#define KMALLOC_CLASSES 9   // 16 .. 4096
+
+typedef struct Slab {
+    SlabCache* cache;
+    struct Slab* next;
+    struct Slab* prev;
+    void* free;             // free objects, linked through their first word
+    uint8_t* mem;           // start of the 2^order page block
+    uint32_t inuse;
+} Slab;
+
+struct SlabCache {
+    Spinlock lock;          // the slab lists and counters
+    const char* name;
+    size_t size;            // object stride, a multiple of align
+    size_t align;
+    size_t offset;          // first object's offset in the block
+    uint32_t order;
+    uint32_t objects;       // objects per slab
+    int off_slab;
+    Slab* partial;
+    Slab* full;
+    Slab* empty;            // at most one is kept around
+    uint64_t slabs;
+    uint64_t active;
+    SlabCache* next;
+};
+
+static SlabCache cache_cache;   // SlabCache descriptors
+static SlabCache slab_cache;    // off-slab Slab descriptors
+static Spinlock caches_lock;
+static SlabCache* caches;
+static SlabCache* kmalloc_caches[KMALLOC_CLASSES];
+
+static const char* kmalloc_names[KMALLOC_CLASSES] = {
+    "kmalloc-16", "kmalloc-32", "kmalloc-64", "kmalloc-128", "kmalloc-256",
+    "kmalloc-512", "kmalloc-1024", "kmalloc-2048", "kmalloc-4096",
+};
+
+static void list_push(Slab** head, Slab* s) {
+    s->prev = NULL;
+    s->next = *head;
+    if (*head) (*head)->prev = s;
+    *head = s;
+}
+
+static void list_remove(Slab** head, Slab* s) {
+    if (s->prev) s->prev->next = s->next;
+    else *head = s->next;
+    if (s->next) s->next->prev = s->prev;
+}
+
+static void cache_setup(SlabCache* c, const char* name, size_t size, size_t align) {
+    if (align < sizeof(void*)) align = sizeof(void*);
+    if (size < sizeof(void*)) size = sizeof(void*);
+    size = (size + align - 1) & ~(align - 1);
+
+    spin_init(&c->lock);
+    c->name = name;
+    c->size = size;
+    c->align = align;
+    c->off_slab = size >= SLAB_OFF_SLAB_MIN;
+    c->offset = c->off_slab ? 0 : ((sizeof(Slab) + align - 1) & ~(align - 1));
+
+    // Smallest block that holds enough objects without wasting over 1/8 of it
+    for (c->order = 0; c->order < SLAB_MAX_ORDER; c->order++) {
+        size_t bytes = (size_t)PAGE_SIZE << c->order;
+        if (bytes <= c->offset) continue;
+        size_t objects = (bytes - c->offset) / size;
+        size_t waste = bytes - c->offset - objects * size;
+        if (objects >= SLAB_MIN_OBJECTS && waste * 8 <= bytes) break;
+    }
+    c->objects = (uint32_t)((((size_t)PAGE_SIZE << c->order) - c->offset) / size);
+
+    c->partial = NULL;
+    c->full = NULL;
+    c->empty = NULL;
+    c->slabs = 0;
+    c->active = 0;
+    uint64_t flags = spin_lock_irqsave(&caches_lock);
+    c->next = caches;
+    caches = c;
+    spin_unlock_irqrestore(&caches_lock, flags);
+}
+
+static Slab* slab_create(SlabCache* c) {
+    uint8_t* mem = (uint8_t*)PMM_AllocatePages(c->order);
+    if (!mem) return NULL;
+
+    Slab* s = c->off_slab ? (Slab*)Slab_Alloc(&slab_cache) : (Slab*)mem;
+    if (!s) {
+        PMM_FreePages(mem, c->order);
+        return NULL;
+    }
+    s->cache = c;
+    s->mem = mem;
+    s->inuse = 0;
+
+    // Thread the free list in address order
+    uint8_t* obj = mem + c->offset;
+    s->free = obj;
+    for (uint32_t i = 0; i + 1 < c->objects; i++, obj += c->size) {
+        *(void**)obj = obj + c->size;
+    }
+    *(void**)obj = NULL;
+
+    PMM_SetPageOwner(mem, 1ULL << c->order, s);
+    c->slabs++;
+    return s;
+}
+
+static void slab_destroy(SlabCache* c, Slab* s) {
+    uint8_t* mem = s->mem;
+    if (c->off_slab) Slab_Free(&slab_cache, s);
+    PMM_FreePages(mem, c->order);
+    c->slabs--;
+}
+
+void Slab_Init() {
+    cache_setup(&slab_cache, "slab", sizeof(Slab), sizeof(void*));
+    cache_setup(&cache_cache, "slab_cache", sizeof(SlabCache), CACHE_LINE_SIZE);
+    for (uint32_t i = 0; i < KMALLOC_CLASSES; i++) {
+        kmalloc_caches[i] = Slab_CreateCache(kmalloc_names[i], (size_t)16 << i, 0);
+    }
+}
+
+SlabCache* Slab_CreateCache(const char* name, size_t size, size_t align) {
+    if (align & (align - 1)) return NULL;
+    if (size > ((size_t)PAGE_SIZE << SLAB_MAX_ORDER)) return NULL;
+    SlabCache* c = (SlabCache*)Slab_Alloc(&cache_cache);
+    if (!c) return NULL;
+    cache_setup(c, name, size, align);
+    return c;
+}
+
+// A new slab's off-slab descriptor comes from slab_cache, whose own
+// descriptors are on-slab, so the nesting stops there
+void* Slab_Alloc(SlabCache* c) {
+    uint64_t flags = spin_lock_irqsave(&c->lock);
+    Slab* s = c->partial;
+    if (!s) {
+        if (c->empty) {
+            s = c->empty;
+            c->empty = NULL;
+        } else {
+            s = slab_create(c);
+            if (!s) {
+                spin_unlock_irqrestore(&c->lock, flags);
+                return NULL;
+            }
+        }
+        list_push(&c->partial, s);
+    }
+
+    void* obj = s->free;
+    s->free = *(void**)obj;
+    s->inuse++;
+    c->active++;
+    if (s->inuse == c->objects) {
+        list_remove(&c->partial, s);
+        list_push(&c->full, s);
+    }
+    spin_unlock_irqrestore(&c->lock, flags);
+    return obj;
+}
+
+void Slab_Free(SlabCache* c, void* obj) {
+    Slab* s = (Slab*)PMM_GetPageOwner(obj);
+    if (!s || s->cache != c) {
+        debug_print("[SLAB] Bad free to ");
+        debug_print(c->name);
+        debug_print("\n");
+        return;
+    }
+
+    uint64_t flags = spin_lock_irqsave(&c->lock);
+    if (s->inuse == c->objects) {
+        list_remove(&c->full, s);
+        list_push(&c->partial, s);
+    }
+    *(void**)obj = s->free;
+    s->free = obj;
+    s->inuse--;
+    c->active--;
+
+    // Keep one empty slab to absorb alloc/free ping-pong, release the rest
+    if (s->inuse == 0) {
+        list_remove(&c->partial, s);
+        if (c->empty) slab_destroy(c, c->empty);
+        c->empty = s;
+    }
+    spin_unlock_irqrestore(&c->lock, flags);
+}
+
+SlabCache* Slab_SizeCache(size_t size) {
+    if (size > SLAB_KMALLOC_MAX) return NULL;
+    if (size <= 16) return kmalloc_caches[0];
+    return kmalloc_caches[60 - __builtin_clzll(size - 1)];
+}
+
+SlabCache* Slab_CacheOf(void* ptr) {
+    Slab* s = (Slab*)PMM_GetPageOwner(ptr);
+    return s ? s->cache : NULL;
+}
+
+size_t Slab_ObjectSize(SlabCache* c) {
+    return c->size;
+}
+
+void Slab_PrintStats() {
+    for (SlabCache* c = caches; c; c = c->next) {
+        if (c->slabs == 0) continue;
+        debug_print("[SLAB] ");
+        debug_print(c->name);
+        debug_print(" size=");
+        debug_dec(c->size);
+        debug_print(" active=");
+        debug_dec(c->active);
+        debug_print(" slabs=");
+        debug_dec(c->slabs);
+        debug_print(" pages/slab=");
+        debug_dec(1ULL << c->order);
+        debug_print("\n");
+    }
+}
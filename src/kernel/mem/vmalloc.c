@@ -0,0 +1,406 @@
+#include "../include/vmalloc.h"
+#include "../include/vmm.h"
+#include "../include/pmm.h"
+#include "../include/slab.h"
+#include "../include/spinlock.h"
+#include "../include/serial.h"
+#include <stddef.h>
+
+#define PAGE_SIZE_2M (1ULL << 21)
+
+// What a range in the window is
+#define VMAP_FREE     0
+#define VMAP_RESERVED 1     // addresses only; the owner maps and unmaps
+#define VMAP_PAGES    2     // backed by frames vfree returns
+#define VMAP_LAZY     3     // the same, filled in on demand
+#define VMAP_IO       4     // device memory, frames not ours
+
+// AVL tree links, embedded in the area they order
+typedef struct AvlNode {
+    struct AvlNode* left;
+    struct AvlNode* right;
+    int height;
+} AvlNode;
+
+// Every range of the window, free or not, is an area. All areas sit in a
+// tree ordered by address, which finds the area holding an address and an
+// area's neighbours in O(log n). Free areas are also in a tree ordered by
+// (size, address), where the smallest one that fits is one descent away.
+typedef struct VmapArea {
+    AvlNode by_addr;
+    AvlNode by_size;
+    uint64_t base;
+    uint64_t size;          // includes the trailing guard page
+    uint32_t kind;
+    uint64_t flags;         // mapping flags of a VMAP_LAZY area
+} VmapArea;
+
+#define AREA(node, link) ((VmapArea*)((char*)(node) - offsetof(VmapArea, link)))
+
+typedef int (*avl_cmp)(AvlNode* a, AvlNode* b);
+
+// Both trees and the counters. Never held across a call into the VMM, so
+// the fault path can look up lazy areas.
+static Spinlock vmalloc_lock;
+static AvlNode* addr_root;
+static AvlNode* size_root;
+static SlabCache* area_cache;
+static uint64_t area_count;
+static uint64_t used_bytes;
+
+static inline int avl_height(AvlNode* n) {
+    return n ? n->height : 0;
+}
+
+static void avl_update(AvlNode* n) {
+    int l = avl_height(n->left);
+    int r = avl_height(n->right);
+    n->height = 1 + (l > r ? l : r);
+}
+
+static AvlNode* rotate_right(AvlNode* n) {
+    AvlNode* l = n->left;
+    n->left = l->right;
+    l->right = n;
+    avl_update(n);
+    avl_update(l);
+    return l;
+}
+
+static AvlNode* rotate_left(AvlNode* n) {
+    AvlNode* r = n->right;
+    n->right = r->left;
+    r->left = n;
+    avl_update(n);
+    avl_update(r);
+    return r;
+}
+
+static AvlNode* avl_balance(AvlNode* n) {
+    avl_update(n);
+    int bf = avl_height(n->left) - avl_height(n->right);
+    if (bf > 1) {
+        if (avl_height(n->left->left) < avl_height(n->left->right)) n->left = rotate_left(n->left);
+        return rotate_right(n);
+    }
+    if (bf < -1) {
+        if (avl_height(n->right->right) < avl_height(n->right->left)) n->right = rotate_right(n->right);
+        return rotate_left(n);
+    }
+    return n;
+}
+
+static AvlNode* avl_insert(AvlNode* root, AvlNode* n, avl_cmp cmp) {
+    if (!root) {
+        n->left = n->right = NULL;
+        n->height = 1;
+        return n;
+    }
+    if (cmp(n, root) < 0) root->left = avl_insert(root->left, n, cmp);
+    else root->right = avl_insert(root->right, n, cmp);
+    return avl_balance(root);
+}
+
+static AvlNode* avl_remove_min(AvlNode* root, AvlNode** min) {
+    if (!root->left) {
+        *min = root;
+        return root->right;
+    }
+    root->left = avl_remove_min(root->left, min);
+    return avl_balance(root);
+}
+
+// Keys are unique, so n is found by its key alone
+static AvlNode* avl_remove(AvlNode* root, AvlNode* n, avl_cmp cmp) {
+    if (!root) return NULL;
+    if (root == n) {
+        if (!n->right) return n->left;
+        AvlNode* min;
+        AvlNode* right = avl_remove_min(n->right, &min);
+        min->left = n->left;
+        min->right = right;
+        return avl_balance(min);
+    }
+    if (cmp(n, root) < 0) root->left = avl_remove(root->left, n, cmp);
+    else root->right = avl_remove(root->right, n, cmp);
+    return avl_balance(root);
+}
+
+static int cmp_addr(AvlNode* a, AvlNode* b) {
+    uint64_t x = AREA(a, by_addr)->base, y = AREA(b, by_addr)->base;
+    return x < y ? -1 : x > y;
+}
+
+static int cmp_size(AvlNode* a, AvlNode* b) {
+    VmapArea* x = AREA(a, by_size);
+    VmapArea* y = AREA(b, by_size);
+    if (x->size != y->size) return x->size < y->size ? -1 : 1;
+    return x->base < y->base ? -1 : x->base > y->base;
+}
+
+// The area holding addr, if any
+static VmapArea* area_find(uint64_t addr) {
+    AvlNode* n = addr_root;
+    while (n) {
+        VmapArea* a = AREA(n, by_addr);
+        if (addr < a->base) n = n->left;
+        else if (addr - a->base >= a->size) n = n->right;
+        else return a;
+    }
+    return NULL;
+}
+
+// The smallest free area of at least size bytes
+static VmapArea* best_fit(uint64_t size) {
+    VmapArea* best = NULL;
+    AvlNode* n = size_root;
+    while (n) {
+        VmapArea* a = AREA(n, by_size);
+        if (a->size >= size) {
+            best = a;
+            n = n->left;
+        } else {
+            n = n->right;
+        }
+    }
+    return best;
+}
+
+static VmapArea* area_new(uint64_t base, uint64_t size, uint32_t kind) {
+    VmapArea* a = (VmapArea*)Slab_Alloc(area_cache);
+    if (!a) return NULL;
+    a->base = base;
+    a->size = size;
+    a->kind = kind;
+    a->flags = 0;
+    addr_root = avl_insert(addr_root, &a->by_addr, cmp_addr);
+    if (kind == VMAP_FREE) size_root = avl_insert(size_root, &a->by_size, cmp_size);
+    area_count++;
+    return a;
+}
+
+static void area_delete(VmapArea* a) {
+    addr_root = avl_remove(addr_root, &a->by_addr, cmp_addr);
+    if (a->kind == VMAP_FREE) size_root = avl_remove(size_root, &a->by_size, cmp_size);
+    Slab_Free(area_cache, a);
+    area_count--;
+}
+
+void VMalloc_Init() {
+    area_cache = Slab_CreateCache("vmap_area", sizeof(VmapArea), 0);
+    area_new(VMALLOC_BASE + VMALLOC_GUARD, VMALLOC_SIZE - VMALLOC_GUARD, VMAP_FREE);
+}
+
+// Carves size bytes plus a guard page, aligned, out of the best-fitting
+// free area. Whatever is left on either side stays free.
+static VmapArea* area_alloc(uint64_t size, uint64_t align, uint32_t kind) {
+    if (!area_cache || size == 0) return NULL;
+    size = ((size + PAGE_SIZE - 1) & ~(uint64_t)(PAGE_SIZE - 1)) + VMALLOC_GUARD;
+    if (align < PAGE_SIZE) align = PAGE_SIZE;
+
+    uint64_t flags = spin_lock_irqsave(&vmalloc_lock);
+    VmapArea* f = best_fit(size + align - PAGE_SIZE);
+    if (!f) {
+        spin_unlock_irqrestore(&vmalloc_lock, flags);
+        return NULL;
+    }
+    uint64_t start = (f->base + align - 1) & ~(align - 1);
+    uint64_t head = start - f->base;
+    uint64_t tail = f->size - head - size;
+
+    // The free area becomes the allocation. Its address order relative to
+    // every other area is unchanged, so only the size tree needs updating.
+    size_root = avl_remove(size_root, &f->by_size, cmp_size);
+    f->base = start;
+    f->size = size;
+    f->kind = kind;
+    if (head) area_new(start - head, head, VMAP_FREE);
+    if (tail) area_new(start + size, tail, VMAP_FREE);
+    used_bytes += size - VMALLOC_GUARD;
+    spin_unlock_irqrestore(&vmalloc_lock, flags);
+    return f;
+}
+
+// Returns a busy area to the free tree, merging it with free neighbours
+static void area_release(VmapArea* a) {
+    uint64_t flags = spin_lock_irqsave(&vmalloc_lock);
+    used_bytes -= a->size - VMALLOC_GUARD;
+    VmapArea* prev = a->base > VMALLOC_BASE ? area_find(a->base - 1) : NULL;
+    VmapArea* next = area_find(a->base + a->size);
+
+    if (prev && prev->kind == VMAP_FREE) {
+        size_root = avl_remove(size_root, &prev->by_size, cmp_size);
+        prev->size += a->size;
+        area_delete(a);     // busy, so only in the address tree
+        a = prev;
+    }
+    if (next && next->kind == VMAP_FREE) {
+        a->size += next->size;
+        area_delete(next);
+    }
+    a->kind = VMAP_FREE;
+    size_root = avl_insert(size_root, &a->by_size, cmp_size);
+    spin_unlock_irqrestore(&vmalloc_lock, flags);
+}
+
+static void* vmalloc_kind(size_t size, uint32_t kind) {
+    VmapArea* a = area_alloc(size, PAGE_SIZE, kind);
+    if (!a) return NULL;
+    a->flags = PAGE_WRITE;
+    if (kind == VMAP_LAZY) return (void*)a->base;
+
+    tlb_batch b = {0};
+    for (uint64_t off = 0; off < a->size - VMALLOC_GUARD; off += PAGE_SIZE) {
+        void* page = PMM_AllocatePage();
+        if (!page) {
+            VMM_Unmap((void*)a->base, off, 1, &b);
+            VMM_FlushBatch(&b);
+            area_release(a);
+            return NULL;
+        }
+        VMM_Remap((void*)(a->base + off), (void*)virt_to_phys(page), PAGE_SIZE, a->flags, &b);
+    }
+    // Fresh mappings replace nothing, so there is nothing to flush
+    return (void*)a->base;
+}
+
+void* vmalloc(size_t size) {
+    return vmalloc_kind(size, VMAP_PAGES);
+}
+
+void* vmalloc_lazy(size_t size) {
+    return vmalloc_kind(size, VMAP_LAZY);
+}
+
+void* VMalloc_Reserve(size_t size, size_t align) {
+    VmapArea* a = area_alloc(size, align, VMAP_RESERVED);
+    return a ? (void*)a->base : NULL;
+}
+
+void vfree(void* addr) {
+    if (!addr) return;
+    uint64_t base = (uint64_t)addr & ~(uint64_t)(PAGE_SIZE - 1);
+    uint64_t flags = spin_lock_irqsave(&vmalloc_lock);
+    VmapArea* a = area_find(base);
+    int bad = !a || a->kind == VMAP_FREE || (a->base != base && a->kind != VMAP_IO);
+    spin_unlock_irqrestore(&vmalloc_lock, flags);
+    if (bad) {
+        debug_print("[VMALLOC] vfree of unknown address\n");
+        return;
+    }
+
+    tlb_batch b = {0};
+    int owned = a->kind == VMAP_PAGES || a->kind == VMAP_LAZY;
+    VMM_Unmap((void*)a->base, a->size - VMALLOC_GUARD, owned, &b);
+    VMM_FlushBatch(&b);
+    area_release(a);
+}
+
+size_t vmalloc_size(void* addr) {
+    uint64_t flags = spin_lock_irqsave(&vmalloc_lock);
+    VmapArea* a = area_find((uint64_t)addr);
+    size_t size = 0;
+    if (a && a->kind != VMAP_FREE && a->base == (uint64_t)addr) size = a->size - VMALLOC_GUARD;
+    spin_unlock_irqrestore(&vmalloc_lock, flags);
+    return size;
+}
+
+void* ioremap(uint64_t phys, size_t size, uint64_t cache) {
+    uint64_t offset = phys & (PAGE_SIZE - 1);
+    uint64_t len = (offset + size + PAGE_SIZE - 1) & ~(uint64_t)(PAGE_SIZE - 1);
+    // Matching the BAR's offset within 2 MiB lets VMM_MapRange use huge pages
+    uint64_t align = len >= PAGE_SIZE_2M ? PAGE_SIZE_2M : PAGE_SIZE;
+    uint64_t phys_base = phys - offset;
+    uint64_t skew = phys_base & (align - 1);
+
+    VmapArea* a = area_alloc(len + skew, align, VMAP_IO);
+    if (!a) return NULL;
+    VMM_MapRange((void*)(a->base + skew), (void*)phys_base, len, PAGE_WRITE | cache);
+    return (void*)(a->base + skew + offset);
+}
+
+void iounmap(void* addr) {
+    vfree(addr);
+}
+
+uint64_t VMalloc_FaultFlags(uint64_t addr) {
+    uint64_t flags = spin_lock_irqsave(&vmalloc_lock);
+    VmapArea* a = area_find(addr);
+    uint64_t result = 0;
+    if (a && a->kind == VMAP_LAZY && addr - a->base < a->size - VMALLOC_GUARD) result = a->flags;
+    spin_unlock_irqrestore(&vmalloc_lock, flags);
+    return result;
+}
+
+void VMalloc_PrintStats() {
+    debug_print("[VMALLOC] areas=");
+    debug_dec(area_count);
+    debug_print(" used=");
+    debug_dec(used_bytes / 1024);
+    debug_print(" KiB, tree height=");
+    debug_dec(avl_height(addr_root));
+    debug_print("\n");
+}
+
+#ifdef TINY64_BENCH
+#include "../include/cpu.h"
+
+#define BENCH_AREAS 4096
+
+static uint64_t bench_seed = 12345;
+
+static uint64_t bench_rand() {
+    bench_seed = bench_seed * 6364136223846793005ULL + 1442695040888963407ULL;
+    return bench_seed >> 33;
+}
+
+// Reserve, lookup and free cycles with BENCH_AREAS ranges live and the free
+// tree fragmented into half as many holes
+void VMalloc_Benchmark() {
+    static void* ranges[BENCH_AREAS];
+    uint64_t areas_before = area_count;
+
+    for (int i = 0; i < BENCH_AREAS; i++) {
+        ranges[i] = VMalloc_Reserve((1 + bench_rand() % 16) * PAGE_SIZE, PAGE_SIZE);
+    }
+    for (int i = 0; i < BENCH_AREAS; i += 2) {
+        vfree(ranges[i]);
+    }
+
+    uint64_t start = rdtsc();
+    for (int i = 0; i < BENCH_AREAS; i += 2) {
+        ranges[i] = VMalloc_Reserve((1 + bench_rand() % 16) * PAGE_SIZE, PAGE_SIZE);
+    }
+    uint64_t reserve_cycles = rdtsc() - start;
+    uint64_t height = avl_height(addr_root);
+
+    start = rdtsc();
+    uint64_t found = 0;
+    for (int i = 0; i < BENCH_AREAS; i++) {
+        if (VMalloc_FaultFlags((uint64_t)ranges[i]) == 0 && vmalloc_size(ranges[i])) found++;
+    }
+    uint64_t lookup_cycles = rdtsc() - start;
+
+    start = rdtsc();
+    for (int i = 0; i < BENCH_AREAS; i++) {
+        vfree(ranges[i]);
+    }
+    uint64_t free_cycles = rdtsc() - start;
+
+    debug_print("[BENCH] VMALLOC: ");
+    debug_dec(BENCH_AREAS);
+    debug_print(" ranges, tree height ");
+    debug_dec(height);
+    debug_print(": best-fit reserve ");
+    debug_dec(reserve_cycles / (BENCH_AREAS / 2));
+    debug_print(", lookup ");
+    debug_dec(lookup_cycles / (BENCH_AREAS * 2));
+    debug_print(", free ");
+    debug_dec(free_cycles / BENCH_AREAS);
+    debug_print(" cycles; ");
+    debug_dec(found);
+    debug_print(" found, ");
+    debug_dec(area_count - areas_before);
+    debug_print(" areas left over\n");
+}
+#endif
@@ -1,8 +1,66 @@
 #include "../include/vmm.h"
 #include "../include/pmm.h"
+#include "../include/cpu.h"
+#include "../include/slab.h"
+#include "../include/vmalloc.h"
+#include "../include/smp.h"
+#include "../include/spinlock.h"
+#include "../include/serial.h"
 #include <stddef.h>
 
+#define PAGE_SIZE_2M (1ULL << 21)
+#define PAGE_SIZE_1G (1ULL << 30)
+
+#define MSR_PAT 0x277
+// PA0-3 = WB, WC, WT, UC, mirrored in PA4-7 so a stray PAT bit changes nothing
+#define PAT_LAYOUT 0x0004010600040106ULL
+
+#define CR0_WP      (1ULL << 16)
+#define CR3_NOFLUSH (1ULL << 63)
+#define CR4_PGE     (1ULL << 7)
+#define CR4_PCIDE   (1ULL << 17)
+#define KERNEL_PCID 0
+#define PCID_COUNT  4096
+
+// PML4 slots below this are each address space's own; the rest are shared
+#define USER_SLOTS 256
+
+// #PF error code
+#define PF_PRESENT (1ULL << 0)    // protection violation rather than a missing page
+#define PF_WRITE   (1ULL << 1)
+
+// A range reserved with VMM_Reserve
+typedef struct VmmRegion {
+    uint64_t base;
+    uint64_t end;
+    uint64_t flags;
+    struct VmmRegion* next;
+} VmmRegion;
+
+// Page tables, the region list and the address space list
+static Spinlock vmm_lock;
 static page_table* kernel_pml4;
+static uint64_t table_pages;
+static uint64_t max_page_size = PAGE_SIZE_2M;
+static int has_pat;
+static int has_pge;
+static int has_pcid;
+static int paging_active;
+static VmmRegion* regions;          // sorted by address
+static SlabCache* region_cache;
+static uint64_t demand_pages;
+
+// Every space points its kernel-half PML4 entries at kernel_pml4's PDPTs,
+// so only the user half is private. Each CPU has its own loaded space.
+static AddressSpace kernel_space;
+static AddressSpace* spaces;        // all but kernel_space
+static SlabCache* space_cache;
+static uint64_t pcid_used[PCID_COUNT / 64];
+// Per CPU, the PCIDs whose cached entries may be out of date: a user
+// mapping changed while the CPU was not running the space, or the PCID was
+// freed. The CPU flushes such a PCID on its next switch to it.
+static uint64_t stale_pcids[MAX_CPUS][PCID_COUNT / 64];
+static uint64_t cow_copies;
 
 // Helper to clear a page
 static void clear_page(void* addr) {
@@ -12,52 +70,868 @@ static void clear_page(void* addr) {
     }
 }
 
+static inline AddressSpace* current_space() {
+    AddressSpace* as = this_cpu()->space;
+    return as ? as : &kernel_space;
+}
+
+static inline void invlpg(uint64_t v) {
+    __asm__ volatile ("invlpg (%0)" : : "r"(v) : "memory");
+}
+
+// Every translation in every PCID. Kernel entries are global, so a CR3
+// reload alone would keep them; toggling CR4.PGE drops everything.
+static void flush_all() {
+    if (has_pge && paging_active) {
+        uint64_t cr4 = read_cr4();
+        write_cr4(cr4 & ~CR4_PGE);
+        write_cr4(cr4);
+    } else {
+        write_cr3(read_cr3() & ~CR3_NOFLUSH);
+    }
+}
+
+static void batch_add(tlb_batch* b, uint64_t v) {
+    if (b->count < TLB_BATCH_MAX) b->addrs[b->count] = v;
+    if (b->count <= TLB_BATCH_MAX) b->count++;
+}
+
+static void batch_add_frame(tlb_batch* b, uint64_t phys, uint32_t order) {
+    // Frames may only be freed once the TLB cannot reach them, so a full
+    // frame list forces an early flush
+    if (b->frame_count == TLB_BATCH_MAX) VMM_FlushBatch(b);
+    b->frames[b->frame_count++] = phys | order;
+}
+
+void VMM_FlushTLB(const uint64_t* addrs, uint32_t count) {
+    if (count > TLB_BATCH_MAX) {
+        flush_all();
+    } else {
+        for (uint32_t i = 0; i < count; i++) invlpg(addrs[i]);
+    }
+}
+
+// Other CPUs may hold the same kernel translations, so they flush too
+// before any frame goes back to the PMM
+void VMM_FlushBatch(tlb_batch* b) {
+    if (b->count) {
+        VMM_FlushTLB(b->addrs, b->count);
+        SMP_ShootdownTLB(b->addrs, b->count);
+    }
+    for (uint32_t i = 0; i < b->frame_count; i++) {
+        PMM_FreePages(phys_to_virt(b->frames[i] & ~0xFFFULL), (uint32_t)(b->frames[i] & 0xFFF));
+    }
+    b->count = 0;
+    b->frame_count = 0;
+}
+
+// NULL when the PMM is out of pages
+static page_table* alloc_table() {
+    page_table* t = (page_table*)PMM_AllocatePage();
+    if (!t) return NULL;
+    clear_page(t);
+    table_pages++;
+    return t;
+}
+
+static void free_table(page_table* t) {
+    PMM_FreePage(t);
+    table_pages--;
+}
+
+// The kernel half has nothing to fall back on without its tables
+static page_table* alloc_kernel_table() {
+    page_table* t = alloc_table();
+    if (!t) {
+        debug_print("[VMM] Out of memory for kernel page tables\n");
+        while (1) __asm__ volatile ("cli; hlt");
+    }
+    return t;
+}
+
+// A kernel-half PML4 entry appeared in kernel_pml4; entries below it are
+// shared already, but the slot itself lives in each space's own PML4
+static void sync_kernel_slot(uint32_t slot) {
+    for (AddressSpace* as = spaces; as; as = as->next) {
+        as->pml4->entries[slot] = kernel_pml4->entries[slot];
+    }
+}
+
+// Kernel-half leaves are global so they survive CR3 loads between address
+// spaces; invlpg still reaches them.
+static inline uint64_t leaf_flags(uint64_t v, uint64_t flags) {
+    flags |= PAGE_PRESENT;
+    if (v >= DIRECT_MAP_BASE) flags |= PAGE_GLOBAL;
+    return flags;
+}
+
+// Returns the table an entry points to, creating it if missing. A huge page
+// in the way is split into a table of pages one level smaller with the same
+// flags, so the translation does not change.
+static page_table* next_table(page_table_entry* e, uint64_t child_size) {
+    if (!(*e & PAGE_PRESENT)) {
+        *e = virt_to_phys(alloc_kernel_table()) | PAGE_PRESENT | PAGE_WRITE;
+    } else if (*e & PAGE_HUGE) {
+        page_table* t = alloc_kernel_table();
+        uint64_t base = *e & PAGE_ADDR_MASK & ~(child_size * 512 - 1);
+        uint64_t flags = *e & ~PAGE_ADDR_MASK;
+        if (child_size == PAGE_SIZE) flags &= ~PAGE_HUGE;
+        for (int i = 0; i < 512; i++) {
+            t->entries[i] = (base + i * child_size) | flags;
+        }
+        *e = virt_to_phys(t) | PAGE_PRESENT | PAGE_WRITE;
+    }
+    return (page_table*)phys_to_virt(*e & PAGE_ADDR_MASK);
+}
+
+// Maps one page of the given size (4 KiB, 2 MiB or 1 GiB); v and p must be
+// aligned to it
+static void map_block(uint64_t v, uint64_t p, uint64_t size, uint64_t flags, tlb_batch* b) {
+    int leaf_shift = (size == PAGE_SIZE_1G) ? 30 : (size == PAGE_SIZE_2M) ? 21 : 12;
+    page_table* t = kernel_pml4;
+    for (int shift = 39; shift > leaf_shift; shift -= 9) {
+        page_table_entry* e = &t->entries[(v >> shift) & 0x1FF];
+        int fresh = !(*e & PAGE_PRESENT);
+        t = next_table(e, 1ULL << (shift - 9));
+        if (shift == 39 && fresh && v >= USER_TOP) sync_kernel_slot((v >> 39) & 0x1FF);
+    }
+    page_table_entry* e = &t->entries[(v >> leaf_shift) & 0x1FF];
+
+    if (size != PAGE_SIZE && (*e & PAGE_PRESENT) && !(*e & PAGE_HUGE)) {
+        // Finer mappings already live here; keep their table and fill it in
+        uint64_t sub = size >> 9;
+        for (uint64_t off = 0; off < size; off += sub) {
+            map_block(v + off, p + off, sub, flags, b);
+        }
+        return;
+    }
+
+    uint64_t old = *e;
+    *e = p | leaf_flags(v, flags) | (size != PAGE_SIZE ? PAGE_HUGE : 0);
+    if (old & PAGE_PRESENT) batch_add(b, v);
+}
+
+#define CHANGE_UNMAP      0
+#define CHANGE_UNMAP_FREE 1
+#define CHANGE_PROTECT    2
+
+// Applies an unmap or protection change to every leaf in [v, end). Leaves
+// the range covers completely are changed at their own size; huge pages
+// that stick out of the range are split first.
+static void change_range(uint64_t v, uint64_t end, int mode, uint64_t flags, tlb_batch* b) {
+    while (v < end) {
+        page_table* t = kernel_pml4;
+        uint64_t next = 0;
+        for (int shift = 39; shift >= 12; shift -= 9) {
+            uint64_t size = 1ULL << shift;
+            page_table_entry* e = &t->entries[(v >> shift) & 0x1FF];
+            next = (v & ~(size - 1)) + size;
+            if (!(*e & PAGE_PRESENT)) break;
+
+            int leaf = shift == 12 || (shift < 39 && (*e & PAGE_HUGE));
+            if (leaf && !(v & (size - 1)) && end - v >= size) {
+                uint64_t phys = *e & PAGE_ADDR_MASK & ~(size - 1);
+                if (mode == CHANGE_PROTECT) {
+                    *e = phys | leaf_flags(v, flags) | (shift > 12 ? PAGE_HUGE : 0);
+                } else {
+                    *e = 0;
+                    if (mode == CHANGE_UNMAP_FREE) batch_add_frame(b, phys, (uint32_t)(shift - 12));
+                }
+                batch_add(b, v);
+                break;
+            }
+            t = next_table(e, size >> 9);
+        }
+        if (next <= v) break;   // wrapped past the top of the address space
+        v = next;
+    }
+}
+
 void VMM_Init() {
-    kernel_pml4 = (page_table*)PMM_AllocatePage();
-    clear_page(kernel_pml4);
+    kernel_pml4 = alloc_kernel_table();
+    kernel_space.pml4 = kernel_pml4;
+    kernel_space.pcid = KERNEL_PCID;
+
+    // CPUID.80000001h:EDX[26] - 1 GiB pages
+    uint32_t a, b, c, d;
+    cpuid(0x80000000, 0, &a, &b, &c, &d);
+    if (a >= 0x80000001) {
+        cpuid(0x80000001, 0, &a, &b, &c, &d);
+        if (d & (1u << 26)) max_page_size = PAGE_SIZE_1G;
+    }
+
+    // CPUID.01h:EDX[16] - PAT. Stale TLB entries go with the CR3 load in
+    // VMM_Activate.
+    cpuid(1, 0, &a, &b, &c, &d);
+    has_pat = (d >> 16) & 1;
+    if (has_pat) {
+        __asm__ volatile ("wbinvd" ::: "memory");
+        wrmsr(MSR_PAT, PAT_LAYOUT);
+    }
+    // EDX[13] - global pages, ECX[17] - PCID. PCID is only worth turning on
+    // with global kernel pages, since invlpg reaches other PCIDs' entries
+    // only when they are global.
+    has_pge = (d >> 13) & 1;
+    has_pcid = has_pge && ((c >> 17) & 1);
 }
 
 void VMM_MapPage(void* virtual_addr, void* physical_addr, uint64_t flags) {
+    tlb_batch b = {0};
+    uint64_t irq = spin_lock_irqsave(&vmm_lock);
+    map_block((uint64_t)virtual_addr & ~0xFFFULL, (uint64_t)physical_addr & ~0xFFFULL, PAGE_SIZE, flags, &b);
+    spin_unlock_irqrestore(&vmm_lock, irq);
+    VMM_FlushBatch(&b);
+}
+
+void VMM_Remap(void* virtual_addr, void* physical_addr, uint64_t length, uint64_t flags, tlb_batch* b) {
+    uint64_t v = (uint64_t)virtual_addr & ~0xFFFULL;
+    uint64_t p = (uint64_t)physical_addr & ~0xFFFULL;
+    uint64_t end = ((uint64_t)virtual_addr + length + 0xFFF) & ~0xFFFULL;
+
+    uint64_t irq = spin_lock_irqsave(&vmm_lock);
+    while (v < end) {
+        uint64_t size = PAGE_SIZE;
+        if (max_page_size >= PAGE_SIZE_1G && !((v | p) & (PAGE_SIZE_1G - 1)) && end - v >= PAGE_SIZE_1G) {
+            size = PAGE_SIZE_1G;
+        } else if (max_page_size >= PAGE_SIZE_2M && !((v | p) & (PAGE_SIZE_2M - 1)) && end - v >= PAGE_SIZE_2M) {
+            size = PAGE_SIZE_2M;
+        }
+        map_block(v, p, size, flags, b);
+        v += size;
+        p += size;
+    }
+    spin_unlock_irqrestore(&vmm_lock, irq);
+}
+
+void VMM_MapRange(void* virtual_addr, void* physical_addr, uint64_t length, uint64_t flags) {
+    tlb_batch b = {0};
+    VMM_Remap(virtual_addr, physical_addr, length, flags, &b);
+    VMM_FlushBatch(&b);
+}
+
+void VMM_Unmap(void* virtual_addr, uint64_t length, int free_frames, tlb_batch* b) {
+    uint64_t v = (uint64_t)virtual_addr & ~0xFFFULL;
+    uint64_t end = ((uint64_t)virtual_addr + length + 0xFFF) & ~0xFFFULL;
+    uint64_t irq = spin_lock_irqsave(&vmm_lock);
+    change_range(v, end, free_frames ? CHANGE_UNMAP_FREE : CHANGE_UNMAP, 0, b);
+    spin_unlock_irqrestore(&vmm_lock, irq);
+}
+
+void VMM_Protect(void* virtual_addr, uint64_t length, uint64_t flags, tlb_batch* b) {
+    uint64_t v = (uint64_t)virtual_addr & ~0xFFFULL;
+    uint64_t end = ((uint64_t)virtual_addr + length + 0xFFF) & ~0xFFFULL;
+    uint64_t irq = spin_lock_irqsave(&vmm_lock);
+    change_range(v, end, CHANGE_PROTECT, flags, b);
+    spin_unlock_irqrestore(&vmm_lock, irq);
+}
+
+void* VMM_UnmapPage(void* virtual_addr) {
+    void* phys = VMM_GetPhysical(virtual_addr);
+    if (!phys) return NULL;
+    tlb_batch b = {0};
+    VMM_Unmap(virtual_addr, PAGE_SIZE, 0, &b);
+    VMM_FlushBatch(&b);
+    return (void*)((uint64_t)phys & ~0xFFFULL);
+}
+
+void* VMM_GetPhysical(void* virtual_addr) {
     uint64_t v = (uint64_t)virtual_addr;
-    uint64_t p = (uint64_t)physical_addr;
+    page_table* t = kernel_pml4;
+    for (int shift = 39; shift >= 12; shift -= 9) {
+        page_table_entry e = t->entries[(v >> shift) & 0x1FF];
+        if (!(e & PAGE_PRESENT)) return NULL;
+        if (shift == 12 || (shift < 39 && (e & PAGE_HUGE))) {
+            uint64_t mask = (1ULL << shift) - 1;
+            return (void*)(((e & PAGE_ADDR_MASK) & ~mask) | (v & mask));
+        }
+        t = (page_table*)phys_to_virt(e & PAGE_ADDR_MASK);
+    }
+    return NULL;
+}
+
+int VMM_Reserve(void* virtual_addr, uint64_t length, uint64_t flags) {
+    uint64_t base = (uint64_t)virtual_addr & ~0xFFFULL;
+    uint64_t end = ((uint64_t)virtual_addr + length + 0xFFF) & ~0xFFFULL;
+    uint64_t irq = spin_lock_irqsave(&vmm_lock);
+    if (!region_cache) region_cache = Slab_CreateCache("vmm_region", sizeof(VmmRegion), 0);
+
+    VmmRegion* prev = NULL;
+    VmmRegion* next = regions;
+    while (next && next->base < base) {
+        prev = next;
+        next = next->next;
+    }
+    VmmRegion* r = NULL;
+    if ((!prev || prev->end <= base) && (!next || next->base >= end)) r = (VmmRegion*)Slab_Alloc(region_cache);
+    if (r) {
+        r->base = base;
+        r->end = end;
+        r->flags = flags;
+        r->next = next;
+        if (prev) prev->next = r;
+        else regions = r;
+    }
+    spin_unlock_irqrestore(&vmm_lock, irq);
+    return r != NULL;
+}
 
-    uint64_t pml4_idx = (v >> 39) & 0x1FF;
-    uint64_t pdp_idx  = (v >> 30) & 0x1FF;
-    uint64_t pd_idx   = (v >> 21) & 0x1FF;
-    uint64_t pt_idx   = (v >> 12) & 0x1FF;
+static int cow_fault(uint64_t v);
 
-    // PML4 -> PDP
-    if (!(kernel_pml4->entries[pml4_idx] & PAGE_PRESENT)) {
-        void* new_table = PMM_AllocatePage();
-        clear_page(new_table);
-        kernel_pml4->entries[pml4_idx] = (uint64_t)new_table | PAGE_PRESENT | PAGE_WRITE;
+// Runs with interrupts off, from the #PF gate
+int VMM_HandleFault(uint64_t addr, uint64_t error_code) {
+    if (error_code & PF_PRESENT) {
+        if ((error_code & PF_WRITE) && addr < USER_TOP) {
+            spin_lock(&vmm_lock);
+            int fixed = cow_fault(addr & ~0xFFFULL);
+            spin_unlock(&vmm_lock);
+            return fixed;
+        }
+        return 0;
     }
-    page_table* pdp = (page_table*)(kernel_pml4->entries[pml4_idx] & ~0xFFFULL);
+    uint64_t flags = 0;
+    if (addr >= VMALLOC_BASE && addr - VMALLOC_BASE < VMALLOC_SIZE) {
+        // vmalloc takes its own lock, and calls into the VMM holding none
+        flags = VMalloc_FaultFlags(addr);
+    } else {
+        spin_lock(&vmm_lock);
+        VmmRegion* r = regions;
+        while (r && r->end <= addr) r = r->next;
+        if (r && addr >= r->base) flags = r->flags;
+        spin_unlock(&vmm_lock);
+    }
+    if (!flags) return 0;
 
-    // PDP -> PD
-    if (!(pdp->entries[pdp_idx] & PAGE_PRESENT)) {
-        void* new_table = PMM_AllocatePage();
-        clear_page(new_table);
-        pdp->entries[pdp_idx] = (uint64_t)new_table | PAGE_PRESENT | PAGE_WRITE;
+    void* page = PMM_AllocatePage();
+    if (!page) return 0;
+    clear_page(page);
+    // Another CPU may have faulted on the same page and filled it first.
+    // Not-present entries are never cached, so there is nothing to flush.
+    spin_lock(&vmm_lock);
+    int raced = VMM_GetPhysical((void*)addr) != NULL;
+    if (!raced) {
+        tlb_batch b = {0};
+        map_block(addr & ~0xFFFULL, virt_to_phys(page), PAGE_SIZE, flags, &b);
+        demand_pages++;
     }
-    page_table* pd = (page_table*)(pdp->entries[pdp_idx] & ~0xFFFULL);
+    spin_unlock(&vmm_lock);
+    if (raced) PMM_FreePage(page);
+    return 1;
+}
+
+uint64_t VMM_GetDemandPages() {
+    return demand_pages;
+}
 
-    // PD -> PT
-    if (!(pd->entries[pd_idx] & PAGE_PRESENT)) {
-        void* new_table = PMM_AllocatePage();
-        clear_page(new_table);
-        pd->entries[pd_idx] = (uint64_t)new_table | PAGE_PRESENT | PAGE_WRITE;
+// Marks pcid stale on every CPU but skip (MAX_CPUS for none). PCID 0
+// flushes on every load anyway.
+static void pcid_stale(uint16_t pcid, uint32_t skip) {
+    if (pcid == KERNEL_PCID) return;
+    for (uint32_t i = 0; i < MAX_CPUS; i++) {
+        if (i != skip) __atomic_or_fetch(&stale_pcids[i][pcid / 64], 1ULL << (pcid % 64), __ATOMIC_SEQ_CST);
     }
-    page_table* pt = (page_table*)(pd->entries[pd_idx] & ~0xFFFULL);
+}
 
-    // PT entry
-    pt->entries[pt_idx] = p | flags | PAGE_PRESENT;
+// With PCIDE set, the PCID goes in CR3[11:0] and bit 63 keeps its cached
+// translations across the switch. PCID 0 is shared (the kernel's, and any
+// space that found no free PCID), so loading it always flushes; kernel
+// entries are global and survive that. Interrupts stay off from the stale
+// check to the load, so a shootdown for a PCID marked after the check
+// arrives with that PCID already loaded.
+static void load_cr3(AddressSpace* as) {
+    uint64_t cr3 = virt_to_phys(as->pml4);
+    uint64_t flags = irq_save();
+    if (read_cr4() & CR4_PCIDE) {
+        uint64_t bit = 1ULL << (as->pcid % 64);
+        uint64_t old = __atomic_fetch_and(&stale_pcids[cpu_id()][as->pcid / 64], ~bit, __ATOMIC_SEQ_CST);
+        cr3 |= as->pcid;
+        if (as->pcid != KERNEL_PCID && !(old & bit)) cr3 |= CR3_NOFLUSH;
+    }
+    write_cr3(cr3);
+    this_cpu()->space = as;
+    irq_restore(flags);
 }
 
 void VMM_Activate() {
-    __asm__ volatile ("mov %0, %%cr3" : : "r"(kernel_pml4));
+    load_cr3(&kernel_space);
+    if (!paging_active) {
+        // Supervisor writes honour read-only pages, so copy-on-write also
+        // catches the kernel writing to user memory
+        write_cr0(read_cr0() | CR0_WP);
+        // The first load ran with PCID 0 and flushed the firmware's entries;
+        // PCIDE may only be set while CR3[11:0] is zero
+        uint64_t cr4 = read_cr4();
+        if (has_pge) cr4 |= CR4_PGE;
+        if (has_pcid) cr4 |= CR4_PCIDE;
+        write_cr4(cr4);
+        paging_active = 1;
+    }
+}
+
+// The trampoline already loaded the BSP's CR0 and CR4. The PAT is per CPU
+// and has to match, or the same mapping would mean different cache types.
+void VMM_InitCPU() {
+    if (has_pat) {
+        __asm__ volatile ("wbinvd" ::: "memory");
+        wrmsr(MSR_PAT, PAT_LAYOUT);
+    }
+    load_cr3(&kernel_space);
 }
 
 page_table* VMM_GetKernelPML4() {
     return kernel_pml4;
 }
+
+uint64_t VMM_GetTablePages() {
+    return table_pages;
+}
+
+static void copy_page(void* dst, const void* src) {
+    uint64_t* d = (uint64_t*)dst;
+    const uint64_t* s = (const uint64_t*)src;
+    for (int i = 0; i < 512; i++) d[i] = s[i];
+}
+
+// The 4 KiB entry for a user address, or NULL if a table on the way is
+// missing (and create is 0, or none can be allocated) or a huge page is in
+// the way
+static page_table_entry* user_entry(page_table* pml4, uint64_t v, int create) {
+    page_table* t = pml4;
+    for (int shift = 39; shift > 12; shift -= 9) {
+        page_table_entry* e = &t->entries[(v >> shift) & 0x1FF];
+        if (!(*e & PAGE_PRESENT)) {
+            if (!create) return NULL;
+            page_table* n = alloc_table();
+            if (!n) return NULL;
+            *e = virt_to_phys(n) | PAGE_PRESENT | PAGE_WRITE | PAGE_USER;
+        } else if (*e & PAGE_HUGE) {
+            return NULL;
+        }
+        t = (page_table*)phys_to_virt(*e & PAGE_ADDR_MASK);
+    }
+    return &t->entries[(v >> 12) & 0x1FF];
+}
+
+// A user translation of as changed, with vmm_lock held. This CPU and every
+// CPU running as drop it now, invlpg only reaching the loaded PCID; any
+// other CPU may still hold it under as's PCID and flushes that on its next
+// switch to as. The frame it pointed to can be released afterwards.
+static void user_changed(AddressSpace* as, uint64_t v) {
+    int loaded = as == current_space();
+    pcid_stale(as->pcid, loaded ? cpu_id() : MAX_CPUS);
+    if (loaded) invlpg(v);
+    SMP_ShootdownTLB(&v, 1);
+}
+
+static uint16_t alloc_pcid() {
+    if (!has_pcid) return KERNEL_PCID;
+    for (uint32_t w = 0; w < PCID_COUNT / 64; w++) {
+        uint64_t free = ~pcid_used[w];
+        if (w == 0) free &= ~1ULL;      // PCID 0 is the kernel's
+        if (free) {
+            uint32_t bit = __builtin_ctzll(free);
+            pcid_used[w] |= 1ULL << bit;
+            return (uint16_t)(w * 64 + bit);
+        }
+    }
+    return KERNEL_PCID;
+}
+
+static AddressSpace* space_create() {
+    if (!space_cache) space_cache = Slab_CreateCache("address_space", sizeof(AddressSpace), 0);
+    AddressSpace* as = (AddressSpace*)Slab_Alloc(space_cache);
+    if (!as) return NULL;
+    as->pml4 = alloc_table();
+    if (!as->pml4) {
+        Slab_Free(space_cache, as);
+        return NULL;
+    }
+    for (int i = USER_SLOTS; i < 512; i++) {
+        as->pml4->entries[i] = kernel_pml4->entries[i];
+    }
+    as->pcid = alloc_pcid();
+    as->next = spaces;
+    spaces = as;
+    return as;
+}
+
+AddressSpace* AddressSpace_Create() {
+    uint64_t irq = spin_lock_irqsave(&vmm_lock);
+    AddressSpace* as = space_create();
+    spin_unlock_irqrestore(&vmm_lock, irq);
+    return as;
+}
+
+static void release_table(page_table* t, int level);
+
+// Copies the tables below t (a PDPT, PD or PT). Writable leaves become
+// read-only and copy-on-write on both sides; every leaf takes a reference on
+// its frame, so read-only pages are simply shared. Returns NULL, with the
+// copy released, if a table cannot be allocated or a huge page turns up:
+// user_entry never maps one, and sharing it would need the whole block
+// reference counted.
+static page_table* clone_table(page_table* t, int level) {
+    page_table* n = alloc_table();
+    if (!n) return NULL;
+    for (int i = 0; i < 512; i++) {
+        page_table_entry e = t->entries[i];
+        if (!(e & PAGE_PRESENT)) continue;
+        if (level > 1) {
+            page_table* child = NULL;
+            if (!(e & PAGE_HUGE)) child = clone_table((page_table*)phys_to_virt(e & PAGE_ADDR_MASK), level - 1);
+            if (!child) {
+                release_table(n, level);
+                return NULL;
+            }
+            n->entries[i] = virt_to_phys(child) | (e & ~PAGE_ADDR_MASK);
+            continue;
+        }
+        if (e & PAGE_WRITE) {
+            e = (e & ~PAGE_WRITE) | PAGE_COW;
+            t->entries[i] = e;
+        }
+        PMM_PageRef(phys_to_virt(e & PAGE_ADDR_MASK));
+        n->entries[i] = e;
+    }
+    return n;
+}
+
+// Unlinks as and frees its tables, PCID and itself, with vmm_lock held
+static void space_free(AddressSpace* as);
+
+AddressSpace* AddressSpace_Clone(AddressSpace* src) {
+    uint64_t irq = spin_lock_irqsave(&vmm_lock);
+    AddressSpace* as = space_create();
+    if (!as) {
+        spin_unlock_irqrestore(&vmm_lock, irq);
+        return NULL;
+    }
+    for (int i = 0; i < USER_SLOTS; i++) {
+        page_table_entry e = src->pml4->entries[i];
+        if (!(e & PAGE_PRESENT)) continue;
+        page_table* pdpt = clone_table((page_table*)phys_to_virt(e & PAGE_ADDR_MASK), 3);
+        if (!pdpt) {
+            space_free(as);
+            as = NULL;
+            break;
+        }
+        as->pml4->entries[i] = virt_to_phys(pdpt) | (e & ~PAGE_ADDR_MASK);
+    }
+
+    // The source lost write access to its private pages, even if the clone
+    // failed part way. Any CPU may still hold its writable translations:
+    // one running it now, or one that ran it before and kept them under its
+    // PCID. Clones are rare, so every CPU drops every PCID.
+    flush_all();
+    SMP_ShootdownTLB(NULL, TLB_BATCH_MAX + 1);
+    spin_unlock_irqrestore(&vmm_lock, irq);
+    return as;
+}
+
+static void release_table(page_table* t, int level) {
+    for (int i = 0; i < 512; i++) {
+        page_table_entry e = t->entries[i];
+        if (!(e & PAGE_PRESENT)) continue;
+        if (level > 1 && !(e & PAGE_HUGE)) {
+            release_table((page_table*)phys_to_virt(e & PAGE_ADDR_MASK), level - 1);
+        } else if (level == 1) {
+            PMM_PageUnref(phys_to_virt(e & PAGE_ADDR_MASK));
+        }
+    }
+    free_table(t);
+}
+
+static void space_free(AddressSpace* as) {
+    AddressSpace** link = &spaces;
+    while (*link != as) link = &(*link)->next;
+    *link = as->next;
+
+    for (int i = 0; i < USER_SLOTS; i++) {
+        page_table_entry e = as->pml4->entries[i];
+        if (e & PAGE_PRESENT) release_table((page_table*)phys_to_virt(e & PAGE_ADDR_MASK), 3);
+    }
+    free_table(as->pml4);
+    // Its entries may still be cached on any CPU, under a PCID the next
+    // space created can get
+    pcid_stale(as->pcid, MAX_CPUS);
+    if (as->pcid != KERNEL_PCID) pcid_used[as->pcid / 64] &= ~(1ULL << (as->pcid % 64));
+    Slab_Free(space_cache, as);
+}
+
+void AddressSpace_Destroy(AddressSpace* as) {
+    if (!as || as == &kernel_space) return;
+    uint64_t irq = spin_lock_irqsave(&vmm_lock);
+    // Entries left under its PCID are flushed by each CPU that reuses it
+    if (as == current_space()) load_cr3(&kernel_space);
+    space_free(as);
+    spin_unlock_irqrestore(&vmm_lock, irq);
+}
+
+void AddressSpace_Switch(AddressSpace* as) {
+    if (as != current_space()) load_cr3(as);
+}
+
+AddressSpace* AddressSpace_Current() {
+    return current_space();
+}
+
+AddressSpace* AddressSpace_Kernel() {
+    return &kernel_space;
+}
+
+int AddressSpace_MapPage(AddressSpace* as, void* virtual_addr, void* physical_addr, uint64_t flags) {
+    uint64_t v = (uint64_t)virtual_addr & ~0xFFFULL;
+    uint64_t p = (uint64_t)physical_addr & ~0xFFFULL;
+    if (v >= USER_TOP) return 0;
+    uint64_t irq = spin_lock_irqsave(&vmm_lock);
+    page_table_entry* e = user_entry(as->pml4, v, 1);
+    if (e) {
+        page_table_entry old = *e;
+        PMM_PageRef(phys_to_virt(p));
+        *e = p | flags | PAGE_PRESENT;
+        if (old & PAGE_PRESENT) {
+            user_changed(as, v);
+            PMM_PageUnref(phys_to_virt(old & PAGE_ADDR_MASK));
+        }
+    }
+    spin_unlock_irqrestore(&vmm_lock, irq);
+    return e != NULL;
+}
+
+void AddressSpace_UnmapPage(AddressSpace* as, void* virtual_addr) {
+    uint64_t v = (uint64_t)virtual_addr & ~0xFFFULL;
+    if (v >= USER_TOP) return;
+    uint64_t irq = spin_lock_irqsave(&vmm_lock);
+    page_table_entry* e = user_entry(as->pml4, v, 0);
+    if (e && (*e & PAGE_PRESENT)) {
+        page_table_entry old = *e;
+        *e = 0;
+        user_changed(as, v);
+        PMM_PageUnref(phys_to_virt(old & PAGE_ADDR_MASK));
+    }
+    spin_unlock_irqrestore(&vmm_lock, irq);
+}
+
+// A write to a copy-on-write page of the loaded space. The last space still
+// holding the frame gets write access back; any other writes to a copy.
+// A writable entry means another CPU got there first and this one faulted
+// on a stale read-only translation, which the fault itself dropped, so the
+// write is simply retried.
+static int cow_fault(uint64_t v) {
+    AddressSpace* as = current_space();
+    page_table_entry* e = user_entry(as->pml4, v, 0);
+    if (!e || !(*e & PAGE_PRESENT)) return 0;
+    if (!(*e & PAGE_COW)) return (*e & PAGE_WRITE) != 0;
+
+    void* frame = phys_to_virt(*e & PAGE_ADDR_MASK);
+    uint64_t flags = (*e & ~PAGE_ADDR_MASK & ~PAGE_COW) | PAGE_WRITE;
+    if (PMM_PageRefCount(frame) > 1) {
+        void* copy = PMM_AllocatePage();
+        if (!copy) return 0;
+        copy_page(copy, frame);
+        PMM_PageRef(copy);
+        // Other CPUs running as must stop reading the old frame too
+        *e = virt_to_phys(copy) | flags;
+        user_changed(as, v);
+        PMM_PageUnref(frame);
+        cow_copies++;
+    } else {
+        *e = (*e & PAGE_ADDR_MASK) | flags;
+        invlpg(v);
+    }
+    return 1;
+}
+
+uint64_t AddressSpace_GetCowCopies() {
+    return cow_copies;
+}
+
+#ifdef TINY64_BENCH
+static void free_tables(page_table* t, int level) {
+    if (level > 1) {
+        for (int i = 0; i < 512; i++) {
+            page_table_entry e = t->entries[i];
+            if ((e & PAGE_PRESENT) && !(e & PAGE_HUGE)) {
+                free_tables((page_table*)phys_to_virt(e & PAGE_ADDR_MASK), level - 1);
+            }
+        }
+    }
+    PMM_FreePage(t);
+}
+
+// Builds the layout map_layout() describes into scratch page tables, once
+// with 4 KiB pages only and once with huge pages, and compares the two
+void VMM_Benchmark(void (*map_layout)()) {
+    page_table* saved_pml4 = kernel_pml4;
+    uint64_t saved_pages = table_pages;
+    uint64_t saved_max = max_page_size;
+    uint64_t limits[2] = {PAGE_SIZE, saved_max};
+    const char* names[2] = {"4 KiB pages", "huge pages "};
+
+    for (int i = 0; i < 2; i++) {
+        table_pages = 0;
+        max_page_size = limits[i];
+        kernel_pml4 = alloc_table();
+        uint64_t start = rdtsc();
+        map_layout();
+        uint64_t cycles = rdtsc() - start;
+
+        debug_print("[BENCH] VMM: ");
+        debug_print(names[i]);
+        debug_print(": ");
+        debug_dec(table_pages);
+        debug_print(" page-table pages, ");
+        debug_dec(cycles);
+        debug_print(" cycles\n");
+        free_tables(kernel_pml4, 4);
+    }
+
+    kernel_pml4 = saved_pml4;
+    table_pages = saved_pages;
+    max_page_size = saved_max;
+}
+
+// An otherwise unused kernel-half slot (PML4 448), clear of the direct map
+// and the heap
+#define BENCH_VA    0xFFFFE00000000000ULL
+#define BENCH_PAGES 512
+
+static void bench_map(uint64_t phys) {
+    for (uint64_t i = 0; i < BENCH_PAGES; i++) {
+        VMM_MapPage((void*)(BENCH_VA + i * PAGE_SIZE), (void*)(phys + i * PAGE_SIZE), PAGE_WRITE);
+    }
+}
+
+// Pulls every page into the TLB, so the unmaps have something to flush
+static void bench_touch() {
+    for (uint64_t i = 0; i < BENCH_PAGES; i++) {
+        *(volatile uint8_t*)(BENCH_VA + i * PAGE_SIZE) = (uint8_t)i;
+    }
+}
+
+static void bench_report(const char* name, uint64_t cycles) {
+    debug_print("[BENCH] VMM: ");
+    debug_print(name);
+    debug_print(": ");
+    debug_dec(cycles / BENCH_PAGES);
+    debug_print(" cycles/page\n");
+}
+
+// Map, unmap and protect cycles per page over BENCH_PAGES 4 KiB pages,
+// unmapping one invlpg per call, in invlpg-sized batches and as a single
+// batch that ends in a full flush
+void VMM_MapBenchmark() {
+    void* frames = PMM_AllocatePages(9);
+    if (!frames) return;
+    uint64_t phys = virt_to_phys(frames);
+    tlb_batch b = {0};
+
+    // Page tables for the window are allocated here, outside the timings
+    bench_map(phys);
+    VMM_Unmap((void*)BENCH_VA, BENCH_PAGES * PAGE_SIZE, 0, &b);
+    VMM_FlushBatch(&b);
+
+    uint64_t start = rdtsc();
+    bench_map(phys);
+    bench_report("map", rdtsc() - start);
+
+    bench_touch();
+    start = rdtsc();
+    for (uint64_t i = 0; i < BENCH_PAGES; i++) {
+        VMM_UnmapPage((void*)(BENCH_VA + i * PAGE_SIZE));
+    }
+    bench_report("unmap, invlpg each", rdtsc() - start);
+
+    bench_map(phys);
+    bench_touch();
+    start = rdtsc();
+    for (uint64_t i = 0; i < BENCH_PAGES; i += TLB_BATCH_MAX) {
+        VMM_Unmap((void*)(BENCH_VA + i * PAGE_SIZE), TLB_BATCH_MAX * PAGE_SIZE, 0, &b);
+        VMM_FlushBatch(&b);
+    }
+    bench_report("unmap, batches of 32", rdtsc() - start);
+
+    bench_map(phys);
+    bench_touch();
+    start = rdtsc();
+    VMM_Unmap((void*)BENCH_VA, BENCH_PAGES * PAGE_SIZE, 0, &b);
+    VMM_FlushBatch(&b);
+    bench_report("unmap, one batch", rdtsc() - start);
+
+    bench_map(phys);
+    bench_touch();
+    start = rdtsc();
+    VMM_Protect((void*)BENCH_VA, BENCH_PAGES * PAGE_SIZE, 0, &b);
+    VMM_FlushBatch(&b);
+    VMM_Protect((void*)BENCH_VA, BENCH_PAGES * PAGE_SIZE, PAGE_WRITE, &b);
+    VMM_FlushBatch(&b);
+    bench_report("protect RO and back", rdtsc() - start);
+
+    VMM_Unmap((void*)BENCH_VA, BENCH_PAGES * PAGE_SIZE, 0, &b);
+    VMM_FlushBatch(&b);
+    PMM_FreePages(frames, 9);
+}
+
+#define BENCH_USER_VA   0x400000ULL
+#define BENCH_AS_PAGES  4096    // 16 MiB resident in the parent
+#define BENCH_COW_PAGES 256
+
+static AddressSpace* bench_space(uint64_t pages, AddressSpace* src) {
+    AddressSpace* as = AddressSpace_Create();
+    for (uint64_t i = 0; i < pages; i++) {
+        uint64_t* page = (uint64_t*)PMM_AllocatePage();
+        if (src) {
+            page_table_entry* e = user_entry(src->pml4, BENCH_USER_VA + i * PAGE_SIZE, 0);
+            copy_page(page, phys_to_virt(*e & PAGE_ADDR_MASK));
+        } else {
+            page[0] = i;
+        }
+        AddressSpace_MapPage(as, (void*)(BENCH_USER_VA + i * PAGE_SIZE), (void*)virt_to_phys(page), PAGE_WRITE | PAGE_USER);
+    }
+    return as;
+}
+
+// Cost of a copy-on-write clone of a 16 MiB address space against copying
+// it outright, and of the write faults that later break the sharing
+void AddressSpace_Benchmark() {
+    uint64_t tables_before = table_pages;
+    AddressSpace* parent = bench_space(BENCH_AS_PAGES, NULL);
+    uint64_t tables = table_pages - tables_before;
+
+    uint64_t start = rdtsc();
+    AddressSpace* child = AddressSpace_Clone(parent);
+    uint64_t clone_cycles = rdtsc() - start;
+
+    start = rdtsc();
+    AddressSpace* copy = bench_space(BENCH_AS_PAGES, parent);
+    uint64_t copy_cycles = rdtsc() - start;
+    AddressSpace_Destroy(copy);
+
+    AddressSpace_Switch(child);
+    start = rdtsc();
+    for (uint64_t i = 0; i < BENCH_COW_PAGES; i++) {
+        *(volatile uint64_t*)(BENCH_USER_VA + i * PAGE_SIZE) = ~i;
+    }
+    uint64_t fault_cycles = rdtsc() - start;
+
+    // The parent must still see its own data
+    AddressSpace_Switch(parent);
+    int intact = 1;
+    for (uint64_t i = 0; i < BENCH_COW_PAGES; i++) {
+        if (*(volatile uint64_t*)(BENCH_USER_VA + i * PAGE_SIZE) != i) intact = 0;
+    }
+    AddressSpace_Switch(&kernel_space);
+
+    debug_print("[BENCH] AS: clone of 16 MiB (");
+    debug_dec(tables);
+    debug_print(" page-table pages): ");
+    debug_dec(clone_cycles);
+    debug_print(" cycles, eager copy: ");
+    debug_dec(copy_cycles);
+    debug_print(" cycles, COW fault: ");
+    debug_dec(fault_cycles / BENCH_COW_PAGES);
+    debug_print(intact ? " cycles/page, parent intact\n" : " cycles/page, PARENT CORRUPTED\n");
+
+    AddressSpace_Destroy(child);
+    AddressSpace_Destroy(parent);
+}
+#endif
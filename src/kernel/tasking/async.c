@@ -0,0 +1,104 @@
+#include "../include/async.h"
+#include "../include/task.h"
+#include "../include/wait.h"
+#include "../include/clock.h"
+#include "../include/serial.h"
+#include <stddef.h>
+
+// The run queue is a FIFO under the wait queue's lock, which the worker
+// sleeps on when it is empty
+static WaitQueue ready;
+static AsyncTask* head;
+static AsyncTask* tail;
+static Task* worker;
+
+static uint64_t spawned;
+static uint64_t steps;
+static uint64_t wakeups;
+
+// With the lock held
+static AsyncTask* pop() {
+    AsyncTask* t = head;
+    if (t) {
+        head = t->next;
+        if (!head) tail = NULL;
+        t->queued = 0;
+    }
+    return t;
+}
+
+static void worker_main() {
+    while (1) {
+        uint64_t flags = spin_lock_irqsave(&ready.lock);
+        AsyncTask* t;
+        while (!(t = pop())) WaitQueue_Wait(&ready);
+        spin_unlock_irqrestore(&ready.lock, flags);
+
+        // A timer that fired as it finished may have queued it again
+        if (t->done) continue;
+        steps++;
+        if (t->fn(t) == ASYNC_DONE) {
+            // done last: an owner may free t as soon as it sees it
+            Timer_Cancel(&t->timer);
+            __atomic_store_n(&t->done, 1, __ATOMIC_RELEASE);
+        }
+    }
+}
+
+static void timer_expired(Timer* timer) {
+    Async_Wake((AsyncTask*)timer->data);
+}
+
+void Async_Init() {
+    WaitQueue_Init(&ready);
+    worker = Task_Create(worker_main, "async");
+    if (!worker) {
+        debug_print("[ASYNC] Could not create the worker\n");
+        return;
+    }
+    // Drivers finishing requests are device event handling
+    Task_SetPriority(worker, TASK_PRIORITY_INPUT);
+}
+
+void Async_Spawn(AsyncTask* t, AsyncStatus (*fn)(AsyncTask* t), void* data) {
+    t->fn = fn;
+    t->data = data;
+    t->resume = 0;
+    t->queued = 0;
+    t->done = 0;
+    t->next = NULL;
+    t->timer.fn = timer_expired;
+    t->timer.data = t;
+    t->timer.armed = 0;
+    spawned++;
+    Async_Wake(t);
+}
+
+void Async_Wake(AsyncTask* t) {
+    uint64_t flags = spin_lock_irqsave(&ready.lock);
+    int queue = !t->queued && !t->done;
+    if (queue) {
+        t->queued = 1;
+        t->next = NULL;
+        if (tail) tail->next = t;
+        else head = t;
+        tail = t;
+        wakeups++;
+    }
+    spin_unlock_irqrestore(&ready.lock, flags);
+    if (queue) WaitQueue_WakeOne(&ready);
+}
+
+void Async_WakeAfter(AsyncTask* t, uint64_t ns) {
+    Timer_Arm(&t->timer, clock_monotonic_ns() + ns);
+}
+
+void Async_PrintStats() {
+    debug_print("[ASYNC] ");
+    debug_dec(spawned);
+    debug_print(" coroutines, ");
+    debug_dec(steps);
+    debug_print(" steps, ");
+    debug_dec(wakeups);
+    debug_print(" wakeups\n");
+}
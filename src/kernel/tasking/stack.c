@@ -0,0 +1,122 @@
+#include "../include/stack.h"
+#include "../include/vmalloc.h"
+#include "../include/vmm.h"
+#include "../include/pmm.h"
+#include "../include/spinlock.h"
+#include "../include/serial.h"
+#include <stddef.h>
+
+// A slot is a guard page followed by the stack. The pool grows a chunk of
+// slots at a time, mapped up front.
+#define STACK_GUARD       4096
+#define STACK_SLOT        (STACK_GUARD + STACK_SIZE)
+#define STACK_CHUNK_SLOTS 64
+#define STACK_MAX_CHUNKS  256       // 16384 stacks
+#define STACK_ORDER       2         // buddy order of a STACK_SIZE block
+#define STACK_FILL        0x57AC57AC57AC57ACULL
+
+// The free list, the chunks and the counters. Stack_IsGuard reads the
+// chunks without it from the fault handler; chunk_count only grows, after
+// the slot it covers is written.
+static Spinlock stack_lock;
+// Free stacks are linked through their top word, the last one a task
+// pushes to and so the first to lose the pattern anyway
+static uint64_t* free_stacks;
+static uint64_t chunks[STACK_MAX_CHUNKS];
+static uint32_t chunk_count;
+static uint64_t stacks_used;
+static uint64_t stacks_total;
+static uint64_t deepest;            // largest high-water mark of a freed stack
+
+static inline uint64_t* top_word(void* base) {
+    return (uint64_t*)((uint8_t*)base + STACK_SIZE) - 1;
+}
+
+static void fill(uint64_t* from, uint64_t* to) {
+    while (from < to) *from++ = STACK_FILL;
+}
+
+static void push_free(void* base) {
+    *top_word(base) = (uint64_t)free_stacks;
+    free_stacks = top_word(base);
+}
+
+// Returns 0 if not even one stack could be added. A chunk the PMM ran out
+// part way through keeps the stacks it got; one with none is given back.
+static int grow() {
+    if (chunk_count == STACK_MAX_CHUNKS) return 0;
+    uint8_t* chunk = (uint8_t*)VMalloc_Reserve(STACK_CHUNK_SLOTS * STACK_SLOT, PAGE_SIZE);
+    if (!chunk) return 0;
+
+    int added = 0;
+    for (; added < STACK_CHUNK_SLOTS; added++) {
+        uint8_t* base = chunk + added * STACK_SLOT + STACK_GUARD;
+        void* frames = PMM_AllocatePages(STACK_ORDER);
+        if (!frames) break;
+        VMM_MapRange(base, (void*)virt_to_phys(frames), STACK_SIZE, PAGE_WRITE);
+        fill((uint64_t*)base, top_word(base));
+        push_free(base);
+        stacks_total++;
+    }
+    if (!added) {
+        vfree(chunk);
+        return 0;
+    }
+    chunks[chunk_count] = (uint64_t)chunk;
+    __atomic_store_n(&chunk_count, chunk_count + 1, __ATOMIC_RELEASE);
+    return 1;
+}
+
+void* Stack_Alloc() {
+    uint64_t flags = spin_lock_irqsave(&stack_lock);
+    if (!free_stacks && !grow()) {
+        spin_unlock_irqrestore(&stack_lock, flags);
+        return NULL;
+    }
+    uint64_t* top = free_stacks;
+    free_stacks = (uint64_t*)*top;
+    *top = STACK_FILL;
+    stacks_used++;
+    spin_unlock_irqrestore(&stack_lock, flags);
+    return (uint8_t*)(top + 1) - STACK_SIZE;
+}
+
+uint64_t Stack_HighWater(void* base) {
+    uint64_t* p = (uint64_t*)base;
+    uint64_t* top = top_word(base);
+    while (p <= top && *p == STACK_FILL) p++;
+    return (uint64_t)((uint8_t*)(top + 1) - (uint8_t*)p);
+}
+
+void Stack_Free(void* base) {
+    if (!base) return;
+    // Only the part the task dirtied needs the pattern back
+    uint64_t used = Stack_HighWater(base);
+    fill((uint64_t*)((uint8_t*)base + STACK_SIZE - used), top_word(base));
+    uint64_t flags = spin_lock_irqsave(&stack_lock);
+    if (used > deepest) deepest = used;
+    push_free(base);
+    stacks_used--;
+    spin_unlock_irqrestore(&stack_lock, flags);
+}
+
+int Stack_IsGuard(uint64_t addr) {
+    uint32_t count = __atomic_load_n(&chunk_count, __ATOMIC_ACQUIRE);
+    for (uint32_t i = 0; i < count; i++) {
+        uint64_t off = addr - chunks[i];
+        if (addr >= chunks[i] && off < STACK_CHUNK_SLOTS * STACK_SLOT) return off % STACK_SLOT < STACK_GUARD;
+    }
+    return 0;
+}
+
+void Stack_PrintStats() {
+    debug_print("[STACK] ");
+    debug_dec(stacks_used);
+    debug_print("/");
+    debug_dec(stacks_total);
+    debug_print(" stacks of ");
+    debug_dec(STACK_SIZE / 1024);
+    debug_print(" KiB in use, deepest freed: ");
+    debug_dec(deepest);
+    debug_print(" bytes\n");
+}
@@ -1,43 +1,768 @@
 #include "../include/task.h"
-#include "../include/heap.h"
+#include "../include/stack.h"
+#include "../include/slab.h"
+#include "../include/cpu.h"
+#include "../include/clock.h"
+#include "../include/interrupts.h"
+#include "../include/smp.h"
+#include "../include/spinlock.h"
+#include "../include/fpu.h"
+#include "../include/serial.h"
 #include <stddef.h>
 
 extern void context_switch(uint64_t* old_rsp, uint64_t new_rsp);
+extern void task_start();
 
-static Task tasks[10];
-static int task_count = 0;
-static int current_task = 0;
+// A CPU's ready tasks: one FIFO per level, and a bit per non-empty FIFO,
+// so the next task is the head of the FIFO at the lowest set bit. The lock
+// covers the FIFOs and the state of every task whose cpu is this one; a
+// CPU holds its own across a switch, and the task it switches to drops it
+// in finish_switch.
+typedef struct {
+    Spinlock lock;
+    uint32_t id;
+    Task* head[TASK_PRIORITIES];
+    Task* tail[TASK_PRIORITIES];
+    uint32_t bitmap;
+    volatile uint32_t queued;       // tasks in the FIFOs
+    Task* current;
+    Task* idle;                     // never queued; runs when nothing else can
+    Task* prev;                     // being switched away from
+    Timer slice_timer;              // ends the current task's timeslice
+    uint64_t run_start;             // clock_monotonic_ns() when current was switched in
+    volatile int need_resched;      // set from interrupt handlers and other CPUs
+    uint64_t steals;                // tasks taken from other CPUs
+    // Idle time and wakeup latency, in TSC cycles, since the last report
+    uint64_t stats_since;
+    uint64_t idle_since;
+    uint64_t idle_cycles;
+    uint64_t wakeups;
+    uint64_t wake_cycles;
+    uint64_t wake_max;
+} __attribute__((aligned(CACHE_LINE_SIZE))) RunQueue;
 
-void Task_Init() {
-    // Current execution becomes Task 0
-    task_count = 1;
-    current_task = 0;
-}
-
-void Task_Create(void (*entry)(), void* stack_top) {
-    if (task_count >= 10) return;
-    
-    uint64_t* stack = (uint64_t*)stack_top;
-    
-    // Interrupt Frame
-    *(--stack) = 0x10;             // SS
-    *(--stack) = (uint64_t)stack_top; // RSP
-    *(--stack) = 0x202;            // RFLAGS (Interrupts enabled)
-    *(--stack) = 0x08;             // CS
-    *(--stack) = (uint64_t)entry;  // RIP
-
-    // Push dummy registers for the stub (15 registers)
-    for(int i=0; i<15; i++) {
-        *(--stack) = 0;
-    }
-    
-    tasks[task_count].rsp = (uint64_t)stack;
+static SlabCache* task_cache;
+static RunQueue rqs[MAX_CPUS];
+// all_tasks, zombies and the counters
+static Spinlock tasks_lock;
+static Task* all_tasks;
+static Task* zombies;               // exited, freed later from task context
+static uint32_t next_id;
+static uint64_t task_count;
+
+// Interrupts must be off
+static inline RunQueue* this_rq() {
+    return &rqs[cpu_id()];
+}
+
+static inline int cpu_online(uint32_t cpu) {
+    return SMP_GetCPU(cpu)->online;
+}
+
+// Urgent levels get short slices so they cannot hog the CPU; background
+// levels get long ones so they switch less
+static inline uint64_t slice_ns(uint32_t level) {
+    return TASK_SLICE_NS * (1 + level / 8);
+}
+
+static inline uint32_t first_level(uint32_t bitmap) {
+    uint32_t level;
+    __asm__ ("bsf %1, %0" : "=r"(level) : "rm"(bitmap));
+    return level;
+}
+
+static void run_push(RunQueue* rq, Task* t) {
+    t->next = NULL;
+    if (rq->tail[t->level]) rq->tail[t->level]->next = t;
+    else rq->head[t->level] = t;
+    rq->tail[t->level] = t;
+    rq->bitmap |= 1u << t->level;
+    rq->queued++;
+}
+
+// A task preempted with slice left goes back to the front of its FIFO
+static void run_push_front(RunQueue* rq, Task* t) {
+    t->next = rq->head[t->level];
+    rq->head[t->level] = t;
+    if (!rq->tail[t->level]) rq->tail[t->level] = t;
+    rq->bitmap |= 1u << t->level;
+    rq->queued++;
+}
+
+static Task* run_pop(RunQueue* rq) {
+    if (!rq->bitmap) return NULL;
+    uint32_t level = first_level(rq->bitmap);
+    Task* t = rq->head[level];
+    rq->head[level] = t->next;
+    if (!rq->head[level]) {
+        rq->tail[level] = NULL;
+        rq->bitmap &= ~(1u << level);
+    }
+    rq->queued--;
+    return t;
+}
+
+static void run_remove(RunQueue* rq, Task* t) {
+    Task* prev = NULL;
+    for (Task* q = rq->head[t->level]; q; prev = q, q = q->next) {
+        if (q != t) continue;
+        if (prev) prev->next = t->next;
+        else rq->head[t->level] = t->next;
+        if (rq->tail[t->level] == t) rq->tail[t->level] = prev;
+        if (!rq->head[t->level]) rq->bitmap &= ~(1u << t->level);
+        rq->queued--;
+        return;
+    }
+}
+
+// Locks the run queue t belongs to. t->cpu only changes with that queue
+// locked, so it is checked again once the lock is held.
+static RunQueue* lock_task_rq(Task* t) {
+    while (1) {
+        uint32_t cpu = t->cpu;
+        RunQueue* rq = &rqs[cpu];
+        spin_lock(&rq->lock);
+        if (t->cpu == cpu) return rq;
+        spin_unlock(&rq->lock);
+    }
+}
+
+// Makes rq's CPU switch soon. Another CPU gets an interrupt; this one
+// switches in Task_Preempt.
+static void kick(RunQueue* rq) {
+    if (rq->need_resched) return;
+    rq->need_resched = 1;
+    if (rq != this_rq()) SMP_SendIPI(rq->id, RESCHED_VECTOR);
+}
+
+// A task that has to wait on a busy CPU is better off on an idle one,
+// which steals it as soon as it schedules
+static void kick_idle(RunQueue* busy) {
+    for (uint32_t i = 0; i < MAX_CPUS; i++) {
+        RunQueue* rq = &rqs[i];
+        if (rq == busy || !cpu_online(i) || rq->current != rq->idle) continue;
+        kick(rq);
+        return;
+    }
+}
+
+// With rq locked and t just queued on it
+static void resched(RunQueue* rq, Task* t) {
+    if (rq->current == rq->idle || t->level < rq->current->level) kick(rq);
+    else kick_idle(rq);
+}
+
+static void wake(Task* t, TaskState from) {
+    RunQueue* rq = lock_task_rq(t);
+    if (t->state == from) {
+        if (t->on_cpu) {
+            // Still on its way to blocking: it just carries on
+            t->state = TASK_RUNNING;
+        } else {
+            t->state = TASK_READY;
+            t->woken_tsc = rdtsc();
+            run_push(rq, t);
+            resched(rq, t);
+        }
+    }
+    spin_unlock(&rq->lock);
+}
+
+// Interrupts are off in timer callbacks; the switch waits for Task_Preempt
+static void sleep_expired(Timer* timer) {
+    wake((Task*)timer->data, TASK_SLEEPING);
+}
+
+// Used its whole slice: give back one level of boost. The slice timer is
+// armed on its own CPU, so this runs there.
+static void slice_expired(Timer* timer) {
+    RunQueue* rq = (RunQueue*)timer->data;
+    Task* current = rq->current;
+    current->slice = 0;
+    if (current->level < current->priority) current->level++;
+    rq->need_resched = 1;
+}
+
+static Task* task_new(const char* name) {
+    Task* t = (Task*)Slab_Alloc(task_cache);
+    if (!t) return NULL;
+    t->rsp = 0;
+    t->state = TASK_READY;
+    t->priority = TASK_PRIORITY_DEFAULT;
+    t->level = TASK_PRIORITY_DEFAULT;
+    t->slice = 0;
+    t->woken_tsc = 0;
+    t->name = name;
+    t->stack_base = NULL;
+    t->stack_size = 0;
+    t->switches = 0;
+    t->runtime = 0;
+    t->blocks = 0;
+    t->fpu_state = NULL;
+    t->fpu_cpu = FPU_NO_CPU;
+    t->cpu = 0;
+    t->on_cpu = 0;
+    t->sleep_timer.fn = sleep_expired;
+    t->sleep_timer.data = t;
+    t->sleep_timer.armed = 0;
+    t->next = NULL;
+    t->wait_next = NULL;
+    t->wait_queue = NULL;
+    t->all_prev = NULL;
+
+    uint64_t flags = spin_lock_irqsave(&tasks_lock);
+    t->id = next_id++;
+    t->all_next = all_tasks;
+    if (all_tasks) all_tasks->all_prev = t;
+    all_tasks = t;
     task_count++;
+    spin_unlock_irqrestore(&tasks_lock, flags);
+    return t;
+}
+
+static void task_free(Task* t) {
+    uint64_t flags = spin_lock_irqsave(&tasks_lock);
+    if (t->all_prev) t->all_prev->all_next = t->all_next;
+    else all_tasks = t->all_next;
+    if (t->all_next) t->all_next->all_prev = t->all_prev;
+    task_count--;
+    spin_unlock_irqrestore(&tasks_lock, flags);
+    FPU_FreeState(t);
+    Stack_Free(t->stack_base);
+    Slab_Free(task_cache, t);
+}
+
+// Frees exited tasks. The scheduler only queues them, since it runs in the
+// timer interrupt with the run queue locked.
+static void reap() {
+    uint64_t flags = spin_lock_irqsave(&tasks_lock);
+    Task* t = zombies;
+    zombies = NULL;
+    spin_unlock_irqrestore(&tasks_lock, flags);
+    while (t) {
+        Task* next = t->next;
+        task_free(t);
+        t = next;
+    }
+}
+
+// Runs when nothing else is ready. Task_Preempt is where it steals work
+// from other CPUs, when one kicks it.
+static void idle_entry() {
+    while (1) {
+        __asm__ volatile ("cli");
+        Task_Preempt();
+        __asm__ volatile ("sti; hlt");
+    }
+}
+
+// A task with a context_switch frame that returns into task_start, which
+// finishes the switch, enables interrupts and calls the entry point it
+// finds in r12. Not queued yet.
+static Task* task_spawn(void (*entry)(), const char* name) {
+    void* base = Stack_Alloc();
+    Task* task = base ? task_new(name) : NULL;
+    if (!task) {
+        Stack_Free(base);
+        return NULL;
+    }
+    task->stack_base = base;
+    task->stack_size = STACK_SIZE;
+
+    uint64_t* stack = (uint64_t*)((uint8_t*)base + STACK_SIZE);
+    *(--stack) = (uint64_t)task_start;
+    *(--stack) = 0;                 // rbp
+    *(--stack) = 0;                 // rbx
+    *(--stack) = (uint64_t)entry;   // r12
+    *(--stack) = 0;                 // r13
+    *(--stack) = 0;                 // r14
+    *(--stack) = 0;                 // r15
+    task->rsp = (uint64_t)stack;
+    return task;
+}
+
+static void rq_init(RunQueue* rq, Task* current, Task* idle) {
+    rq->current = current;
+    rq->idle = idle;
+    idle->priority = idle->level = TASK_PRIORITY_IDLE;
+    idle->state = TASK_RUNNING;     // whether it runs or not; it is never queued
+    idle->cpu = rq->id;
+    current->state = TASK_RUNNING;
+    current->on_cpu = 1;
+    current->cpu = rq->id;
+    current->slice = slice_ns(current->level);
+    rq->run_start = clock_monotonic_ns();
+    rq->stats_since = rq->idle_since = rdtsc();
+}
+
+void Task_Init() {
+    task_cache = Slab_CreateCache("task", sizeof(Task), CACHE_LINE_SIZE);
+    for (uint32_t i = 0; i < MAX_CPUS; i++) {
+        rqs[i].id = i;
+        rqs[i].slice_timer.fn = slice_expired;
+        rqs[i].slice_timer.data = &rqs[i];
+    }
+
+    // Current execution becomes the first task, on the boot stack
+    RunQueue* rq = &rqs[0];
+    Task* kernel = task_new("kernel");
+    rq_init(rq, kernel, task_spawn(idle_entry, "idle"));
+    Timer_Arm(&rq->slice_timer, rq->run_start + kernel->slice);
+}
+
+void Task_StartCPU(void* stack_base) {
+    __asm__ volatile ("cli");
+    RunQueue* rq = this_rq();
+    Task* idle = task_new("idle");
+    idle->stack_base = stack_base;
+    idle->stack_size = STACK_SIZE;
+    rq_init(rq, idle, idle);
+    // Straight to work, if any is waiting
+    rq->need_resched = 1;
+    idle_entry();
+}
+
+// Fewest tasks running or ready, this CPU on a tie
+static RunQueue* least_loaded() {
+    RunQueue* best = this_rq();
+    uint32_t best_load = best->queued + (best->current != best->idle);
+    for (uint32_t i = 0; i < MAX_CPUS; i++) {
+        RunQueue* rq = &rqs[i];
+        if (!cpu_online(i)) continue;
+        uint32_t load = rq->queued + (rq->current != rq->idle);
+        if (load < best_load) {
+            best = rq;
+            best_load = load;
+        }
+    }
+    return best;
+}
+
+Task* Task_Create(void (*entry)(), const char* name) {
+    reap();
+    Task* task = task_spawn(entry, name);
+    if (!task) return NULL;
+
+    uint64_t flags = irq_save();
+    RunQueue* rq = least_loaded();
+    spin_lock(&rq->lock);
+    task->cpu = rq->id;
+    run_push(rq, task);
+    resched(rq, task);
+    spin_unlock(&rq->lock);
+    irq_restore(flags);
+    return task;
+}
+
+// Time spent in the idle task, and from a wakeup to the woken task running
+static void account(RunQueue* rq, Task* prev, Task* next) {
+    if (prev != rq->idle && next != rq->idle && !next->woken_tsc) return;
+    uint64_t now = rdtsc();
+    if (prev == rq->idle) rq->idle_cycles += now - rq->idle_since;
+    if (next == rq->idle) rq->idle_since = now;
+    if (next->woken_tsc) {
+        uint64_t latency = now - next->woken_tsc;
+        rq->wakeups++;
+        rq->wake_cycles += latency;
+        if (latency > rq->wake_max) rq->wake_max = latency;
+        next->woken_tsc = 0;
+    }
+}
+
+// Takes the most urgent ready task of the CPU with the most waiting. Only
+// tries the lock, since the other CPU may be stealing from this one.
+static Task* steal(RunQueue* rq) {
+    RunQueue* busiest = NULL;
+    for (uint32_t i = 0; i < MAX_CPUS; i++) {
+        if (i == rq->id || !cpu_online(i) || !rqs[i].queued) continue;
+        if (!busiest || rqs[i].queued > busiest->queued) busiest = &rqs[i];
+    }
+    if (!busiest || !spin_trylock(&busiest->lock)) return NULL;
+    Task* t = run_pop(busiest);
+    if (t) {
+        t->cpu = rq->id;
+        rq->steals++;
+    }
+    spin_unlock(&busiest->lock);
+    return t;
+}
+
+// Queues the current task according to its state and makes the next one
+// current. rq is locked, interrupts are off.
+static Task* pick_next(RunQueue* rq) {
+    Task* prev = rq->current;
+    uint64_t now = clock_monotonic_ns();
+    uint64_t ran = now - rq->run_start;
+    prev->runtime += ran;
+    prev->slice = prev->slice > ran ? prev->slice - ran : 0;
+    rq->need_resched = 0;
+
+    if (prev->state == TASK_RUNNING && prev != rq->idle) {
+        prev->state = TASK_READY;
+        if (prev->slice) run_push_front(rq, prev);
+        else run_push(rq, prev);
+    }
+
+    Task* next = run_pop(rq);
+    if (!next) next = steal(rq);
+    if (!next) next = rq->idle;
+    next->state = TASK_RUNNING;
+    next->on_cpu = 1;
+    if (!next->slice) next->slice = slice_ns(next->level);
+    if (next != prev) {
+        next->switches++;
+        account(rq, prev, next);
+    }
+    rq->current = next;
+
+    // Nothing ticks while the idle task runs; a wakeup ends it
+    rq->run_start = now;
+    if (next == rq->idle) Timer_Cancel(&rq->slice_timer);
+    else Timer_Arm(&rq->slice_timer, now + next->slice);
+    return next;
+}
+
+// The first thing a task does once switched to, on whichever CPU that was:
+// the task switched away from is off its stack now, so another CPU may run
+// it, and the run queue can be unlocked.
+void finish_switch() {
+    RunQueue* rq = this_rq();
+    Task* prev = rq->prev;
+    rq->prev = NULL;
+    int dead = prev->state == TASK_DEAD;
+    __atomic_store_n(&prev->on_cpu, 0, __ATOMIC_RELEASE);
+    spin_unlock(&rq->lock);
+
+    if (dead) {
+        spin_lock(&tasks_lock);
+        prev->next = zombies;
+        zombies = prev;
+        spin_unlock(&tasks_lock);
+    }
+}
+
+// Every switch, voluntary or from the timer, goes through context_switch on
+// the stack of the task being left, so every saved rsp points at the same
+// kind of frame. A task preempted by the timer resumes inside the interrupt
+// handler and leaves it through the stub's iretq. Called with rq locked;
+// returns with it unlocked, possibly on another CPU.
+static void schedule(RunQueue* rq) {
+    Task* prev = rq->current;
+    Task* next = pick_next(rq);
+    if (next == prev) {
+        spin_unlock(&rq->lock);
+        return;
+    }
+    rq->prev = prev;
+    FPU_Switch(prev, next);
+    context_switch(&prev->rsp, next->rsp);
+    finish_switch();
+}
+
+// A task switched to from here does not return through the interrupt
+// handler until it is preempted in turn. Interrupts must be off.
+void Task_Preempt() {
+    RunQueue* rq = this_rq();
+    if (!rq->need_resched) return;
+    spin_lock(&rq->lock);
+    schedule(rq);
+}
+
+void Task_Yield() {
+    uint64_t flags = irq_save();
+    RunQueue* rq = this_rq();
+    spin_lock(&rq->lock);
+    rq->current->slice = 0;
+    schedule(rq);
+    irq_restore(flags);
+}
+
+// Gave the CPU up with slice left: one level of boost, up to TASK_BOOST_MAX
+static void boost(RunQueue* rq, Task* t) {
+    t->blocks++;
+    if (t->slice > clock_monotonic_ns() - rq->run_start && t->level > 0 && t->level + TASK_BOOST_MAX > t->priority) t->level--;
+    t->slice = 0;
+}
+
+void Task_PrepareBlock() {
+    uint64_t flags = irq_save();
+    RunQueue* rq = this_rq();
+    spin_lock(&rq->lock);
+    rq->current->state = TASK_BLOCKED;
+    spin_unlock(&rq->lock);
+    irq_restore(flags);
+}
+
+void Task_Block() {
+    uint64_t flags = irq_save();
+    RunQueue* rq = this_rq();
+    spin_lock(&rq->lock);
+    Task* current = rq->current;
+    if (current->state == TASK_BLOCKED) {
+        boost(rq, current);
+        schedule(rq);
+    } else {
+        spin_unlock(&rq->lock);
+    }
+    irq_restore(flags);
+}
+
+void Task_Wake(Task* task) {
+    uint64_t flags = irq_save();
+    wake(task, TASK_BLOCKED);
+    // From task context a more urgent task runs right away; from an
+    // interrupt handler, as the handler returns
+    if (flags & 0x200) Task_Preempt();
+    irq_restore(flags);
+}
+
+void Task_Sleep(uint64_t ns) {
+    if (!ns) {
+        Task_Yield();
+        return;
+    }
+    uint64_t flags = irq_save();
+    RunQueue* rq = this_rq();
+    spin_lock(&rq->lock);
+    Task* current = rq->current;
+    boost(rq, current);
+    current->state = TASK_SLEEPING;
+    // On this CPU, which cannot take the interrupt until it has switched
+    Timer_Arm(&current->sleep_timer, clock_monotonic_ns() + ns);
+    schedule(rq);
+    irq_restore(flags);
+}
+
+void Task_SetPriority(Task* task, uint32_t priority) {
+    if (!task) return;
+    if (priority >= TASK_PRIORITIES) priority = TASK_PRIORITIES - 1;
+    uint64_t flags = irq_save();
+    RunQueue* rq = lock_task_rq(task);
+    int queued = task->state == TASK_READY;
+    if (queued) run_remove(rq, task);
+    task->priority = priority;
+    task->level = priority;
+    task->slice = 0;
+    if (queued) run_push(rq, task);
+    spin_unlock(&rq->lock);
+    irq_restore(flags);
+}
+
+// Switches away for good; the task is freed later from another task
+void Task_Exit() {
+    __asm__ volatile ("cli");
+    RunQueue* rq = this_rq();
+    spin_lock(&rq->lock);
+    rq->current->state = TASK_DEAD;
+    schedule(rq);
+    while (1) __asm__ volatile ("hlt");
+}
+
+Task* Task_Current() {
+    uint64_t flags = irq_save();
+    Task* t = this_rq()->current;
+    irq_restore(flags);
+    return t;
+}
+
+void Task_PrintStats() {
+    reap();
+    uint64_t deepest = 0;
+    uint64_t flags = spin_lock_irqsave(&tasks_lock);
+    debug_print("[TASK] ");
+    debug_dec(task_count);
+    debug_print(" tasks\n");
+    for (Task* t = all_tasks; t; t = t->all_next) {
+        uint64_t used = t->stack_base ? Stack_HighWater(t->stack_base) : 0;
+        if (used > deepest) deepest = used;
+        debug_print("[TASK]   ");
+        debug_dec(t->id);
+        debug_print(" ");
+        debug_print(t->name ? t->name : "?");
+        debug_print(": cpu=");
+        debug_dec(t->cpu);
+        debug_print(" prio=");
+        debug_dec(t->priority);
+        debug_print("/");
+        debug_dec(t->level);
+        debug_print(" switches=");
+        debug_dec(t->switches);
+        debug_print(" run=");
+        debug_dec(t->runtime / 1000);
+        debug_print("us");
+        debug_print(" blocks=");
+        debug_dec(t->blocks);
+        if (t->stack_base) {
+            debug_print(" stack=");
+            debug_dec(used);
+            debug_print("/");
+            debug_dec(t->stack_size);
+        }
+        debug_print("\n");
+    }
+    spin_unlock_irqrestore(&tasks_lock, flags);
+    debug_print("[TASK] deepest stack: ");
+    debug_dec(deepest);
+    debug_print(" bytes\n");
+
+    for (uint32_t i = 0; i < MAX_CPUS; i++) {
+        if (!cpu_online(i)) continue;
+        RunQueue* rq = &rqs[i];
+        flags = spin_lock_irqsave(&rq->lock);
+        uint64_t now = rdtsc();
+        uint64_t span = now - rq->stats_since;
+        uint64_t idle = rq->idle_cycles;
+        if (rq->current == rq->idle) idle += now - rq->idle_since;
+        uint64_t n = rq->wakeups, total = rq->wake_cycles, max = rq->wake_max;
+        uint64_t steals = rq->steals;
+        rq->stats_since = rq->idle_since = now;
+        rq->idle_cycles = rq->wakeups = rq->wake_cycles = rq->wake_max = 0;
+        spin_unlock_irqrestore(&rq->lock, flags);
+
+        debug_print("[TASK] cpu ");
+        debug_dec(i);
+        debug_print(": idle ");
+        debug_dec(span ? idle * 100 / span : 0);
+        debug_print("% of ");
+        debug_dec(span);
+        debug_print(" cycles, ");
+        debug_dec(n);
+        debug_print(" wakeups, latency avg ");
+        debug_dec(clock_cycles_to_ns(n ? total / n : 0));
+        debug_print(" ns, max ");
+        debug_dec(clock_cycles_to_ns(max));
+        debug_print(" ns, ");
+        debug_dec(steals);
+        debug_print(" steals\n");
+    }
+    Stack_PrintStats();
 }
 
-uint64_t Task_Schedule(uint64_t current_rsp) {
-    tasks[current_task].rsp = current_rsp;
-    current_task = (current_task + 1) % task_count;
-    return tasks[current_task].rsp;
+#ifdef TINY64_BENCH
+#define BENCH_TASKS 4096
+#define BENCH_PREEMPTS 10000
+
+static void bench_entry() {
+}
+
+// Drops every bench task, which all sit at TASK_PRIORITY_DEFAULT with the
+// calling task, and makes the caller current again
+static void bench_reset(RunQueue* rq, Task* self, Task** created, int n) {
+    while (rq->head[TASK_PRIORITY_DEFAULT]) run_remove(rq, rq->head[TASK_PRIORITY_DEFAULT]);
+    for (int i = 0; i < n; i++) task_free(created[i]);
+    rq->current = self;
+    self->state = TASK_RUNNING;
+    self->on_cpu = 1;
+    self->slice = slice_ns(self->level);
 }
 
+// Creates BENCH_TASKS tasks and tears them down again without running
+// them, then times preemption at the end of a timeslice, slice timer
+// included, with 2 to 1000 tasks ready. The preemptions are simulated: the
+// scheduler picks and rotates tasks, but none of them runs. Only CPU 0 is
+// up, so every task lands on its run queue.
+void Task_Benchmark() {
+    static Task* created[BENCH_TASKS];
+    static const int counts[4] = {2, 10, 100, 1000};
+    uint64_t flags = irq_save();
+    RunQueue* rq = this_rq();
+    Task* self = rq->current;
+
+    // The first pass grows the stack pool, the second only pops from it
+    for (int pass = 0; pass < 2; pass++) {
+        uint64_t start = rdtsc();
+        int n = 0;
+        while (n < BENCH_TASKS && (created[n] = Task_Create(bench_entry, "bench"))) n++;
+        uint64_t create_cycles = rdtsc() - start;
+
+        start = rdtsc();
+        bench_reset(rq, self, created, n);
+        uint64_t free_cycles = rdtsc() - start;
+
+        debug_print(pass ? "[BENCH] Task: pooled stacks: " : "[BENCH] Task: growing pool: ");
+        debug_dec(n);
+        debug_print(" tasks, create ");
+        debug_dec(create_cycles / (n ? n : 1));
+        debug_print(", destroy ");
+        debug_dec(free_cycles / (n ? n : 1));
+        debug_print(" cycles/task\n");
+    }
+
+    for (int c = 0; c < 4; c++) {
+        int n = 0;
+        while (n < counts[c] - 1 && (created[n] = Task_Create(bench_entry, "bench"))) n++;
+
+        spin_lock(&rq->lock);
+        uint64_t start = rdtsc();
+        for (int i = 0; i < BENCH_PREEMPTS; i++) {
+            slice_expired(&rq->slice_timer);
+            pick_next(rq);
+        }
+        uint64_t cycles = rdtsc() - start;
+        bench_reset(rq, self, created, n);
+        spin_unlock(&rq->lock);
+
+        debug_print("[BENCH] Task: ");
+        debug_dec(n + 1);
+        debug_print(" ready tasks: ");
+        debug_dec(cycles / BENCH_PREEMPTS);
+        debug_print(" cycles/preemption\n");
+    }
+    irq_restore(flags);
+}
+
+#define BENCH_SWITCHES 10000
+
+static volatile int bench_mode;     // 0: Task_Yield, 1: timer path, 2: done
+
+// Switches away through the timer interrupt path: the stub saving every
+// register, the EOI, the expired-timer scan and iretq on the way back
+static void bench_timer_switch() {
+    uint64_t flags = irq_save();
+    RunQueue* rq = this_rq();
+    rq->current->slice = 0;
+    rq->need_resched = 1;
+    __asm__ volatile ("int %0" : : "i"(TIMER_VECTOR) : "memory");
+    irq_restore(flags);
+}
+
+static void bench_partner() {
+    while (bench_mode != 2) {
+        if (bench_mode) bench_timer_switch();
+        else Task_Yield();
+    }
+}
+
+// Cycles per switch between two tasks of the same level handing the CPU
+// back and forth, voluntarily and through the timer interrupt
+void Task_SwitchBenchmark() {
+    Task* partner = Task_Create(bench_partner, "bench");
+    if (!partner) return;
+    Task* self = Task_Current();
+    Task_SetPriority(self, self->priority);
+    Task_SetPriority(partner, self->priority);
+    const char* names[2] = {"Task_Yield", "timer interrupt"};
+
+    for (int mode = 0; mode < 2; mode++) {
+        bench_mode = mode;
+        Task_Yield();
+
+        uint64_t start = rdtsc();
+        for (int i = 0; i < BENCH_SWITCHES; i++) {
+            if (mode) bench_timer_switch();
+            else Task_Yield();
+        }
+        uint64_t cycles = rdtsc() - start;
+
+        debug_print("[BENCH] Task: switch via ");
+        debug_print(names[mode]);
+        debug_print(": ");
+        debug_dec(cycles / (2 * BENCH_SWITCHES));
+        debug_print(" cycles\n");
+    }
+
+    // Let the partner see it is done and exit
+    bench_mode = 2;
+    Task_Yield();
+}
+#endif
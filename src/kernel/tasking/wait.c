@@ -0,0 +1,148 @@
+#include "../include/wait.h"
+#include "../include/cpu.h"
+#include <stddef.h>
+
+#define COMPLETION_ALL 0xFFFFFFFFu
+
+void WaitQueue_Init(WaitQueue* q) {
+    spin_init(&q->lock);
+    q->head = q->tail = NULL;
+}
+
+static void unlink(WaitQueue* q, Task* t) {
+    Task* prev = NULL;
+    for (Task* w = q->head; w; prev = w, w = w->wait_next) {
+        if (w != t) continue;
+        if (prev) prev->wait_next = t->wait_next;
+        else q->head = t->wait_next;
+        if (q->tail == t) q->tail = prev;
+        break;
+    }
+    t->wait_queue = NULL;
+}
+
+void WaitQueue_Wait(WaitQueue* q) {
+    Task* t = Task_Current();
+    t->wait_next = NULL;
+    t->wait_queue = q;
+    if (q->tail) q->tail->wait_next = t;
+    else q->head = t;
+    q->tail = t;
+
+    // Blocked before the lock is dropped, so a wake from here on finds it
+    Task_PrepareBlock();
+    spin_unlock(&q->lock);
+    Task_Block();
+    spin_lock(&q->lock);
+    // Woken with Task_Wake rather than through the queue
+    if (t->wait_queue) unlink(q, t);
+}
+
+uint32_t WaitQueue_WakeOne(WaitQueue* q) {
+    uint64_t flags = spin_lock_irqsave(&q->lock);
+    Task* t = q->head;
+    if (t) {
+        q->head = t->wait_next;
+        if (!q->head) q->tail = NULL;
+        t->wait_queue = NULL;
+    }
+    spin_unlock_irqrestore(&q->lock, flags);
+
+    // With interrupts back on, so a more urgent task runs right away
+    if (!t) return 0;
+    Task_Wake(t);
+    return 1;
+}
+
+uint32_t WaitQueue_WakeAll(WaitQueue* q) {
+    uint64_t flags = spin_lock_irqsave(&q->lock);
+    Task* t = q->head;
+    q->head = q->tail = NULL;
+    for (Task* w = t; w; w = w->wait_next) w->wait_queue = NULL;
+    spin_unlock_irqrestore(&q->lock, flags);
+
+    uint32_t n = 0;
+    while (t) {
+        // A woken task may run, and wait again, before the loop goes on
+        Task* next = t->wait_next;
+        Task_Wake(t);
+        t = next;
+        n++;
+    }
+    return n;
+}
+
+void Event_Init(Event* e) {
+    e->signalled = 0;
+    WaitQueue_Init(&e->waiters);
+}
+
+void Event_Wait(Event* e) {
+    uint64_t flags = spin_lock_irqsave(&e->waiters.lock);
+    while (!e->signalled) WaitQueue_Wait(&e->waiters);
+    spin_unlock_irqrestore(&e->waiters.lock, flags);
+}
+
+void Event_Signal(Event* e) {
+    uint64_t flags = spin_lock_irqsave(&e->waiters.lock);
+    e->signalled = 1;
+    spin_unlock_irqrestore(&e->waiters.lock, flags);
+    WaitQueue_WakeAll(&e->waiters);
+}
+
+void Event_Reset(Event* e) {
+    e->signalled = 0;
+}
+
+void Semaphore_Init(Semaphore* s, uint32_t count) {
+    s->count = count;
+    WaitQueue_Init(&s->waiters);
+}
+
+void Semaphore_Down(Semaphore* s) {
+    uint64_t flags = spin_lock_irqsave(&s->waiters.lock);
+    while (!s->count) WaitQueue_Wait(&s->waiters);
+    s->count--;
+    spin_unlock_irqrestore(&s->waiters.lock, flags);
+}
+
+int Semaphore_TryDown(Semaphore* s) {
+    uint64_t flags = spin_lock_irqsave(&s->waiters.lock);
+    int taken = s->count != 0;
+    if (taken) s->count--;
+    spin_unlock_irqrestore(&s->waiters.lock, flags);
+    return taken;
+}
+
+void Semaphore_Up(Semaphore* s) {
+    uint64_t flags = spin_lock_irqsave(&s->waiters.lock);
+    s->count++;
+    spin_unlock_irqrestore(&s->waiters.lock, flags);
+    WaitQueue_WakeOne(&s->waiters);
+}
+
+void Completion_Init(Completion* c) {
+    c->done = 0;
+    WaitQueue_Init(&c->waiters);
+}
+
+void Completion_Wait(Completion* c) {
+    uint64_t flags = spin_lock_irqsave(&c->waiters.lock);
+    while (!c->done) WaitQueue_Wait(&c->waiters);
+    if (c->done != COMPLETION_ALL) c->done--;
+    spin_unlock_irqrestore(&c->waiters.lock, flags);
+}
+
+void Completion_Complete(Completion* c) {
+    uint64_t flags = spin_lock_irqsave(&c->waiters.lock);
+    if (c->done != COMPLETION_ALL) c->done++;
+    spin_unlock_irqrestore(&c->waiters.lock, flags);
+    WaitQueue_WakeOne(&c->waiters);
+}
+
+void Completion_CompleteAll(Completion* c) {
+    uint64_t flags = spin_lock_irqsave(&c->waiters.lock);
+    c->done = COMPLETION_ALL;
+    spin_unlock_irqrestore(&c->waiters.lock, flags);
+    WaitQueue_WakeAll(&c->waiters);
+}